@@ -27,8 +27,8 @@ namespace Baikal
         m_api->SetOption("acc.type", "bvh");
         m_api->SetOption("bvh.builder", "sah");
 #else
-        m_api->SetOption("acc.type", "fatbvh");
-        m_api->SetOption("bvh.builder", "sah");
+        // Let the library time the candidate structures on the first commit
+        m_api->SetOption("acc.type", "auto");
 #endif
     }
 
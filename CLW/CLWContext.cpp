@@ -101,7 +101,7 @@ CLWEvent CLWContext::Launch1D(unsigned int idx, size_t globalSize, size_t localS
     for (unsigned i = 0; i < events.size(); ++i)
         eventsToWait[i] = events[i];
 
-    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 2, nullptr, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), &eventsToWait[0], &event);
+    status = clEnqueueNDRangeKernel(commandQueues_[idx], kernel, 1, nullptr, &wgGlobalSize, &wgLocalSize, (cl_uint)eventsToWait.size(), eventsToWait.empty() ? nullptr : &eventsToWait[0], &event);
     ThrowIf(status != CL_SUCCESS, status, "clEnqueueNDRangeKernel failed");
 
     return CLWEvent::Create(event);
@@ -238,6 +238,17 @@ unsigned int CLWContext::GetDeviceCount() const
     return (unsigned int)devices_.size();
 }
 
+unsigned int CLWContext::CreateCommandQueue(unsigned int deviceIdx)
+{
+    commandQueues_.push_back(CLWCommandQueue::Create(devices_[deviceIdx], *this));
+    return (unsigned int)commandQueues_.size() - 1;
+}
+
+unsigned int CLWContext::GetCommandQueueCount() const
+{
+    return (unsigned int)commandQueues_.size();
+}
+
 CLWDevice CLWContext::GetDevice(unsigned int idx) const
 {
     return devices_[idx];
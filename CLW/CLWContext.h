@@ -98,6 +98,11 @@ public:
 
     CLWCommandQueue GetCommandQueue(unsigned int idx) const { return commandQueues_[idx]; }
 
+    // Create an additional command queue for the specified device.
+    // Returns the index of the queue which can be passed to the calls above.
+    unsigned int CreateCommandQueue(unsigned int deviceIdx);
+    unsigned int GetCommandQueueCount() const;
+
 private:
     void InitCL();
 
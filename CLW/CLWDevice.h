@@ -51,6 +51,7 @@ public:
     cl_ulong GetGlobalMemSize() const;
     cl_ulong GetMaxAllocSize() const;
     size_t   GetMaxWorkGroupSize() const;
+    cl_uint  GetMaxComputeUnits() const;
     cl_device_type GetType() const;
     cl_device_id GetID() const;
     cl_uint GetMinAlignSize() const;
@@ -88,6 +89,7 @@ private:
     cl_ulong                 maxAllocSize_;
     cl_device_local_mem_type localMemType_;
     size_t                   maxWorkGroupSize_;
+    cl_uint                  maxComputeUnits_;
     cl_uint                     minAlignSize_;
     
     friend class CLWPlatform;
@@ -48,7 +48,9 @@ namespace Calc
     {
         kRead = 0x1,
         kWrite = 0x2,
-        kPinned = 0x4
+        kPinned = 0x4,
+        // Use initial data memory as buffer storage (OpenCL only)
+        kUseHostPtr = 0x8
     };
 
     enum MapType
@@ -46,6 +46,8 @@ namespace Calc
 
         std::uint32_t min_alignment;
         std::uint32_t max_num_queues;
+        // Number of compute units, 0 if the API does not report it
+        std::uint32_t max_compute_units;
 
         std::size_t global_mem_size;
         std::size_t local_mem_size;
@@ -101,6 +103,10 @@ namespace Calc
         // Execution
         // Calls are blocking if passed nullptr for an event, otherwise use Event to sync
         virtual void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e) = 0;
+        // Same as above, but the execution starts only after all the events in the wait list are resolved.
+        // Events might come from any queue of the device.
+        virtual void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size,
+                             Event const* const* wait_events, std::size_t num_wait_events, Event** e) = 0;
 
         // Events handling
         virtual void WaitForEvent(Event* e) = 0;
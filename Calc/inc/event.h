@@ -34,6 +34,8 @@ namespace Calc
 
         virtual void Wait() = 0;
         virtual bool IsComplete() const = 0;
+        // Execution time of the completed command in milliseconds, negative if the device does not profile it
+        virtual float GetDuration() const { return -1.f; }
 
         Event(Event const&) = delete;
         Event& operator = (Event const&) = delete;
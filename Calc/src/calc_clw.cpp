@@ -81,6 +81,8 @@ namespace Calc
         spec.min_alignment = m_devices[idx].GetMinAlignSize();
         spec.max_alloc_size = m_devices[idx].GetMaxAllocSize();
         spec.max_local_size = m_devices[idx].GetMaxWorkGroupSize();
+        spec.max_num_queues = DeviceClw::NUM_QUEUES;
+        spec.max_compute_units = m_devices[idx].GetMaxComputeUnits();
     }
 
     // Create the device with specified index
@@ -112,6 +112,8 @@ namespace Calc
             spec.min_alignment = static_cast< std::uint32_t >( device->get_device_properties().limits.minMemoryMapAlignment );
             spec.max_alloc_size = static_cast< std::size_t >(hostMemory);
             spec.max_local_size = static_cast< std::size_t >(localMemory);
+            spec.max_num_queues = 1;
+            spec.max_compute_units = 0;
         }
 
         else
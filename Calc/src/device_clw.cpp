@@ -57,8 +57,10 @@ namespace Calc
 
         void Wait() override;
         bool IsComplete() const override;
+        float GetDuration() const override;
 
         void SetEvent(CLWEvent event);
+        CLWEvent GetEvent() const { return m_event; }
 
     private:
         CLWEvent m_event;
@@ -97,6 +99,19 @@ namespace Calc
         }
     }
 
+    float EventClw::GetDuration() const
+    {
+        // Queues wrapped from the application might not have profiling enabled
+        try
+        {
+            return m_event.GetDuration();
+        }
+        catch (CLWException&)
+        {
+            return -1.f;
+        }
+    }
+
     void EventClw::SetEvent(CLWEvent event)
     {
         m_event = event;
@@ -221,6 +236,12 @@ namespace Calc
         : m_device(device)
         , m_context(CLWContext::Create(device))
     {
+        // Create extra queues to allow concurrent submissions
+        for (auto i = 1U; i < NUM_QUEUES; ++i)
+        {
+            m_context.CreateCommandQueue(0);
+        }
+
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
         {
@@ -262,6 +283,8 @@ namespace Calc
         spec.min_alignment = m_device.GetMinAlignSize();
         spec.max_alloc_size = m_device.GetMaxAllocSize();
         spec.max_local_size = m_device.GetMaxWorkGroupSize();
+        spec.max_num_queues = m_context.GetCommandQueueCount();
+        spec.max_compute_units = m_device.GetMaxComputeUnits();
     }
 
     Buffer* DeviceClw::CreateBuffer(std::size_t size, std::uint32_t flags)
@@ -280,7 +303,8 @@ namespace Calc
     {
         try
         {
-            return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags) | CL_MEM_COPY_HOST_PTR, initdata));
+            cl_mem_flags hostflags = (flags & kUseHostPtr) ? CL_MEM_USE_HOST_PTR : CL_MEM_COPY_HOST_PTR;
+            return new BufferClw(m_context.CreateBuffer<char>(size, Convert2ClCreationFlags(flags) | hostflags, initdata));
         }
         catch (CLWException& e)
         {
@@ -491,12 +515,24 @@ namespace Calc
     }
 
     void DeviceClw::Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e)
+    {
+        Execute(func, queue, global_size, local_size, nullptr, 0, e);
+    }
+
+    void DeviceClw::Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size,
+                            Event const* const* wait_events, std::size_t num_wait_events, Event** e)
     {
         auto func_clw = static_cast<FunctionClw const*>(func);
 
+        std::vector<CLWEvent> events(num_wait_events);
+        for (auto i = 0U; i < num_wait_events; ++i)
+        {
+            events[i] = static_cast<EventClw const*>(wait_events[i])->GetEvent();
+        }
+
         try
         {
-            CLWEvent event = m_context.Launch1D(queue, global_size, local_size, func_clw->GetKernel());
+            CLWEvent event = m_context.Launch1D(queue, global_size, local_size, func_clw->GetKernel(), events);
 
             if (e)
             {
@@ -555,6 +591,8 @@ namespace Calc
 
     EventClw* DeviceClw::CreateEventClw() const
     {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
         if (m_event_pool.empty())
         {
             auto event = new EventClw();
@@ -570,6 +608,7 @@ namespace Calc
 
     void DeviceClw::ReleaseEventClw(EventClw* e) const
     {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
         m_event_pool.push(e);
     }
     
@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "device_cl.h"
 #include "CLW.h"
 
+#include <mutex>
 #include <queue>
 
 namespace Calc
@@ -69,6 +70,8 @@ namespace Calc
 
         // Execution
         void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e) override;
+        void Execute(Function const* func, std::uint32_t queue, size_t global_size, size_t local_size,
+                     Event const* const* wait_events, std::size_t num_wait_events, Event** e) override;
 
         // Events handling
         void WaitForEvent(Event* e) override;
@@ -89,6 +92,9 @@ namespace Calc
 
         Platform GetPlatform() const override { return Platform::kOpenCL; }
 
+        // Number of command queues created for a device owning its context
+        static const std::uint32_t NUM_QUEUES = 4;
+
     protected:
         EventClw* CreateEventClw() const;
         void      ReleaseEventClw(EventClw* e) const;
@@ -101,5 +107,7 @@ namespace Calc
         static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
         // Event pool
         mutable std::queue<EventClw*> m_event_pool;
+        // Events are created and released from any submitting thread
+        mutable std::mutex m_event_pool_mutex;
     };
 }
\ No newline at end of file
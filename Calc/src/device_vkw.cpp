@@ -132,7 +132,10 @@ namespace Calc
         spec.min_alignment = static_cast< std::uint32_t >(device->get_device_properties().limits.minMemoryMapAlignment);
         spec.max_alloc_size = static_cast< std::size_t >(hostMemory);
         spec.max_local_size = static_cast< std::size_t >(localMemory);
-
+        // All the work goes to a single Anvil queue
+        spec.max_num_queues = 1;
+        // Vulkan does not expose the number of compute units
+        spec.max_compute_units = 0;
     }
 
     // Buffer creation and deletion
@@ -148,6 +151,12 @@ namespace Calc
             throw ExceptionVk("Buffer size of 0 isn't valid" );
             return nullptr;
         }
+
+        if (flags & kUseHostPtr)
+        {
+            throw ExceptionVk("Host pointer buffers aren't supported" );
+            return nullptr;
+        }
         const Anvil::QueueFamilyBits queueToUse = (true == m_use_compute_pipe) ?
                                                 Anvil::QUEUE_FAMILY_COMPUTE_BIT :
                                                 Anvil::QUEUE_FAMILY_GRAPHICS_BIT;
@@ -452,6 +461,19 @@ namespace Calc
         vulkan_function->UnreferenceParametersBuffers();
     }
 
+    void DeviceVulkanw::Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size,
+                                 Event const* const* /*wait_events*/, std::size_t num_wait_events, Event** e )
+    {
+        // All the work goes to a single queue, complete what has been submitted
+        // so far to resolve the wait list
+        if ( num_wait_events > 0 )
+        {
+            Finish( queue );
+        }
+
+        Execute( func, queue, global_size, local_size, e );
+    }
+
     // Events handling
     void DeviceVulkanw::WaitForEvent( Event* e )
     {
@@ -77,6 +77,8 @@ namespace Calc
 
         // Execution
         void Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size, Event** e ) override;
+        void Execute( Function const* func, std::uint32_t queue, size_t global_size, size_t local_size,
+                      Event const* const* wait_events, std::size_t num_wait_events, Event** e ) override;
 
         // Events handling
         void WaitForEvent( Event* e ) override;
@@ -24,6 +24,10 @@ project "RadeonRays"
         defines {"RR_RAYMASK"}
     end
 
+    if _OPTIONS["enable_traversal_counters"] then
+        defines {"RR_TRAVERSAL_COUNTERS"}
+    end
+
     defines {"EXPORT_API"}
 
     files { "../RadeonRays/**.h", "../RadeonRays/**.cpp","../RadeonRays/src/kernels/CL/**.cl", "../RadeonRays/src/kernels/GLSL/**.comp"}
@@ -53,7 +53,7 @@ namespace RadeonRays
     struct Intersection;
 
     /// Represents a device, which can be used by API for intersection purposes.
-    /// API is distributing the work across multiple devices itsels, so
+    /// API is distributing the work across multiple devices itself, so
     /// this structure is only used to query devices configuration and
     /// limit the number of devices available for the API.
     struct RRAPI DeviceInfo
@@ -100,7 +100,10 @@ namespace RadeonRays
         virtual void SetTransform(matrix const& m, matrix const& minv) = 0;
         virtual void GetTransform(matrix& m, matrix& minv) const = 0;
 
-        // Motion blur
+        // Motion blur: over the unit time interval the shape is translated by the linear
+        // velocity in world space and rotated by the angular velocity around its object space origin.
+        // Rays sample the shape at their time (ray::SetTime, clamped to [0, 1]).
+        // OpenCL only: committing a moving shape on Vulkan throws.
         virtual void SetLinearVelocity(float3 const& v) = 0;
         virtual float3 GetLinearVelocity() const = 0;
 
@@ -154,18 +157,104 @@ namespace RadeonRays
         int padding0;
         int padding1;
         
-        // UV parametrization
+        // UV parametrization, barycentrics for triangles. Quads are parametrized
+        // with vertex 0 at (0, 0), 1 at (1, 0), 2 at (1, 1) and 3 at (0, 1)
         float4 uvwt;
 
         Intersection();
     };
 
+    // Host provided threads for the CPU side work of the library (BVH builds,
+    // mesh processing, Embree queries). Execute is called once per task and has
+    // to call func(arg) exactly once on any thread, now or later. Calls may come
+    // from any thread, including from inside func.
+    class RRAPI TaskArena
+    {
+    public:
+        virtual ~TaskArena() = 0;
+        virtual void Execute(void (*func)(void*), void* arg) = 0;
+    };
+
+    // Mesh creation flags
+    enum MeshFlags
+    {
+        // Vertex and index data is copied, the memory can be released right after the call
+        kMeshCopyData = 0x0,
+        // Vertex data (and index data of triangle meshes, numfacevertices == nullptr) is used in place.
+        // The memory has to stay valid and unchanged until the mesh is deleted.
+        kMeshReferenceData = 0x1
+    };
+
+    // Host memory description of a mesh, arguments match CreateMesh
+    struct MeshDesc
+    {
+        // Position data
+        float const* vertices;
+        int vnum;
+        int vstride;
+        // Index data for vertices
+        int const* indices;
+        int istride;
+        // Numbers of vertices per face, nullptr for triangle meshes
+        int const* numfacevertices;
+        // Number of faces
+        int numfaces;
+        // Combination of MeshFlags
+        int flags;
+    };
+
     enum MapType
     {
         kMapRead = 0x1,
         kMapWrite = 0x2
     };
 
+    // Measurements returned by IntersectionApi::GetStatistics
+    struct Statistics
+    {
+        // Last Commit, wall clock time of each phase in milliseconds.
+        // Phases a backend does not have (or runs inside another one) are 0.
+        float bounds_ms;
+        float build_ms;
+        float translate_ms;
+        float upload_ms;
+        float commit_ms;
+        // Acceleration structure of the last Commit, 0 if unknown for the backend.
+        // SAH cost is relative to the cost of a primitive test
+        std::uint32_t node_count;
+        std::uint32_t height;
+        float sah_cost;
+        // Device memory taken by the scene
+        std::uint64_t memory_bytes;
+
+        // Queries since the last Commit. Buffer driven ray counts are taken as maxrays.
+        std::uint64_t num_queries;
+        std::uint64_t num_rays;
+        // Device execution time of the queries, measured for blocking queries and for queries
+        // whose event has been waited for or seen complete. Only OpenCL profiles queries,
+        // both fields are 0 for other backends.
+        float query_ms;
+        // Rays per second of device execution time of the measured queries, buffer driven
+        // queries are left out as only the device knows their ray count
+        float rays_per_second;
+    };
+
+    // Work done by the traversal for a single ray, see IntersectionApi::SetTraversalCounters
+    struct TraversalCounters
+    {
+        // BVH nodes fetched
+        std::uint32_t nodes;
+        // Ray-triangle tests, a quad counts as two
+        std::uint32_t primitives;
+    };
+
+    // Counter the traversal helpers look at
+    enum TraversalMetric
+    {
+        kTraversalNodes,
+        kTraversalPrimitives
+    };
+
     // IntersectionApi is designed to provide fast means for ray-scene intersection
     // for AMD architectures. It effectively absracts underlying AMD hardware and
     // software stack and allows user to issue low-latency batched ray queries.
@@ -190,6 +279,17 @@ namespace RadeonRays
         // device(s) to use
         static void SetPlatform(const DeviceInfo::Platform platform);
 
+        /******************************************
+        CPU threading
+        ******************************************/
+        // CPU side work is run on a work stealing scheduler shared by all the APIs.
+        // Set the number of its threads, 0 means one per hardware thread.
+        // Call when no API is doing any work, e.g. before creating one.
+        static void SetThreadCount(int count);
+        // Run CPU side work on host threads instead, nullptr restores the scheduler threads.
+        // The arena has to outlive its use. Call when no API is doing any work.
+        static void SetTaskArena(TaskArena* arena);
+
 
         /******************************************
         Device management
@@ -205,6 +305,10 @@ namespace RadeonRays
         API lifetime management
         ******************************************/
         static IntersectionApi* Create(std::uint32_t devidx);
+        // Create an API spanning several devices. The scene is replicated on every device
+        // and each query is split across the devices proportionally to their measured throughput.
+        // Buffers created by such an API live in host memory and are streamed to the devices.
+        static IntersectionApi* Create(std::uint32_t const* devidx, std::uint32_t numdevices);
 
         // Deallocation
         static void Delete(IntersectionApi* api);
@@ -229,15 +333,34 @@ namespace RadeonRays
             int  numfaces
             ) const = 0;
 
+        // Create nummeshes meshes at once, the meshes are processed in parallel and
+        // get consecutive IDs. If event is nullptr the call is blocking, otherwise it returns
+        // immediately and the meshes array is filled once the event is complete. The descriptors
+        // are copied, the memory they point to has to stay valid until then (or for the lifetime
+        // of the mesh with kMeshReferenceData). If creation fails no meshes are returned.
+        virtual void CreateMeshes(MeshDesc const* descs, int nummeshes, Shape** meshes, Event** event) const = 0;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         virtual Shape* CreateInstance(Shape const* shape) const = 0;
+        // Create numinstances instances of a shape at once. transforms holds an object to world
+        // matrix for each instance (inverses are computed internally), the instances are written
+        // into the instances array. Much faster than separate CreateInstance and SetTransform calls
+        // for large instance counts. The call is blocking, so the returned values are ready upon return.
+        virtual void CreateInstances(Shape const* shape, int numinstances, matrix const* transforms, Shape** instances) const = 0;
+        // Set object to world transforms of numshapes shapes at once, inverses are computed internally
+        virtual void SetTransforms(Shape* const* shapes, int numshapes, matrix const* transforms) const = 0;
         // Delete the shape (to simplify DLL boundary crossing
         virtual void DeleteShape(Shape const* shape) = 0;
-        // Attach shape to participate in intersection process
+        // Attach shape to participate in intersection process. A shape can be attached
+        // to a single IntersectionApi at a time, deleting a shape detaches it.
         virtual void AttachShape(Shape const* shape) = 0;
+        // Attach numshapes shapes at once
+        virtual void AttachShapes(Shape const* const* shapes, int numshapes) = 0;
         // Detach shape, i.e. it is not going to be considered part of the scene anymore
         virtual void DetachShape(Shape const* shape) = 0;
+        // Detach numshapes shapes at once
+        virtual void DetachShapes(Shape const* const* shapes, int numshapes) = 0;
         // Detach all objects
         virtual void DetachAll() = 0;
         // Commit all geometry creations/changes
@@ -252,6 +375,10 @@ namespace RadeonRays
         ******************************************/
         // Create a buffer to use the most efficient acceleration possible
         virtual Buffer* CreateBuffer(size_t size, void* initdata) const = 0;
+        // Create a buffer using caller owned memory as its storage, so nothing gets copied on CPU backends.
+        // The memory has to outlive the buffer and should be aligned to 64 bytes. OpenCL devices may keep a cached
+        // copy, so access the contents through MapBuffer/UnmapBuffer. Not supported on Vulkan.
+        virtual Buffer* CreateBufferFromHostPointer(void* ptr, size_t size) const = 0;
         // Delete the buffer
         virtual void DeleteBuffer(Buffer* buffer) const = 0;
         // Map buffer. Event pointer might be nullptr.
@@ -291,6 +418,12 @@ namespace RadeonRays
         // option "bvh.force2level" values {0(default), 1}
         //         by default 2-level BVH is used only if there is instancing in the scene or
         //         motion blur is enabled. 1 forces 2-level BVH for all cases.
+        // option "bvh.refit_top_level" values {0(default), 1} (2-level BVH only: on transform changes keep the top level
+        //         topology and only refit its bounds, uploading the changed nodes, faster to update but may degrade traversal)
+        // option "bvh.instance_flatten_faces" values {int, not set by default} (OpenCL and acc.type "bvh" only, also when picked
+        //         by "auto": instances no longer force 2-level BVH, instanced meshes with up to this number of faces are copied
+        //         into world space and larger ones are referenced through per instance transforms. Instances keep forcing
+        //         2-level BVH with the other acceleration structures)
         // option "bvh.builder" values {"sah" (use surface area heuristic), "median" (use spatial median, faster to build, default)}
         // option "bvh.sah.use_splits" values {0(default),1} (allow spatial splits for BVH)
         // option "bvh.sah.traversal_cost" values {float, default = 10.f for GPU } (cost of node traversal vs triangle intersection)
@@ -298,10 +431,39 @@ namespace RadeonRays
         //         (overlap area which is considered for a spatial splits, fraction of parent bbox)
         // option "bvh.sah.max_split_depth" values {int, default = 10} (max depth in the tree where spatial split can happen)
         // option "bvh.sah.extra_node_budget" values {float, default = 1.f} (maximum node memory budget compared to normal bvh (2*num_tris - 1), for ex. 0.3 = 30% more nodes allowed
+        // option "acc.type" values {"bvh" (default), "fatbvh", "hlbvh", "auto"}
+        //         "auto" builds the candidate structures on the first commit with geometry, times them on a sampled
+        //         probe ray set and keeps the best one, see GetAccelerationReport. Candidates are bvh and fatbvh with the
+        //         median and sah builders, the latter also with a lower bvh.sah.traversal_cost and with bvh.sah.use_splits,
+        //         and hlbvh. Other bvh.sah options are taken from the world. Ignored when 2-level BVH is used.
+        // option "acc.auto.queries_per_build" values {float, default = 100.f} (number of probe-sized query batches expected
+        //         between rebuilds, used by "auto" to weigh build time against traversal time)
+        // option "embree.build_quality" values {0(default), 1} (Embree only: 1 builds higher quality structures, slower to build.
+        //         Changing it rebuilds the whole scene, otherwise commits only update instances of changed shapes)
+        // option "embree.packet_width" values {0(default), 1, 4, 8, 16} (Embree only: rays are traced in packets of this width,
+        //         1 traces rtcIntersectN streams, 0 picks the widest packet the host CPU supports: 16 for AVX-512, 8 for AVX)
+        // option "embree.chunk_size" values {int, default = 256} (Embree only: number of rays per worker task)
+        // option "device.num_queues" values {int, default = 1} (number of device queues to use, if > 1 the last queue is used for
+        //         MapBuffer/UnmapBuffer and queries are distributed round-robin across the others, so uploads overlap traversal.
+        //         Dependent calls have to be ordered with events in this mode, calls without events are blocking)
+        // option "debug.capture_dir" values {string, not set by default} (existing directory every Commit writes the attached
+        //         geometry and the options to, followed by the rays of each query, so the workload can be replayed with the
+        //         Replay tool on any backend. Capturing waits for and reads back the query rays, empty string stops it)
         // Set API global option: string
         virtual void SetOption(char const* name, char const* value) = 0;
         // Set API global option: float
         virtual void SetOption(char const* name, float value) = 0;
+        // Get the measurements and the decision made by acc.type = "auto".
+        // The string is empty for other modes and is valid until the next Commit.
+        virtual char const* GetAccelerationReport() const = 0;
+        // Get the build measurements of the last Commit and the query counters since.
+        // Collection is always on, its overhead is a couple of timer reads per call.
+        virtual Statistics GetStatistics() const = 0;
+        // Write TraversalCounters of every ray of the following queries to counters, indexed like the rays,
+        // so it has to hold as many entries as the queried ray count (maxrays for indirect queries).
+        // The buffer has to stay alive until nullptr stops counting. Needs OpenCL and the library built with RR_TRAVERSAL_COUNTERS
+        // (premake --enable_traversal_counters), instrumented kernels are slower than the regular ones.
+        virtual void SetTraversalCounters(Buffer* counters) = 0;
 
     protected:
         IntersectionApi();
@@ -311,6 +473,15 @@ namespace RadeonRays
         virtual ~IntersectionApi() = 0;
     };
 
+    // Count metric of numrays counters into numbins bins of binwidth values each,
+    // the last bin takes everything above as well
+    RRAPI void BuildTraversalHistogram(TraversalCounters const* counters, int numrays, TraversalMetric metric,
+                                       std::uint32_t binwidth, int numbins, std::uint32_t* bins);
+    // Write metric of a width x height camera ray set stored row by row, top row first, to a binary PPM image.
+    // Values are shaded from blue to red up to maxvalue, 0 takes the largest value of the set.
+    RRAPI void WriteTraversalHeatmap(char const* filename, TraversalCounters const* counters, int width, int height,
+                                     TraversalMetric metric, std::uint32_t maxvalue);
+
     inline IntersectionApi::IntersectionApi(){}
     inline IntersectionApi::~IntersectionApi(){}
 
@@ -323,6 +494,7 @@ namespace RadeonRays
     inline Buffer::~Buffer(){}
     inline Shape::~Shape(){}
     inline Event::~Event(){}
+    inline TaskArena::~TaskArena(){}
     inline Exception::~Exception(){}
 }
 
@@ -20,6 +20,7 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
 THE SOFTWARE.
 ********************************************************************/
 #include "bvh.h"
+#include "../async/task_scheduler.h"
 
 #include <algorithm>
 #include <thread>
@@ -27,7 +28,6 @@ THE SOFTWARE.
 #include <numeric>
 #include <cassert>
 #include <vector>
-#include <future>
 
 namespace RadeonRays
 {
@@ -36,6 +36,9 @@ namespace RadeonRays
         return v != v;
     }
 
+    // Subtrees with more primitives are built in parallel
+    static int const kParallelBuildThreshold = 8192;
+
     void Bvh::Build(bbox const* bounds, int numbounds)
     {
         for (int i = 0; i < numbounds; ++i)
@@ -52,6 +55,15 @@ namespace RadeonRays
         return m_bounds;
     }
 
+    void Bvh::UpdateHeight(int level)
+    {
+        int height = m_height;
+
+        while (height < level && !m_height.compare_exchange_weak(height, level))
+        {
+        }
+    }
+
     void  Bvh::InitNodeAllocator(size_t maxnum)
     {
         m_nodecnt = 0;
@@ -65,7 +77,7 @@ namespace RadeonRays
 
     void Bvh::BuildNode(SplitRequest const& req, bbox const* bounds, float3 const* centroids, int* primindices)
     {
-        m_height = std::max(m_height, req.level);
+        UpdateHeight(req.level);
 
         Node* node = AllocateNode();
         node->bounds = req.bounds;
@@ -205,13 +217,30 @@ namespace RadeonRays
             // Right request
             SplitRequest rightrequest = { splitidx, req.numprims - (splitidx - req.startidx), &node->rc, rightbounds, rightcentroid_bounds, req.level + 1 };
 
+            if (req.numprims > kParallelBuildThreshold)
             {
-                // Put those to stack
-                BuildNode(leftrequest, bounds, centroids, primindices);
-            }
+                // Subtrees cover disjoint index ranges and node allocation is atomic,
+                // so the left one is a task for idle scheduler threads to steal
+                TaskGroup left;
+                left.Run([&]()
+                {
+                    BuildNode(leftrequest, bounds, centroids, primindices);
+                });
 
-            {
                 BuildNode(rightrequest, bounds, centroids, primindices);
+
+                left.Wait();
+            }
+            else
+            {
+                {
+                    // Put those to stack
+                    BuildNode(leftrequest, bounds, centroids, primindices);
+                }
+
+                {
+                    BuildNode(rightrequest, bounds, centroids, primindices);
+                }
             }
         }
 
@@ -464,6 +493,48 @@ namespace RadeonRays
         m_root = &m_nodes[0];
     }
 
+    float Bvh::GetSahCost() const
+    {
+        if (!m_root)
+        {
+            return 0.f;
+        }
+
+        float rootarea = m_root->bounds.surface_area();
+
+        if (rootarea <= 0.f)
+        {
+            return 0.f;
+        }
+
+        // Expected cost of a random ray hitting the root: each node is entered
+        // with the probability of its area relative to the root
+        float cost = 0.f;
+        std::stack<Node const*> stack;
+        stack.push(m_root);
+
+        while (!stack.empty())
+        {
+            Node const* node = stack.top();
+            stack.pop();
+
+            float probability = node->bounds.surface_area() / rootarea;
+
+            if (node->type == kLeaf)
+            {
+                cost += probability * node->numprims;
+            }
+            else
+            {
+                cost += probability * m_traversal_cost;
+                stack.push(node->lc);
+                stack.push(node->rc);
+            }
+        }
+
+        return cost;
+    }
+
     void Bvh::PrintStatistics(std::ostream& os) const
     {
         os << "Class name: " << "Bvh\n";
@@ -471,6 +542,7 @@ namespace RadeonRays
         os << "Number of triangles: " << m_indices.size() << "\n";
         os << "Number of nodes: " << m_nodecnt << "\n";
         os << "Tree height: " << GetHeight() << "\n";
+        os << "SAH cost: " << GetSahCost() << "\n";
     }
 
 }
@@ -59,6 +59,12 @@ namespace RadeonRays
         // Get tree height
         int GetHeight() const;
 
+        // Get number of nodes
+        int GetNodeCount() const;
+
+        // Get SAH cost of the tree relative to a primitive test
+        float GetSahCost() const;
+
         // Get reordered prim indices Nodes are pointing to
         virtual int const* GetIndices() const;
 
@@ -74,6 +80,8 @@ namespace RadeonRays
         virtual void BuildImpl(bbox const* bounds, int numbounds);
         // BVH node
         struct Node;
+        // Track tree height, thread safe
+        void UpdateHeight(int level);
         // Node allocation
         virtual Node* AllocateNode();
         virtual void  InitNodeAllocator(size_t maxnum);
@@ -126,8 +134,8 @@ namespace RadeonRays
         Node* m_root;
         // SAH flag
         bool m_usesah;
-        // Tree height
-        int m_height;
+        // Tree height, atomic for thread safety
+        std::atomic<int> m_height;
         // Node traversal cost
         float m_traversal_cost;
 
@@ -183,6 +191,11 @@ namespace RadeonRays
     { 
         return m_height; 
     }
+
+    inline int Bvh::GetNodeCount() const
+    {
+        return m_nodecnt;
+    }
 }
 
 #endif // BVH_H
\ No newline at end of file
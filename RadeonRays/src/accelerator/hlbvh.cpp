@@ -30,7 +30,6 @@ THE SOFTWARE.
 
 #include <vector>
 #include <numeric>
-#include <chrono>
 #include <cstring>
 #include <iostream>
 #include <assert.h>
@@ -127,17 +126,8 @@ namespace RadeonRays
     // Build function
     void Hlbvh::Build(bbox const* bounds, int numbounds)
     {
-#ifdef _DEBUG
-        auto s = std::chrono::high_resolution_clock::now();
-#endif
+        // Build time is reported through Strategy statistics
         BuildImpl(bounds, numbounds);
-#ifdef _DEBUG
-        m_device->Finish(0);
-        // Note, that this is total time spent for setup and construction 
-        // including the time spent waiting in the queue.
-        auto d = std::chrono::high_resolution_clock::now() - s;
-        std::cout << "HLBVH setup + construction CPU time: " << std::chrono::duration_cast<std::chrono::milliseconds>(d).count() << "ms\n";
-#endif
     }
     
     
@@ -40,7 +40,7 @@ namespace RadeonRays
     void SplitBvh::BuildNode(SplitRequest& req, PrimRefArray& primrefs)
     {
         // Update current height
-        m_height = std::max(m_height, req.level);
+        UpdateHeight(req.level);
 
         // Allocate new node
         Node* node = AllocateNode();
@@ -0,0 +1,276 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "task_scheduler.h"
+#include "radeon_rays.h"
+
+namespace RadeonRays
+{
+    // Index of the scheduler worker running on this thread, -1 for other threads
+    static thread_local int t_worker_index = -1;
+
+    TaskScheduler& TaskScheduler::Instance()
+    {
+        static TaskScheduler scheduler;
+        return scheduler;
+    }
+
+    TaskScheduler::TaskScheduler()
+        : m_pending(0)
+        , m_stop(false)
+        , m_thread_count(0)
+        , m_arena(nullptr)
+    {
+        Start();
+    }
+
+    TaskScheduler::~TaskScheduler()
+    {
+        Stop();
+    }
+
+    void TaskScheduler::Start()
+    {
+        int numthreads = m_thread_count > 0 ? m_thread_count : static_cast<int>(std::thread::hardware_concurrency());
+        numthreads = numthreads == 0 ? 2 : numthreads;
+
+        if (m_arena)
+            numthreads = 0;
+
+        m_stop = false;
+        m_queues.clear();
+        for (int i = 0; i <= numthreads; ++i)
+        {
+            m_queues.emplace_back(new TaskQueue());
+        }
+
+        for (int i = 0; i < numthreads; ++i)
+        {
+            m_threads.push_back(std::thread(&TaskScheduler::WorkerLoop, this, i));
+        }
+    }
+
+    void TaskScheduler::Stop()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_park_mutex);
+            m_stop = true;
+        }
+        m_park_cv.notify_all();
+
+        // Workers drain the queues before they exit
+        for (auto& thread : m_threads)
+        {
+            thread.join();
+        }
+
+        m_threads.clear();
+    }
+
+    void TaskScheduler::SetThreadCount(int count)
+    {
+        Stop();
+        m_thread_count = count;
+        Start();
+    }
+
+    int TaskScheduler::GetThreadCount() const
+    {
+        if (m_arena || m_threads.empty())
+        {
+            int numthreads = static_cast<int>(std::thread::hardware_concurrency());
+            return numthreads == 0 ? 2 : numthreads;
+        }
+
+        return static_cast<int>(m_threads.size());
+    }
+
+    void TaskScheduler::SetArena(TaskArena* arena)
+    {
+        Stop();
+        m_arena = arena;
+        Start();
+    }
+
+    void TaskScheduler::Submit(std::function<void()>&& task)
+    {
+        // Workers push to their own deque, the others to the injection one
+        auto index = t_worker_index >= 0 ? t_worker_index : static_cast<int>(m_queues.size()) - 1;
+
+        {
+            std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+            m_queues[index]->tasks.push_back(std::move(task));
+        }
+
+        ++m_pending;
+
+        if (m_arena)
+        {
+            m_arena->Execute(&TaskScheduler::RunPendingTask, this);
+        }
+        else
+        {
+            // Taking the lock makes sure a worker going to sleep sees the task
+            {
+                std::lock_guard<std::mutex> lock(m_park_mutex);
+            }
+            m_park_cv.notify_one();
+        }
+    }
+
+    bool TaskScheduler::PopTask(int index, std::function<void()>& task)
+    {
+        auto numqueues = static_cast<int>(m_queues.size());
+
+        // Own tasks are taken newest first to keep the data hot
+        if (index >= 0)
+        {
+            auto& queue = *m_queues[index];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = std::move(queue.tasks.back());
+                queue.tasks.pop_back();
+                --m_pending;
+                return true;
+            }
+        }
+
+        // Then the injection queue and the other workers, oldest first
+        for (int i = 0; i < numqueues; ++i)
+        {
+            auto victim = (numqueues - 1 + i) % numqueues;
+            if (victim == index)
+                continue;
+
+            auto& queue = *m_queues[victim];
+            std::lock_guard<std::mutex> lock(queue.mutex);
+            if (!queue.tasks.empty())
+            {
+                task = std::move(queue.tasks.front());
+                queue.tasks.pop_front();
+                --m_pending;
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    bool TaskScheduler::RunPendingTask()
+    {
+        std::function<void()> task;
+        if (!PopTask(t_worker_index, task))
+            return false;
+
+        task();
+        return true;
+    }
+
+    void TaskScheduler::RunPendingTask(void* scheduler)
+    {
+        static_cast<TaskScheduler*>(scheduler)->RunPendingTask();
+    }
+
+    void TaskScheduler::WorkerLoop(int index)
+    {
+        t_worker_index = index;
+
+        for (;;)
+        {
+            if (RunPendingTask())
+                continue;
+
+            std::unique_lock<std::mutex> lock(m_park_mutex);
+            m_park_cv.wait(lock, [this]() { return m_pending > 0 || m_stop; });
+
+            if (m_stop && m_pending == 0)
+                break;
+        }
+
+        t_worker_index = -1;
+    }
+
+    TaskGroup::TaskGroup()
+        : m_state(std::make_shared<State>())
+    {
+        m_state->count = 0;
+    }
+
+    TaskGroup::~TaskGroup()
+    {
+        WaitNoThrow();
+    }
+
+    void TaskGroup::Run(std::function<void()>&& task)
+    {
+        auto state = m_state;
+        ++state->count;
+
+        TaskScheduler::Instance().Submit([state, task]()
+        {
+            try
+            {
+                task();
+            }
+            catch (...)
+            {
+                std::lock_guard<std::mutex> lock(state->mutex);
+                if (!state->error)
+                    state->error = std::current_exception();
+            }
+
+            std::lock_guard<std::mutex> lock(state->mutex);
+            --state->count;
+            state->cv.notify_all();
+        });
+    }
+
+    void TaskGroup::WaitNoThrow()
+    {
+        auto& scheduler = TaskScheduler::Instance();
+
+        while (m_state->count > 0)
+        {
+            // Help with pending work, which might include our own tasks
+            if (scheduler.RunPendingTask())
+                continue;
+
+            // Everything left is running on other threads
+            std::unique_lock<std::mutex> lock(m_state->mutex);
+            m_state->cv.wait(lock, [this]() { return m_state->count == 0; });
+        }
+    }
+
+    void TaskGroup::Wait()
+    {
+        WaitNoThrow();
+
+        std::exception_ptr error;
+        {
+            std::lock_guard<std::mutex> lock(m_state->mutex);
+            std::swap(error, m_state->error);
+        }
+
+        if (error)
+            std::rethrow_exception(error);
+    }
+}
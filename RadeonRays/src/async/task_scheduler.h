@@ -0,0 +1,168 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace RadeonRays
+{
+    class TaskArena;
+
+    ///< Work stealing task scheduler shared by all CPU side work of the library.
+    ///< Every worker owns a deque: it pops its own tasks from the back and
+    ///< steals from the front of the others. Tasks submitted by other threads
+    ///< go to a shared injection deque. Idle workers park on a condition variable.
+    ///< A host TaskArena can replace the workers, then every submitted task
+    ///< is handed over to the arena as a call which runs one pending task.
+    ///<
+    class TaskScheduler
+    {
+    public:
+        static TaskScheduler& Instance();
+
+        // Number of worker threads, 0 means one per hardware thread.
+        // Must not be called while tasks are in flight.
+        void SetThreadCount(int count);
+        // Number of threads expected to execute tasks
+        int GetThreadCount() const;
+
+        // Use host threads instead of the workers, nullptr restores the workers.
+        // Must not be called while tasks are in flight.
+        void SetArena(TaskArena* arena);
+
+        // Queue the task for asynchronous execution
+        void Submit(std::function<void()>&& task);
+
+        // Execute one pending task on the calling thread.
+        // Returns false if there was nothing to execute.
+        bool RunPendingTask();
+
+    private:
+        TaskScheduler();
+        ~TaskScheduler();
+        TaskScheduler(TaskScheduler const&) = delete;
+        TaskScheduler& operator = (TaskScheduler const&) = delete;
+
+        void Start();
+        void Stop();
+        void WorkerLoop(int index);
+        bool PopTask(int index, std::function<void()>& task);
+        static void RunPendingTask(void* scheduler);
+
+        struct TaskQueue
+        {
+            std::mutex mutex;
+            std::deque<std::function<void()>> tasks;
+        };
+
+        // Queue per worker, the injection queue goes last
+        std::vector<std::unique_ptr<TaskQueue>> m_queues;
+        std::vector<std::thread> m_threads;
+        // Number of queued tasks
+        std::atomic<int> m_pending;
+        std::mutex m_park_mutex;
+        std::condition_variable m_park_cv;
+        bool m_stop;
+        int m_thread_count;
+        TaskArena* m_arena;
+    };
+
+    ///< Set of tasks which are waited for together. Waiting threads execute
+    ///< pending tasks in the meantime, so groups can be nested inside tasks.
+    ///<
+    class TaskGroup
+    {
+    public:
+        TaskGroup();
+        ~TaskGroup();
+
+        void Run(std::function<void()>&& task);
+
+        // Blocks until all the tasks are done, rethrows the first task error
+        void Wait();
+
+    private:
+        TaskGroup(TaskGroup const&) = delete;
+        TaskGroup& operator = (TaskGroup const&) = delete;
+
+        void WaitNoThrow();
+
+        struct State
+        {
+            std::atomic<int> count;
+            std::mutex mutex;
+            std::condition_variable cv;
+            std::exception_ptr error;
+        };
+
+        std::shared_ptr<State> m_state;
+    };
+
+    // Call func(i) for every i in [begin, end) on the scheduler,
+    // iterations are processed in chunks of at least grain.
+    // The calling thread takes part in the work and returns when all is done.
+    template <typename F>
+    void ParallelFor(int begin, int end, F const& func, int grain = 1)
+    {
+        int count = end - begin;
+        if (count <= 0)
+            return;
+
+        // A few chunks per thread to balance uneven iterations
+        int maxchunks = 4 * TaskScheduler::Instance().GetThreadCount();
+        int numchunks = std::min((count + grain - 1) / std::max(grain, 1), maxchunks);
+
+        if (numchunks <= 1)
+        {
+            for (int i = begin; i < end; ++i)
+                func(i);
+            return;
+        }
+
+        int chunksize = (count + numchunks - 1) / numchunks;
+
+        TaskGroup group;
+        for (int chunkstart = begin + chunksize; chunkstart < end; chunkstart += chunksize)
+        {
+            int chunkend = std::min(chunkstart + chunksize, end);
+            group.Run([&func, chunkstart, chunkend]()
+            {
+                for (int i = chunkstart; i < chunkend; ++i)
+                    func(i);
+            });
+        }
+
+        for (int i = begin; i < begin + chunksize; ++i)
+            func(i);
+
+        group.Wait();
+    }
+}
@@ -25,7 +25,10 @@ THE SOFTWARE.
 #include "buffer.h"
 #include "device.h"
 #include "event.h"
+#include "except.h"
 #include "../primitive/shapeimpl.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
 
 #include "calc_holder.h"
 
@@ -35,7 +38,12 @@ THE SOFTWARE.
 #include "../strategy/fatbvhstrategy.h"
 #include "../strategy/hlbvh_strategy.h"
 #include "../world/world.h"
+#include "../except/except.h"
+#include <algorithm>
+#include <chrono>
 #include <iostream>
+#include <random>
+#include <sstream>
 
 namespace RadeonRays
 {
@@ -44,6 +52,10 @@ namespace RadeonRays
         : m_device(device, [calc](Calc::Device* device) { calc->DeleteDevice(device); })
         , m_intersector(new BvhStrategy(device))
         , m_intersector_string("bvh")
+        , m_num_query_queues(1)
+        , m_transfer_queue(0)
+        , m_next_queue(0)
+        , m_counters(nullptr)
     {
         // Initialize event pool
         for (auto i = 0; i < EVENT_POOL_INITIAL_SIZE; ++i)
@@ -64,6 +76,43 @@ namespace RadeonRays
 
     void CalcIntersectionDevice::Preprocess(World const& world)
     {
+        // Make sure nothing is in flight while the scene data is updated
+        if (m_transfer_queue != 0)
+        {
+            for (auto i = 0U; i <= m_transfer_queue; ++i)
+            {
+                m_device->Finish(i);
+            }
+        }
+
+        // Check how many queues we are allowed to use. With more than one queue
+        // the last one is dedicated to transfers and queries go round-robin across the rest.
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        auto optnumqueues = world.options_.GetOption("device.num_queues");
+        auto numqueues = optnumqueues ? static_cast<std::uint32_t>(optnumqueues->AsFloat()) : 1U;
+        numqueues = std::max(1U, std::min(numqueues, spec.max_num_queues));
+
+        m_num_query_queues = numqueues > 1 ? numqueues - 1 : 1;
+        m_transfer_queue = numqueues > 1 ? numqueues - 1 : 0;
+
+        auto moving = [](ShapeImpl const* shape)
+        {
+            auto v = shape->GetLinearVelocity();
+            auto q = shape->GetAngularVelocity();
+            return v.sqnorm() > 0.f || q.x != 0.f || q.y != 0.f || q.z != 0.f;
+        };
+
+        // Only the OpenCL bvh2l kernels interpolate shapes by ray time
+        if (m_device->GetPlatform() != Calc::Platform::kOpenCL)
+        {
+            for (auto iter = world.shapes_.cbegin(); iter != world.shapes_.cend(); ++iter)
+            {
+                ThrowIf(moving(static_cast<ShapeImpl const*>(*iter)), "Motion blur is supported on OpenCL only.");
+            }
+        }
+
         bool use2level = false;
 
         // First check if 2 level BVH has been forced
@@ -82,17 +131,36 @@ namespace RadeonRays
             }
             else
             {
-                // Otherwise check if there are instances in the world
+                // Only "bvh" can reference instances itself if asked to, the other
+                // single level strategies would flatten all of them
+                auto optflatten = world.options_.GetOption("bvh.instance_flatten_faces");
+                auto optacctype = world.options_.GetOption("acc.type");
+                std::string acctype = optacctype ? optacctype->AsString() : "bvh";
+
+                if (acctype == "auto")
+                {
+                    acctype = m_auto_acctype;
+                }
+
+                bool hybrid = optflatten && acctype == "bvh" && m_device->GetPlatform() == Calc::Platform::kOpenCL;
+
+                // Otherwise check if there are instances or moving shapes in the world
                 for (auto iter = world.shapes_.cbegin(); iter != world.shapes_.cend(); ++iter)
                 {
                     // Get implementation
                     auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
                     // Check if it is an instance and update flag
-                    use2level = use2level | shapeimpl->is_instance();
+                    use2level = use2level | (shapeimpl->is_instance() && !hybrid);
+
+                    // Only 2-level BVH interpolates shapes by ray time
+                    use2level = use2level | moving(shapeimpl);
                 }
             }
         }
 
+        // Options the tuned configuration overrides, none unless in auto mode
+        Options overrides;
+
         if (use2level)
         {
             if (m_intersector_string != "bvh2l")
@@ -103,33 +171,39 @@ namespace RadeonRays
         }
         else
         {
+            auto optacctype = world.options_.GetOption("acc.type");
+            std::string acctype = optacctype ? optacctype->AsString() : "bvh";
+
+            if (acctype == "auto")
             {
-                auto optacctype = world.options_.GetOption("acc.type");
-                std::string acctype = optacctype ? optacctype->AsString() : "bvh";
+                // Tune on the first commit having geometry and stick to the decision
+                if (m_auto_acctype.empty() && !world.shapes_.empty())
+                {
+                    // The winner is already built against this world
+                    Autotune(world);
+                    m_intersector->SetTraversalCounters(m_counters);
+                    return;
+                }
 
-                if (acctype == "bvh")
+                if (!m_auto_acctype.empty())
                 {
-                    if (m_intersector_string != "bvh")
-                    {
-                        m_intersector.reset(new BvhStrategy(m_device.get()));
-                        m_intersector_string = "bvh";
-                    }
+                    acctype = m_auto_acctype;
+                    overrides = m_auto_options;
                 }
-                else if (acctype == "fatbvh")
+                else
                 {
-                    if (m_intersector_string != "fatbvh")
-                    {
-                        m_intersector.reset(new FatBvhStrategy(m_device.get()));
-                        m_intersector_string = "fatbvh";
-                    }
+                    acctype = "bvh";
                 }
-                else if (acctype == "hlbvh")
+            }
+
+            if (m_intersector_string != acctype)
+            {
+                auto strategy = CreateStrategy(acctype);
+
+                if (strategy)
                 {
-                    if (m_intersector_string != "hlbvh")
-                    {
-                        m_intersector.reset(new HlbvhStrategy(m_device.get()));
-                        m_intersector_string = "hlbvh";
-                    }
+                    m_intersector.reset(strategy);
+                    m_intersector_string = acctype;
                 }
             }
         }
@@ -137,6 +211,8 @@ namespace RadeonRays
         try
         {
             // Let intersector to do its preprocessing job
+            m_intersector->SetTraversalCounters(m_counters);
+            m_intersector->SetOptionOverrides(overrides);
             m_intersector->Preprocess(world);
         }
         catch (Exception& e)
@@ -146,6 +222,288 @@ namespace RadeonRays
         }
     }
 
+    Strategy* CalcIntersectionDevice::CreateStrategy(std::string const& acctype) const
+    {
+        if (acctype == "bvh")
+        {
+            return new BvhStrategy(m_device.get());
+        }
+        else if (acctype == "fatbvh")
+        {
+            return new FatBvhStrategy(m_device.get());
+        }
+        else if (acctype == "hlbvh")
+        {
+            return new HlbvhStrategy(m_device.get());
+        }
+
+        return nullptr;
+    }
+
+    // Number of rays in the autotuner probe set
+    static int const kProbeRayCount = 1 << 16;
+    // Number of timed probe queries per candidate
+    static int const kProbeRuns = 4;
+
+    // Shoot rays from random points within the scene bounds towards random faces,
+    // which roughly resembles a mix of primary and secondary rays.
+    static void GenerateProbeRays(World const& world, int numrays, std::vector<ray>& rays)
+    {
+        std::mt19937 rng(0x5eed);
+        std::uniform_int_distribution<std::size_t> shape_distr(0, world.shapes_.size() - 1);
+        std::uniform_real_distribution<float> unit_distr(0.f, 1.f);
+
+        std::vector<float3> targets;
+        targets.reserve(numrays);
+        bbox scenebounds;
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(world.shapes_[shape_distr(rng)]);
+
+            bbox facebounds;
+
+            if (shapeimpl->is_instance())
+            {
+                auto instance = static_cast<Instance const*>(shapeimpl);
+                auto mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                if (mesh->num_faces() == 0)
+                    continue;
+
+                matrix m, minv;
+                instance->GetTransform(m, minv);
+
+                mesh->GetFaceBounds(static_cast<int>(unit_distr(rng) * (mesh->num_faces() - 1)), true, facebounds);
+                facebounds = transform_bbox(facebounds, m);
+            }
+            else
+            {
+                auto mesh = static_cast<Mesh const*>(shapeimpl);
+
+                if (mesh->num_faces() == 0)
+                    continue;
+
+                mesh->GetFaceBounds(static_cast<int>(unit_distr(rng) * (mesh->num_faces() - 1)), false, facebounds);
+            }
+
+            targets.push_back(facebounds.center());
+            scenebounds.grow(facebounds);
+        }
+
+        rays.clear();
+        rays.reserve(targets.size());
+
+        for (auto const& target : targets)
+        {
+            float3 o = scenebounds.pmin + float3(unit_distr(rng), unit_distr(rng), unit_distr(rng)) * scenebounds.extents();
+            float3 d = target - o;
+
+            if (d.sqnorm() == 0.f)
+            {
+                d = float3(0.f, 0.f, 1.f);
+            }
+
+            rays.push_back(ray(o, normalize(d)));
+        }
+    }
+
+    void CalcIntersectionDevice::Autotune(World const& world)
+    {
+        // SAH knobs are left to the world options where a candidate does not set them
+        struct Candidate
+        {
+            char const* acctype;
+            char const* builder;
+            // bvh.sah.traversal_cost, 0 if not set
+            float traversal_cost;
+            // bvh.sah.use_splits
+            bool use_splits;
+        };
+
+        static Candidate const candidates[] =
+        {
+            { "bvh", "median", 0.f, false },
+            { "bvh", "sah", 0.f, false },
+            { "bvh", "sah", 3.f, false },
+            { "bvh", "sah", 0.f, true },
+            { "fatbvh", "median", 0.f, false },
+            { "fatbvh", "sah", 0.f, false },
+            { "fatbvh", "sah", 3.f, false },
+            { "fatbvh", "sah", 0.f, true },
+            // Builds on the device and ignores the builder options
+            { "hlbvh", "median", 0.f, false }
+        };
+
+        auto describe = [](Candidate const& candidate)
+        {
+            std::ostringstream name;
+            name << candidate.acctype << "/" << candidate.builder;
+
+            if (candidate.traversal_cost > 0.f)
+            {
+                name << " traversal_cost=" << candidate.traversal_cost;
+            }
+
+            if (candidate.use_splits)
+            {
+                name << " splits";
+            }
+
+            return name.str();
+        };
+
+        auto overrides = [](Candidate const& candidate)
+        {
+            Options options;
+            options.SetValue("bvh.builder", candidate.builder);
+
+            if (candidate.traversal_cost > 0.f)
+            {
+                options.SetValue("bvh.sah.traversal_cost", candidate.traversal_cost);
+            }
+
+            if (candidate.use_splits)
+            {
+                options.SetValue("bvh.sah.use_splits", 1.f);
+            }
+
+            return options;
+        };
+
+        auto optqueries = world.options_.GetOption("acc.auto.queries_per_build");
+        float queries_per_build = optqueries ? optqueries->AsFloat() : 100.f;
+
+        std::vector<ray> probe;
+        GenerateProbeRays(world, kProbeRayCount, probe);
+        int numrays = static_cast<int>(probe.size());
+
+        std::ostringstream report;
+        report << "acc.type = auto: " << numrays << " probe rays, " << queries_per_build << " queries per build\n";
+
+        Calc::Buffer* rays = nullptr;
+        Calc::Buffer* hits = nullptr;
+
+        if (numrays > 0)
+        {
+            rays = m_device->CreateBuffer(numrays * sizeof(ray), Calc::BufferType::kRead, probe.data());
+            hits = m_device->CreateBuffer(numrays * sizeof(Intersection), Calc::BufferType::kWrite);
+        }
+
+        std::unique_ptr<Strategy> best;
+        Candidate const* best_candidate = nullptr;
+        double best_score = 0.0;
+
+        for (auto const& candidate : candidates)
+        {
+            report << "  " << describe(candidate) << ": ";
+
+            try
+            {
+                std::unique_ptr<Strategy> strategy(CreateStrategy(candidate.acctype));
+                strategy->SetOptionOverrides(overrides(candidate));
+
+                auto start = std::chrono::high_resolution_clock::now();
+                strategy->Preprocess(world);
+                m_device->Finish(0);
+                auto built = std::chrono::high_resolution_clock::now();
+
+                double trace_ms = 0.0;
+
+                if (numrays > 0)
+                {
+                    // Warm up caches and lazy driver state first
+                    strategy->QueryIntersection(0, rays, numrays, hits, nullptr, nullptr);
+                    m_device->Finish(0);
+
+                    auto trace_start = std::chrono::high_resolution_clock::now();
+
+                    for (int i = 0; i < kProbeRuns; ++i)
+                    {
+                        strategy->QueryIntersection(0, rays, numrays, hits, nullptr, nullptr);
+                    }
+
+                    m_device->Finish(0);
+                    auto trace_end = std::chrono::high_resolution_clock::now();
+
+                    trace_ms = std::chrono::duration<double, std::milli>(trace_end - trace_start).count() / kProbeRuns;
+                }
+
+                double build_ms = std::chrono::duration<double, std::milli>(built - start).count();
+                double score = build_ms + queries_per_build * trace_ms;
+
+                report << "build " << build_ms << " ms, trace " << trace_ms << " ms, score " << score << "\n";
+
+                if (!best || score < best_score)
+                {
+                    best = std::move(strategy);
+                    best_candidate = &candidate;
+                    best_score = score;
+                }
+            }
+            catch (Exception& e)
+            {
+                report << "failed (" << e.what() << ")\n";
+            }
+            catch (Calc::Exception& e)
+            {
+                report << "failed (" << e.what() << ")\n";
+            }
+        }
+
+        if (numrays > 0)
+        {
+            m_device->DeleteBuffer(rays);
+            m_device->DeleteBuffer(hits);
+        }
+
+        ThrowIf(!best, "Autotuner failed to build any acceleration structure");
+
+        report << "  selected " << describe(*best_candidate) << "\n";
+
+        m_intersector = std::move(best);
+        m_intersector_string = best_candidate->acctype;
+        m_auto_acctype = best_candidate->acctype;
+        m_auto_options = overrides(*best_candidate);
+        m_report = report.str();
+
+#ifdef RR_PROFILE
+        std::cout << m_report;
+#endif
+    }
+
+    char const* CalcIntersectionDevice::GetAccelerationReport() const
+    {
+        return m_report.c_str();
+    }
+
+    Statistics CalcIntersectionDevice::GetStatistics() const
+    {
+        return m_intersector->GetStatistics();
+    }
+
+    float CalcIntersectionDevice::GetQueryDuration(Event const* event) const
+    {
+        return static_cast<CalcEventHolder const*>(event)->m_event->GetDuration();
+    }
+
+    void CalcIntersectionDevice::SetTraversalCounters(Buffer* counters)
+    {
+#ifdef RR_TRAVERSAL_COUNTERS
+        ThrowIf(counters && m_device->GetPlatform() != Calc::Platform::kOpenCL, "Traversal counters are supported on OpenCL only.");
+#else
+        ThrowIf(counters != nullptr, "Traversal counters need the library built with RR_TRAVERSAL_COUNTERS.");
+#endif
+
+        m_counters = counters ? static_cast<CalcBufferHolder*>(counters)->GetData() : nullptr;
+        m_intersector->SetTraversalCounters(m_counters);
+    }
+
+    void CalcIntersectionDevice::CheckTraversalCounters(int numrays) const
+    {
+        ThrowIf(m_counters && m_counters->GetSize() < numrays * sizeof(TraversalCounters), "Traversal counter buffer is too small for the query.");
+    }
+
     Buffer* CalcIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
     {
         // If initdata is passed in use different Calc call with init data
@@ -161,6 +519,15 @@ namespace RadeonRays
         }
     }
 
+    Buffer* CalcIntersectionDevice::CreateBufferFromHostPointer(void* ptr, size_t size) const
+    {
+        ThrowIf(m_device->GetPlatform() != Calc::Platform::kOpenCL, "Host pointer buffers are supported on OpenCL only.");
+
+        // The memory is used directly on CPU devices, GPU ones keep it coherent on map
+        auto calc_buffer = m_device->CreateBuffer(size, Calc::BufferType::kWrite | Calc::BufferType::kUseHostPtr, ptr);
+        return new CalcBufferHolder(m_device.get(), calc_buffer);
+    }
+
     void CalcIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
     {
         delete buffer;
@@ -191,7 +558,7 @@ namespace RadeonRays
         if (event)
         {
             Calc::Event* e = nullptr;
-            m_device->MapBuffer(calc_buffer->GetData(), 0, offset, size, CalcMapType(type), data, &e);
+            m_device->MapBuffer(calc_buffer->GetData(), GetTransferQueue(), offset, size, CalcMapType(type), data, &e);
 
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), e);
@@ -199,7 +566,8 @@ namespace RadeonRays
         }
         else
         {
-            m_device->MapBuffer(calc_buffer->GetData(), 0, offset, size, CalcMapType(type), data, nullptr);
+            m_device->MapBuffer(calc_buffer->GetData(), GetTransferQueue(), offset, size, CalcMapType(type), data, nullptr);
+            FinishIfRequired(GetTransferQueue());
         }
     }
 
@@ -210,7 +578,7 @@ namespace RadeonRays
         if (event)
         {
             Calc::Event* e = nullptr;
-            m_device->UnmapBuffer(calc_buffer->GetData(), 0, ptr, &e);
+            m_device->UnmapBuffer(calc_buffer->GetData(), GetTransferQueue(), ptr, &e);
             
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), e);
@@ -218,24 +586,28 @@ namespace RadeonRays
         }
         else
         {
-            m_device->UnmapBuffer(calc_buffer->GetData(), 0, ptr, nullptr);
+            m_device->UnmapBuffer(calc_buffer->GetData(), GetTransferQueue(), ptr, nullptr);
+            FinishIfRequired(GetTransferQueue());
         }
     }
 
 
     void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
+        CheckTraversalCounters(numrays);
+
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
         auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        auto queue = GetQueryQueue();
 
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            m_intersector->QueryIntersection(queue, ray_buffer, numrays, hit_buffer, e, &calc_event);
             
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), calc_event);
@@ -243,23 +615,27 @@ namespace RadeonRays
         }
         else
         {
-            m_intersector->QueryIntersection(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+            m_intersector->QueryIntersection(queue, ray_buffer, numrays, hit_buffer, e, nullptr);
+            FinishIfRequired(queue);
         }
     }
 
     void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
+        CheckTraversalCounters(numrays);
+
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
         auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        auto queue = GetQueryQueue();
 
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, &calc_event);
+            m_intersector->QueryOcclusion(queue, ray_buffer, numrays, hit_buffer, e, &calc_event);
             
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), calc_event);
@@ -267,24 +643,28 @@ namespace RadeonRays
         }
         else
         {
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays, hit_buffer, e, nullptr);
+            m_intersector->QueryOcclusion(queue, ray_buffer, numrays, hit_buffer, e, nullptr);
+            FinishIfRequired(queue);
         }
     }
 
     void CalcIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
+        CheckTraversalCounters(maxrays);
+
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
         auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
         auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        auto queue = GetQueryQueue();
 
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            m_intersector->QueryIntersection(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
             
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), calc_event);
@@ -292,24 +672,28 @@ namespace RadeonRays
         }
         else
         {
-            m_intersector->QueryIntersection(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            m_intersector->QueryIntersection(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            FinishIfRequired(queue);
         }
     }
 
     void CalcIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
+        CheckTraversalCounters(maxrays);
+
         // Extract Calc buffers from their holders
         auto ray_buffer = static_cast<CalcBufferHolder const*>(rays)->m_buffer.get();
         auto hit_buffer = static_cast<CalcBufferHolder const*>(hits)->m_buffer.get();
         auto numrays_buffer = static_cast<CalcBufferHolder const*>(numrays)->m_buffer.get();
         // If waitevent is passed in we have to extract it as well
         auto e = waitevent ? static_cast<CalcEventHolder const*>(waitevent)->m_event.get() : nullptr;
+        auto queue = GetQueryQueue();
 
         if (event)
         {
             // event pointer has been provided, so construct holder and return event to the user
             Calc::Event* calc_event = nullptr;
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
+            m_intersector->QueryOcclusion(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, &calc_event);
             
             auto holder = CreateEventHolder();
             holder->Set(m_device.get(), calc_event);
@@ -317,13 +701,31 @@ namespace RadeonRays
         }
         else
         {
-            m_intersector->QueryOcclusion(0, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            m_intersector->QueryOcclusion(queue, ray_buffer, numrays_buffer, maxrays, hit_buffer, e, nullptr);
+            FinishIfRequired(queue);
         }
 
     }
 
+    std::uint32_t CalcIntersectionDevice::GetQueryQueue() const
+    {
+        return m_next_queue++ % m_num_query_queues;
+    }
+
+    void CalcIntersectionDevice::FinishIfRequired(std::uint32_t queue) const
+    {
+        // With a single in-order queue subsequent calls are implicitly ordered,
+        // otherwise calls without events have to be blocking
+        if (m_transfer_queue != 0)
+        {
+            m_device->Finish(queue);
+        }
+    }
+
     CalcEventHolder* CalcIntersectionDevice::CreateEventHolder() const
     {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
+
         if (m_event_pool.empty())
         {
             auto event = new CalcEventHolder();
@@ -339,6 +741,7 @@ namespace RadeonRays
 
     void    CalcIntersectionDevice::ReleaseEventHolder(CalcEventHolder* e) const
     {
+        std::lock_guard<std::mutex> lock(m_event_pool_mutex);
         m_event_pool.push(e);
     }
 }
@@ -25,10 +25,14 @@ THE SOFTWARE.
 
 #include "calc.h"
 #include "device.h"
+#include "../util/options.h"
 
+#include <atomic>
 #include <memory>
 #include <functional>
+#include <mutex>
 #include <queue>
+#include <string>
 
 
 namespace RadeonRays
@@ -50,6 +54,8 @@ namespace RadeonRays
 
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
 
+        Buffer* CreateBufferFromHostPointer(void* ptr, size_t size) const override;
+
         void DeleteBuffer(Buffer* const) const override;
 
         void DeleteEvent(Event* const) const override;
@@ -66,19 +72,59 @@ namespace RadeonRays
 
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
 
+        char const* GetAccelerationReport() const override;
+
+        Statistics GetStatistics() const override;
+
+        float GetQueryDuration(Event const* event) const override;
+
+        void SetTraversalCounters(Buffer* counters) override;
+
         Calc::Platform GetPlatform() const { return m_device->GetPlatform(); }
     protected:
+        // Create a strategy for the given acc.type, nullptr if the type is unknown
+        Strategy* CreateStrategy(std::string const& acctype) const;
+        // Build and time candidate structures for acc.type = "auto"
+        void Autotune(World const& world);
+
         CalcEventHolder* CreateEventHolder() const;
         void      ReleaseEventHolder(CalcEventHolder* e) const;
 
+        // Pick the queue for the next query batch (round-robin)
+        std::uint32_t GetQueryQueue() const;
+        // Queue used for buffer uploads and readbacks
+        std::uint32_t GetTransferQueue() const { return m_transfer_queue; }
+        // Calls without events are blocking when several queues are in use
+        void FinishIfRequired(std::uint32_t queue) const;
+        // Make sure the traversal counters can take numrays entries
+        void CheckTraversalCounters(int numrays) const;
+
         std::unique_ptr<Calc::Device, std::function<void(Calc::Device*)>> m_device;
         std::unique_ptr<Strategy> m_intersector;
         std::string m_intersector_string;
 
+        // Configuration picked for acc.type = "auto", empty until tuned
+        std::string m_auto_acctype;
+        // Builder options of the picked configuration, set as strategy overrides
+        Options m_auto_options;
+        // Autotuner measurements and decision
+        std::string m_report;
+
+        // Number of queues used for queries
+        std::uint32_t m_num_query_queues;
+        // Queue used for Map/Unmap
+        std::uint32_t m_transfer_queue;
+        // Round-robin counter for query queues
+        mutable std::atomic<std::uint32_t> m_next_queue;
+        // Traversal counter side buffer, not owned
+        Calc::Buffer* m_counters;
+
         // Initial number of events in the pool
         static const std::size_t EVENT_POOL_INITIAL_SIZE = 100;
         // Event pool
         mutable std::queue<CalcEventHolder*> m_event_pool;
+        // Queries might be issued from several threads
+        mutable std::mutex m_event_pool_mutex;
     };
 }
 
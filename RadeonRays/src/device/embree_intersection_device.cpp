@@ -22,8 +22,13 @@ THE SOFTWARE.
 #include "embree_intersection_device.h"
 
 #include <iostream>
+#include <chrono>
 #include <future>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <exception>
+#include <memory>
 #include "../world/world.h"
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
@@ -33,34 +38,146 @@ THE SOFTWARE.
 #include "../except/except.h"
 #include "embree2/rtcore.h"
 #include "embree2/rtcore_ray.h"
-#include "../async/thread_pool.h"
+#include "../async/task_scheduler.h"
 
 #include <xmmintrin.h>
 #include <pmmintrin.h>
 
-//count of elements for one thread pool task
-#define TASK_SIZE 256
-
-//switch between rtcIntersect4 and rtcIntercetN
-//#define INTERSECTN
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
 
+//default count of rays for one scheduler task
+#define TASK_SIZE 256
 
 namespace RadeonRays
 {
+    // Embree entry points by packet type
+    template <typename Packet> struct EmbreePacket;
+
+    template <> struct EmbreePacket<RTCRay4>
+    {
+        static int const kWidth = 4;
+        static void Intersect(int const* valid, RTCScene scene, RTCRay4& packet) { rtcIntersect4(valid, scene, packet); }
+        static void Occluded(int const* valid, RTCScene scene, RTCRay4& packet) { rtcOccluded4(valid, scene, packet); }
+    };
+
+    template <> struct EmbreePacket<RTCRay8>
+    {
+        static int const kWidth = 8;
+        static void Intersect(int const* valid, RTCScene scene, RTCRay8& packet) { rtcIntersect8(valid, scene, packet); }
+        static void Occluded(int const* valid, RTCScene scene, RTCRay8& packet) { rtcOccluded8(valid, scene, packet); }
+    };
+
+    template <> struct EmbreePacket<RTCRay16>
+    {
+        static int const kWidth = 16;
+        static void Intersect(int const* valid, RTCScene scene, RTCRay16& packet) { rtcIntersect16(valid, scene, packet); }
+        static void Occluded(int const* valid, RTCScene scene, RTCRay16& packet) { rtcOccluded16(valid, scene, packet); }
+    };
+
+    // Convert up to a packet width of rays into packet lanes, four lanes at a time:
+    // origin/maxt and direction/time float4s are transposed straight into the SOA arrays.
+    // Lanes past count are disabled.
+    template <typename Packet>
+    static void FillPacket(Packet& packet, int* valid, ray const* rays, int count)
+    {
+        __m128 const zero = _mm_setzero_ps();
+        __m128i const invalid = _mm_set1_epi32(static_cast<int>(RTC_INVALID_GEOMETRY_ID));
+
+        for (int lane = 0; lane < EmbreePacket<Packet>::kWidth; lane += 4)
+        {
+            __m128 o[4];
+            __m128 d[4];
+
+            for (int j = 0; j < 4; ++j)
+            {
+                bool used = lane + j < count;
+                o[j] = used ? _mm_loadu_ps(&rays[lane + j].o.x) : zero;
+                d[j] = used ? _mm_loadu_ps(&rays[lane + j].d.x) : zero;
+                valid[lane + j] = used && rays[lane + j].IsActive() ? -1 : 0;
+                packet.mask[lane + j] = used ? rays[lane + j].GetMask() : 0;
+            }
+
+            _MM_TRANSPOSE4_PS(o[0], o[1], o[2], o[3]);
+            _MM_TRANSPOSE4_PS(d[0], d[1], d[2], d[3]);
+
+            _mm_store_ps(packet.orgx + lane, o[0]);
+            _mm_store_ps(packet.orgy + lane, o[1]);
+            _mm_store_ps(packet.orgz + lane, o[2]);
+            _mm_store_ps(packet.tfar + lane, o[3]);
+            _mm_store_ps(packet.dirx + lane, d[0]);
+            _mm_store_ps(packet.diry + lane, d[1]);
+            _mm_store_ps(packet.dirz + lane, d[2]);
+            _mm_store_ps(packet.time + lane, d[3]);
+            _mm_store_ps(packet.tnear + lane, zero);
+            _mm_store_si128(reinterpret_cast<__m128i*>(packet.geomID + lane), invalid);
+            _mm_store_si128(reinterpret_cast<__m128i*>(packet.primID + lane), invalid);
+            _mm_store_si128(reinterpret_cast<__m128i*>(packet.instID + lane), invalid);
+        }
+    }
+
+    // Check the CPU and the OS support the registers wide packets are traced with
+    static bool HostSupportsPacketWidth(int width)
+    {
+        if (width <= 4)
+            return true;
+
+#if defined(_MSC_VER)
+        int info[4];
+        __cpuid(info, 0);
+        int maxleaf = info[0];
+
+        __cpuid(info, 1);
+        bool osxsave = (info[2] & (1 << 27)) != 0;
+        bool avx = (info[2] & (1 << 28)) != 0;
+        if (!osxsave || !avx)
+            return false;
+
+        // YMM state has to be enabled by the OS
+        unsigned long long xcr0 = _xgetbv(0);
+        if ((xcr0 & 0x6) != 0x6)
+            return false;
+
+        if (width <= 8)
+            return true;
+
+        if (maxleaf < 7)
+            return false;
+
+        // AVX-512F and ZMM state
+        __cpuidex(info, 7, 0);
+        return (info[1] & (1 << 16)) != 0 && (xcr0 & 0xe6) == 0xe6;
+#else
+        __builtin_cpu_init();
+        return width <= 8 ? __builtin_cpu_supports("avx") != 0 : __builtin_cpu_supports("avx512f") != 0;
+#endif
+    }
+
     //simple RadeonRays::Buffer implementation
     class EmbreeBuffer : public Buffer
     {
     public:
         EmbreeBuffer(size_t size, void* init)
             : m_data(nullptr)
+            , m_owned(true)
         {
             m_data = new char[size];
             if (init)
                 memcpy(m_data, init, size);
         }
+
+        // Wrap caller owned memory, nothing gets copied
+        explicit EmbreeBuffer(void* ptr)
+            : m_data(ptr)
+            , m_owned(false)
+        {
+        }
+
         virtual ~EmbreeBuffer()
         {
-            delete[] m_data;
+            if (m_owned)
+                delete[] static_cast<char*>(m_data);
             m_data = nullptr;
         }
 
@@ -76,47 +193,131 @@ namespace RadeonRays
 
     private:
         void* m_data;
+        bool m_owned;
+    };
+
+    //completion state shared between an event and the tasks signaling it,
+    //so the event itself can be deleted while the work is still in flight
+    class EmbreeEventState
+    {
+    public:
+        explicit EmbreeEventState(bool complete)
+            : m_complete(complete)
+        {
+        }
+
+        bool Complete() const
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            return m_complete;
+        }
+
+        // Blocks until completed, rethrows the error of the task if any
+        void Wait()
+        {
+            WaitNoThrow();
+            if (m_error)
+                std::rethrow_exception(m_error);
+        }
+
+        void WaitNoThrow()
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this]() { return m_complete; });
+        }
+
+        // Mark as completed, wake up waiters and run completion callbacks
+        void Signal(std::exception_ptr error = nullptr)
+        {
+            std::vector<std::function<void()>> callbacks;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                m_complete = true;
+                m_error = error;
+                callbacks.swap(m_callbacks);
+            }
+            m_cv.notify_all();
+
+            for (auto& callback : callbacks)
+            {
+                callback();
+            }
+        }
+
+        // Run callback on completion, right away if already completed
+        void OnComplete(std::function<void()>&& callback)
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                if (!m_complete)
+                {
+                    m_callbacks.push_back(std::move(callback));
+                    return;
+                }
+            }
+            callback();
+        }
+
+    private:
+        mutable std::mutex m_mutex;
+        std::condition_variable m_cv;
+        bool m_complete;
+        std::exception_ptr m_error;
+        std::vector<std::function<void()>> m_callbacks;
     };
 
     //simple RadeonRays::Event implementation
     class EmbreeEvent : public Event
     {
     public:
-        EmbreeEvent(std::function<void()>&& f)
-            : m_ftr()
+        // Events of synchronous calls are complete from the start
+        explicit EmbreeEvent(bool complete = true)
+            : m_state(std::make_shared<EmbreeEventState>(complete))
         {
-            std::packaged_task<void()> task(std::move(f));
-            m_ftr = task.get_future();
-            std::thread(std::move(task)).detach();
         }
 
         virtual ~EmbreeEvent()
         {
-            Wait();
+            m_state->WaitNoThrow();
         }
 
         virtual bool Complete() const
         {
-            return m_ftr.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+            return m_state->Complete();
         }
 
         virtual void Wait()
         {
-            m_ftr.wait();
+            m_state->Wait();
+        }
+
+        // Used by dependent tasks to wait for this one
+        std::shared_ptr<EmbreeEventState> GetState() const
+        {
+            return m_state;
         }
     private:
-        std::future<void> m_ftr;
+        std::shared_ptr<EmbreeEventState> m_state;
     };
 
+    // Ray types every scene is queried with
+    static RTCAlgorithmFlags const kSceneAlgorithms = RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN;
+
     EmbreeIntersectionDevice::EmbreeIntersectionDevice()
-        : m_pool(1)
+        : m_build_quality(0)
+        , m_packet_width(4)
+        , m_chunk_size(TASK_SIZE)
+        , m_stats()
+        , m_shape_records(1, EmbreeShapeRecord{ kNullId, 0 })
     {
         m_device = rtcNewDevice(nullptr);
         RTCError result = rtcDeviceGetError(m_device);
         if (result != RTC_NO_ERROR)
             std::cout << "Failed to create embree rtcDevice: " << result << std::endl;
 
-        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
+        m_packet_width = GetNativePacketWidth();
+
+        m_scene = rtcDeviceNewScene(m_device, GetSceneFlags(true), kSceneAlgorithms);
         result = rtcDeviceGetError(m_device);
         if (result != RTC_NO_ERROR)
             std::cout << "Failed to create embree scene: " << result << std::endl;
@@ -132,92 +333,187 @@ namespace RadeonRays
 
     }
 
+    RTCSceneFlags EmbreeIntersectionDevice::GetSceneFlags(bool toplevel) const
+    {
+        // Top level scene is edited in place, mesh scenes never change
+        int flags = toplevel ? RTC_SCENE_DYNAMIC : RTC_SCENE_STATIC;
+
+        if (m_build_quality > 0)
+            flags |= RTC_SCENE_HIGH_QUALITY;
+
+        return static_cast<RTCSceneFlags>(flags);
+    }
+
+    int EmbreeIntersectionDevice::GetNativePacketWidth() const
+    {
+        // Widest packet the host and the Embree build both support
+        if (HostSupportsPacketWidth(16) && rtcDeviceGetParameter1i(m_device, RTC_CONFIG_INTERSECT16) > 0)
+            return 16;
+
+        if (HostSupportsPacketWidth(8) && rtcDeviceGetParameter1i(m_device, RTC_CONFIG_INTERSECT8) > 0)
+            return 8;
+
+        return 4;
+    }
+
     void EmbreeIntersectionDevice::Preprocess(World const& world)
     {
-        for (auto& it : m_instances)
-            it.second.updated = false;
+        auto start = std::chrono::high_resolution_clock::now();
 
-        //checking removed shapes
-        for (auto it = world.shapes_.begin(); it != world.shapes_.end(); ++it)
+        auto optwidth = world.options_.GetOption("embree.packet_width");
+        int width = optwidth ? static_cast<int>(optwidth->AsFloat()) : 0;
+        ThrowIf(width != 0 && width != 1 && width != 4 && width != 8 && width != 16, "Invalid embree.packet_width value.");
+        if (width == 8 || width == 16)
         {
-            auto& i = *it;
-            const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
-            if (m_instances.count(shape))
-                m_instances[shape].updated = true;
+            bool supported = rtcDeviceGetParameter1i(m_device, width == 8 ? RTC_CONFIG_INTERSECT8 : RTC_CONFIG_INTERSECT16) > 0;
+            ThrowIf(!supported || !HostSupportsPacketWidth(width), "Packet width is not supported on this host.");
         }
+        m_packet_width = width == 0 ? GetNativePacketWidth() : width;
+
+        auto optchunk = world.options_.GetOption("embree.chunk_size");
+        m_chunk_size = optchunk ? std::max(static_cast<int>(optchunk->AsFloat()), 16) : TASK_SIZE;
 
-        //cleanup not updated instances
-        auto itr = m_instances.begin();
-        while (itr != m_instances.end())
+        auto optquality = world.options_.GetOption("embree.build_quality");
+        int quality = optquality ? static_cast<int>(optquality->AsFloat()) : 0;
+
+        // Scene flags are fixed at creation, so start from scratch on quality change
+        bool rebuild = false;
+        if (quality != m_build_quality)
         {
-            if (!itr->second.updated)
-            {
-                //if no instances left => clear stored mesh
-                auto& mesh = m_meshes[itr->first];
-                ThrowIf(mesh.instance_count <= 0, "Invalid embree mesh");
-                --mesh.instance_count;
-                if (mesh.instance_count == 0)
-                {
-                    rtcDeleteScene(itr->second.scene);
-                    CheckEmbreeError();
-                    m_meshes.erase(itr->first);
-                }
-                itr = m_instances.erase(itr);
-            }
-            else
+            m_build_quality = quality;
+
+            rtcDeleteScene(m_scene);
+            CheckEmbreeError();
+
+            for (auto& mesh : m_meshes)
             {
-                ++itr;
+                rtcDeleteScene(mesh.second.scene);
+                CheckEmbreeError();
             }
-        }
-        m_instances.clear();
-        rtcDeleteScene(m_scene); CheckEmbreeError();
-        m_scene = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN); CheckEmbreeError();
 
-        for (auto i : world.shapes_)
-        {
-            const ShapeImpl* shape = dynamic_cast<const ShapeImpl*>(i);
-            ThrowIf(!shape, "Invalid shape.");
+            m_instances.clear();
+            m_meshes.clear();
 
-            //update only if shape already precessed before
-            EmbreeSceneData& data = m_instances[shape];
-            data.mesh_id = shape->GetId();
-            data.updated = true;
+            m_scene = rtcDeviceNewScene(m_device, GetSceneFlags(true), kSceneAlgorithms);
+            CheckEmbreeError();
+            rebuild = true;
+        }
 
-            //for each new Shape creating new embree scene with geometry
-            //and adding its instance to m_scene
-            const Mesh* mesh = dynamic_cast<const Mesh*> (shape);
-            if (mesh)
+        std::vector<MeshKey> released;
+        // Embree scene needs a commit, shape records need an update
+        bool changed = rebuild;
+        bool updated = rebuild;
+
+        if (rebuild)
+        {
+            for (auto i : world.shapes_)
             {
-                data.scene = GetEmbreeMesh(mesh);
+                const ShapeImpl* shape = static_cast<const ShapeImpl*>(i);
+                AddShape(shape, GetBaseMesh(shape));
             }
-            else // instance
+        }
+        else
+        {
+            auto changes = world.GetChanges();
+            updated = !changes.empty();
+
+            // Removals go first, so shapes reallocated at the address of a removed one are added anew
+            for (auto const& change : changes)
             {
-                const Instance* inst = dynamic_cast<const Instance*> (shape);
-                ThrowIf(!inst, "Invalid shape.");
-                mesh = dynamic_cast<const Mesh*> (inst->GetBaseShape());
-                ThrowIf(!mesh, "Invalid mesh.");
-                //adding mesh of instance if it's not being processed before
-                data.scene = GetEmbreeMesh(mesh);
-                ++m_meshes[mesh].instance_count;
+                auto itr = m_instances.find(change.shape);
+
+                if (itr != m_instances.end() && (change.flags & (ShapeImpl::kStateChangeRemoved | ShapeImpl::kStateChangeAdded)))
+                {
+                    rtcDeleteGeometry(m_scene, itr->second.geom);
+                    CheckEmbreeError();
+                    released.push_back(itr->second.mesh);
+                    m_instances.erase(itr);
+                    itr = m_instances.end();
+                    changed = true;
+                }
+
+                if (change.flags & ShapeImpl::kStateChangeRemoved)
+                {
+                    continue;
+                }
+
+                const ShapeImpl* shape = static_cast<const ShapeImpl*>(change.shape);
+
+                if (itr == m_instances.end())
+                {
+                    AddShape(shape, GetBaseMesh(shape));
+                    changed = true;
+                }
+                else
+                {
+                    changed = UpdateShape(shape) || changed;
+                }
             }
+        }
 
-            unsigned geom = rtcNewInstance(m_scene, data.scene);
-            CheckEmbreeError();
-            matrix trans, transInv;
-            shape->GetTransform(trans, transInv);
-            rtcSetTransform(m_scene, geom, RTC_MATRIX_ROW_MAJOR, &trans.m00);
-            CheckEmbreeError();
-            rtcSetMask(m_scene, geom, shape->GetMask());
-            CheckEmbreeError();
-            rtcSetUserData(m_scene, geom, &data);
+        if (changed)
+        {
+            rtcCommit(m_scene);
             CheckEmbreeError();
+        }
+
+        if (updated)
+        {
+            UpdateShapeRecords();
+        }
+
+        // Mesh scenes are not referenced by the committed scene anymore
+        for (auto const& mesh : released)
+        {
+            ReleaseEmbreeMesh(mesh);
+        }
 
-            data.geom = geom;
+        // Embree builds and commits in one go, so everything is accounted as build time
+        if (changed || updated)
+        {
+            m_stats = Statistics();
+            m_stats.build_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        }
+    }
 
+    Statistics EmbreeIntersectionDevice::GetStatistics() const
+    {
+        return m_stats;
+    }
+
+    const Mesh* EmbreeIntersectionDevice::GetBaseMesh(const ShapeImpl* shape)
+    {
+        const Mesh* mesh = dynamic_cast<const Mesh*>(shape);
+        if (!mesh)
+        {
+            const Instance* inst = dynamic_cast<const Instance*>(shape);
+            ThrowIf(!inst, "Invalid shape.");
+            mesh = dynamic_cast<const Mesh*>(inst->GetBaseShape());
+            ThrowIf(!mesh, "Invalid mesh.");
         }
 
-        rtcCommit(m_scene);
+        return mesh;
+    }
+
+    void EmbreeIntersectionDevice::AddShape(const ShapeImpl* shape, const Mesh* mesh)
+    {
+        EmbreeSceneData& data = m_instances[shape];
+        data.mesh_id = shape->GetId();
+        data.mesh = MeshKey(mesh, mesh->stamp());
+
+        //each mesh gets its own embree scene, shapes are instances of those in m_scene
+        data.scene = AcquireEmbreeMesh(mesh);
+
+        unsigned geom = rtcNewInstance(m_scene, data.scene);
+        CheckEmbreeError();
+        matrix trans, transInv;
+        shape->GetTransform(trans, transInv);
+        rtcSetTransform(m_scene, geom, RTC_MATRIX_ROW_MAJOR, &trans.m00);
         CheckEmbreeError();
+        rtcSetMask(m_scene, geom, shape->GetMask());
+        CheckEmbreeError();
+
+        data.geom = geom;
     }
 
     Buffer* EmbreeIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
@@ -225,6 +521,11 @@ namespace RadeonRays
         return new EmbreeBuffer(size, initdata);
     }
 
+    Buffer* EmbreeIntersectionDevice::CreateBufferFromHostPointer(void* ptr, size_t size) const
+    {
+        return new EmbreeBuffer(ptr);
+    }
+
     void EmbreeIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
     {
         delete buffer;
@@ -237,7 +538,6 @@ namespace RadeonRays
 
     void EmbreeIntersectionDevice::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
     {
-        EmbreeEvent* ev = new EmbreeEvent([]() {});
         if (data)
         {
             EmbreeBuffer* buf = dynamic_cast<EmbreeBuffer*>(buffer);
@@ -245,244 +545,292 @@ namespace RadeonRays
             *data = buf->GetData();
         }
 
+        // Host memory is mapped directly, nothing to wait for
         if (event)
         {
-            *event = ev;
-        }
-        else
-        {
-            ev->Wait();
-            DeleteEvent(ev);
+            *event = new EmbreeEvent();
         }
     }
 
     void EmbreeIntersectionDevice::UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const
     {
-        EmbreeEvent* ev = new EmbreeEvent([]() {});
-
         if (event)
         {
-            *event = ev;
-        }
-        else
-        {
-            ev->Wait();
-            DeleteEvent(ev);
+            *event = new EmbreeEvent();
         }
     }
-    
 
-    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    void EmbreeIntersectionDevice::Dispatch(std::function<void(int, int)>&& job, int numitems, Event const* waitevent, Event** event) const
     {
-        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
-        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+        auto dependency = waitevent ? static_cast<EmbreeEvent const*>(waitevent)->GetState() : nullptr;
+        auto chunksize = m_chunk_size;
+        auto numtasks = (numitems + chunksize - 1) / chunksize;
+        auto shared_job = std::make_shared<std::function<void(int, int)>>(std::move(job));
+
+        // Synchronous call: no event, the caller takes part in the work
+        // and small batches are processed without waking anyone up
+        if (!event)
+        {
+            if (dependency)
+            {
+                dependency->Wait();
+            }
 
-        EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]() 
-        {
-            m_pool.setSleepTime(0);
-            //processing buffers workflow:
-            //1. convert RadeonRays::ray to RTCRay
-            //2. rtcIntersect
-            //3. convert RTCRay hit result to RadeonRays::Intersection
-            std::vector<std::future<void> > jobs;
-            jobs.reserve(numrays / TASK_SIZE);
-#ifndef INTERSECTN
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+            ParallelFor(0, numtasks, [&shared_job, numitems, chunksize](int task)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+                auto begin = task * chunksize;
+                (*shared_job)(begin, std::min(chunksize, numitems - begin));
+            });
+            return;
+        }
 
-                jobs.push_back(std::move(m_pool.submit(([this, src_ray, hit, count]()
-                {
-                    RTCRay4 data;
-                    for (int i = 0; i < count; i+=4)
-                    {
-                        int rays_count = (i + 4) < count ? 4 : count - i; // count of valid rays
-                        RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0,}; //disable all rays
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
-                            FillRTCRay(data, j, src_ray[i+j]);
-                        }
-                        rtcIntersect4(valid, m_scene, data); CheckEmbreeError();
-                        for (int j = 0; j < rays_count; ++j)
-                            FillIntersection(hit[i+j], data, j);
-                    }
-                }))));
-            }
-#else
-            std::vector<RTCRay> data(numrays);
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+        // Run a single chunk, the last one to finish signals the event
+        auto remaining = std::make_shared<std::atomic<int>>(numtasks);
+        auto error = std::make_shared<std::exception_ptr>();
+        auto error_lock = std::make_shared<std::mutex>();
+        auto run_task = [shared_job, numitems, chunksize, remaining, error, error_lock](int task, EmbreeEventState* state)
+        {
+            try
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* dst_ray = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                jobs.push_back(std::move(m_pool.submit([this, dst_ray, src_ray, count]()
-                {
-                    for (int j = 0; j < count; ++j)
-                        FillRTCRay(dst_ray[j], src_ray[j]);
-                })));
+                auto begin = task * chunksize;
+                (*shared_job)(begin, std::min(chunksize, numitems - begin));
             }
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            jobs.clear();
-            rtcIntersectN(m_scene, &data[0], numrays, sizeof(RTCRay));
-            CheckEmbreeError();
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+            catch (...)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* src_hit = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+                std::lock_guard<std::mutex> lock(*error_lock);
+                if (!*error)
+                    *error = std::current_exception();
+            }
 
-                jobs.push_back(std::move(m_pool.submit([this, hit, src_hit, src_ray, count]()
-                {
-                    for (int i = 0; i < count; ++i)
-                        if (src_ray[i].IsActive())
-                        {
-                            FillIntersection(hit[i], src_hit[i]);
-                        }
-                })));
+            if (--*remaining == 0)
+            {
+                state->Signal(*error);
             }
-            
-#endif // INTERSECTN
+        };
 
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
-        });
+        auto ev = new EmbreeEvent(false);
+        auto state = ev->GetState();
+        *event = ev;
 
-        if (event)
+        if (numtasks == 0)
         {
-            *event = ev;
+            state->Signal();
+            return;
+        }
+
+        auto start = [run_task, numtasks, state]()
+        {
+            auto& scheduler = TaskScheduler::Instance();
+            for (int i = 0; i < numtasks; ++i)
+            {
+                scheduler.Submit([run_task, i, state]() { run_task(i, state.get()); });
+            }
+        };
+
+        // Workers are woken up once the dependency is signaled
+        if (dependency)
+        {
+            dependency->OnComplete(std::move(start));
         }
         else
         {
-            ev->Wait();
-            DeleteEvent(ev);
+            start();
         }
     }
 
+
+    void EmbreeIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
+        EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
+
+        const ray* src_rays = static_cast<const ray*>(fireRays->GetData());
+        Intersection* dst_hits = static_cast<Intersection*>(fireHits->GetData());
+        int width = m_packet_width;
+
+        Dispatch([this, src_rays, dst_hits, width](int begin, int count)
+        {
+            switch (width)
+            {
+            case 1: IntersectStream(src_rays + begin, dst_hits + begin, count); break;
+            case 8: IntersectPackets<RTCRay8>(src_rays + begin, dst_hits + begin, count); break;
+            case 16: IntersectPackets<RTCRay16>(src_rays + begin, dst_hits + begin, count); break;
+            default: IntersectPackets<RTCRay4>(src_rays + begin, dst_hits + begin, count); break;
+            }
+        }, numrays, waitevent, event);
+    }
+
     void EmbreeIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
     {
         const EmbreeBuffer* fireRays = dynamic_cast<const EmbreeBuffer*>(rays); ThrowIf(!fireRays, "Invalid embree buffer.");
         EmbreeBuffer* fireHits = dynamic_cast<EmbreeBuffer*>(hits); ThrowIf(!fireHits, "Invalid embree buffer.");
 
-        EmbreeEvent* ev = new EmbreeEvent([this, fireRays, fireHits, numrays]()
-        {
-            m_pool.setSleepTime(0);
-            //processing buffers workflow:
-            //1. convert RadeonRays::ray to RTCRay
-            //2. rtcOccluded
-            //3. convert RTCRay hit result
-            std::vector<std::future<void> > jobs;
-            jobs.reserve(numrays / TASK_SIZE);
-#ifndef INTERSECTN
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+        const ray* src_rays = static_cast<const ray*>(fireRays->GetData());
+        int* dst_hits = static_cast<int*>(fireHits->GetData());
+        int width = m_packet_width;
+
+        Dispatch([this, src_rays, dst_hits, width](int begin, int count)
+        {
+            switch (width)
             {
+            case 1: OccludeStream(src_rays + begin, dst_hits + begin, count); break;
+            case 8: OccludePackets<RTCRay8>(src_rays + begin, dst_hits + begin, count); break;
+            case 16: OccludePackets<RTCRay16>(src_rays + begin, dst_hits + begin, count); break;
+            default: OccludePackets<RTCRay4>(src_rays + begin, dst_hits + begin, count); break;
+            }
+        }, numrays, waitevent, event);
+    }
+
+    template <typename Packet>
+    void EmbreeIntersectionDevice::IntersectPackets(const ray* rays, Intersection* hits, int count) const
+    {
+        int const width = EmbreePacket<Packet>::kWidth;
+        Packet packet;
+        RTCORE_ALIGN(64) int valid[width];
+        RTCORE_ALIGN(16) int slots[4];
 
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                int* hit = &static_cast<int*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
+        __m128i const one = _mm_set1_epi32(1);
+        __m128 const zero = _mm_setzero_ps();
+        EmbreeShapeRecord const* records = m_shape_records.data();
 
-                jobs.push_back(std::move(m_pool.submit(([this, src_ray, hit, count]()
-                {
-                    RTCRay4 data;
-                    for (int i = 0; i < count; i += 4)
-                    {
-                        int rays_count = (i + 4) < count ? 4 : count - i; // count of valid rays
-                        RTCORE_ALIGN(16) int valid[4] = { 0, 0, 0, 0, }; //disable all rays
-                        for (int j = 0; j < 4; ++j)
-                        {
-                            data.orgx[j] = 0;
-                            data.orgy[j] = 0;
-                            data.orgz[j] = 0;
-
-                            data.dirx[j] = 0;
-                            data.diry[j] = 0;
-                            data.dirz[j] = 0;
-
-                            data.tnear[j] = 0;
-                            data.tfar[j] = 0;
-                            data.geomID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.primID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.instID[j] = RTC_INVALID_GEOMETRY_ID;
-                            data.time[j] = 0;
-                            data.mask[j] = 0xFFFFFF;
-                        }
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            valid[j] = src_ray[i + j].IsActive() ? -1 : 0;
-                            FillRTCRay(data, j, src_ray[i + j]);
-                        }
-                        rtcOccluded4(valid, m_scene, data); CheckEmbreeError();
-                        for (int j = 0; j < rays_count; ++j)
-                        {
-                            if (data.instID[j] == RTC_INVALID_GEOMETRY_ID || data.geomID[j] == RTC_INVALID_GEOMETRY_ID)
-                            {
-                                hit[i + j] = RTC_INVALID_GEOMETRY_ID;
-                                continue;
-                            }
-                            hit[i + j] = data.instID[j];
-                            EmbreeSceneData* data = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, hit[i + j]));
-                            hit[i + j] = data->mesh_id;
-                        }
-                    }
-                }))));
+        for (int i = 0; i < count; i += width)
+        {
+            int rays_count = std::min(width, count - i); // count of valid rays
+            FillPacket(packet, valid, rays + i, rays_count);
+            EmbreePacket<Packet>::Intersect(valid, m_scene, packet); CheckEmbreeError();
+
+            Intersection* hit = hits + i;
+
+            // Four lanes at a time: (shapeid, primid, 0, 0) and (u, v, 0, t)
+            // are transposed from the packet into Intersection layout
+            int j = 0;
+            for (; j + 4 <= rays_count; j += 4)
+            {
+                __m128i slot = _mm_add_epi32(_mm_load_si128(reinterpret_cast<__m128i const*>(packet.instID + j)), one);
+                _mm_store_si128(reinterpret_cast<__m128i*>(slots), slot);
+
+                __m128 ids = _mm_castsi128_ps(_mm_setr_epi32(records[slots[0]].id, records[slots[1]].id, records[slots[2]].id, records[slots[3]].id));
+                __m128 prims = _mm_load_ps(reinterpret_cast<float const*>(packet.primID + j));
+                __m128 pad0 = zero;
+                __m128 pad1 = zero;
+                _MM_TRANSPOSE4_PS(ids, prims, pad0, pad1);
+
+                __m128 u = _mm_load_ps(packet.u + j);
+                __m128 v = _mm_load_ps(packet.v + j);
+                __m128 w = zero;
+                __m128 t = _mm_load_ps(packet.tfar + j);
+                _MM_TRANSPOSE4_PS(u, v, w, t);
+
+                _mm_storeu_ps(reinterpret_cast<float*>(&hit[j]), ids);
+                _mm_storeu_ps(&hit[j].uvwt.x, u);
+                _mm_storeu_ps(reinterpret_cast<float*>(&hit[j + 1]), prims);
+                _mm_storeu_ps(&hit[j + 1].uvwt.x, v);
+                _mm_storeu_ps(reinterpret_cast<float*>(&hit[j + 2]), pad0);
+                _mm_storeu_ps(&hit[j + 2].uvwt.x, w);
+                _mm_storeu_ps(reinterpret_cast<float*>(&hit[j + 3]), pad1);
+                _mm_storeu_ps(&hit[j + 3].uvwt.x, t);
             }
-#else
-            std::vector<RTCRay> data(numrays);
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+
+            for (; j < rays_count; ++j)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                RTCRay* dst_ray = &data[i];
-                Intersection* hit = &static_cast<Intersection*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                jobs.push_back(std::move(m_pool.submit([this, dst_ray, src_ray, count]()
-                {
-                    for (int j = 0; j < count; ++j)
-                        FillRTCRay(dst_ray[j], src_ray[j]);
-                })));
+                hit[j].shapeid = GetShapeId(packet.instID[j]);
+                hit[j].primid = packet.primID[j];
+                hit[j].uvwt = float4(packet.u[j], packet.v[j], 0.f, packet.tfar[j]);
             }
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            jobs.clear();
-            rtcOccludedN(m_scene, &data[0], numrays, sizeof(RTCRay));
-            CheckEmbreeError();
-            for (int i = 0; i < numrays; i += TASK_SIZE)
+        }
+    }
+
+    template <typename Packet>
+    void EmbreeIntersectionDevice::OccludePackets(const ray* rays, int* hits, int count) const
+    {
+        int const width = EmbreePacket<Packet>::kWidth;
+        Packet packet;
+        RTCORE_ALIGN(64) int valid[width];
+        RTCORE_ALIGN(16) int slots[4];
+
+        __m128i const one = _mm_set1_epi32(1);
+        __m128i const invalid = _mm_set1_epi32(static_cast<int>(RTC_INVALID_GEOMETRY_ID));
+        EmbreeShapeRecord const* records = m_shape_records.data();
+
+        for (int i = 0; i < count; i += width)
+        {
+            int rays_count = std::min(width, count - i); // count of valid rays
+            FillPacket(packet, valid, rays + i, rays_count);
+            EmbreePacket<Packet>::Occluded(valid, m_scene, packet); CheckEmbreeError();
+
+            // Lanes without a hit point at the kNullId record
+            int j = 0;
+            for (; j + 4 <= rays_count; j += 4)
             {
-                const ray* src_ray = &static_cast<const ray*>(fireRays->GetData())[i];
-                int* hit = &static_cast<int*>(fireHits->GetData())[i];
-                int count = (i + TASK_SIZE) < numrays ? TASK_SIZE : numrays - i;
-                RTCRay* hit_src = &data[i];
-                jobs.push_back(std::move(m_pool.submit([this, hit, hit_src, src_ray, count]()
-                {
-                    for (int i = 0; i < count; ++i)
-                    {
-                        if (hit_src[i].instID == RTC_INVALID_GEOMETRY_ID || hit_src[i].geomID == RTC_INVALID_GEOMETRY_ID)
-                        {
-                            hit[i] = RTC_INVALID_GEOMETRY_ID;
-                            continue;
-                        }
-                        hit[i] = hit_src[i].instID;
-                        EmbreeSceneData* data = static_cast<EmbreeSceneData*>(rtcGetUserData(m_scene, hit[i]));
-                        hit[i] = data->mesh_id;
-                    }
-                })));
+                __m128i slot = _mm_add_epi32(_mm_load_si128(reinterpret_cast<__m128i const*>(packet.instID + j)), one);
+                __m128i missed = _mm_cmpeq_epi32(_mm_load_si128(reinterpret_cast<__m128i const*>(packet.geomID + j)), invalid);
+                _mm_store_si128(reinterpret_cast<__m128i*>(slots), _mm_andnot_si128(missed, slot));
+
+                __m128i ids = _mm_setr_epi32(records[slots[0]].id, records[slots[1]].id, records[slots[2]].id, records[slots[3]].id);
+                _mm_storeu_si128(reinterpret_cast<__m128i*>(hits + i + j), ids);
             }
-#endif // INTERSECTN
 
-            std::for_each(jobs.begin(), jobs.end(), [](std::future<void>& j) {j.wait(); });
-            m_pool.setSleepTime(1);
-        });
+            for (; j < rays_count; ++j)
+            {
+                hits[i + j] = packet.geomID[j] != RTC_INVALID_GEOMETRY_ID ? GetShapeId(packet.instID[j]) : kNullId;
+            }
+        }
+    }
 
-        if (event)
+    void EmbreeIntersectionDevice::IntersectStream(const ray* rays, Intersection* hits, int count) const
+    {
+        std::vector<RTCRay> data(count);
+        for (int i = 0; i < count; ++i)
+            FillRTCRay(data[i], rays[i]);
+
+        rtcIntersectN(m_scene, &data[0], count, sizeof(RTCRay));
+        CheckEmbreeError();
+
+        for (int i = 0; i < count; ++i)
+            if (rays[i].IsActive())
+            {
+                FillIntersection(hits[i], data[i]);
+            }
+    }
+
+    void EmbreeIntersectionDevice::OccludeStream(const ray* rays, int* hits, int count) const
+    {
+        std::vector<RTCRay> data(count);
+        for (int i = 0; i < count; ++i)
+            FillRTCRay(data[i], rays[i]);
+
+        rtcOccludedN(m_scene, &data[0], count, sizeof(RTCRay));
+        CheckEmbreeError();
+
+        for (int i = 0; i < count; ++i)
         {
-            *event = ev;
+            bool occluded = data[i].instID != RTC_INVALID_GEOMETRY_ID && data[i].geomID != RTC_INVALID_GEOMETRY_ID;
+            hits[i] = occluded ? GetShapeId(data[i].instID) : kNullId;
         }
-        else
+    }
+
+    Id EmbreeIntersectionDevice::GetShapeId(unsigned instid) const
+    {
+        // RTC_INVALID_GEOMETRY_ID wraps around to the kNullId record
+        return m_shape_records[instid + 1].id;
+    }
+
+    void EmbreeIntersectionDevice::UpdateShapeRecords()
+    {
+        unsigned numgeoms = 0;
+        for (auto& instance : m_instances)
+        {
+            numgeoms = std::max(numgeoms, instance.second.geom + 1);
+        }
+
+        EmbreeShapeRecord const nullrecord = { kNullId, 0 };
+        m_shape_records.assign(numgeoms + 1, nullrecord);
+
+        for (auto& instance : m_instances)
         {
-            ev->Wait();
-            DeleteEvent(ev);
+            auto& record = m_shape_records[instance.second.geom + 1];
+            record.id = instance.second.mesh_id;
+            record.mask = instance.first->GetMask();
         }
     }
 
@@ -496,56 +844,95 @@ namespace RadeonRays
         Throw("Not implemented for embree device.");
     }
 
-    RTCScene EmbreeIntersectionDevice::GetEmbreeMesh(const RadeonRays::Mesh* mesh)
+    RTCScene EmbreeIntersectionDevice::AcquireEmbreeMesh(const RadeonRays::Mesh* mesh)
     {
-        if (m_meshes.count(mesh))
-            return m_meshes[mesh].scene;
-        RTCScene result = rtcDeviceNewScene(m_device, RTC_SCENE_STATIC, RTC_INTERSECT1 | RTC_INTERSECT4 | RTC_INTERSECT8 | RTC_INTERSECT16 | RTC_INTERSECTN);
+        MeshKey const key(mesh, mesh->stamp());
+
+        auto itr = m_meshes.find(key);
+        if (itr != m_meshes.end())
+        {
+            ++itr->second.instance_count;
+            return itr->second.scene;
+        }
+
+        RTCScene result = rtcDeviceNewScene(m_device, GetSceneFlags(false), kSceneAlgorithms);
         CheckEmbreeError();
-        ThrowIf(!mesh->puretriangle(), "Only triangle meshes supported by now.");
 
-        unsigned id = rtcNewTriangleMesh(result, RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
+        // Mixed meshes go in as quad meshes, their triangles repeat the last vertex
+        bool const quads = !mesh->puretriangle();
+        int const facesize = quads ? 4 : 3;
+
+        unsigned id = quads ?
+            rtcNewQuadMesh(result, RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices()) :
+            rtcNewTriangleMesh(result, RTC_GEOMETRY_STATIC, mesh->num_faces(), mesh->num_vertices());
         CheckEmbreeError();
         
-        const float3* kMeshVerts = mesh->GetVertexData();
         float* verts = static_cast<float*>(rtcMapBuffer(result, id, RTC_VERTEX_BUFFER));
         CheckEmbreeError();
         ThrowIf(!verts, "Failed to map embree buffer.");
         for (int i = 0; i < mesh->num_vertices(); ++i)
         {
-            verts[4 * i] = kMeshVerts[i].x;
-            verts[4 * i + 1] = kMeshVerts[i].y;
-            verts[4 * i + 2] = kMeshVerts[i].z;
-            verts[4 * i + 3] = kMeshVerts[i].w;
+            float3 const vertex = mesh->GetVertex(i);
+            verts[4 * i] = vertex.x;
+            verts[4 * i + 1] = vertex.y;
+            verts[4 * i + 2] = vertex.z;
+            verts[4 * i + 3] = 0.f;
         }
         rtcUnmapBuffer(result, id, RTC_VERTEX_BUFFER);
 
         int* indices = static_cast<int*>(rtcMapBuffer(result, id, RTC_INDEX_BUFFER));
         CheckEmbreeError();
         ThrowIf(!indices, "Failed to map embree buffer.");
-        const Mesh::Face* kFaces = mesh->GetFaceData();
         for (int i = 0; i < mesh->num_faces(); ++i)
         {
-            indices[3 * i] = kFaces[i].i0;
-            indices[3 * i + 1] = kFaces[i].i1;
-            indices[3 * i + 2] = kFaces[i].i2;
+            Mesh::Face const face = mesh->GetFace(i);
+            indices[facesize * i] = face.i0;
+            indices[facesize * i + 1] = face.i1;
+            indices[facesize * i + 2] = face.i2;
+
+            if (quads)
+            {
+                indices[facesize * i + 3] = face.type_ == Mesh::FaceType::QUAD ? face.i3 : face.i2;
+            }
         }
         rtcUnmapBuffer(result, id, RTC_INDEX_BUFFER);
         CheckEmbreeError();
         rtcCommit(result);
 
-        m_meshes[mesh].scene = result;
-        m_meshes[mesh].instance_count = 1;
+        m_meshes[key].scene = result;
+        m_meshes[key].instance_count = 1;
 
         return result;
     }
 
-    void EmbreeIntersectionDevice::UpdateShape(const RadeonRays::ShapeImpl* shape)
+    void EmbreeIntersectionDevice::ReleaseEmbreeMesh(MeshKey const& mesh)
     {
-        const EmbreeSceneData& data = m_instances[shape];
+        auto itr = m_meshes.find(mesh);
+        ThrowIf(itr == m_meshes.end() || itr->second.instance_count <= 0, "Invalid embree mesh");
+
+        //if no instances left => clear stored mesh
+        if (--itr->second.instance_count == 0)
+        {
+            rtcDeleteScene(itr->second.scene);
+            CheckEmbreeError();
+            m_meshes.erase(itr);
+        }
+    }
+
+    bool EmbreeIntersectionDevice::UpdateShape(const RadeonRays::ShapeImpl* shape)
+    {
+        EmbreeSceneData& data = m_instances[shape];
         int state = shape->GetStateChange();
-        if (state == ShapeImpl::kStateChangeNone)
-            return;
+
+        // Ids only live in the shape records
+        if (state & ShapeImpl::kStateChangeId)
+        {
+            data.mesh_id = shape->GetId();
+        }
+
+        // Motion blur is not supported by embree device, velocities are ignored
+        if (!(state & (ShapeImpl::kStateChangeMask | ShapeImpl::kStateChangeTransform)))
+            return false;
 
         if (state & ShapeImpl::kStateChangeMask)
         {
@@ -559,12 +946,9 @@ namespace RadeonRays
             rtcSetTransform(m_scene, data.geom, RTC_MATRIX_ROW_MAJOR, &trans.m00);
             CheckEmbreeError();
         }
-        if (state & ShapeImpl::kStateChangeId)
-        {
-            m_instances[shape].mesh_id = shape->GetId();
-        }
-
-        ThrowIf((state & ShapeImpl::kStateChangeMotion) ? true : false, "Not implemented for embree device");
+        rtcUpdate(m_scene, data.geom);
+        CheckEmbreeError();
+        return true;
     }
 
     void EmbreeIntersectionDevice::FillRTCRay(RTCRay& dst, const ray& src) const
@@ -586,34 +970,9 @@ namespace RadeonRays
         dst.mask = src.GetMask();
     }
 
-    void EmbreeIntersectionDevice::FillRTCRay(RTCRay4& dst, int i, const ray& src) const
-    {
-        dst.orgx[i] = src.o.x;
-        dst.orgy[i] = src.o.y;
-        dst.orgz[i] = src.o.z;
-
-        dst.dirx[i] = src.d.x;
-        dst.diry[i] = src.d.y;
-        dst.dirz[i] = src.d.z;
-
-        dst.tnear[i] = 0;
-        dst.tfar[i] = src.GetMaxT();
-        dst.geomID[i] = RTC_INVALID_GEOMETRY_ID;
-        dst.primID[i] = RTC_INVALID_GEOMETRY_ID;
-        dst.instID[i] = RTC_INVALID_GEOMETRY_ID;
-        dst.time[i] = src.GetTime();
-        dst.mask[i] = src.GetMask();
-    }
-
-
     void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRay& src) const
     {
-        dst.shapeid = src.instID;
-        if (dst.shapeid != RTC_INVALID_GEOMETRY_ID)
-        {
-            const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, dst.shapeid));
-            dst.shapeid = kData->mesh_id;
-        }
+        dst.shapeid = GetShapeId(src.instID);
         dst.primid = src.primID;
 
         dst.uvwt.x = src.u;
@@ -621,23 +980,6 @@ namespace RadeonRays
         dst.uvwt.z = 0;
         dst.uvwt.w = src.tfar;
     }
-    void EmbreeIntersectionDevice::FillIntersection(Intersection& dst, const RTCRay4& src, int i) const
-    {
-        dst.shapeid = src.instID[i];
-        if (dst.shapeid != RTC_INVALID_GEOMETRY_ID)
-        {
-            const EmbreeSceneData* kData = static_cast<const EmbreeSceneData*>(rtcGetUserData(m_scene, dst.shapeid));
-            dst.shapeid = kData->mesh_id;
-        }
-        dst.primid = src.primID[i];
-
-        dst.uvwt.x = src.u[i];
-        dst.uvwt.y = src.v[i];
-        dst.uvwt.z = 0;
-        dst.uvwt.w = src.tfar[i];
-    }
-
-
     void EmbreeIntersectionDevice::CheckEmbreeError() const
     {
         RTCError err = rtcDeviceGetError(m_device);
@@ -23,9 +23,11 @@ THE SOFTWARE.
 
 #include "intersection_device.h"
 #include <map>
+#include <vector>
+#include <functional>
+#include <utility>
 
 #include <embree2/rtcore.h>
-#include "../async/thread_pool.h"
 
 namespace RadeonRays
 {
@@ -45,6 +47,7 @@ namespace RadeonRays
         //IntersectionDevice
         void Preprocess(World const& world) override;
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
+        Buffer* CreateBufferFromHostPointer(void* ptr, size_t size) const override;
         void DeleteBuffer(Buffer* const) const override;
         void DeleteEvent(Event* const) const override;
         void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
@@ -53,24 +56,58 @@ namespace RadeonRays
         void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
         void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
         void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+        Statistics GetStatistics() const override;
     
     protected:
-        RTCScene GetEmbreeMesh(const Mesh*);
-        void UpdateShape(const ShapeImpl*);
+        // Run job(begin, count) over numitems in TASK_SIZE chunks on the task scheduler once waitevent completes.
+        // Synchronous calls (event == nullptr) are processed in place by the calling thread as well.
+        void Dispatch(std::function<void(int, int)>&& job, int numitems, Event const* waitevent, Event** event) const;
+        RTCSceneFlags GetSceneFlags(bool toplevel) const;
+        // Mesh scenes are keyed by the mesh and its creation stamp, a mesh allocated at the address
+        // of a deleted one gets its own scene while the old one waits for its instances to be released
+        typedef std::pair<const Mesh*, std::uint64_t> MeshKey;
+        // Get a reference to the embree scene holding mesh geometry, created on first use
+        RTCScene AcquireEmbreeMesh(const Mesh*);
+        void ReleaseEmbreeMesh(MeshKey const&);
+        // Mesh geometry the shape is made of
+        static const Mesh* GetBaseMesh(const ShapeImpl*);
+        // Add an instance of the shape to m_scene
+        void AddShape(const ShapeImpl*, const Mesh*);
+        // Apply shape state changes to its instance in m_scene, returns true if m_scene needs a commit
+        bool UpdateShape(const ShapeImpl*);
+        // Widest packet supported by the host ISA and the Embree build
+        int GetNativePacketWidth() const;
+        // Trace rays in packets of Packet width
+        template <typename Packet> void IntersectPackets(const ray* rays, Intersection* hits, int count) const;
+        template <typename Packet> void OccludePackets(const ray* rays, int* hits, int count) const;
+        // Trace rays as a single rtcIntersectN/rtcOccludedN stream
+        void IntersectStream(const ray* rays, Intersection* hits, int count) const;
+        void OccludeStream(const ray* rays, int* hits, int count) const;
+        // Translate Embree instance id to shape id, a single table load
+        Id GetShapeId(unsigned instid) const;
+        // Rebuild m_shape_records from m_instances
+        void UpdateShapeRecords();
         void FillRTCRay(RTCRay& dst, const ray& src) const;
-        void FillRTCRay(RTCRay4& dst, int i, const ray& src) const;
         void FillIntersection(Intersection& dst, const RTCRay& src) const;
-        void FillIntersection(Intersection& dst, const RTCRay4& src, int i) const;
         void CheckEmbreeError() const;
         
         // embree device
         RTCDevice m_device;
         
-        // scene for intersection
+        // scene for intersection, edited in place on commit
         RTCScene m_scene; 
 
-        //thread pool for parallelizing work with buffers
-        mutable thread_pool<void> m_pool;
+        // "embree.build_quality" the scenes were created with
+        int m_build_quality;
+
+        // Packet width queries are traced with, 1 for rtcIntersectN streams
+        int m_packet_width;
+
+        // Number of rays per scheduler task
+        int m_chunk_size;
+
+        // Time of the last Preprocess call which changed the scene, structure is opaque
+        Statistics m_stats;
 
         struct EmbreeMesh
         {
@@ -85,17 +122,26 @@ namespace RadeonRays
                 : scene(nullptr)
                 , mesh_id(kNullId)
                 , geom(RTC_INVALID_GEOMETRY_ID)
-                , updated(false)
+                , mesh(nullptr, 0)
             {}
             RTCScene scene; //instantiated scene
             Id mesh_id; //FireRays::Shape id
             unsigned geom; //embree geometry id
-            bool updated;  //shows is data updated through last IntersectionDevice::Preprocess call
+            MeshKey mesh; //instantiated mesh, it might be deleted already
         };
 
+        struct EmbreeShapeRecord
+        {
+            Id id; //FireRays::Shape id
+            int mask; //shape intersection mask
+        };
+
+        //shape records by embree instance id + 1, record 0 stands for RTC_INVALID_GEOMETRY_ID
+        std::vector<EmbreeShapeRecord> m_shape_records;
+
         //used for synchronization embree and FireRays::Shape ids
         std::map<const Shape*, EmbreeSceneData> m_instances; //scenes to instantiate
-        std::map<const Shape*, EmbreeMesh> m_meshes; // contains all original embree meshes. Any geometry used in m_scene is an instance.
+        std::map<MeshKey, EmbreeMesh> m_meshes; // contains all original embree meshes. Any geometry used in m_scene is an instance.
     };
 }
 
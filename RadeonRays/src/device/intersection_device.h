@@ -24,6 +24,7 @@ THE SOFTWARE.
 #ifndef INTERSECTION_DEVICE_H
 #define INTERSECTION_DEVICE_H
 #include "radeon_rays.h"
+#include "../except/except.h"
 
 namespace RadeonRays
 {
@@ -45,6 +46,10 @@ namespace RadeonRays
         // if initdata == nullptr the buffer is allocated, but not initialized.
         virtual Buffer* CreateBuffer(size_t size, void* initdata) const = 0;
 
+        // Create a buffer using caller owned memory as its storage.
+        // The memory has to outlive the buffer.
+        virtual Buffer* CreateBufferFromHostPointer(void* ptr, size_t size) const = 0;
+
         // Release buffer memory.
         virtual void DeleteBuffer(Buffer* const) const = 0;
 
@@ -88,6 +93,19 @@ namespace RadeonRays
         // The call waits until waitevent is resolved (on a target device) if waitevent != nullptr.
         // The call is non-blocking if event is passed it, otherwise (event == nullptr) it is blocking.
         virtual void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const = 0;
+
+        // Return the report of the acceleration structure selection made during Preprocess.
+        // The string is empty unless the device had to pick the structure itself.
+        virtual char const* GetAccelerationReport() const { return ""; }
+
+        // Return build measurements of the last Preprocess call, query fields are filled by the API.
+        virtual Statistics GetStatistics() const { return Statistics(); }
+
+        // Return device execution time of a completed query in milliseconds, negative if the device does not profile queries.
+        virtual float GetQueryDuration(Event const* /*event*/) const { return -1.f; }
+
+        // Set the buffer instrumented kernels write per ray TraversalCounters to, nullptr stops counting.
+        virtual void SetTraversalCounters(Buffer* counters) { ThrowIf(counters != nullptr, "Traversal counters are not supported by this device."); }
     
         IntersectionDevice(IntersectionDevice const&) = delete;
         IntersectionDevice& operator = (IntersectionDevice const&) = delete;
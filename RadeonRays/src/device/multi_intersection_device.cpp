@@ -0,0 +1,478 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "multi_intersection_device.h"
+
+#include "../except/except.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <thread>
+
+namespace RadeonRays
+{
+    // Largest fraction of a child query time its completion may go unnoticed for
+    static double const kMaxTimingUncertainty = 0.1;
+
+    // Host side copy of the data plus lazily created per-device buffers
+    struct MultiIntersectionDevice::MultiBuffer : public Buffer
+    {
+        MultiBuffer(size_t size, std::size_t numdevices)
+            : storage(size)
+            , data(storage.data())
+            , size(size)
+            , children(numdevices, nullptr)
+        {
+        }
+
+        // Wrap caller owned memory
+        MultiBuffer(void* ptr, size_t size, std::size_t numdevices)
+            : data(static_cast<char*>(ptr))
+            , size(size)
+            , children(numdevices, nullptr)
+        {
+        }
+
+        std::vector<char> storage;
+        char* data;
+        size_t size;
+        mutable std::vector<Buffer*> children;
+    };
+
+    // Aggregates child device events of a split query.
+    // Results are copied back into host memory as soon as
+    // corresponding child query completes.
+    // Device throughput is measured from the submission of a child query
+    // until its completion is first noticed by a poll, samples are dropped
+    // if the preceding poll is too far back to tell when the query finished.
+    class MultiIntersectionDevice::MultiEvent : public Event
+    {
+    public:
+        typedef std::chrono::high_resolution_clock clock;
+
+        struct Pending
+        {
+            std::size_t device;
+            Event* event;
+            Buffer* src;
+            MultiBuffer* dst;
+            size_t offset;
+            size_t size;
+            int numrays;
+            // Submission, last poll which found the query running and completion
+            clock::time_point start;
+            clock::time_point polled;
+            clock::time_point end;
+            bool done;
+        };
+
+        MultiEvent(MultiIntersectionDevice const* owner)
+            : m_owner(owner)
+        {
+        }
+
+        ~MultiEvent()
+        {
+            // Make sure child queries are not referencing our buffers anymore
+            Resolve(true);
+        }
+
+        void Add(Pending const& pending)
+        {
+            m_pending.push_back(pending);
+        }
+
+        // Note completion of child queries
+        void Poll() const
+        {
+            for (auto& p : m_pending)
+            {
+                if (!p.done)
+                {
+                    p.done = p.event->Complete();
+                    (p.done ? p.end : p.polled) = clock::now();
+                }
+            }
+        }
+
+        bool Complete() const override
+        {
+            return Resolve(false);
+        }
+
+        void Wait() override
+        {
+            Resolve(true);
+        }
+
+    private:
+        // Collect completed child queries, returns true if all are done
+        bool Resolve(bool block) const
+        {
+            while (!m_pending.empty())
+            {
+                Poll();
+
+                auto iter = std::partition(m_pending.begin(), m_pending.end(),
+                    [](Pending const& p) { return !p.done; });
+
+                for (auto i = iter; i != m_pending.end(); ++i)
+                {
+                    Finish(*i);
+                }
+
+                bool progress = iter != m_pending.end();
+                m_pending.erase(iter, m_pending.end());
+
+                if (!block)
+                {
+                    break;
+                }
+
+                if (!progress)
+                {
+                    std::this_thread::yield();
+                }
+            }
+
+            return m_pending.empty();
+        }
+
+        void Finish(Pending const& p) const
+        {
+            auto device = m_owner->m_devices[p.device].get();
+            device->DeleteEvent(p.event);
+
+            auto elapsed = std::chrono::duration<double>(p.end - p.start).count();
+            auto uncertainty = std::chrono::duration<double>(p.end - p.polled).count();
+
+            if (uncertainty <= kMaxTimingUncertainty * elapsed)
+            {
+                m_owner->UpdateThroughput(p.device, p.numrays, elapsed);
+            }
+
+            void* data = nullptr;
+            Event* e = nullptr;
+            device->MapBuffer(p.src, kMapRead, 0, p.size, &data, &e);
+            e->Wait();
+            device->DeleteEvent(e);
+            std::memcpy(&p.dst->data[p.offset], data, p.size);
+            device->UnmapBuffer(p.src, data, &e);
+            e->Wait();
+            device->DeleteEvent(e);
+        }
+
+        MultiIntersectionDevice const* m_owner;
+        mutable std::vector<Pending> m_pending;
+    };
+
+    MultiIntersectionDevice::MultiIntersectionDevice(std::vector<IntersectionDevice*> const& devices)
+        : m_throughput(devices.size(), 0.0)
+    {
+        ThrowIf(devices.empty(), "No devices specified.");
+
+        for (auto device : devices)
+        {
+            m_devices.emplace_back(device);
+        }
+    }
+
+    MultiIntersectionDevice::~MultiIntersectionDevice() = default;
+
+    void MultiIntersectionDevice::Preprocess(World const& world)
+    {
+        // Replicate the scene on every device
+        for (auto& device : m_devices)
+        {
+            device->Preprocess(world);
+        }
+    }
+
+    char const* MultiIntersectionDevice::GetAccelerationReport() const
+    {
+        // Every device tunes on its own, report the first one
+        return m_devices.front()->GetAccelerationReport();
+    }
+
+    Statistics MultiIntersectionDevice::GetStatistics() const
+    {
+        // Every device builds the same scene, report the first one
+        return m_devices.front()->GetStatistics();
+    }
+
+    Buffer* MultiIntersectionDevice::CreateBuffer(size_t size, void* initdata) const
+    {
+        auto buffer = new MultiBuffer(size, m_devices.size());
+
+        if (initdata)
+        {
+            std::memcpy(buffer->data, initdata, size);
+        }
+
+        return buffer;
+    }
+
+    Buffer* MultiIntersectionDevice::CreateBufferFromHostPointer(void* ptr, size_t size) const
+    {
+        return new MultiBuffer(ptr, size, m_devices.size());
+    }
+
+    void MultiIntersectionDevice::DeleteBuffer(Buffer* const buffer) const
+    {
+        auto multi_buffer = static_cast<MultiBuffer*>(buffer);
+
+        for (auto i = 0U; i < m_devices.size(); ++i)
+        {
+            if (multi_buffer->children[i])
+            {
+                m_devices[i]->DeleteBuffer(multi_buffer->children[i]);
+            }
+        }
+
+        delete multi_buffer;
+    }
+
+    void MultiIntersectionDevice::DeleteEvent(Event* const event) const
+    {
+        delete static_cast<MultiEvent*>(event);
+    }
+
+    void MultiIntersectionDevice::MapBuffer(Buffer* buffer, MapType /*type*/, size_t offset, size_t size, void** data, Event** event) const
+    {
+        auto multi_buffer = static_cast<MultiBuffer*>(buffer);
+
+        ThrowIf(offset + size > multi_buffer->size, "Map range is out of buffer bounds.");
+
+        // Host copy is always up to date, so the call is synchronous
+        *data = &multi_buffer->data[offset];
+
+        if (event)
+        {
+            *event = new MultiEvent(this);
+        }
+    }
+
+    void MultiIntersectionDevice::UnmapBuffer(Buffer* /*buffer*/, void* /*ptr*/, Event** event) const
+    {
+        // Data is uploaded to the devices at query time
+        if (event)
+        {
+            *event = new MultiEvent(this);
+        }
+    }
+
+    float MultiIntersectionDevice::GetThroughput(std::size_t devidx) const
+    {
+        std::lock_guard<std::mutex> lock(m_throughput_mutex);
+        return static_cast<float>(m_throughput[devidx]);
+    }
+
+    void MultiIntersectionDevice::UpdateThroughput(std::size_t devidx, int numrays, double seconds) const
+    {
+        if (seconds <= 0.0 || numrays <= 0)
+        {
+            return;
+        }
+
+        auto throughput = numrays / seconds;
+
+        std::lock_guard<std::mutex> lock(m_throughput_mutex);
+        auto& current = m_throughput[devidx];
+        // Exponential moving average to smooth out timing noise
+        current = current > 0.0 ? 0.75 * current + 0.25 * throughput : throughput;
+    }
+
+    std::vector<MultiIntersectionDevice::Portion> MultiIntersectionDevice::Split(int numrays) const
+    {
+        std::vector<double> weights;
+        {
+            std::lock_guard<std::mutex> lock(m_throughput_mutex);
+            weights = m_throughput;
+        }
+
+        // Devices which have not been measured yet get an average share,
+        // so they are measured on the next query
+        double sum = 0.0;
+        int measured = 0;
+        for (auto w : weights)
+        {
+            if (w > 0.0)
+            {
+                sum += w;
+                ++measured;
+            }
+        }
+
+        auto average = measured ? sum / measured : 1.0;
+        sum = 0.0;
+        for (auto& w : weights)
+        {
+            w = w > 0.0 ? w : average;
+            sum += w;
+        }
+
+        auto best = static_cast<std::size_t>(std::max_element(weights.cbegin(), weights.cend()) - weights.cbegin());
+
+        // Find device shares and hand too small ones over to the fastest device
+        std::vector<int> counts(m_devices.size(), 0);
+        int assigned = 0;
+        for (auto i = 0U; i < m_devices.size(); ++i)
+        {
+            if (i == best)
+            {
+                continue;
+            }
+
+            auto count = static_cast<int>(numrays * (weights[i] / sum));
+
+            if (count >= kMinRaysPerDevice)
+            {
+                counts[i] = count;
+                assigned += count;
+            }
+        }
+
+        counts[best] = numrays - assigned;
+
+        std::vector<Portion> portions;
+        int offset = 0;
+        for (auto i = 0U; i < m_devices.size(); ++i)
+        {
+            if (counts[i] > 0)
+            {
+                Portion portion = { i, offset, counts[i] };
+                portions.push_back(portion);
+                offset += counts[i];
+            }
+        }
+
+        return portions;
+    }
+
+    void MultiIntersectionDevice::Query(bool occlusion, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        // Child devices have no knowledge of each other's events, so wait on the host
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        auto ray_buffer = static_cast<MultiBuffer const*>(rays);
+        auto hit_buffer = static_cast<MultiBuffer*>(hits);
+        auto hit_size = occlusion ? sizeof(int) : sizeof(Intersection);
+
+        ThrowIf(numrays * sizeof(ray) > ray_buffer->size, "Ray buffer is too small.");
+        ThrowIf(numrays * hit_size > hit_buffer->size, "Hit buffer is too small.");
+
+        std::unique_ptr<MultiEvent> multi_event(new MultiEvent(this));
+
+        for (auto const& portion : Split(numrays))
+        {
+            auto device = m_devices[portion.device].get();
+
+            // Make sure the device has its own copies of the buffers
+            auto& child_rays = ray_buffer->children[portion.device];
+            if (!child_rays)
+            {
+                child_rays = device->CreateBuffer(ray_buffer->size, nullptr);
+            }
+
+            auto& child_hits = hit_buffer->children[portion.device];
+            if (!child_hits)
+            {
+                child_hits = device->CreateBuffer(hit_buffer->size, nullptr);
+            }
+
+            // Upload device's portion of rays
+            void* data = nullptr;
+            Event* e = nullptr;
+            auto ray_size = portion.count * sizeof(ray);
+            device->MapBuffer(child_rays, kMapWrite, 0, ray_size, &data, &e);
+            e->Wait();
+            device->DeleteEvent(e);
+            std::memcpy(data, &ray_buffer->data[portion.offset * sizeof(ray)], ray_size);
+            device->UnmapBuffer(child_rays, data, &e);
+            e->Wait();
+            device->DeleteEvent(e);
+
+            auto start = MultiEvent::clock::now();
+
+            if (occlusion)
+            {
+                device->QueryOcclusion(child_rays, portion.count, child_hits, nullptr, &e);
+            }
+            else
+            {
+                device->QueryIntersection(child_rays, portion.count, child_hits, nullptr, &e);
+            }
+
+            MultiEvent::Pending pending = { portion.device, e, child_hits, hit_buffer,
+                portion.offset * hit_size, portion.count * hit_size, portion.count, start, start, start, false };
+            multi_event->Add(pending);
+
+            // Earlier portions might be done while this one has been uploaded
+            multi_event->Poll();
+        }
+
+        if (event)
+        {
+            *event = multi_event.release();
+        }
+        else
+        {
+            multi_event->Wait();
+        }
+    }
+
+    void MultiIntersectionDevice::QueryIntersection(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(false, rays, numrays, hits, waitevent, event);
+    }
+
+    void MultiIntersectionDevice::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        Query(true, rays, numrays, hits, waitevent, event);
+    }
+
+    // Ray count lives in host memory, so indirect queries are resolved on the host
+    void MultiIntersectionDevice::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        auto count = *reinterpret_cast<int const*>(static_cast<MultiBuffer const*>(numrays)->data);
+        Query(false, rays, std::max(0, std::min(count, maxrays)), hits, nullptr, event);
+    }
+
+    void MultiIntersectionDevice::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hits, Event const* waitevent, Event** event) const
+    {
+        if (waitevent)
+        {
+            const_cast<Event*>(waitevent)->Wait();
+        }
+
+        auto count = *reinterpret_cast<int const*>(static_cast<MultiBuffer const*>(numrays)->data);
+        Query(true, rays, std::max(0, std::min(count, maxrays)), hits, nullptr, event);
+    }
+}
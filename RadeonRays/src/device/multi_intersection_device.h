@@ -0,0 +1,108 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "intersection_device.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< The class represents a device which spans several intersection devices.
+    ///< The committed scene is replicated on every child device and each query
+    ///< batch is split across the children proportionally to the throughput
+    ///< measured on previous queries. Buffers are kept in host memory and are
+    ///< streamed to the children on demand, so any mix of backends can be used.
+    ///<
+    class MultiIntersectionDevice : public IntersectionDevice
+    {
+    public:
+        // The device takes ownership of the child devices
+        MultiIntersectionDevice(std::vector<IntersectionDevice*> const& devices);
+        ~MultiIntersectionDevice();
+
+        void Preprocess(World const& world) override;
+
+        Buffer* CreateBuffer(size_t size, void* initdata) const override;
+
+        Buffer* CreateBufferFromHostPointer(void* ptr, size_t size) const override;
+
+        void DeleteBuffer(Buffer* const) const override;
+
+        void DeleteEvent(Event* const) const override;
+
+        void MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const override;
+
+        void UnmapBuffer(Buffer* buffer, void* ptr, Event** event) const override;
+
+        void QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        void QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const override;
+
+        void QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const override;
+
+        char const* GetAccelerationReport() const override;
+
+        Statistics GetStatistics() const override;
+
+        // Number of child devices
+        std::size_t GetDeviceCount() const { return m_devices.size(); }
+
+        // Measured throughput of a child device in rays per second (0 if not measured yet)
+        float GetThroughput(std::size_t devidx) const;
+
+    private:
+        struct MultiBuffer;
+        class MultiEvent;
+
+        // Part of a query batch assigned to a single child device
+        struct Portion
+        {
+            std::size_t device;
+            int offset;
+            int count;
+        };
+
+        // Split numrays rays across the child devices
+        std::vector<Portion> Split(int numrays) const;
+
+        // Dispatch the query on all the child devices
+        void Query(bool occlusion, Buffer const* rays, int numrays, Buffer* hits, Event const* waitevent, Event** event) const;
+
+        // Update throughput estimation for the child device
+        void UpdateThroughput(std::size_t devidx, int numrays, double seconds) const;
+
+        // Child devices
+        std::vector<std::unique_ptr<IntersectionDevice>> m_devices;
+        // Throughput estimations (rays per second)
+        mutable std::vector<double> m_throughput;
+        // Guards throughput estimations
+        mutable std::mutex m_throughput_mutex;
+
+        // Batches smaller than this are not split across devices
+        static const int kMinRaysPerDevice = 1024;
+    };
+}
@@ -26,7 +26,10 @@ THE SOFTWARE.
 #include "device.h"
 
 #include "../device/calc_intersection_device.h"
+#include "../device/multi_intersection_device.h"
+#include "../async/task_scheduler.h"
 #include <cassert>
+#include <vector>
 
 #if USE_OPENCL
 #include "../device/calc_intersection_device_cl.h"
@@ -177,6 +180,16 @@ namespace RadeonRays
         s_calc_platform = platform;
     }
 
+    void IntersectionApi::SetThreadCount(int count)
+    {
+        TaskScheduler::Instance().SetThreadCount(count);
+    }
+
+    void IntersectionApi::SetTaskArena(TaskArena* arena)
+    {
+        TaskScheduler::Instance().SetArena(arena);
+    }
+
     std::uint32_t IntersectionApi::GetDeviceCount()
     {
         auto* calc = GetCalc();
@@ -243,12 +256,12 @@ namespace RadeonRays
         devinfo.type = spec.type == Calc::DeviceType::kGpu ? DeviceInfo::kGpu : DeviceInfo::kCpu;
     }
 
-    IntersectionApi* IntersectionApi::Create(std::uint32_t devidx)
+    static IntersectionDevice* CreateIntersectionDevice(std::uint32_t devidx)
     {
         if (IsDeviceIndexEmbree(devidx))
         {
 #ifdef USE_EMBREE
-            return new IntersectionApiImpl(new EmbreeIntersectionDevice());
+            return new EmbreeIntersectionDevice();
 #endif //USE_EMBREE
         }
         else
@@ -256,13 +269,47 @@ namespace RadeonRays
             auto* calc = GetCalc();
             if (calc != nullptr)
             {
-                return new IntersectionApiImpl(new CalcIntersectionDevice(calc, calc->CreateDevice(devidx)));
+                return new CalcIntersectionDevice(calc, calc->CreateDevice(devidx));
             }
         }
 
         return nullptr;
     }
 
+    IntersectionApi* IntersectionApi::Create(std::uint32_t devidx)
+    {
+        auto device = CreateIntersectionDevice(devidx);
+        return device ? new IntersectionApiImpl(device) : nullptr;
+    }
+
+    IntersectionApi* IntersectionApi::Create(std::uint32_t const* devidx, std::uint32_t numdevices)
+    {
+        if (numdevices == 1)
+        {
+            return Create(devidx[0]);
+        }
+
+        std::vector<IntersectionDevice*> devices;
+        for (auto i = 0U; i < numdevices; ++i)
+        {
+            auto device = CreateIntersectionDevice(devidx[i]);
+
+            if (!device)
+            {
+                for (auto d : devices)
+                {
+                    delete d;
+                }
+
+                return nullptr;
+            }
+
+            devices.push_back(device);
+        }
+
+        return devices.empty() ? nullptr : new IntersectionApiImpl(new MultiIntersectionDevice(devices));
+    }
+
     // Deallocation (to simplify DLL scenario)
     void IntersectionApi::Delete(IntersectionApi* api)
     {
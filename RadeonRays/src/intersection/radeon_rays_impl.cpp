@@ -25,6 +25,8 @@ THE SOFTWARE.
 #include "../primitive/instance.h"
 #include "../except/except.h"
 #include "../device/intersection_device.h"
+#include "../async/task_scheduler.h"
+#include "../util/capture.h"
 
 #if USE_OPENCL
 #include "../device/calc_intersection_device_cl.h"
@@ -36,13 +38,244 @@ THE SOFTWARE.
 #endif
 
 #include <vector>
+#include <algorithm>
 #include <cfloat>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <chrono>
 
 namespace RadeonRays
 {
+    // Create the meshes of descs in parallel, either all of them are written to meshes or none
+    static void CreateMeshBatch(MeshDesc const* descs, int nummeshes, Id firstid, Shape** meshes)
+    {
+        std::vector<Mesh*> created(nummeshes, nullptr);
+
+        try
+        {
+            ParallelFor(0, nummeshes, [&](int i)
+            {
+                MeshDesc const& desc = descs[i];
+
+                Mesh* mesh = new Mesh(desc.vertices, desc.vnum, desc.vstride,
+                    desc.indices, desc.istride, desc.numfacevertices, desc.numfaces,
+                    (desc.flags & kMeshReferenceData) != 0);
+
+                mesh->SetId(firstid + i);
+
+                created[i] = mesh;
+            });
+        }
+        catch (...)
+        {
+            for (auto mesh : created)
+            {
+                delete mesh;
+            }
+
+            throw;
+        }
+
+        std::copy(created.cbegin(), created.cend(), meshes);
+    }
+
+    // Asynchronous CreateMeshes call, shared by the worker task and its event
+    class MeshBatch : public std::enable_shared_from_this<MeshBatch>
+    {
+    public:
+        MeshBatch(MeshDesc const* descs, int nummeshes, Id firstid, Shape** meshes)
+            : m_descs(descs, descs + nummeshes)
+            , m_firstid(firstid)
+            , m_meshes(meshes)
+            , m_complete(false)
+            , m_waited(false)
+        {
+        }
+
+        void Start()
+        {
+            auto self = shared_from_this();
+
+            m_group.Run([self]()
+            {
+                try
+                {
+                    CreateMeshBatch(self->m_descs.data(), static_cast<int>(self->m_descs.size()), self->m_firstid, self->m_meshes);
+                }
+                catch (...)
+                {
+                    self->m_complete = true;
+                    throw;
+                }
+
+                self->m_complete = true;
+            });
+        }
+
+        bool Complete() const
+        {
+            return m_complete;
+        }
+
+        // Rethrows the creation error on every call
+        void Wait()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            if (!m_waited)
+            {
+                m_waited = true;
+
+                try
+                {
+                    m_group.Wait();
+                }
+                catch (...)
+                {
+                    m_error = std::current_exception();
+                }
+            }
+
+            if (m_error)
+            {
+                std::rethrow_exception(m_error);
+            }
+        }
+
+    private:
+        std::vector<MeshDesc> m_descs;
+        Id m_firstid;
+        Shape** m_meshes;
+        std::atomic<bool> m_complete;
+        TaskGroup m_group;
+        std::mutex m_mutex;
+        bool m_waited;
+        std::exception_ptr m_error;
+    };
+
+    class MeshBatchEvent : public Event
+    {
+    public:
+        explicit MeshBatchEvent(std::shared_ptr<MeshBatch> batch)
+            : m_batch(batch)
+        {
+        }
+
+        // The meshes array must not be written once the event is gone
+        ~MeshBatchEvent()
+        {
+            try
+            {
+                m_batch->Wait();
+            }
+            catch (...)
+            {
+            }
+        }
+
+        bool Complete() const override
+        {
+            return m_batch->Complete();
+        }
+
+        void Wait() override
+        {
+            m_batch->Wait();
+        }
+
+    private:
+        std::shared_ptr<MeshBatch> m_batch;
+    };
+
+    // Add device execution time of a completed query to the counters if the device profiles it
+    static void RecordQueryTime(IntersectionDevice const* device, Event const* event, QueryCounters& counters,
+                                std::uint64_t numrays, bool exact)
+    {
+        float ms = device->GetQueryDuration(event);
+
+        if (ms >= 0.f)
+        {
+            auto ns = static_cast<std::uint64_t>(ms * 1e6);
+            counters.timed_ns += ns;
+
+            if (exact)
+            {
+                counters.rated_rays += numrays;
+                counters.rated_ns += ns;
+            }
+        }
+    }
+
+    // Query event handed out to the user, records the query time once completion is observed
+    class TimedQueryEvent : public Event
+    {
+    public:
+        TimedQueryEvent(Event* event, IntersectionDevice const* device, std::shared_ptr<QueryCounters> const& counters,
+                        std::uint64_t numrays, bool exact)
+            : m_event(event)
+            , m_device(device)
+            , m_counters(counters)
+            , m_numrays(numrays)
+            , m_exact(exact)
+            , m_recorded(false)
+        {
+        }
+
+        bool Complete() const override
+        {
+            bool complete = m_event->Complete();
+
+            if (complete)
+            {
+                Record();
+            }
+
+            return complete;
+        }
+
+        void Wait() override
+        {
+            m_event->Wait();
+            Record();
+        }
+
+        // Event the device has returned for the query
+        Event* GetDeviceEvent() const
+        {
+            return m_event;
+        }
+
+        // Devices only know their own events
+        static Event const* Unwrap(Event const* event)
+        {
+            auto timed = dynamic_cast<TimedQueryEvent const*>(event);
+            return timed ? timed->m_event : event;
+        }
+
+    private:
+        void Record() const
+        {
+            if (!m_recorded.exchange(true))
+            {
+                RecordQueryTime(m_device, m_event, *m_counters, m_numrays, m_exact);
+            }
+        }
+
+        Event* m_event;
+        IntersectionDevice const* m_device;
+        // Keeps the counters alive if the event outlives the api
+        std::shared_ptr<QueryCounters> m_counters;
+        std::uint64_t m_numrays;
+        bool m_exact;
+        mutable std::atomic<bool> m_recorded;
+    };
+
     IntersectionApiImpl::IntersectionApiImpl(IntersectionDevice* device)
         : nextid_(1)
     , m_device(device)
+    , m_commit_ms(0.f)
+    , m_counters(std::make_shared<QueryCounters>())
     {
         world_.hint_ = 0;
     }
@@ -79,6 +312,24 @@ namespace RadeonRays
         return mesh;
     }
 
+    void IntersectionApiImpl::CreateMeshes(MeshDesc const* descs, int nummeshes, Shape** meshes, Event** event) const
+    {
+        ThrowIf(nummeshes < 0 || (nummeshes > 0 && (!descs || !meshes)), "Invalid mesh batch.");
+
+        // Reserve a contiguous range of IDs
+        Id firstid = nextid_.fetch_add(nummeshes);
+
+        if (!event)
+        {
+            CreateMeshBatch(descs, nummeshes, firstid, meshes);
+            return;
+        }
+
+        auto batch = std::make_shared<MeshBatch>(descs, nummeshes, firstid, meshes);
+        batch->Start();
+
+        *event = new MeshBatchEvent(batch);
+    }
 
     Shape* IntersectionApiImpl::CreateInstance(Shape const* shape) const
     {
@@ -91,6 +342,32 @@ namespace RadeonRays
         return instance;
     }
 
+    void IntersectionApiImpl::CreateInstances(Shape const* shape, int numinstances, matrix const* transforms, Shape** instances) const
+    {
+        Mesh const* mesh = static_cast<Mesh const*>(shape);
+
+        // Reserve a contiguous range of IDs
+        Id firstid = nextid_.fetch_add(numinstances);
+
+        ParallelFor(0, numinstances, [&](int i)
+        {
+            Instance* instance = new Instance(mesh);
+
+            instance->SetId(firstid + i);
+            instance->SetTransform(transforms[i], inverse(transforms[i]));
+
+            instances[i] = instance;
+        });
+    }
+
+    void IntersectionApiImpl::SetTransforms(Shape* const* shapes, int numshapes, matrix const* transforms) const
+    {
+        ParallelFor(0, numshapes, [&](int i)
+        {
+            shapes[i]->SetTransform(transforms[i], inverse(transforms[i]));
+        });
+    }
+
     void IntersectionApiImpl::DeleteShape(Shape const* shape)
     {
         delete shape;
@@ -101,11 +378,21 @@ namespace RadeonRays
         world_.AttachShape(shape);
     }
 
+    void IntersectionApiImpl::AttachShapes(Shape const* const* shapes, int numshapes)
+    {
+        world_.AttachShapes(shapes, numshapes);
+    }
+
     void IntersectionApiImpl::DetachShape(Shape const* shape)
     {
         world_.DetachShape(shape);
     }
 
+    void IntersectionApiImpl::DetachShapes(Shape const* const* shapes, int numshapes)
+    {
+        world_.DetachShapes(shapes, numshapes);
+    }
+
     void IntersectionApiImpl::DetachAll()
     {
         world_.DetachAll();
@@ -115,8 +402,16 @@ namespace RadeonRays
     void IntersectionApiImpl::Commit()
     {
         ThrowIf(world_.shapes_.empty(), "Scene is empty.");
+
+        auto start = std::chrono::high_resolution_clock::now();
+
         m_device->Preprocess(world_);
 
+        m_commit_ms = std::chrono::duration<float, std::milli>(std::chrono::high_resolution_clock::now() - start).count();
+        m_counters->Reset();
+
+        CaptureScene();
+
         world_.OnCommit();
     }
 
@@ -125,28 +420,163 @@ namespace RadeonRays
         m_device->DeleteBuffer(buffer);
     }
 
+    void IntersectionApiImpl::SubmitQuery(std::uint64_t numrays, bool exact, Event const* waitevent, Event** event,
+                                          std::function<void(Event const*, Event**)> const& query) const
+    {
+        ++m_counters->queries;
+        m_counters->rays += numrays;
+
+        if (!event)
+        {
+            // Blocking query, wait on an event of our own to get at the device time
+            Event* e = nullptr;
+            query(TimedQueryEvent::Unwrap(waitevent), &e);
+            e->Wait();
+            RecordQueryTime(m_device.get(), e, *m_counters, numrays, exact);
+            m_device->DeleteEvent(e);
+            return;
+        }
+
+        query(TimedQueryEvent::Unwrap(waitevent), event);
+
+        *event = new TimedQueryEvent(*event, m_device.get(), m_counters, numrays, exact);
+    }
+
+    void IntersectionApiImpl::CaptureScene()
+    {
+        auto option = world_.options_.GetOption("debug.capture_dir");
+        std::string dir = option ? option->AsString() : "";
+
+        if (dir.empty())
+        {
+            m_capture.reset();
+            return;
+        }
+
+        if (!m_capture || m_capture->GetDirectory() != dir)
+        {
+            m_capture.reset(new CaptureWriter(dir));
+        }
+
+        m_capture->WriteScene(world_);
+    }
+
+    void IntersectionApiImpl::CaptureQuery(CaptureQueryType type, Buffer const* rays, int numrays,
+                                           Buffer const* numraysbuffer, int maxrays, Event const* waitevent) const
+    {
+        if (!m_capture || !m_capture->HasScene())
+        {
+            return;
+        }
+
+        // The rays might not have been written yet
+        if (waitevent)
+        {
+            const_cast<Event*>(TimedQueryEvent::Unwrap(waitevent))->Wait();
+        }
+
+        Event* e = nullptr;
+
+        if (numraysbuffer)
+        {
+            int* count = nullptr;
+            m_device->MapBuffer(const_cast<Buffer*>(numraysbuffer), kMapRead, 0, sizeof(int), (void**)&count, &e);
+            e->Wait();
+            m_device->DeleteEvent(e);
+
+            numrays = std::min(std::max(*count, 0), maxrays);
+
+            m_device->UnmapBuffer(const_cast<Buffer*>(numraysbuffer), count, &e);
+            e->Wait();
+            m_device->DeleteEvent(e);
+        }
+
+        if (numrays <= 0)
+        {
+            m_capture->WriteQuery(type, nullptr, 0, maxrays);
+            return;
+        }
+
+        ray* data = nullptr;
+        m_device->MapBuffer(const_cast<Buffer*>(rays), kMapRead, 0, numrays * sizeof(ray), (void**)&data, &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+
+        try
+        {
+            m_capture->WriteQuery(type, data, numrays, maxrays);
+        }
+        catch (...)
+        {
+            m_device->UnmapBuffer(const_cast<Buffer*>(rays), data, &e);
+            e->Wait();
+            m_device->DeleteEvent(e);
+            throw;
+        }
+
+        m_device->UnmapBuffer(const_cast<Buffer*>(rays), data, &e);
+        e->Wait();
+        m_device->DeleteEvent(e);
+    }
+
     void IntersectionApiImpl::QueryIntersection(Buffer const* rays, int numrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
     {
-        m_device->QueryIntersection(rays, numrays, hitinfos, waitevent, event);
+        CaptureQuery(kCaptureIntersection, rays, numrays, nullptr, 0, waitevent);
+
+        SubmitQuery(numrays, true, waitevent, event, [&](Event const* deviceevent, Event** result)
+        {
+            m_device->QueryIntersection(rays, numrays, hitinfos, deviceevent, result);
+        });
     }
 
     void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, int numrays, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
-        m_device->QueryOcclusion(rays, numrays, hitresults, waitevent, event);
+        CaptureQuery(kCaptureOcclusion, rays, numrays, nullptr, 0, waitevent);
+
+        SubmitQuery(numrays, true, waitevent, event, [&](Event const* deviceevent, Event** result)
+        {
+            m_device->QueryOcclusion(rays, numrays, hitresults, deviceevent, result);
+        });
     }
 
     void IntersectionApiImpl::QueryIntersection(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitinfos, Event const* waitevent, Event** event) const
     {
-        m_device->QueryIntersection(rays, numrays, maxrays, hitinfos, waitevent, event);
+        CaptureQuery(kCaptureIntersection, rays, 0, numrays, maxrays, waitevent);
+
+        SubmitQuery(maxrays, false, waitevent, event, [&](Event const* deviceevent, Event** result)
+        {
+            m_device->QueryIntersection(rays, numrays, maxrays, hitinfos, deviceevent, result);
+        });
     }
 
     void IntersectionApiImpl::QueryOcclusion(Buffer const* rays, Buffer const* numrays, int maxrays, Buffer* hitresults, Event const* waitevent, Event** event) const
     {
-        m_device->QueryOcclusion(rays, numrays, maxrays, hitresults, waitevent, event);
+        CaptureQuery(kCaptureOcclusion, rays, 0, numrays, maxrays, waitevent);
+
+        SubmitQuery(maxrays, false, waitevent, event, [&](Event const* deviceevent, Event** result)
+        {
+            m_device->QueryOcclusion(rays, numrays, maxrays, hitresults, deviceevent, result);
+        });
     }
 
     void IntersectionApiImpl::DeleteEvent(Event* event) const
     {
+        // Mesh creation events are not known to the device
+        if (dynamic_cast<MeshBatchEvent*>(event))
+        {
+            delete event;
+            return;
+        }
+
+        // Query events wrap the device ones, an already completed query still gets counted
+        if (auto timed = dynamic_cast<TimedQueryEvent*>(event))
+        {
+            timed->Complete();
+            m_device->DeleteEvent(timed->GetDeviceEvent());
+            delete timed;
+            return;
+        }
+
         m_device->DeleteEvent(event);
     }
 
@@ -155,6 +585,12 @@ namespace RadeonRays
         return m_device->CreateBuffer(size, initdata);
     }
 
+    Buffer* IntersectionApiImpl::CreateBufferFromHostPointer(void* ptr, size_t size) const
+    {
+        ThrowIf(!ptr, "Host pointer is null.");
+        return m_device->CreateBufferFromHostPointer(ptr, size);
+    }
+
     void IntersectionApiImpl::MapBuffer(Buffer* buffer, MapType type, size_t offset, size_t size, void** data, Event** event) const
     {
         return m_device->MapBuffer(buffer, type, offset, size, data, event);
@@ -175,6 +611,33 @@ namespace RadeonRays
         return world_.shapes_.size() == 0;
     }
 
+    char const* IntersectionApiImpl::GetAccelerationReport() const
+    {
+        return m_device->GetAccelerationReport();
+    }
+
+    Statistics IntersectionApiImpl::GetStatistics() const
+    {
+        Statistics stats = m_device->GetStatistics();
+
+        stats.commit_ms = m_commit_ms;
+        stats.num_queries = m_counters->queries;
+        stats.num_rays = m_counters->rays;
+
+        std::uint64_t rated_ns = m_counters->rated_ns;
+        std::uint64_t rated_rays = m_counters->rated_rays;
+
+        stats.query_ms = static_cast<float>(m_counters->timed_ns * 1e-6);
+        stats.rays_per_second = rated_ns > 0 ? static_cast<float>(rated_rays * 1e9 / rated_ns) : 0.f;
+
+        return stats;
+    }
+
+    void IntersectionApiImpl::SetTraversalCounters(Buffer* counters)
+    {
+        m_device->SetTraversalCounters(counters);
+    }
+
 #ifdef USE_OPENCL
     RRAPI Buffer* CreateFromOpenClBuffer(RadeonRays::IntersectionApi* api, cl_mem buffer)
     {
@@ -23,13 +23,42 @@ THE SOFTWARE.
 #define INTERSECTIONAPI_IMPL
 
 #include <atomic>
+#include <cstdint>
+#include <functional>
+#include <memory>
 
 #include "radeon_rays.h"
 #include "../world/world.h"
+#include "../util/capture_format.h"
 
 namespace RadeonRays
 {
     class IntersectionDevice;
+    class CaptureWriter;
+
+    ///< Query counters reported by GetStatistics, updated from any thread
+    struct QueryCounters
+    {
+        QueryCounters() { Reset(); }
+
+        void Reset()
+        {
+            queries = 0;
+            rays = 0;
+            timed_ns = 0;
+            rated_rays = 0;
+            rated_ns = 0;
+        }
+
+        std::atomic<std::uint64_t> queries;
+        std::atomic<std::uint64_t> rays;
+        // Device execution time of the profiled queries whose completion has been observed
+        std::atomic<std::uint64_t> timed_ns;
+        // Rays and device execution time of the ones with a known ray count, buffer driven
+        // counts are only known to the device
+        std::atomic<std::uint64_t> rated_rays;
+        std::atomic<std::uint64_t> rated_ns;
+    };
 
     /// IntersectionApi is designed to provide fast means for ray-scene intersection
     /// for AMD architectures. It effectively absracts underlying AMD hardware and
@@ -62,15 +91,27 @@ namespace RadeonRays
             int  numfaces
             ) const override;
 
+        // Create nummeshes meshes at once, asynchronously if event is not nullptr
+        void CreateMeshes(MeshDesc const* descs, int nummeshes, Shape** meshes, Event** event) const override;
+
         // Create an instance of a shape with its own transform (set via Shape interface).
         // The call is blocking, so the returned value is ready upon return.
         Shape* CreateInstance(Shape const* shape) const override;
+        // Create numinstances instances of a shape with the given object to world transforms.
+        // The call is blocking, so the returned values are ready upon return.
+        void CreateInstances(Shape const* shape, int numinstances, matrix const* transforms, Shape** instances) const override;
+        // Set object to world transforms of numshapes shapes at once
+        void SetTransforms(Shape* const* shapes, int numshapes, matrix const* transforms) const override;
         // Delete the shape (to simplify DLL boundary crossing
         void DeleteShape(Shape const* shape) override;
         // Attach shape to participate in intersection process
         void AttachShape(Shape const* shape) override;
+        // Attach numshapes shapes at once
+        void AttachShapes(Shape const* const* shapes, int numshapes) override;
         // Detach shape, i.e. it is not going to be considered part of the scene anymore
         void DetachShape(Shape const* shape) override;
+        // Detach numshapes shapes at once
+        void DetachShapes(Shape const* const* shapes, int numshapes) override;
         // Detach all objects
         void DetachAll() override;
         // Commit all geometry creations/changes
@@ -86,6 +127,9 @@ namespace RadeonRays
         ******************************************/
         Buffer* CreateBuffer(size_t size, void* initdata) const override;
 
+        // Create a buffer using caller owned memory as its storage
+        Buffer* CreateBufferFromHostPointer(void* ptr, size_t size) const override;
+
         // Delete the buffer
         void DeleteBuffer(Buffer* buffer) const override;
         // Map buffer. Event pointer might be nullptr.
@@ -128,6 +172,12 @@ namespace RadeonRays
         void SetOption(char const* name, char const* value) override;
         // Set API global option: float
         void SetOption(char const* name, float value) override;
+        // Get the acceleration structure selection report
+        char const* GetAccelerationReport() const override;
+        // Get the build measurements of the last Commit and the query counters since
+        Statistics GetStatistics() const override;
+        // Set the side buffer per ray traversal counters are written to
+        void SetTraversalCounters(Buffer* counters) override;
         
 
         IntersectionDevice* GetDevice() const { return m_device.get(); }
@@ -139,12 +189,30 @@ namespace RadeonRays
         ~IntersectionApiImpl();
 
     private:
+        // Count the query and record its device execution time on completion, either in place
+        // or through an event wrapping the one returned by query. Buffer driven queries pass
+        // maxrays and exact == false, they are left out of the ray rate.
+        void SubmitQuery(std::uint64_t numrays, bool exact, Event const* waitevent, Event** event,
+                         std::function<void(Event const*, Event**)> const& query) const;
+
+        // Start, stop or continue capturing as set by "debug.capture_dir" and write the committed scene
+        void CaptureScene();
+        // Write the query rays if capturing, numraysbuffer is nullptr unless the count is in remote memory
+        void CaptureQuery(CaptureQueryType type, Buffer const* rays, int numrays,
+                          Buffer const* numraysbuffer, int maxrays, Event const* waitevent) const;
+
         // Container for all shapes
         World world_;
         // Shape ID tracker
         mutable std::atomic<Id> nextid_;
         // Intersection device
         std::unique_ptr<IntersectionDevice> m_device;
+        // Wall clock time of the last Commit
+        float m_commit_ms;
+        // Query counters since the last Commit, shared with the query events handed out
+        std::shared_ptr<QueryCounters> m_counters;
+        // Scene and ray capture, nullptr unless enabled
+        std::unique_ptr<CaptureWriter> m_capture;
     };
 }
 
@@ -38,19 +38,24 @@ DEFINES
  **************************************************************************/
 #define STARTIDX(x)     (((int)(x->pmin.w)))
 #define LEAFNODE(x)     (((x).pmin.w) != -1.f)
+// Face.cnt value of the faces standing for referenced instances,
+// such faces keep root node index of the instanced mesh BVH in idx[0]
+#define INSTANCE_FACE   (-1)
 
 typedef struct 
 {
     // BVH structure
     __global BvhNode const*       nodes;
     // Scene positional data
-    __global float3 const*        vertices;
+    __global float const*         vertices;
     // Scene indices
     __global Face const*          faces;
     // Shape data
     __global ShapeData const*     shapes;
     // Extra data
     __global int const*           extra;
+    // Counters of the ray being traced by instrumented kernels
+    COUNTERS_FIELD
 } SceneData;
 
 /*************************************************************************
@@ -62,6 +67,107 @@ HELPER FUNCTIONS
 /*************************************************************************
 BVH FUNCTIONS
 **************************************************************************/
+// intersect a ray with the object space BVH of a referenced instance
+void IntersectInstanceClosest(
+    SceneData const* scenedata,
+    Face const* instface,
+    ray const* r,                // ray to instersect
+    Intersection* isect          // Intersection structure
+    )
+{
+    ShapeData shape = scenedata->shapes[instface->shapeidx];
+
+#ifdef RR_RAY_MASK
+    if (!(Ray_GetMask(r) & shape.mask))
+        return;
+#endif
+
+    // Affine transform keeps ray parametrization, so hit distances stay comparable
+    ray lr = transform_ray(*r, shape.m0, shape.m1, shape.m2, shape.m3);
+    float3 invdir = make_float3(1.f, 1.f, 1.f) / lr.d.xyz;
+
+    int idx = instface->idx[0];
+
+    while (idx != -1)
+    {
+        BvhNode node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
+        if (IntersectBox(&lr, invdir, node, isect->uvwt.w))
+        {
+            if (LEAFNODE(node))
+            {
+                Face face = scenedata->faces[STARTIDX((&node))];
+                COUNT_FACE(scenedata, &face)
+                if (IntersectFace(&lr, &face, scenedata->vertices, isect))
+                {
+                    isect->primid = face.id;
+                    isect->shapeid = shape.id;
+                }
+
+                idx = (int)(node.pmax.w);
+            }
+            else
+            {
+                ++idx;
+            }
+        }
+        else
+        {
+            idx = (int)(node.pmax.w);
+        }
+    }
+}
+
+// check if a ray hits anything in the object space BVH of a referenced instance
+bool IntersectInstanceAny(
+    SceneData const* scenedata,
+    Face const* instface,
+    ray const* r                      // ray to instersect
+    )
+{
+    ShapeData shape = scenedata->shapes[instface->shapeidx];
+
+#ifdef RR_RAY_MASK
+    if (!(Ray_GetMask(r) & shape.mask))
+        return false;
+#endif
+
+    ray lr = transform_ray(*r, shape.m0, shape.m1, shape.m2, shape.m3);
+    float3 invdir = make_float3(1.f, 1.f, 1.f) / lr.d.xyz;
+
+    int idx = instface->idx[0];
+
+    while (idx != -1)
+    {
+        BvhNode node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
+        if (IntersectBox(&lr, invdir, node, lr.o.w))
+        {
+            if (LEAFNODE(node))
+            {
+                Face face = scenedata->faces[STARTIDX((&node))];
+                COUNT_FACE(scenedata, &face)
+                if (IntersectFaceP(&lr, &face, scenedata->vertices))
+                {
+                    return true;
+                }
+
+                idx = (int)(node.pmax.w);
+            }
+            else
+            {
+                ++idx;
+            }
+        }
+        else
+        {
+            idx = (int)(node.pmax.w);
+        }
+    }
+
+    return false;
+}
+
 //  intersect a ray with leaf BVH node
 void IntersectLeafClosest(
     SceneData const* scenedata,
@@ -70,14 +176,16 @@ void IntersectLeafClosest(
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
     face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+
+    if (face.cnt == INSTANCE_FACE)
+    {
+        IntersectInstanceClosest(scenedata, &face, r, isect);
+        return;
+    }
 
 #ifdef RR_RAY_MASK
     int shapemask = scenedata->shapes[face.shapeidx].mask;
@@ -86,7 +194,8 @@ void IntersectLeafClosest(
 #endif
 
     {
-        if (IntersectTriangle(r, v1, v2, v3, isect))
+        COUNT_FACE(scenedata, &face)
+        if (IntersectFace(r, &face, scenedata->vertices, isect))
         {
             isect->primid = face.id;
             isect->shapeid = scenedata->shapes[face.shapeidx].id;
@@ -101,14 +210,15 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
     face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
+
+    if (face.cnt == INSTANCE_FACE)
+    {
+        return IntersectInstanceAny(scenedata, &face, r);
+    }
 
 #ifdef RR_RAY_MASK
     int shapemask = scenedata->shapes[face.shapeidx].mask;
@@ -116,7 +226,8 @@ bool IntersectLeafAny(
     if (Ray_GetMask(r) & shapemask)
 #endif
     {
-        if (IntersectTriangleP(r, v1, v2, v3))
+        COUNT_FACE(scenedata, &face)
+        if (IntersectFaceP(r, &face, scenedata->vertices))
         {
             return true;
         }
@@ -142,6 +253,7 @@ void IntersectSceneClosest(SceneData const* scenedata,  ray const* r, Intersecti
         // Try intersecting against current node's bounding box.
         // If this is the leaf try to intersect against contained triangle.
         BvhNode node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
         if (IntersectBox(r, invdir, node, isect->uvwt.w))
         {
             if (LEAFNODE(node))
@@ -175,6 +287,7 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
         // Try intersecting against current node's bounding box.
         // If this is the leaf try to intersect against contained triangle.
         BvhNode node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
         if (IntersectBox(r, invdir, node, r->o.w))
         {
             if (LEAFNODE(node))
@@ -204,11 +317,15 @@ bool IntersectSceneAny(SceneData const* scenedata,  ray const* r)
 }
 
 
+// Persistent threads versions: the kernels are launched with just enough
+// work groups to fill the device and each group keeps fetching batches
+// of 64 rays from the counter until the workload is exhausted.
+// The counter has to be zeroed before the launch.
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosestAMD(
 // Input
 __global BvhNode const* nodes,   // BVH nodes
-__global float3 const* vertices, // Scene positional data
+__global float const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
 __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
@@ -216,11 +333,11 @@ int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
 __global Intersection* hits, // Hit datas
 __global int*          raycnt 
+    COUNTERS_ARGS
     )
 {
     __local int nextrayidx;
 
-    int global_id  = get_global_id(0);
     int local_id  = get_local_id(0);
 
     // Fill scene data 
@@ -233,46 +350,51 @@ __global int*          raycnt
         0
     };
 
-    if (local_id == 0)
+    for (;;)
     {
-        nextrayidx = 0;
-    }
+        // Make sure everyone has read the previous batch index
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-    int ridx = 0;
-    Intersection isect;
-
-    while (ridx < numrays)
-    {
         if (local_id == 0)
         {
             nextrayidx = atomic_add(raycnt, 64);
         }
 
-        ridx = nextrayidx + local_id;
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        if (ridx >= numrays)
+        // Uniform across the group, so the barriers above are safe
+        if (nextrayidx >= numrays)
             break;
 
-        // Fetch ray
-        ray r = rays[ridx];
+        int ridx = nextrayidx + local_id;
 
-        if (Ray_IsActive(&r))
+        if (ridx < numrays)
         {
-            // Calculate closest hit
-            IntersectSceneClosest(&scenedata, &r, &isect);
+            // Fetch ray
+            int idx = offset + ridx;
+            ray r = rays[idx];
+            COUNTERS_BEGIN(scenedata)
 
-            // Write data back in case of a hit
-            hits[ridx] = isect;
+            if (Ray_IsActive(&r))
+            {
+                // Calculate closest hit
+                Intersection isect;
+                IntersectSceneClosest(&scenedata, &r, &isect);
+
+                // Write data back in case of a hit
+                hits[idx] = isect;
+            }
+
+            COUNTERS_STORE(idx)
         }
     }
 }
 
-
 __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAnyAMD(
     // Input
     __global BvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,    // Scene indices
     __global ShapeData const* shapes,     // Shapes
     __global ray const* rays,        // Ray workload
@@ -280,11 +402,11 @@ __kernel void IntersectAnyAMD(
     int numrays,               // Number of rays to process                    
     __global int* hitresults,  // Hit results
     __global int* raycnt
+    COUNTERS_ARGS
     )
 {
     __local int nextrayidx;
 
-    int global_id = get_global_id(0);
     int local_id = get_local_id(0);
 
     // Fill scene data 
@@ -297,31 +419,38 @@ __kernel void IntersectAnyAMD(
         0
     };
 
-    if (local_id == 0)
+    for (;;)
     {
-        nextrayidx = 0;
-    }
+        // Make sure everyone has read the previous batch index
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-    int ridx = 0;
-    while (ridx < numrays)
-    {
         if (local_id == 0)
         {
             nextrayidx = atomic_add(raycnt, 64);
         }
 
-        ridx = nextrayidx + local_id;
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        if (ridx >= numrays)
+        // Uniform across the group, so the barriers above are safe
+        if (nextrayidx >= numrays)
             break;
 
-        // Fetch ray
-        ray r = rays[ridx];
+        int ridx = nextrayidx + local_id;
 
-        if (Ray_IsActive(&r))
+        if (ridx < numrays)
         {
-            // Calculate any intersection
-            hitresults[ridx] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+            // Fetch ray
+            int idx = offset + ridx;
+            ray r = rays[idx];
+            COUNTERS_BEGIN(scenedata)
+
+            if (Ray_IsActive(&r))
+            {
+                // Calculate any intersection
+                hitresults[idx] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+            }
+
+            COUNTERS_STORE(idx)
         }
     }
 }
@@ -330,20 +459,22 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 // Version with range check
 __kernel void IntersectClosestRCAMD(
     __global BvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,      // Scene indices
     __global ShapeData const* shapes,     // Shapes
     __global ray const* rays,        // Ray workload
     int offset,                // Offset in rays array
     __global int const* numrays,     // Number of rays in the workload
+    int maxrays,               // Capacity of rays and hits
     __global Intersection* hits, // Hit datas
     __global int* raycnt
+    COUNTERS_ARGS
     )
 {
     __local int nextrayidx;
 
-    int global_id = get_global_id(0);
     int local_id = get_local_id(0);
+    int count = min(*numrays, maxrays);
 
     // Fill scene data 
     SceneData scenedata =
@@ -355,35 +486,41 @@ __kernel void IntersectClosestRCAMD(
         0
     };
 
-    if (local_id == 0)
+    for (;;)
     {
-        nextrayidx = 0;
-    }
+        // Make sure everyone has read the previous batch index
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-    int ridx = 0;
-    Intersection isect;
-
-    while (ridx < *numrays)
-    {
         if (local_id == 0)
         {
             nextrayidx = atomic_add(raycnt, 64);
         }
 
-        ridx = nextrayidx + local_id;
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        if (ridx >= *numrays)
+        // Uniform across the group, so the barriers above are safe
+        if (nextrayidx >= count)
             break;
 
-        // Fetch ray
-        ray r = rays[ridx];
+        int ridx = nextrayidx + local_id;
 
-        if (Ray_IsActive(&r))
+        if (ridx < count)
         {
-            // Calculate closest hit
-            IntersectSceneClosest(&scenedata, &r, &isect);
-            // Write data back in case of a hit
-            hits[ridx] = isect;
+            // Fetch ray
+            int idx = offset + ridx;
+            ray r = rays[idx];
+            COUNTERS_BEGIN(scenedata)
+
+            if (Ray_IsActive(&r))
+            {
+                // Calculate closest hit
+                Intersection isect;
+                IntersectSceneClosest(&scenedata, &r, &isect);
+                // Write data back in case of a hit
+                hits[idx] = isect;
+            }
+
+            COUNTERS_STORE(idx)
         }
     }
 }
@@ -393,20 +530,22 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAnyRCAMD(
     // Input
     __global BvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,    // Scene indices
     __global ShapeData const* shapes,     // Shapes
     __global ray const* rays,        // Ray workload
     int offset,                // Offset in rays array
     __global int const* numrays,     // Number of rays in the workload
+    int maxrays,               // Capacity of rays and hits
     __global int* hitresults,   // Hit results
     __global int* raycnt
+    COUNTERS_ARGS
     )
 {
     __local int nextrayidx;
 
-    int global_id = get_global_id(0);
     int local_id = get_local_id(0);
+    int count = min(*numrays, maxrays);
 
     // Fill scene data 
     SceneData scenedata =
@@ -418,31 +557,38 @@ __kernel void IntersectAnyRCAMD(
         0
     };
 
-    if (local_id == 0)
+    for (;;)
     {
-        nextrayidx = 0;
-    }
+        // Make sure everyone has read the previous batch index
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-    int ridx = 0;
-    while (ridx < *numrays)
-    {
         if (local_id == 0)
         {
             nextrayidx = atomic_add(raycnt, 64);
         }
 
-        ridx = nextrayidx + local_id;
+        barrier(CLK_LOCAL_MEM_FENCE);
 
-        if (ridx >= *numrays)
+        // Uniform across the group, so the barriers above are safe
+        if (nextrayidx >= count)
             break;
 
-        // Fetch ray
-        ray r = rays[ridx];
+        int ridx = nextrayidx + local_id;
 
-        if (Ray_IsActive(&r))
+        if (ridx < count)
         {
-            // Calculate any intersection
-            hitresults[ridx] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+            // Fetch ray
+            int idx = offset + ridx;
+            ray r = rays[idx];
+            COUNTERS_BEGIN(scenedata)
+
+            if (Ray_IsActive(&r))
+            {
+                // Calculate any intersection
+                hitresults[idx] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
+            }
+
+            COUNTERS_STORE(idx)
         }
     }
 }
@@ -452,13 +598,14 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosest(
 // Input
 __global BvhNode const* nodes,   // BVH nodes
-__global float3 const* vertices, // Scene positional data
+__global float const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
 __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process
 __global Intersection* hits // Hit datas
+    COUNTERS_ARGS
 )
 {
     int global_id = get_global_id(0);
@@ -478,6 +625,7 @@ __global Intersection* hits // Hit datas
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -488,6 +636,8 @@ __global Intersection* hits // Hit datas
             // Write data back in case of a hit
             hits[global_id] = isect;
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
 
@@ -495,13 +645,14 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAny(
 // Input
 __global BvhNode const* nodes,   // BVH nodes
-__global float3 const* vertices, // Scene positional data
+__global float const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
 __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 int numrays,               // Number of rays to process                    
 __global int* hitresults  // Hit results
+    COUNTERS_ARGS
 )
 {
     int global_id = get_global_id(0);
@@ -522,12 +673,15 @@ __global int* hitresults  // Hit results
     {
         // Fetch ray
         ray r = rays[offset + global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
             // Calculate any intersection
             hitresults[offset + global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
         }
+
+        COUNTERS_STORE(offset + global_id)
     }
 }
 
@@ -535,13 +689,14 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 // Version with range check
 __kernel void IntersectClosestRC(
 __global BvhNode const* nodes,   // BVH nodes
-__global float3 const* vertices, // Scene positional data
+__global float const* vertices, // Scene positional data
 __global Face const* faces,      // Scene indices
 __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 __global int const* numrays,     // Number of rays in the workload
 __global Intersection* hits // Hit datas
+    COUNTERS_ARGS
 )
 {
     int global_id = get_global_id(0);
@@ -562,6 +717,7 @@ __global Intersection* hits // Hit datas
         // Fetch ray
         int idx = offset + global_id;
         ray r = rays[idx];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -571,6 +727,8 @@ __global Intersection* hits // Hit datas
             // Write data back in case of a hit
             hits[idx] = isect;
         }
+
+        COUNTERS_STORE(idx)
     }
 }
 
@@ -579,13 +737,14 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAnyRC(
 // Input
 __global BvhNode const* nodes,   // BVH nodes
-__global float3 const* vertices, // Scene positional data
+__global float const* vertices, // Scene positional data
 __global Face const* faces,    // Scene indices
 __global ShapeData const* shapes,     // Shapes
 __global ray const* rays,        // Ray workload
 int offset,                // Offset in rays array
 __global int const* numrays,     // Number of rays in the workload
 __global int* hitresults   // Hit results
+    COUNTERS_ARGS
 )
 {
     int global_id = get_global_id(0);
@@ -605,11 +764,14 @@ __global int* hitresults   // Hit results
     {
         // Fetch ray
         ray r = rays[offset + global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
             // Calculate any intersection
             hitresults[offset + global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
         }
+
+        COUNTERS_STORE(offset + global_id)
     }
 }
\ No newline at end of file
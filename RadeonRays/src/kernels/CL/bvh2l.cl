@@ -42,6 +42,28 @@ TYPE DEFINITIONS
 
 
 
+// Compact per shape record, the last row of the transform is always (0, 0, 0, 1)
+typedef struct
+{
+    // World to object space transform rows
+    float4 m0;
+    float4 m1;
+    float4 m2;
+    int id;
+    int mask;
+    // Index of root bvh node
+    int bvhidx;
+    // Index into motion data, -1 for static shapes
+    int motionidx;
+} InstanceData;
+
+typedef struct
+{
+    float4 linearvelocity;
+    // Angular velocity (quaternion)
+    float4 angularvelocity;
+} InstanceMotion;
+
 #define STARTIDX(x)     (((int)(x->pmin.w)))
 #define SHAPEIDX(x)     (((int)(x.pmin.w)))
 #define LEAFNODE(x)     (((x).pmin.w) != -1.f)
@@ -51,16 +73,58 @@ typedef struct
     // BVH structure
     __global BvhNode*       nodes;
     // Scene positional data
-    __global float3*        vertices;
+    __global float const*         vertices;
     // Scene indices
     __global Face*          faces;
     // Transforms
-    __global ShapeData*     shapedata;
+    __global InstanceData*  shapedata;
     // Root BVH idx
     int rootidx;
+    // Top level bounds at the end of the shutter interval
+    __global BvhNode*       endnodes;
+    // Velocities of moving shapes
+    __global InstanceMotion* motiondata;
+    // Nonzero if any shape moves
+    int motion;
+    // Counters of the ray being traced by instrumented kernels
+    COUNTERS_FIELD
 } SceneData;
 
 
+/*************************************************************************
+MOTION BLUR FUNCTIONS
+**************************************************************************/
+// Shapes move over the unit time interval, top level nodes store bounds
+// at time 0 and endnodes at time 1
+BvhNode InterpolateTopNode(SceneData const* scenedata, int idx, BvhNode node, float t)
+{
+    BvhNode end = scenedata->endnodes[idx - scenedata->rootidx];
+    node.pmin.xyz = mix(node.pmin.xyz, end.pmin.xyz, t);
+    node.pmax.xyz = mix(node.pmax.xyz, end.pmax.xyz, t);
+    return node;
+}
+
+// Bring world space ray into shape object space at time t. The shape is translated
+// by linearvelocity in world space and rotated by angularvelocity around its
+// object space origin over the unit time interval.
+void TransformRayMotion(InstanceData const* shape, InstanceMotion const* motion, ray* r, float t)
+{
+    r->o.xyz -= motion->linearvelocity.xyz * t;
+
+    *r = transform_ray(*r, shape->m0, shape->m1, shape->m2, make_float4(0.f, 0.f, 0.f, 1.f));
+
+    float4 q = motion->angularvelocity;
+    float sqnorm = dot(q, q);
+
+    if (sqnorm > 0.f)
+    {
+        // Take the short way and interpolate from identity
+        q = (q.w < 0.f ? -q : q) / sqrt(sqnorm);
+        q = normalize(mix(make_float4(0.f, 0.f, 0.f, 1.f), q, t));
+        rotate_ray(r, q);
+    }
+}
+
 /*************************************************************************
 BVH FUNCTIONS
 **************************************************************************/
@@ -72,16 +136,13 @@ bool IntersectLeafClosest(
     Intersection* isect          // Intersection structure
 )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
     face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
-    if (IntersectTriangle(r, v1, v2, v3, isect))
+    COUNT_FACE(scenedata, &face)
+    if (IntersectFace(r, &face, scenedata->vertices, isect))
     {
         isect->primid = face.id;
         return true;
@@ -97,16 +158,13 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
 )
 {
-    float3 v1, v2, v3;
     Face face;
 
     int start = STARTIDX(node);
     face = scenedata->faces[start];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
-    if (IntersectTriangleP(r, v1, v2, v3))
+    COUNT_FACE(scenedata, &face)
+    if (IntersectFaceP(r, &face, scenedata->vertices))
     {
         return true;
     }
@@ -128,6 +186,8 @@ bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
     float3 invdirtop = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
     // We need to keep original ray around for returns from bottom hierarchy
     ray topray = *r;
+    // Ray time within the shutter interval
+    float time = clamp(Ray_GetTime(r), 0.f, 1.f);
 
     // Fetch top level BVH index
     int idx = scenedata->rootidx;
@@ -139,6 +199,13 @@ bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
     {
         // Try intersecting against current node's bounding box.
         BvhNode node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
+
+        // Top level bounds move with the shapes
+        if (topidx == -1 && scenedata->motion)
+        {
+            node = InterpolateTopNode(scenedata, idx, node, time);
+        }
         if (IntersectBox(r, invdir, node, isect->uvwt.w))
         {
             if (LEAFNODE(node))
@@ -164,29 +231,27 @@ bool IntersectSceneClosest2L(SceneData* scenedata, ray* r, Intersection* isect)
                     topidx = idx;
                     // Get shape descrition struct index
                     int shapeidx = SHAPEIDX(node);
-                    // Get shape mask
-                    int shapemask = scenedata->shapedata[shapeidx].mask;
+                    // Fetch shape description
+                    InstanceData shape = scenedata->shapedata[shapeidx];
                     // Drill into 2nd level BVH only if the geometry is not masked vs current ray
                     // otherwise skip the subtree
-                    if (Ray_GetMask(r) && shapemask)
+                    if (Ray_GetMask(r) && shape.mask)
                     {
                         // Fetch bottom level BVH index
-                        idx = scenedata->shapedata[shapeidx].bvhidx;
-                        shapeid = scenedata->shapedata[shapeidx].id;
-
-                        // Fetch BVH transform
-                        float4 wmi0 = scenedata->shapedata[shapeidx].m0;
-                        float4 wmi1 = scenedata->shapedata[shapeidx].m1;
-                        float4 wmi2 = scenedata->shapedata[shapeidx].m2;
-                        float4 wmi3 = scenedata->shapedata[shapeidx].m3;
-
-                        // Apply linear motion blur (world coordinates)
-                        //float4 lmv = scenedata->shapedata[shapeidx].linearvelocity;
-                        //float4 amv = scenedata->shapedata[SHAPEDATAIDX(node)].angularvelocity;
-                        //r->o.xyz -= (lmv.xyz*r->d.w);
-                        // Transfrom the ray
-                        *r = transform_ray(*r, wmi0, wmi1, wmi2, wmi3);
-                        // rotate_ray(r, amv);
+                        idx = shape.bvhidx;
+                        shapeid = shape.id;
+
+                        if (shape.motionidx >= 0)
+                        {
+                            // Transform the ray taking shape motion into account
+                            InstanceMotion motion = scenedata->motiondata[shape.motionidx];
+                            TransformRayMotion(&shape, &motion, r, time);
+                        }
+                        else
+                        {
+                            // Transfrom the ray
+                            *r = transform_ray(*r, shape.m0, shape.m1, shape.m2, make_float4(0.f, 0.f, 0.f, 1.f));
+                        }
                         // Recalc invdir
                         invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
                         // And continue traversal of the bottom level BVH
@@ -238,6 +303,8 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
     float3 invdirtop = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
     // We need to keep original ray around for returns from bottom hierarchy
     ray topray = *r;
+    // Ray time within the shutter interval
+    float time = clamp(Ray_GetTime(r), 0.f, 1.f);
 
     // Fetch top level BVH index
     int idx = scenedata->rootidx;
@@ -247,6 +314,13 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
     {
         // Try intersecting against current node's bounding box.
         BvhNode node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
+
+        // Top level bounds move with the shapes
+        if (topidx == -1 && scenedata->motion)
+        {
+            node = InterpolateTopNode(scenedata, idx, node, time);
+        }
         if (IntersectBox(r, invdir, node, r->o.w))
         {
             if (LEAFNODE(node))
@@ -269,28 +343,26 @@ bool IntersectSceneAny2L(SceneData* scenedata, ray* r)
                     // Get shape descrition struct index
                     int shapeidx = SHAPEIDX(node);
 
-                    // Get shape mask
-                    int shapemask = scenedata->shapedata[shapeidx].mask;
+                    // Fetch shape description
+                    InstanceData shape = scenedata->shapedata[shapeidx];
                     // Drill into 2nd level BVH only if the geometry is not masked vs current ray
                     // otherwise skip the subtree
-                    if (Ray_GetMask(r) && shapemask)
+                    if (Ray_GetMask(r) && shape.mask)
                     {
                         // Fetch bottom level BVH index
-                        idx = scenedata->shapedata[shapeidx].bvhidx;
-
-                        // Fetch BVH transform
-                        float4 wmi0 = scenedata->shapedata[shapeidx].m0;
-                        float4 wmi1 = scenedata->shapedata[shapeidx].m1;
-                        float4 wmi2 = scenedata->shapedata[shapeidx].m2;
-                        float4 wmi3 = scenedata->shapedata[shapeidx].m3;
-
-                        // Apply linear motion blur (world coordinates)
-                        //float4 lmv = scenedata->shapedata[shapeidx].linearvelocity;
-                        //float4 amv = scenedata->shapedata[SHAPEDATAIDX(node)].angularvelocity;
-                        //r->o.xyz -= (lmv.xyz*r->d.w);
-                        // Transfrom the ray
-                        *r = transform_ray(*r, wmi0, wmi1, wmi2, wmi3);
-                        //rotate_ray(r, amv);
+                        idx = shape.bvhidx;
+
+                        if (shape.motionidx >= 0)
+                        {
+                            // Transform the ray taking shape motion into account
+                            InstanceMotion motion = scenedata->motiondata[shape.motionidx];
+                            TransformRayMotion(&shape, &motion, r, time);
+                        }
+                        else
+                        {
+                            // Transfrom the ray
+                            *r = transform_ray(*r, shape.m0, shape.m1, shape.m2, make_float4(0.f, 0.f, 0.f, 1.f));
+                        }
                         // Recalc invdir
                         invdir = make_float3(1.f, 1.f, 1.f) / r->d.xyz;
                         // And continue traversal of the bottom level BVH
@@ -340,14 +412,18 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosest2L(
     // Input
     __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face* faces,    // Scene indices
-    __global ShapeData* shapedata, // Transforms
+    __global InstanceData* shapedata, // Transforms
     int rootidx,               // BVH root idx
     __global ray* rays,        // Ray workload
     int offset,                // Offset in rays array
     int numrays,               // Number of rays to process
-    __global Intersection* hits // Hit datas
+    __global Intersection* hits, // Hit datas
+    __global BvhNode* endnodes,  // Top level bounds at time 1
+    __global InstanceMotion* motiondata, // Velocities of moving shapes
+    int motion                   // Nonzero if any shape moves
+    COUNTERS_ARGS
 )
 {
 
@@ -360,7 +436,10 @@ __kernel void IntersectClosest2L(
         vertices,
         faces,
         shapedata,
-        rootidx
+        rootidx,
+        endnodes,
+        motiondata,
+        motion
     };
 
     // Handle only working subset
@@ -369,6 +448,7 @@ __kernel void IntersectClosest2L(
         // Fetch ray
         int idx = offset + global_id;
         ray r = rays[idx];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -379,6 +459,8 @@ __kernel void IntersectClosest2L(
             // Write data back in case of a hit
             hits[idx] = isect;
         }
+
+        COUNTERS_STORE(idx)
     }
 }
 
@@ -386,14 +468,18 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAny2L(
     // Input
     __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face* faces,    // Scene indices
-    __global ShapeData* shapedata, // Transforms
+    __global InstanceData* shapedata, // Transforms
     int rootidx,               // BVH root idx
     __global ray* rays,        // Ray workload
     int offset,                // Offset in rays array
     int numrays,               // Number of rays to process
-    __global int* hitresults   // Hit results
+    __global int* hitresults,  // Hit results
+    __global BvhNode* endnodes,  // Top level bounds at time 1
+    __global InstanceMotion* motiondata, // Velocities of moving shapes
+    int motion                   // Nonzero if any shape moves
+    COUNTERS_ARGS
 )
 {
     int global_id = get_global_id(0);
@@ -405,7 +491,10 @@ __kernel void IntersectAny2L(
         vertices,
         faces,
         shapedata,
-        rootidx
+        rootidx,
+        endnodes,
+        motiondata,
+        motion
     };
 
     // Handle only working subset
@@ -413,12 +502,15 @@ __kernel void IntersectAny2L(
     {
         // Fetch ray
         ray r = rays[offset + global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
             // Calculate any intersection
             hitresults[offset + global_id] = IntersectSceneAny2L(&scenedata, &r) ? 1 : -1;
         }
+
+        COUNTERS_STORE(offset + global_id)
     }
 }
 
@@ -427,14 +519,18 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosestRC2L(
     // Input
     __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face* faces,    // Scene indices
-    __global ShapeData* shapedata, // Transforms
+    __global InstanceData* shapedata, // Transforms
     int rootidx,               // BVH root idx
     __global ray* rays,        // Ray workload
     __global int* numrays,     // Number of rays in the workload
     int offset,                // Offset in rays array
-    __global Intersection* hits // Hit datas
+    __global Intersection* hits, // Hit datas
+    __global BvhNode* endnodes,  // Top level bounds at time 1
+    __global InstanceMotion* motiondata, // Velocities of moving shapes
+    int motion                   // Nonzero if any shape moves
+    COUNTERS_ARGS
 )
 {
     int global_id = get_global_id(0);
@@ -446,7 +542,10 @@ __kernel void IntersectClosestRC2L(
         vertices,
         faces,
         shapedata,
-        rootidx
+        rootidx,
+        endnodes,
+        motiondata,
+        motion
     };
 
     // Handle only working subset
@@ -455,6 +554,7 @@ __kernel void IntersectClosestRC2L(
         // Fetch ray
         int idx = offset + global_id;
         ray r = rays[idx];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -464,6 +564,8 @@ __kernel void IntersectClosestRC2L(
 
             hits[idx] = isect;
         }
+
+        COUNTERS_STORE(idx)
     }
 }
 
@@ -472,14 +574,18 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAnyRC2L(
     // Input
     __global BvhNode* nodes,   // BVH nodes
-    __global float3* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face* faces,    // Scene indices
-    __global ShapeData* shapedata, // Transforms
+    __global InstanceData* shapedata, // Transforms
     int rootidx,               // BVH root idx
     __global ray* rays,        // Ray workload
     __global int* numrays,     // Number of rays in the workload
     int offset,                // Offset in rays array
-    __global int* hitresults   // Hit results
+    __global int* hitresults,  // Hit results
+    __global BvhNode* endnodes,  // Top level bounds at time 1
+    __global InstanceMotion* motiondata, // Velocities of moving shapes
+    int motion                   // Nonzero if any shape moves
+    COUNTERS_ARGS
 )
 {
     int global_id = get_global_id(0);
@@ -491,7 +597,10 @@ __kernel void IntersectAnyRC2L(
         vertices,
         faces,
         shapedata,
-        rootidx
+        rootidx,
+        endnodes,
+        motiondata,
+        motion
     };
 
     // Handle only working subset
@@ -499,11 +608,14 @@ __kernel void IntersectAnyRC2L(
     {
         // Fetch ray
         ray r = rays[offset + global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
             // Calculate any intersection
             hitresults[offset + global_id] = IntersectSceneAny2L(&scenedata, &r) ? 1 : -1;
         }
+
+        COUNTERS_STORE(offset + global_id)
     }
 }
\ No newline at end of file
@@ -72,12 +72,41 @@ typedef struct _Face
     int shapeidx;
     // Primitive ID
     int id;
-    // Idx count
+    // Idx count, 4 for quads
     int cnt;
+    // Fourth vertex index of quads
+    int idx3;
 
-    int2 padding;
+    int padding;
 } Face;
 
+// Instrumented kernels count the work done for every ray. The counters live in
+// private memory during traversal, SceneData points to them and the kernels
+// store them to the side buffer indexed like the rays if countersenabled != 0.
+#ifdef RR_TRAVERSAL_COUNTERS
+typedef struct _TraversalCounters
+{
+    // BVH nodes fetched
+    int nodes;
+    // Ray-triangle tests, quads count twice
+    int primitives;
+} TraversalCounters;
+
+#define COUNTERS_ARGS                   , __global TraversalCounters* counters, int countersenabled
+#define COUNTERS_FIELD                  TraversalCounters* counters;
+#define COUNTERS_BEGIN(scenedata)       TraversalCounters raycounters = { 0, 0 }; (scenedata).counters = &raycounters;
+#define COUNTERS_STORE(idx)             if (countersenabled) counters[idx] = raycounters;
+#define COUNT_NODE(scenedata)           ++(scenedata)->counters->nodes;
+#define COUNT_FACE(scenedata, face)     (scenedata)->counters->primitives += ((face)->cnt == 4 ? 2 : 1);
+#else
+#define COUNTERS_ARGS
+#define COUNTERS_FIELD
+#define COUNTERS_BEGIN(scenedata)
+#define COUNTERS_STORE(idx)
+#define COUNT_NODE(scenedata)
+#define COUNT_FACE(scenedata, face)
+#endif
+
 #ifndef APPLE
 
 float4 make_float4(float x, float y, float z, float w)
@@ -240,6 +269,62 @@ int IntersectTriangleP(ray const* r, float3 v1, float3 v2, float3 v3)
     return 1;
 }
 
+// Quads are tested as triangles (v1, v2, v3) and (v1, v3, v4). The hit uv is mapped
+// to the quad parametrization: v1 at (0, 0), v2 at (1, 0), v3 at (1, 1), v4 at (0, 1)
+int IntersectQuad(ray const* r, float3 v1, float3 v2, float3 v3, float3 v4, Intersection* isect)
+{
+    int hit = 0;
+
+    if (IntersectTriangle(r, v1, v2, v3, isect))
+    {
+        isect->uvwt.x += isect->uvwt.y;
+        hit = 1;
+    }
+
+    // Non planar quads might be hit by both halves, the closer one wins
+    if (IntersectTriangle(r, v1, v3, v4, isect))
+    {
+        isect->uvwt.y += isect->uvwt.x;
+        hit = 1;
+    }
+
+    return hit;
+}
+
+int IntersectQuadP(ray const* r, float3 v1, float3 v2, float3 v3, float3 v4)
+{
+    return IntersectTriangleP(r, v1, v2, v3) || IntersectTriangleP(r, v1, v3, v4);
+}
+
+// Intersect a triangle or quad face
+int IntersectFace(ray const* r, Face const* face, __global float const* vertices, Intersection* isect)
+{
+    const float3 v1 = vload3(face->idx[0], vertices);
+    const float3 v2 = vload3(face->idx[1], vertices);
+    const float3 v3 = vload3(face->idx[2], vertices);
+
+    if (face->cnt == 4)
+    {
+        return IntersectQuad(r, v1, v2, v3, vload3(face->idx3, vertices), isect);
+    }
+
+    return IntersectTriangle(r, v1, v2, v3, isect);
+}
+
+int IntersectFaceP(ray const* r, Face const* face, __global float const* vertices)
+{
+    const float3 v1 = vload3(face->idx[0], vertices);
+    const float3 v2 = vload3(face->idx[1], vertices);
+    const float3 v3 = vload3(face->idx[2], vertices);
+
+    if (face->cnt == 4)
+    {
+        return IntersectQuadP(r, v1, v2, v3, vload3(face->idx3, vertices));
+    }
+
+    return IntersectTriangleP(r, v1, v2, v3);
+}
+
 #ifdef AMD_MEDIA_OPS
 #pragma OPENCL EXTENSION cl_amd_media_ops2 : enable
 #endif
@@ -49,13 +49,15 @@ typedef struct
     // BVH structure
     __global FatBvhNode const*     nodes;
     // Scene positional data
-    __global float3 const*         vertices;
+    __global float const*          vertices;
     // Scene indices
     __global Face const*         faces;
     // Shape IDs
     __global ShapeData const*     shapes;
     // Extra data
     __global int const*             extra;
+    // Counters of the ray being traced by instrumented kernels
+    COUNTERS_FIELD
 } SceneData;
 
 /*************************************************************************
@@ -75,13 +77,9 @@ void IntersectLeafClosest(
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     face = scenedata->faces[faceidx];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
 #ifdef RR_RAY_MASK
     int shapemask = scenedata->shapes[face.shapeidx].mask;
@@ -89,7 +87,8 @@ void IntersectLeafClosest(
     if (Ray_GetMask(r) & shapemask)
 #endif
     {
-        if (IntersectTriangle(r, v1, v2, v3, isect))
+        COUNT_FACE(scenedata, &face)
+        if (IntersectFace(r, &face, scenedata->vertices, isect))
         {
             isect->primid = face.id;
             isect->shapeid = scenedata->shapes[face.shapeidx].id;
@@ -104,13 +103,9 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     face = scenedata->faces[faceidx];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
 #ifdef RR_RAY_MASK
     int shapemask = scenedata->shapes[face.shapeidx].mask;
@@ -118,7 +113,8 @@ bool IntersectLeafAny(
     if (Ray_GetMask(r) & shapemask)
 #endif
     {
-        if (IntersectTriangleP(r, v1, v2, v3))
+        COUNT_FACE(scenedata, &face)
+        if (IntersectFaceP(r, &face, scenedata->vertices))
         {
             return true;
         }
@@ -160,6 +156,7 @@ bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersectio
         while (idx > -1)
         {
             node = scenedata->nodes[idx];
+            COUNT_NODE(scenedata)
 
             leftleaf = LEAFNODE(node.lbound);
             rightleaf = LEAFNODE(node.rbound);
@@ -268,6 +265,7 @@ bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersectio
     while (idx > -1)
     {
         node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
 
         leftleaf = LEAFNODE(node.lbound);
         rightleaf = LEAFNODE(node.rbound);
@@ -348,6 +346,7 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r, __global int* s
         while (idx > -1)
         {
             node = scenedata->nodes[idx];
+            COUNT_NODE(scenedata)
 
             leftleaf = LEAFNODE(node.lbound);
             rightleaf = LEAFNODE(node.rbound);
@@ -456,6 +455,7 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r)
     while (idx > -1)
     {
         node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
 
         leftleaf = LEAFNODE(node.lbound);
         rightleaf = LEAFNODE(node.rbound);
@@ -519,7 +519,7 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectClosest(
     // Input
     __global FatBvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,    // Scene indices
     __global ShapeData const* shapes, // Shape data
     __global ray const* rays,        // Ray workload
@@ -527,6 +527,7 @@ __kernel void IntersectClosest(
     int numrays,               // Number of rays to process
     __global Intersection* hits // Hit datas
     , __global int* stack
+    COUNTERS_ARGS
     )
 {
     __local int ldsstack[SHORT_STACK_SIZE * 64];
@@ -549,6 +550,7 @@ __kernel void IntersectClosest(
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
         
         if (Ray_IsActive(&r))
         {
@@ -563,6 +565,8 @@ __kernel void IntersectClosest(
             // Write data back in case of a hit
             hits[global_id] = isect;
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
 
@@ -570,7 +574,7 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAny(
     // Input
     __global FatBvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,    // Scene indices
     __global ShapeData const* shapes,     // Shape data
     __global ray const* rays,        // Ray workload
@@ -578,6 +582,7 @@ __kernel void IntersectAny(
     int numrays,               // Number of rays to process                    
     __global int* hitresults  // Hit results
     , __global int* stack
+    COUNTERS_ARGS
     )
 {
 
@@ -600,6 +605,7 @@ __kernel void IntersectAny(
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -610,6 +616,8 @@ __kernel void IntersectAny(
             hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
 #endif
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
 
@@ -617,7 +625,7 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 // Version with range check
 __kernel void IntersectClosestRC(
     __global FatBvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,      // Scene indices
     __global ShapeData const* shapes,     // Shape data
     __global ray const* rays,        // Ray workload
@@ -625,6 +633,7 @@ __kernel void IntersectClosestRC(
     __global int const* numrays,     // Number of rays in the workload
     __global Intersection* hits // Hit datas
     , __global int* stack
+    COUNTERS_ARGS
     )
 {
     __local int ldsstack[SHORT_STACK_SIZE * 64];
@@ -648,6 +657,7 @@ __kernel void IntersectClosestRC(
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -661,6 +671,8 @@ __kernel void IntersectClosestRC(
             // Write data back in case of a hit
             hits[global_id] = isect;
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
 
@@ -669,7 +681,7 @@ __attribute__((reqd_work_group_size(64, 1, 1)))
 __kernel void IntersectAnyRC(
     // Input
     __global FatBvhNode const* nodes,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,    // Scene indices
     __global ShapeData const* shapes,     // Shape data
     __global ray const* rays,        // Ray workload
@@ -677,6 +689,7 @@ __kernel void IntersectAnyRC(
     __global int const* numrays,     // Number of rays in the workload
     __global int* hitresults   // Hit results
     , __global int* stack
+    COUNTERS_ARGS
     )
 {
     __local int ldsstack[SHORT_STACK_SIZE * 64];
@@ -699,6 +712,7 @@ __kernel void IntersectAnyRC(
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -709,5 +723,7 @@ __kernel void IntersectAnyRC(
             hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
 #endif
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
@@ -136,7 +136,7 @@ bool IntersectVoxelClosest(
         }
         else if (face.cnt == 4)
         {
-            v2 = scenedata->vertices[face.idx[3]];
+            v2 = scenedata->vertices[face.idx3];
             if (IntersectTriangle(r, v3, v2, v1, isect))
             {
                 isect->primid = face.id;
@@ -175,7 +175,7 @@ bool IntersectVoxelAny(
         }
         else if (face.cnt == 4)
         {
-            v2 = scenedata->vertices[face.idx[3]];
+            v2 = scenedata->vertices[face.idx3];
             if (IntersectTriangleP(r, v3, v2, v1))
             {
                 return true;
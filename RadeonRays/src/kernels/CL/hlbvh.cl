@@ -54,13 +54,15 @@ typedef struct
     // Scene bounds
     __global bbox const* bounds;
     // Scene positional data
-    __global float3 const* vertices;
+    __global float const* vertices;
     // Scene indices
     __global Face const* faces;
     // Shape IDs
     __global ShapeData const* shapes;
     // Extra data
     __global int const* extra;
+    // Counters of the ray being traced by instrumented kernels
+    COUNTERS_FIELD
 } SceneData;
 
 /*************************************************************************
@@ -80,13 +82,9 @@ bool IntersectLeafClosest(
     Intersection* isect          // Intersection structure
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     face = scenedata->faces[faceidx];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
 #ifdef RR_RAY_MASK
     int shapemask = scenedata->shapes[face.shapeidx].mask;
@@ -94,7 +92,8 @@ bool IntersectLeafClosest(
     if (Ray_GetMask(r) & shapemask)
 #endif
     {
-        if (IntersectTriangle(r, v1, v2, v3, isect))
+        COUNT_FACE(scenedata, &face)
+        if (IntersectFace(r, &face, scenedata->vertices, isect))
         {
             isect->primid = face.id;
             isect->shapeid = scenedata->shapes[face.shapeidx].id;
@@ -112,13 +111,9 @@ bool IntersectLeafAny(
     ray const* r                      // ray to instersect
     )
 {
-    float3 v1, v2, v3;
     Face face;
 
     face = scenedata->faces[faceidx];
-    v1 = scenedata->vertices[face.idx[0]];
-    v2 = scenedata->vertices[face.idx[1]];
-    v3 = scenedata->vertices[face.idx[2]];
 
 #ifdef RR_RAY_MASK
     int shapemask = scenedata->shapes[face.shapeidx].mask;
@@ -126,7 +121,8 @@ bool IntersectLeafAny(
     if (Ray_GetMask(r) & shapemask)
 #endif
     {
-        if (IntersectTriangleP(r, v1, v2, v3))
+        COUNT_FACE(scenedata, &face)
+        if (IntersectFaceP(r, &face, scenedata->vertices))
         {
             return true;
         }
@@ -164,6 +160,7 @@ bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersectio
     while (idx > -1)
     {
         node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
 
         if (LEAFNODE(node))
         {
@@ -258,6 +255,7 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r)
             return false;
 
         node = scenedata->nodes[idx];
+        COUNT_NODE(scenedata)
 
         if (LEAFNODE(node))
         {
@@ -344,6 +342,7 @@ bool IntersectSceneClosest(SceneData const* scenedata, ray const* r, Intersectio
         while (idx > -1)
         {
             node = scenedata->nodes[idx];
+            COUNT_NODE(scenedata)
 
             if (LEAFNODE(node))
             {
@@ -448,6 +447,7 @@ bool IntersectSceneAny(SceneData const* scenedata, ray const* r, __global int* s
         while (idx > -1)
         {
             node = scenedata->nodes[idx];
+            COUNT_NODE(scenedata)
 
             if (LEAFNODE(node))
             {
@@ -533,7 +533,7 @@ __kernel void IntersectClosest(
     // Input
     __global HlbvhNode const* nodes,   // BVH nodes
     __global bbox const* bounds,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,    // Scene indices
     __global ShapeData const* shapes, // Shape data
     __global ray const* rays,        // Ray workload
@@ -541,6 +541,7 @@ __kernel void IntersectClosest(
     int numrays,               // Number of rays to process
     __global Intersection* hits // Hit datas
     , __global int* stack
+    COUNTERS_ARGS
     )
 {
 #ifndef LDS_BUG
@@ -566,6 +567,7 @@ __kernel void IntersectClosest(
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -579,6 +581,8 @@ __kernel void IntersectClosest(
             // Write data back in case of a hit
             hits[global_id] = isect;
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
 
@@ -588,7 +592,7 @@ __kernel void IntersectAny(
     // Input
     __global HlbvhNode const* nodes,   // BVH nodes
     __global bbox const* bounds,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,    // Scene indices
     __global ShapeData const* shapes,     // Shape data
     __global ray const* rays,        // Ray workload
@@ -596,6 +600,7 @@ __kernel void IntersectAny(
     int numrays,               // Number of rays to process                    
     __global int* hitresults  // Hit results
     , __global int* stack
+    COUNTERS_ARGS
     )
 {
 
@@ -622,6 +627,7 @@ __kernel void IntersectAny(
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -632,6 +638,8 @@ __kernel void IntersectAny(
             hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
 #endif
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
 
@@ -641,7 +649,7 @@ __kernel void IntersectClosestRC(
     // Input
     __global HlbvhNode const* nodes,   // BVH nodes
     __global bbox const* bounds,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,      // Scene indices
     __global ShapeData const* shapes,     // Shape data
     __global ray const* rays,        // Ray workload
@@ -649,6 +657,7 @@ __kernel void IntersectClosestRC(
     __global int const* numrays,     // Number of rays in the workload
     __global Intersection* hits // Hit datas
     , __global int* stack
+    COUNTERS_ARGS
     )
 {
 #ifndef LDS_BUG
@@ -675,6 +684,7 @@ __kernel void IntersectClosestRC(
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -689,6 +699,8 @@ __kernel void IntersectClosestRC(
             // Write data back in case of a hit
             hits[global_id] = isect;
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
 
@@ -698,7 +710,7 @@ __kernel void IntersectAnyRC(
     // Input
     __global HlbvhNode const* nodes,   // BVH nodes
     __global bbox const* bounds,   // BVH nodes
-    __global float3 const* vertices, // Scene positional data
+    __global float const* vertices, // Scene positional data
     __global Face const* faces,    // Scene indices
     __global ShapeData const* shapes,     // Shape data
     __global ray const* rays,        // Ray workload
@@ -706,6 +718,7 @@ __kernel void IntersectAnyRC(
     __global int const* numrays,     // Number of rays in the workload
     __global int* hitresults   // Hit results
     , __global int* stack
+    COUNTERS_ARGS
     )
 {
 #ifndef LDS_BUG
@@ -731,6 +744,7 @@ __kernel void IntersectAnyRC(
     {
         // Fetch ray
         ray r = rays[global_id];
+        COUNTERS_BEGIN(scenedata)
 
         if (Ray_IsActive(&r))
         {
@@ -741,5 +755,7 @@ __kernel void IntersectAnyRC(
             hitresults[global_id] = IntersectSceneAny(&scenedata, &r) ? 1 : -1;
 #endif
         }
+
+        COUNTERS_STORE(global_id)
     }
 }
\ No newline at end of file
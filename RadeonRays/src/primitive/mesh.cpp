@@ -22,38 +22,57 @@ THE SOFTWARE.
 #include "mesh.h"
 
 #include "../except/except.h"
+#include "../async/task_scheduler.h"
 
 #include <algorithm>
+#include <atomic>
 #include <functional>
 
 namespace RadeonRays
 {
+    // Source of mesh creation stamps
+    static std::atomic<std::uint64_t> g_next_stamp(0);
+
     Mesh::Mesh(float const* vertices, int vnum, int vstride,
         int const* vidx, int vistride,
         int const* nfaceverts,
-        int nfaces)
-        : puretriangle_(true)
+        int nfaces,
+        bool reference)
+        : vertexdata_(nullptr)
+        , vertexstride_(0)
+        , numvertices_(vnum)
+        , indexdata_(nullptr)
+        , indexstride_(0)
+        , numfaces_(nfaces)
+        , puretriangle_(true)
+        , stamp_(g_next_stamp++)
     {
-        // Handle vertices
-        // Allocate space in advance
-        vertices_.resize(vnum);
         // Calculate vertex stride, assume dense packing if non passed
         vstride = (vstride == 0) ? (3 * sizeof(float)) : vstride;
-        // Allocate space for faces
-        faces_.resize(nfaces);
 
-        // Load vertices
-#pragma omp parallel for
-        for (int i = 0; i < vnum; ++i)
+        // Handle vertices
+        if (reference)
+        {
+            vertexdata_ = reinterpret_cast<char const*>(vertices);
+            vertexstride_ = vstride;
+        }
+        else
         {
-            float const* current = (float const*)((char*)vertices + i*vstride);
+            // Allocate space in advance
+            vertices_.resize(vnum);
+
+            // Load vertices
+            ParallelFor(0, vnum, [&](int i)
+            {
+                float const* current = (float const*)((char*)vertices + i*vstride);
 
-            float3 temp;
-            temp.x = current[0];
-            temp.y = current[1];
-            temp.z = current[2];
+                vertices_[i].x = current[0];
+                vertices_[i].y = current[1];
+                vertices_[i].z = current[2];
+            });
 
-            vertices_[i] = temp;
+            vertexdata_ = reinterpret_cast<char const*>(vertices_.data());
+            vertexstride_ = sizeof(PackedVertex);
         }
 
         // If mesh consists of triangles only apply parallel loading
@@ -63,65 +82,89 @@ namespace RadeonRays
 
             int istride = (vistride == 0) ? (3 * sizeof(int)) : vistride;
 
-#pragma omp parallel for
-            for (int i = 0; i < nfaces; ++i)
+            // Triangles are decoded from the indices on access
+            if (reference)
+            {
+                indexdata_ = reinterpret_cast<char const*>(vidx);
+                indexstride_ = istride;
+                return;
+            }
+
+            // Allocate space for faces
+            faces_.resize(nfaces);
+
+            ParallelFor(0, nfaces, [&](int i)
             {
                 faces_[i].i0 = *((int const*)((char const*)vidx + i * istride));
                 faces_[i].i1 = *((int const*)((char const*)vidx + i * istride + sizeof(int)));
                 faces_[i].i2 = *((int const*)((char const*)vidx + i * istride + 2 * sizeof(int)));
+                faces_[i].i3 = 0;
                 faces_[i].type_ = FaceType::TRIANGLE;
-            }
+            });
         }
-        // Otherwise execute serially
+        // Otherwise find out where each face starts and load them in parallel as well
         else
         {
-            char const* vidxptr = (char const*)vidx;
+            std::vector<std::size_t> offsets(nfaces);
+            std::size_t offset = 0;
 
             for (int i = 0; i < nfaces; ++i)
             {
-                // Triangle case
-                if (nfaceverts[i] == 3)
+                if (nfaceverts[i] != 3 && nfaceverts[i] != 4)
                 {
-                    faces_[i].i0 = *((int const*)(vidxptr));
-                    faces_[i].i1 = *((int const*)(vidxptr + sizeof(int)));
-                    faces_[i].i2 = *((int const*)(vidxptr + 2 * sizeof(int)));
-                    faces_[i].type_ = FaceType::TRIANGLE;
+                    throw ExceptionImpl("Wrong number of vertices per face");
+                }
 
-                    // Goto next primitive
-                    vidxptr += (vistride == 0) ? (3 * sizeof(int)) : vistride;
+                offsets[i] = offset;
+                offset += (vistride == 0) ? (nfaceverts[i] * sizeof(int)) : vistride;
+
+                if (nfaceverts[i] == 4)
+                {
+                    puretriangle_ = false;
                 }
+            }
+
+            // Allocate space for faces
+            faces_.resize(nfaces);
+
+            char const* vidxptr = (char const*)vidx;
+
+            ParallelFor(0, nfaces, [&](int i)
+            {
+                int const* current = (int const*)(vidxptr + offsets[i]);
+
+                faces_[i].i0 = current[0];
+                faces_[i].i1 = current[1];
+                faces_[i].i2 = current[2];
+
                 // Quad case
-                else if (nfaceverts[i] == 4)
+                if (nfaceverts[i] == 4)
                 {
-                    faces_[i].i0 = *((int const*)(vidxptr));
-                    faces_[i].i1 = *((int const*)(vidxptr + sizeof(int)));
-                    faces_[i].i2 = *((int const*)(vidxptr + 2 * sizeof(int)));
-                    faces_[i].i3 = *((int const*)(vidxptr + 3 * sizeof(int)));
+                    faces_[i].i3 = current[3];
                     faces_[i].type_ = FaceType::QUAD;
-
-                    puretriangle_ = false;
-
-                    // Goto next primitive
-                    vidxptr += (vistride == 0) ? (4 * sizeof(int)) : vistride;
                 }
+                // Triangle case
                 else
                 {
-                    throw ExceptionImpl("Wrong number of vertices per face");
+                    faces_[i].i3 = 0;
+                    faces_[i].type_ = FaceType::TRIANGLE;
                 }
-            }
+            });
         }
     }
 
     int Mesh::GetTransformedFace(int const faceidx, matrix const & transform, float3* outverts) const
     {
+        Face const face = GetFace(faceidx);
+
         // origin code special cased identity matrix. TODO check speed regressions
-        outverts[0] = transform_point(vertices_[faces_[faceidx].i0], transform);
-        outverts[1] = transform_point(vertices_[faces_[faceidx].i1], transform);
-        outverts[2] = transform_point(vertices_[faces_[faceidx].i2], transform);
+        outverts[0] = transform_point(GetVertex(face.i0), transform);
+        outverts[1] = transform_point(GetVertex(face.i1), transform);
+        outverts[2] = transform_point(GetVertex(face.i2), transform);
 
-        if (faces_[faceidx].type_ == FaceType::QUAD)
+        if (face.type_ == FaceType::QUAD)
         {
-            outverts[3] = transform_point(vertices_[faces_[faceidx].i3], transform);
+            outverts[3] = transform_point(GetVertex(face.i3), transform);
             return 4;
         } else
         {
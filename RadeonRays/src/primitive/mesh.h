@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include <vector>
 #include <memory>
 #include <cassert>
+#include <cstdint>
 
 #include "shapeimpl.h"
 #include "math/bbox.h"
@@ -33,6 +34,19 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
+    ///< Vertex position without the padding of float3. Meshes and
+    ///< device vertex buffers store 12 bytes per vertex.
+    ///<
+    struct PackedVertex
+    {
+        PackedVertex() = default;
+        PackedVertex(float3 const& v) : x(v.x), y(v.y), z(v.z) {}
+
+        float x, y, z;
+    };
+
+    static_assert(sizeof(PackedVertex) == 3 * sizeof(float), "PackedVertex must be tightly packed");
+
     ///< Transformable primitive implementation which represents
     ///< triangle mesh. Vertices, normals and uvs are indixed separately
     ///< using their own index buffers each.
@@ -63,11 +77,13 @@ namespace RadeonRays
             FaceType type_;
         };
 
-        //
+        // If reference is true vertex data (and index data of pure triangle meshes)
+        // is used in place and has to stay valid and unchanged for the mesh lifetime
         Mesh(float const* vertices, int vnum, int vstride,
             int const* vidx, int vistride,
             int const* nfaceverts,
-            int nfaces);
+            int nfaces,
+            bool reference = false);
         
         //
         ~Mesh();
@@ -77,12 +93,14 @@ namespace RadeonRays
         int num_vertices() const;
         // 
         void GetFaceBounds(int faceidx, bool objectspace, bbox& bounds) const;
+        // Object space vertex position
+        float3 GetVertex(int vertexidx) const;
         //
-        float3 const* GetVertexData() const { return &vertices_[0]; }
-        //
-        Face const* GetFaceData() const { return &faces_[0]; }
+        Face GetFace(int faceidx) const;
         // True if the mesh consists of triangles only
         bool puretriangle() const { return puretriangle_;  }
+        // Unique creation stamp, tells apart a mesh allocated at the address of a deleted one
+        std::uint64_t stamp() const { return stamp_; }
 
     private:
         /// Disallow to copy meshes, too heavy
@@ -92,24 +110,58 @@ namespace RadeonRays
         // transforms face vertices, outverts but be at least 4 float3 in size, no of vertices in face returned
         int GetTransformedFace(int const faceidx, matrix const & transform, float3* outverts) const;
 
-        /// Vertices
-        std::vector<float3> vertices_;
-        /// Primitives
+        /// Vertices, empty if referenced
+        std::vector<PackedVertex> vertices_;
+        /// Primitives, empty if referenced
         std::vector<Face> faces_;
+        /// Vertex positions either in vertices_ or in caller memory
+        char const* vertexdata_;
+        int vertexstride_;
+        int numvertices_;
+        /// Referenced triangle indices
+        char const* indexdata_;
+        int indexstride_;
+        int numfaces_;
         /// Pure triangle flag
         bool puretriangle_;
+        /// Creation stamp
+        std::uint64_t stamp_;
     };
 
     //
     inline int Mesh::num_faces() const
     {
-        return (int)faces_.size();
+        return numfaces_;
     }
 
     //
     inline int Mesh::num_vertices() const
     {
-        return (int)vertices_.size();
+        return numvertices_;
+    }
+
+    inline float3 Mesh::GetVertex(int vertexidx) const
+    {
+        float const* v = reinterpret_cast<float const*>(vertexdata_ + (std::size_t)vertexidx * vertexstride_);
+        return float3(v[0], v[1], v[2]);
+    }
+
+    inline Mesh::Face Mesh::GetFace(int faceidx) const
+    {
+        if (!indexdata_)
+        {
+            return faces_[faceidx];
+        }
+
+        int const* idx = reinterpret_cast<int const*>(indexdata_ + (std::size_t)faceidx * indexstride_);
+
+        Face face;
+        face.i0 = idx[0];
+        face.i1 = idx[1];
+        face.i2 = idx[2];
+        face.i3 = 0;
+        face.type_ = FaceType::TRIANGLE;
+        return face;
     }
 }
 
@@ -25,6 +25,7 @@ THE SOFTWARE.
 #include "radeon_rays.h"
 #include "math/float3.h"
 #include "math/matrix.h"
+#include "../world/world.h"
 
 namespace RadeonRays
 {
@@ -41,7 +42,10 @@ namespace RadeonRays
             kStateChangeTransform = 0x1,
             kStateChangeMotion = 0x2,
             kStateChangeId = 0x4,
-            kStateChangeMask = 0x5
+            kStateChangeMask = 0x8,
+            // Only used in World change records
+            kStateChangeAdded = 0x10,
+            kStateChangeRemoved = 0x20
         };
         
         // Constructor
@@ -54,35 +58,41 @@ namespace RadeonRays
         virtual bool is_instance() const;
 
         // World space transform
-        void SetTransform(matrix const& m, matrix const& minv) override;
+        void SetTransform(matrix const& m, matrix const& minv) final;
         
         // Get world space matrix along with its inverse
-        void GetTransform(matrix& m, matrix& minv) const override;
+        void GetTransform(matrix& m, matrix& minv) const final;
         
         // Motion blur
-        void SetLinearVelocity(float3 const& v) override;
+        void SetLinearVelocity(float3 const& v) final;
         
         // Get linear motion
-        float3 GetLinearVelocity() const override;
+        float3 GetLinearVelocity() const final;
         
         // Set angular motion for motion blur
-        void SetAngularVelocity(quaternion const& q) override;
+        void SetAngularVelocity(quaternion const& q) final;
         
         // Get angular motion
-        quaternion GetAngularVelocity() const override;
+        quaternion GetAngularVelocity() const final;
         
         // ID of a shape
-        void SetId(Id id) override;
+        void SetId(Id id) final;
         
         // Get ID
-        Id GetId() const override;
+        Id GetId() const final;
 
         // Set intersection mask 
-        void SetMask(int mask) override;
+        void SetMask(int mask) final;
 
         // Get intersection mask
-        int  GetMask() const override;
+        int  GetMask() const final;
         
+        // Get world space matrix without copying
+        matrix const& GetWorldMatrix() const;
+
+        // Get inverse world space matrix without copying
+        matrix const& GetWorldMatrixInverse() const;
+
         // Get state changes since last OnCommit
         int GetStateChange() const;
 
@@ -90,6 +100,11 @@ namespace RadeonRays
         void OnCommit() const;
         
     protected:
+        // Set state change flags reporting the first change since commit to the world
+        void MarkChanged(int flags);
+
+        friend class World;
+
         // World transform
         matrix worldmat_;
         matrix worldmatinv_;
@@ -100,22 +115,52 @@ namespace RadeonRays
         Id id_;
         // State change
         mutable int statechange_;
+        // World the shape is attached to, its index in World::shapes_
+        // and the commit it has been attached during
+        mutable World* world_;
+        mutable std::size_t worldindex_;
+        mutable std::uint64_t worldepoch_;
+        // Positions in World::shapes_added_ and World::shapes_dirty_, only valid while listed there
+        mutable std::size_t addedindex_;
+        mutable std::size_t dirtyindex_;
     };
 
     inline ShapeImpl::ShapeImpl()
+        : statechange_(kStateChangeNone)
+        , world_(nullptr)
+        , worldindex_(0)
+        , worldepoch_(0)
+        , addedindex_(0)
+        , dirtyindex_(0)
     {
         SetMask(0xFFFFFFFF);
     }
 
     inline ShapeImpl::~ShapeImpl()
     {
+        // Do not leave a dangling pointer in the scene
+        if (world_)
+        {
+            world_->DetachShape(this);
+        }
+    }
+
+    inline void ShapeImpl::MarkChanged(int flags)
+    {
+        int prev = statechange_;
+        statechange_ |= flags;
+
+        if (prev == kStateChangeNone && world_)
+        {
+            world_->OnShapeChanged(this);
+        }
     }
     
     inline void ShapeImpl::SetTransform(matrix const& m, matrix const& minv)
     {
         worldmat_ = m;
         worldmatinv_ = minv;
-        statechange_ |= kStateChangeTransform;
+        MarkChanged(kStateChangeTransform);
     }
     
     inline void ShapeImpl::GetTransform(matrix& m, matrix& minv) const
@@ -124,10 +169,20 @@ namespace RadeonRays
         minv = worldmatinv_;
     }
     
+    inline matrix const& ShapeImpl::GetWorldMatrix() const
+    {
+        return worldmat_;
+    }
+
+    inline matrix const& ShapeImpl::GetWorldMatrixInverse() const
+    {
+        return worldmatinv_;
+    }
+    
     inline void ShapeImpl::SetLinearVelocity(float3 const& v)
     {
         linearmotion_ = v;
-        statechange_ |= kStateChangeMotion;
+        MarkChanged(kStateChangeMotion);
     }
     
     inline float3 ShapeImpl::GetLinearVelocity() const
@@ -138,7 +193,7 @@ namespace RadeonRays
     inline void ShapeImpl::SetAngularVelocity(quaternion const& q)
     {
         angulrmotion_ = q;
-        statechange_ |= kStateChangeMotion;
+        MarkChanged(kStateChangeMotion);
     }
     
     inline quaternion ShapeImpl::GetAngularVelocity() const
@@ -149,7 +204,7 @@ namespace RadeonRays
     inline void ShapeImpl::SetId(Id id)
     {
         id_ = id;
-        statechange_ |= kStateChangeId;
+        MarkChanged(kStateChangeId);
     }
     
     inline Id ShapeImpl::GetId() const
@@ -175,7 +230,7 @@ namespace RadeonRays
     inline void ShapeImpl::SetMask(int mask)
     {
         mask_ = mask;
-        statechange_ |= kStateChangeMask;
+        MarkChanged(kStateChangeMask);
     }
 
     inline int  ShapeImpl::GetMask() const
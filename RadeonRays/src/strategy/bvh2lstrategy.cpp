@@ -26,27 +26,39 @@ THE SOFTWARE.
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../except/except.h"
+#include "../async/task_scheduler.h"
 
 #include "device.h"
 #include "executable.h"
+#include "function_pool.h"
 
-#include <set>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
 
 static int const kWorkGroupSize = 64;
 
 namespace RadeonRays
 {
+    // Compact per shape record, 64 bytes
     struct Bvh2lStrategy::ShapeData
     {
+        // World to object transform rows, the last one is always (0, 0, 0, 1)
+        float3 m0;
+        float3 m1;
+        float3 m2;
         // Shape ID
         Id id;
+        int mask;
         // Index of root bvh node
         int bvhidx;
-        int mask;
-        int padding1;
-        // Transform
-        matrix minv;
-        // Motion blur data
+        // Index into motion data, -1 for static shapes
+        int motionidx;
+    };
+
+    // Motion blur data, only stored if some shape moves
+    struct Bvh2lStrategy::ShapeMotion
+    {
         float3 linearvelocity;
         // Angular veocity (quaternion)
         quaternion angularvelocity;
@@ -58,9 +70,11 @@ namespace RadeonRays
         int shadeidx;
         // Primitive ID within the mesh
         int id;
-        // Idx count
+        // Idx count, 4 for quads
         int cnt;
-        int padding[2];
+        // Fourth vertex index of quads
+        int idx3;
+        int padding;
     };
 
     struct Bvh2lStrategy::GpuData
@@ -75,14 +89,20 @@ namespace RadeonRays
         Calc::Buffer* faces;
         // Shape IDs
         Calc::Buffer* shapes;
+        // Top level bounds at the end of the shutter interval
+        Calc::Buffer* endnodes;
+        // Shape velocities
+        Calc::Buffer* motiondata;
 
         int bvhrootidx;
+        // Nonzero if any shape moves
+        int motion;
 
         Calc::Executable* executable;
-        Calc::Function* isect_func;
-        Calc::Function* occlude_func;
-        Calc::Function* isect_indirect_func;
-        Calc::Function* occlude_indirect_func;
+        std::unique_ptr<FunctionPool> isect_func;
+        std::unique_ptr<FunctionPool> occlude_func;
+        std::unique_ptr<FunctionPool> isect_indirect_func;
+        std::unique_ptr<FunctionPool> occlude_indirect_func;
 
         GpuData(Calc::Device* d)
             : device(d)
@@ -90,7 +110,10 @@ namespace RadeonRays
             , vertices(nullptr)
             , faces(nullptr)
             , shapes(nullptr)
+            , endnodes(nullptr)
+            , motiondata(nullptr)
             , bvhrootidx(-1)
+            , motion(0)
             , executable(nullptr)
             , isect_func(nullptr)
             , occlude_func(nullptr)
@@ -105,12 +128,14 @@ namespace RadeonRays
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
             device->DeleteBuffer(shapes);
+            device->DeleteBuffer(endnodes);
+            device->DeleteBuffer(motiondata);
             if(executable != nullptr)
             {
-                executable->DeleteFunction(isect_func);
-                executable->DeleteFunction(occlude_func);
-                executable->DeleteFunction(isect_indirect_func);
-                executable->DeleteFunction(occlude_indirect_func);
+                isect_func.reset();
+                occlude_func.reset();
+                isect_indirect_func.reset();
+                occlude_indirect_func.reset();
                 device->DeleteExecutable(executable);
             }
         }
@@ -119,19 +144,136 @@ namespace RadeonRays
 
     struct Bvh2lStrategy::CpuData
     {
+        // Meshes followed by instances, including base meshes which are not in the world
+        std::vector<Shape const*> shapes;
+        // Base meshes which are not in the world
+        std::unordered_set<Shape const*> shapes_disabled;
+        // Mesh to BVH index
+        std::unordered_map<Shape const*, int> mesh_index;
+        // Shape to index in shapes
+        std::unordered_map<Shape const*, int> shape_index;
+        int nummeshes = 0;
+        int numinstances = 0;
+        // Shape index to top level leaf (shape data) index
+        std::vector<int> shape_slots;
+        // Nonzero for moving shapes
+        std::vector<char> moving;
+
         std::vector<int> mesh_vertices_start_idx;
         std::vector<int> mesh_faces_start_idx;
         std::vector<Bvh const*> bvhptrs;
         std::vector<ShapeData> shapedata;
-        std::vector<bbox> bounds;
+        // Indexed by shape data index, empty if nothing moves
+        std::vector<ShapeMotion> motiondata;
+        // World space shape bounds at the start and the end of the shutter interval
+        std::vector<bbox> start_bounds;
+        std::vector<bbox> end_bounds;
+        // Top level node bounds at the end of the shutter interval
+        std::vector<bbox> endnodes;
 
         PlainBvhTranslator translator;
     };
 
+    // Max number of clean elements between two dirty ones to still upload them at once
+    static int const kMaxDirtyGap = 16;
+
+    // Upload runs of dirty elements, base is the element offset within the buffer
+    template <typename T>
+    static void UploadDirtyRanges(Calc::Device* device, Calc::Buffer* buffer, int base, T* data, std::vector<char> const& dirty)
+    {
+        int count = (int)dirty.size();
+        int i = 0;
+
+        while (i < count)
+        {
+            if (!dirty[i])
+            {
+                ++i;
+                continue;
+            }
+
+            int end = i + 1;
+
+            for (int j = end; j < count && j - end <= kMaxDirtyGap; ++j)
+            {
+                if (dirty[j])
+                {
+                    end = j + 1;
+                }
+            }
+
+            device->WriteBuffer(buffer, 0, (base + i) * sizeof(T), (end - i) * sizeof(T), data + i, nullptr);
+            i = end;
+        }
+    }
+
+    // Keep motion only buffer in sync with the data, fully recreating it if dirty is nullptr
+    template <typename T>
+    static void UploadMotionBuffer(Calc::Device* device, bool motion, Calc::Buffer*& buffer, std::vector<T>& data, std::vector<char> const* dirty)
+    {
+        if (!motion)
+        {
+            device->DeleteBuffer(buffer);
+            buffer = nullptr;
+            return;
+        }
+
+        if (dirty && buffer)
+        {
+            UploadDirtyRanges(device, buffer, 0, &data[0], *dirty);
+        }
+        else
+        {
+            device->DeleteBuffer(buffer);
+            buffer = device->CreateBuffer(data.size() * sizeof(T), Calc::kRead, &data[0]);
+        }
+    }
+
+    // Compare spatial extents ignoring w components
+    static bool SameBounds(bbox const& a, bbox const& b)
+    {
+        return a.pmin.x == b.pmin.x && a.pmin.y == b.pmin.y && a.pmin.z == b.pmin.z &&
+            a.pmax.x == b.pmax.x && a.pmax.y == b.pmax.y && a.pmax.z == b.pmax.z;
+    }
+
+    // Check if the shape moves within the shutter interval
+    static bool HasMotion(ShapeImpl const* shape)
+    {
+        float3 v = shape->GetLinearVelocity();
+        quaternion q = shape->GetAngularVelocity();
+
+        return v.sqnorm() > 0.f || q.x != 0.f || q.y != 0.f || q.z != 0.f;
+    }
+
+    // Calculate world space bounds of the shape at the start and the end of the shutter interval
+    static void GetMotionBounds(ShapeImpl const* shape, bbox const& objbounds, bbox& start, bbox& end)
+    {
+        matrix const& m = shape->GetWorldMatrix();
+
+        bbox local = objbounds;
+
+        quaternion q = shape->GetAngularVelocity();
+
+        if (q.x != 0.f || q.y != 0.f || q.z != 0.f)
+        {
+            // The shape rotates around its origin, so bound the sphere it sweeps
+            float3 corner = vmax(vmax(-objbounds.pmin, objbounds.pmin), vmax(-objbounds.pmax, objbounds.pmax));
+            float radius = std::sqrt(corner.sqnorm());
+            local = bbox(float3(-radius, -radius, -radius), float3(radius, radius, radius));
+        }
+
+        start = transform_bbox(local, m);
+
+        float3 v = shape->GetLinearVelocity();
+        end = bbox(start.pmin + v, start.pmax + v);
+    }
+
     Bvh2lStrategy::Bvh2lStrategy(Calc::Device* device)
         : Strategy(device)
         , m_gpudata(new GpuData(device))
         , m_cpudata(new CpuData)
+        , m_cache_use_sah(false)
+        , m_cache_traversal_cost(0.f)
     {
         std::string buildopts =
 #ifdef RR_RAY_MASK
@@ -140,6 +282,10 @@ namespace RadeonRays
             "";
 #endif
 
+#ifdef RR_TRAVERSAL_COUNTERS
+        buildopts += " -D RR_TRAVERSAL_COUNTERS";
+#endif
+
 #ifndef RR_EMBED_KERNELS
         if ( device->GetPlatform() == Calc::Platform::kOpenCL )
         {
@@ -171,10 +317,10 @@ namespace RadeonRays
 #endif
 #endif
 
-        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest2L");
-        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny2L");
-        m_gpudata->isect_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestRC2L");
-        m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC2L");
+        m_gpudata->isect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosest2L"));
+        m_gpudata->occlude_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAny2L"));
+        m_gpudata->isect_indirect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosestRC2L"));
+        m_gpudata->occlude_indirect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAnyRC2L"));
     }
 
     void Bvh2lStrategy::Preprocess(World const& world)
@@ -185,6 +331,9 @@ namespace RadeonRays
         // Full rebuild in case number of objects changes
         if (m_bvhs.size() == 0 || world.has_changed())
         {
+            m_stats = Statistics();
+            PhaseTimer timer;
+
             if (m_bvhs.size() != 0)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
@@ -194,8 +343,8 @@ namespace RadeonRays
             }
 
 
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+            auto builder = GetOption(world.options_, "bvh.builder");
+            auto tcost = GetOption(world.options_, "bvh.sah.traversal_cost");
 
             bool use_sah = false;
             float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
@@ -206,44 +355,12 @@ namespace RadeonRays
                 use_sah = true;
             }
 
-            // Copy the shapes here to be able to partition them and handle more efficiently
-            // #22: we need to be able to handle instances whos base shapes are not present 
-            // in the scene, so we have to add them manually here.
-            std::vector<Shape const*> shapes;
-            std::set<Shape const*> shapes_disabled;
-
-            for (auto s : world.shapes_)
-            {
-                auto shapeimpl = static_cast<ShapeImpl const*>(s);
-
-                if (shapeimpl->is_instance())
-                {
-                    // Here we know this is an instance, need to check if its base shape has been added as well
-                    auto instance = static_cast<Instance const*>(shapeimpl);
-                    auto base_shape = instance->GetBaseShape();
-
-                    if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
-                    {
-                        // Need to add the shape to the list
-                        shapes.push_back(base_shape);
-                        // And mark it disabled
-                        shapes_disabled.insert(base_shape);
-                    }
-                }
-
-                shapes.push_back(s);
-            }
-
-            // Now partition the range into meshes and instances
-            auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
-            {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
-            });
+            // Meshes first, then instances
+            CollectShapes(world);
 
-            // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
+            auto const& shapes = m_cpudata->shapes;
+            int nummeshes = m_cpudata->nummeshes;
+            int numinstances = m_cpudata->numinstances;
 
             int numvertices = 0;
             int numfaces = 0;
@@ -254,16 +371,43 @@ namespace RadeonRays
             m_cpudata->bvhptrs.resize(nummeshes + 1);
             m_cpudata->shapedata.resize(nummeshes + numinstances);
 
+            // Cached BVHs are no good if built with other settings
+            if (use_sah != m_cache_use_sah || traversal_cost != m_cache_traversal_cost)
+            {
+                m_bvh_cache.clear();
+                m_cache_use_sah = use_sah;
+                m_cache_traversal_cost = traversal_cost;
+            }
+
             // [0...numshapes-1] contain bottom level BVHs
             // [numshapes] is the top level one
-            m_bvhs.resize(nummeshes + 1);
-            // Create actual BVH objects
-            for (int i = 0; i < nummeshes + 1; ++i)
+            m_bvhs.assign(nummeshes + 1, nullptr);
+
+            // Reuse BVHs of the meshes which have been built before,
+            // only keep the ones which are still in use
+            std::unordered_map<Shape const*, CachedBvh> cache;
+            std::vector<int> tobuild;
+
+            for (int i = 0; i < nummeshes; ++i)
             {
-                m_bvhs[i].reset(new Bvh(traversal_cost, use_sah));
-                m_cpudata->bvhptrs[i] = m_bvhs[i].get();
+                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
+                auto iter = m_bvh_cache.find(mesh);
+
+                if (iter != m_bvh_cache.cend() && iter->second.stamp == mesh->stamp())
+                {
+                    m_bvhs[i] = iter->second.bvh;
+                }
+                else
+                {
+                    m_bvhs[i].reset(new Bvh(traversal_cost, use_sah));
+                    tobuild.push_back(i);
+                }
+
+                cache[mesh] = CachedBvh{ mesh->stamp(), m_bvhs[i] };
             }
 
+            m_bvh_cache.swap(cache);
+
             // Prepare necessary offsets in the arrays
             // in order to be able to parallelize
             for (int i = 0; i < nummeshes; ++i)
@@ -277,71 +421,65 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
-            // We can't avoild allocating it here, since bounds aren't stored anywhere
-            m_cpudata->bounds.resize(numfaces);
-
             // We are storing individual object bounds here to build top level BVH
-            std::vector<bbox> object_bounds(nummeshes + numinstances);
+            m_cpudata->start_bounds.resize(nummeshes + numinstances);
+            m_cpudata->end_bounds.resize(nummeshes + numinstances);
+            m_cpudata->moving.resize(nummeshes + numinstances);
 
-            matrix m, minv;
+            timer.Lap(m_stats.bounds_ms);
 
-            // Handle simple shapes
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
+            // Build BVHs for new meshes, sizes vary a lot so balance dynamically
+            ParallelFor(0, (int)tobuild.size(), [&](int k)
             {
+                int i = tobuild[k];
 
                 Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                mesh->GetTransform(m, minv);
+
+                // We can't avoid allocating it here, since bounds aren't stored anywhere
+                std::vector<bbox> bounds(mesh->num_faces());
 
                 for (int j = 0; j < mesh->num_faces(); ++j)
                 {
                     // Request bounds in object space since we build BVHs for objects locally
-                    mesh->GetFaceBounds(j, true, m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i] + j]);
+                    mesh->GetFaceBounds(j, true, bounds[j]);
                 }
 
                 // Build BVH for current mesh
-                m_bvhs[i]->Build(&m_cpudata->bounds[m_cpudata->mesh_faces_start_idx[i]], mesh->num_faces());
+                m_bvhs[i]->Build(&bounds[0], mesh->num_faces());
+            });
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
+            timer.Lap(m_stats.build_ms);
 
-                // Collect BVH pointers for toip level build
+            // Collect BVH pointers for top level build
+            for (int i = 0; i < nummeshes; ++i)
+            {
                 m_cpudata->bvhptrs[i] = m_bvhs[i].get();
             }
 
-            // Handle instances
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            // Extract and store bounds. Note they are in object space and we need to translate them to world space
+            ParallelFor(0, nummeshes + numinstances, [&](int i)
             {
+                UpdateShapeBounds(i);
+            });
 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                instance->GetTransform(m, minv);
-
-                // Find BVH for the instance
-                Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
-
-                // It should be there
-                auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
-
-                // TODO: should be assert
-                ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
-
-                int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+            m_gpudata->motion = std::find(m_cpudata->moving.cbegin(), m_cpudata->moving.cend(), 1) != m_cpudata->moving.cend() ? 1 : 0;
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
-            }
+            timer.Lap(m_stats.bounds_ms);
 
             // Calculate top level BVH
-            m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-            m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+            BuildTopLevel(world);
+
+            timer.Lap(m_stats.build_ms);
 
             m_cpudata->translator.Flush();
             // TODO: parallelize this
             m_cpudata->translator.Process(&m_cpudata->bvhptrs[0], &m_cpudata->mesh_faces_start_idx[0], nummeshes);
 
+            // Split top level bounds into shutter open and close ones
+            RefitTopLevel(nullptr);
+
+            timer.Lap(m_stats.translate_ms);
+
             // Update GPU data
             // Copy translated nodes first
             m_gpudata->bvh = m_device->CreateBuffer(m_cpudata->translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::kRead, &m_cpudata->translator.nodes_[0]);
@@ -351,35 +489,30 @@ namespace RadeonRays
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::kRead);
+                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(PackedVertex), Calc::kRead);
 
                 // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
+                PackedVertex* vertexdata = nullptr;
                 Calc::Event* e = nullptr;
 
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(PackedVertex), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                ParallelFor(0, nummeshes, [&](int i)
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
 
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[m_cpudata->mesh_vertices_start_idx[i] + j] = myvertexdata[j];
+                        vertexdata[m_cpudata->mesh_vertices_start_idx[i] + j] = mesh->GetVertex(j);
                     }
-                }
+                });
 
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
 
@@ -406,8 +539,7 @@ namespace RadeonRays
                 // Besides that we need to permute the faces accorningly to BVH reordering, whihc
                 // is contained within bvh.primids_
 
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                ParallelFor(0, nummeshes, [&](int i)
                 {
                     // Reordering indices for a given mesh
                     int const* reordering = m_bvhs[i]->GetIndices();
@@ -415,8 +547,6 @@ namespace RadeonRays
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
-                    Mesh::Face const* myfaces = mesh->GetFaceData();
-
                     int startidx = m_cpudata->mesh_vertices_start_idx[i];
 
                     for (int j = 0; j < mesh->num_faces(); ++j)
@@ -424,15 +554,17 @@ namespace RadeonRays
                         // Copy face data to GPU buffer
                         int myidx = m_cpudata->mesh_faces_start_idx[i] + j;
                         int faceidx = reordering[j];
+                        Mesh::Face const myface = mesh->GetFace(faceidx);
 
-                        facedata[myidx].idx[0] = myfaces[faceidx].idx[0] + startidx;
-                        facedata[myidx].idx[1] = myfaces[faceidx].idx[1] + startidx;
-                        facedata[myidx].idx[2] = myfaces[faceidx].idx[2] + startidx;
+                        facedata[myidx].idx[0] = myface.idx[0] + startidx;
+                        facedata[myidx].idx[1] = myface.idx[1] + startidx;
+                        facedata[myidx].idx[2] = myface.idx[2] + startidx;
 
-                        facedata[myidx].cnt = 3;
+                        facedata[myidx].cnt = (myface.type_ == Mesh::FaceType::QUAD ? 4 : 3);
+                        facedata[myidx].idx3 = myface.idx[3] + startidx;
                         facedata[myidx].id = faceidx;
                     }
-                }
+                });
 
                 m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
 
@@ -442,227 +574,399 @@ namespace RadeonRays
 
 
             // Now we need to collect shapdata
-            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+            UpdateShapeData();
 
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes + numinstances; ++i)
-            {
-                // Get the mesh
-                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
+            // Create face ID buffer
+            m_gpudata->shapes = m_device->CreateBuffer((nummeshes + numinstances) * sizeof(ShapeData), Calc::kRead, &m_cpudata->shapedata[0]);
+
+            UploadMotion(nullptr, nullptr);
 
-                m_cpudata->shapedata[i].id = shapeimpl->GetId();
+            // Make sure everything is commited
+            m_device->Finish(0);
+
+            timer.Lap(m_stats.upload_ms);
 
-                // For disabled shapes force mask to zero since these shapes 
-                // present only virtually (they have not been added to the scene)
-                // and we need to skip them while doing traversal.
-                if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
+            UpdateStructureStatistics();
+        }
+        // Refit
+        else if (statechange != ShapeImpl::kStateChangeNone)
+        {
+            ResetPhaseStatistics();
+            PhaseTimer timer;
+
+            // Nothing has been attached or detached, so the shape list
+            // collected during the last build is still valid
+            int nummeshes = m_cpudata->nummeshes;
+            int numshapes = m_cpudata->nummeshes + m_cpudata->numinstances;
+
+            // Changed shapes come from the world change records, only moved ones need new bounds
+            std::vector<int> changed;
+            std::vector<int> moved;
+
+            for (auto const& change : world.GetChanges())
+            {
+                int shapeidx = m_cpudata->shape_index.at(change.shape);
+                changed.push_back(shapeidx);
+
+                if (change.flags & ~(ShapeImpl::kStateChangeId | ShapeImpl::kStateChangeMask))
                 {
-                    m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
+                    moved.push_back(shapeidx);
                 }
-                else
+            }
+
+            // Ids and masks only live in shape data
+            if (moved.empty())
+            {
+                std::vector<char> dirtyslots(numshapes, 0);
+
+                for (auto shapeidx : changed)
                 {
-                    m_cpudata->shapedata[i].mask = 0x0;
+                    int slot = m_cpudata->shape_slots[shapeidx];
+                    FillShapeData(slot);
+                    dirtyslots[slot] = 1;
                 }
 
-                shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+                UploadDirtyRanges(m_device, m_gpudata->shapes, 0, &m_cpudata->shapedata[0], dirtyslots);
+                m_device->Finish(0);
+
+                timer.Lap(m_stats.upload_ms);
+                return;
+            }
+
+            ParallelFor(0, (int)moved.size(), [&](int i)
+            {
+                UpdateShapeBounds(moved[i]);
+            });
+
+            timer.Lap(m_stats.bounds_ms);
+
+            int motion = std::find(m_cpudata->moving.cbegin(), m_cpudata->moving.cend(), 1) != m_cpudata->moving.cend() ? 1 : 0;
+
+            auto optrefit = GetOption(world.options_, "bvh.refit_top_level");
+            // Motion data layout changes if motion gets enabled or disabled, so update everything then
+            bool refit = optrefit && optrefit->AsFloat() > 0.f && motion == m_gpudata->motion;
+
+            m_gpudata->motion = motion;
+
+            int root = m_cpudata->translator.root_;
+            int numnodes = 2 * numshapes - 1;
+
+            if (refit)
+            {
+                // Keep top level topology and only update the bounds
+                std::vector<char> dirtynodes(numnodes, 0);
+                RefitTopLevel(&dirtynodes);
+
+                timer.Lap(m_stats.build_ms);
+
+                UploadDirtyRanges(m_device, m_gpudata->bvh, root, &m_cpudata->translator.nodes_[root], dirtynodes);
+
+                // Only the changed shapes need new shape data
+                std::vector<char> dirtyslots(numshapes, 0);
 
-                if (!shapeimpl->is_instance())
+                for (auto shapeidx : changed)
                 {
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
+                    int slot = m_cpudata->shape_slots[shapeidx];
+                    FillShapeData(slot);
+                    dirtyslots[slot] = 1;
                 }
-                else
-                {
-                    Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
 
-                    // Find corresponding mesh
-                    Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+                UploadDirtyRanges(m_device, m_gpudata->shapes, 0, &m_cpudata->shapedata[0], dirtyslots);
+                UploadMotion(&dirtynodes, &dirtyslots);
+            }
+            else
+            {
+                // Calculate top level BVH
+                BuildTopLevel(world);
 
-                    // It should be there
-                    auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+                timer.Lap(m_stats.build_ms);
 
-                    // TODO: should be assert
-                    ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+                // TODO: parallelize this
+                m_cpudata->translator.UpdateTopLevel(*m_bvhs[nummeshes]);
+                RefitTopLevel(nullptr);
 
-                    int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+                timer.Lap(m_stats.translate_ms);
 
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-                }
+                // Update GPU data
+                // Copy only top BVH data
+                m_device->WriteBuffer(m_gpudata->bvh, 0, root * sizeof(PlainBvhTranslator::Node), numnodes * sizeof(PlainBvhTranslator::Node), &m_cpudata->translator.nodes_[root], nullptr);
+
+                // Top level leaves have been reordered, so all shape data has to be updated
+                UpdateShapeData();
+
+                m_device->WriteBuffer(m_gpudata->shapes, 0, 0, numshapes * sizeof(ShapeData), &m_cpudata->shapedata[0], nullptr);
+                UploadMotion(nullptr, nullptr);
             }
 
-            // Create face ID buffer
-            m_gpudata->shapes = m_device->CreateBuffer((nummeshes + numinstances) * sizeof(ShapeData), Calc::kRead, &m_cpudata->shapedata[0]);
+            m_device->Finish(0);
+
+            timer.Lap(m_stats.upload_ms);
+
+            UpdateStructureStatistics();
         }
-        // Refit
-        else if (statechange != ShapeImpl::kStateChangeNone)
+    }
+
+    void Bvh2lStrategy::CollectShapes(World const& world)
+    {
+        auto& shapes = m_cpudata->shapes;
+        auto& shapes_disabled = m_cpudata->shapes_disabled;
+
+        shapes.clear();
+        shapes_disabled.clear();
+        m_cpudata->mesh_index.clear();
+        m_cpudata->shape_index.clear();
+
+        // Copy the shapes here to be able to partition them and handle more efficiently
+        // #22: we need to be able to handle instances whos base shapes are not present 
+        // in the scene, so we have to add them manually here.
+        std::unordered_set<Shape const*> attached;
+
+        for (auto s : world.shapes_)
         {
-            //std::cout << "Refit\n";
+            if (!static_cast<ShapeImpl const*>(s)->is_instance())
+            {
+                attached.insert(s);
+            }
+        }
 
-            // Copy the shapes here to be able to partition them and handle more efficiently
-            // #22: we need to be able to handle instances whos base shapes are not present 
-            // in the scene, so we have to add them manually here.
-            std::vector<Shape const*> shapes;
-            std::set<Shape const*> shapes_disabled;
+        for (auto s : world.shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(s);
 
-            for (auto s : world.shapes_)
+            if (shapeimpl->is_instance())
             {
-                auto shapeimpl = static_cast<ShapeImpl const*>(s);
+                // Here we know this is an instance, need to check if its base shape has been added as well
+                auto instance = static_cast<Instance const*>(shapeimpl);
+                auto base_shape = instance->GetBaseShape();
 
-                if (shapeimpl->is_instance())
+                // Need to add the shape to the list once and mark it disabled
+                if (attached.find(base_shape) == attached.cend() && shapes_disabled.insert(base_shape).second)
                 {
-                    // Here we know this is an instance, need to check if its base shape has been added as well
-                    auto instance = static_cast<Instance const*>(shapeimpl);
-                    auto base_shape = instance->GetBaseShape();
-
-                    if (std::find(world.shapes_.cbegin(), world.shapes_.cend(), base_shape) == world.shapes_.cend())
-                    {
-                        // Need to add the shape to the list
-                        shapes.push_back(base_shape);
-                        // And mark it disabled
-                        shapes_disabled.insert(base_shape);
-                    }
+                    shapes.push_back(base_shape);
                 }
-
-                shapes.push_back(s);
             }
 
-            // Now partition the range into meshes and instances
-            auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
-            {
-                return !static_cast<ShapeImpl const*>(shape)->is_instance();
-            });
+            shapes.push_back(s);
+        }
 
-            // Count the number of meshes
-            int nummeshes = (int)std::distance(shapes.begin(), firstinst);
-            // Count the number of instances
-            int numinstances = (int)std::distance(firstinst, shapes.end());
+        // Now partition the range into meshes and instances
+        auto firstinst = std::partition(shapes.begin(), shapes.end(), [&](Shape const* shape)
+        {
+            return !static_cast<ShapeImpl const*>(shape)->is_instance();
+        });
 
-            std::vector<bbox> object_bounds(nummeshes + numinstances);
+        // Count the number of meshes
+        m_cpudata->nummeshes = (int)std::distance(shapes.begin(), firstinst);
+        // Count the number of instances
+        m_cpudata->numinstances = (int)std::distance(firstinst, shapes.end());
 
-            matrix m, minv;
+        // Each mesh has its own BVH
+        for (int i = 0; i < m_cpudata->nummeshes; ++i)
+        {
+            m_cpudata->mesh_index[shapes[i]] = i;
+        }
 
-            // Go over meshes and rebuild BVH bounds
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
-            {
-                Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                mesh->GetTransform(m, minv);
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[i]->Bounds(), m);
-            }
+        for (int i = 0; i < (int)shapes.size(); ++i)
+        {
+            m_cpudata->shape_index[shapes[i]] = i;
+        }
+    }
 
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
-            {
+    int Bvh2lStrategy::GetBvhIndex(int shapeidx) const
+    {
+        if (shapeidx < m_cpudata->nummeshes)
+        {
+            return shapeidx;
+        }
 
-                Instance const* instance = static_cast<Instance const*>(shapes[i]);
-                // Get transform to apply to object bounds
-                instance->GetTransform(m, minv);
+        auto instance = static_cast<Instance const*>(m_cpudata->shapes[shapeidx]);
+        auto iter = m_cpudata->mesh_index.find(instance->GetBaseShape());
 
-                // Find BVH for the instance
-                Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+        // TODO: should be assert
+        ThrowIf(iter == m_cpudata->mesh_index.cend(), "Internal error");
 
-                // It should be there
-                auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+        return iter->second;
+    }
 
-                // TODO: should be assert
-                ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+    void Bvh2lStrategy::UpdateShapeBounds(int shapeidx)
+    {
+        auto shapeimpl = static_cast<ShapeImpl const*>(m_cpudata->shapes[shapeidx]);
 
-                int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+        GetMotionBounds(shapeimpl, m_bvhs[GetBvhIndex(shapeidx)]->Bounds(), m_cpudata->start_bounds[shapeidx], m_cpudata->end_bounds[shapeidx]);
+        m_cpudata->moving[shapeidx] = HasMotion(shapeimpl) ? 1 : 0;
+    }
 
-                // Extract and store bounds. Note they are in object space and we need to translate them to world space
-                object_bounds[i] = transform_bbox(m_bvhs[bvhidx]->Bounds(), m);
-            }
+    void Bvh2lStrategy::BuildTopLevel(World const& world)
+    {
+        auto builder = GetOption(world.options_, "bvh.builder");
+        auto tcost = GetOption(world.options_, "bvh.sah.traversal_cost");
 
-            // Calculate top level BVH
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
+        bool use_sah = builder && builder->AsString() == "sah";
+        float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
 
-            bool use_sah = false;
-            float traversal_cost = tcost ? tcost->AsFloat() : 10.f;
+        int nummeshes = m_cpudata->nummeshes;
+        int numshapes = m_cpudata->nummeshes + m_cpudata->numinstances;
 
+        // Build over the bounds swept during the shutter interval
+        std::vector<bbox> object_bounds(numshapes);
 
-            if (builder && builder->AsString() == "sah")
+        ParallelFor(0, numshapes, [&](int i)
+        {
+            object_bounds[i] = bboxunion(m_cpudata->start_bounds[i], m_cpudata->end_bounds[i]);
+        });
+
+        m_bvhs[nummeshes].reset(new Bvh(traversal_cost, use_sah));
+        m_bvhs[nummeshes]->Build(&object_bounds[0], numshapes);
+        m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+    }
+
+    void Bvh2lStrategy::RefitTopLevel(std::vector<char>* dirty)
+    {
+        int numshapes = m_cpudata->nummeshes + m_cpudata->numinstances;
+
+        // Top level nodes are the last ones, each leaf holds a single shape
+        auto& nodes = m_cpudata->translator.nodes_;
+        auto& endnodes = m_cpudata->endnodes;
+        int root = m_cpudata->translator.root_;
+        int numnodes = 2 * numshapes - 1;
+        int const* topindices = m_bvhs[m_cpudata->nummeshes]->GetIndices();
+
+        endnodes.resize(numnodes);
+
+        // Children always follow their parent, so refit bottom-up by going backwards
+        for (int i = numnodes - 1; i >= 0; --i)
+        {
+            auto& node = nodes[root + i].bounds;
+
+            bbox start;
+            bbox end;
+
+            if (node.pmin.w != -1.f)
             {
-                use_sah = true;
+                int shapeidx = topindices[(int)node.pmin.w];
+                start = m_cpudata->start_bounds[shapeidx];
+                end = m_cpudata->end_bounds[shapeidx];
+            }
+            else
+            {
+                // Left child is next to the parent, right one is where the left one skips to
+                int lc = i + 1;
+                int rc = (int)nodes[root + lc].bounds.pmax.w - root;
+                start = bboxunion(nodes[root + lc].bounds, nodes[root + rc].bounds);
+                end = bboxunion(endnodes[lc], endnodes[rc]);
             }
 
-            m_bvhs[nummeshes].reset(new Bvh(traversal_cost, use_sah));
-            m_bvhs[nummeshes]->Build(&object_bounds[0], nummeshes + numinstances);
-            m_cpudata->bvhptrs[nummeshes] = m_bvhs[nummeshes].get();
+            if (dirty && (!SameBounds(start, node) || (m_gpudata->motion && !SameBounds(end, endnodes[i]))))
+            {
+                (*dirty)[i] = 1;
+            }
 
+            // Nodes keep start bounds, w components hold the links
+            node.pmin = float3(start.pmin.x, start.pmin.y, start.pmin.z, node.pmin.w);
+            node.pmax = float3(start.pmax.x, start.pmax.y, start.pmax.z, node.pmax.w);
+            endnodes[i] = end;
+        }
+    }
 
-            // TODO: parallelize this
-            m_cpudata->translator.UpdateTopLevel(*m_bvhs[nummeshes]);
+    void Bvh2lStrategy::UpdateShapeData()
+    {
+        int numshapes = m_cpudata->nummeshes + m_cpudata->numinstances;
+        int const* topindices = m_bvhs[m_cpudata->nummeshes]->GetIndices();
 
-            // Update GPU data
-            // Copy only top BVH data
-            Calc::Event* e = nullptr;
-            m_device->WriteBuffer(m_gpudata->bvh, 0, m_cpudata->translator.root_ * sizeof(PlainBvhTranslator::Node), (2 * (nummeshes + numinstances) - 1) * sizeof(PlainBvhTranslator::Node), (char*)&m_cpudata->translator.nodes_[m_cpudata->translator.root_], &e);
+        m_cpudata->shape_slots.resize(numshapes);
+        m_cpudata->motiondata.resize(m_gpudata->motion ? numshapes : 0);
 
-            e->Wait();
-            m_device->DeleteEvent(e);
+        ParallelFor(0, numshapes, [&](int i)
+        {
+            m_cpudata->shape_slots[topindices[i]] = i;
+            FillShapeData(i);
+        });
+    }
 
-            // Now we need to collect shapdata
-            int const* topindices = m_bvhs[nummeshes]->GetIndices();
+    void Bvh2lStrategy::FillShapeData(int slot)
+    {
+        int shapeidx = m_bvhs[m_cpudata->nummeshes]->GetIndices()[slot];
 
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes + numinstances; ++i)
-            {
-                // Get the mesh
-                ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(shapes[topindices[i]]);
-
-                m_cpudata->shapedata[i].id = shapeimpl->GetId();
-                // For disabled shapes force mask to zero since these shapes 
-                // present only virtually (they have not been added to the scene)
-                // and we need to skip them while doing traversal.
-                if (shapes_disabled.find(shapeimpl) == shapes_disabled.cend())
-                {
-                    m_cpudata->shapedata[i].mask = shapeimpl->GetMask();
-                }
-                else
-                {
-                    m_cpudata->shapedata[i].mask = 0x0;
-                }
+        // Get the mesh
+        ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(m_cpudata->shapes[shapeidx]);
+        ShapeData& data = m_cpudata->shapedata[slot];
 
-                shapeimpl->GetTransform(m, m_cpudata->shapedata[i].minv);
+        data.id = shapeimpl->GetId();
 
-                if (!shapeimpl->is_instance())
-                {
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[topindices[i]];
-                }
-                else
-                {
-                    Instance const* instance = static_cast<Instance const*>(shapes[topindices[i]]);
+        // For disabled shapes force mask to zero since these shapes 
+        // present only virtually (they have not been added to the scene)
+        // and we need to skip them while doing traversal.
+        if (m_cpudata->shapes_disabled.find(shapeimpl) == m_cpudata->shapes_disabled.cend())
+        {
+            data.mask = shapeimpl->GetMask();
+        }
+        else
+        {
+            data.mask = 0x0;
+        }
 
-                    // Find corresponding mesh
-                    Mesh const* basemesh = static_cast<Mesh const*>(instance->GetBaseShape());
+        matrix const& minv = shapeimpl->GetWorldMatrixInverse();
+        data.m0 = float3(minv.m00, minv.m01, minv.m02, minv.m03);
+        data.m1 = float3(minv.m10, minv.m11, minv.m12, minv.m13);
+        data.m2 = float3(minv.m20, minv.m21, minv.m22, minv.m23);
+        data.bvhidx = m_cpudata->translator.roots_[GetBvhIndex(shapeidx)];
+        data.motionidx = -1;
 
-                    // It should be there
-                    auto iter = std::find(shapes.cbegin(), shapes.cbegin() + nummeshes, basemesh);
+        if (m_cpudata->moving[shapeidx])
+        {
+            ShapeMotion& motion = m_cpudata->motiondata[slot];
+            motion.linearvelocity = shapeimpl->GetLinearVelocity();
+            motion.angularvelocity = shapeimpl->GetAngularVelocity();
+            data.motionidx = slot;
+        }
+    }
 
-                    // TODO: should be assert
-                    ThrowIf(iter == shapes.cbegin() + nummeshes, "Internal error");
+    void Bvh2lStrategy::UploadMotion(std::vector<char> const* dirtynodes, std::vector<char> const* dirtyslots)
+    {
+        bool motion = m_gpudata->motion != 0;
 
-                    int bvhidx = (int)std::distance(shapes.cbegin(), iter);
+        UploadMotionBuffer(m_device, motion, m_gpudata->endnodes, m_cpudata->endnodes, dirtynodes);
+        UploadMotionBuffer(m_device, motion, m_gpudata->motiondata, m_cpudata->motiondata, dirtyslots);
+    }
 
-                    m_cpudata->shapedata[i].bvhidx = m_cpudata->translator.roots_[bvhidx];
-                }
-            }
+    void Bvh2lStrategy::UpdateStructureStatistics()
+    {
+        int nummeshes = m_cpudata->nummeshes;
+        int bottomheight = 0;
 
-            // Create face ID buffer
-            m_device->WriteBuffer(m_gpudata->shapes, 0, 0, (nummeshes + numinstances) * sizeof(ShapeData), (char*)&m_cpudata->shapedata[0], &e);
+        // Top level leaves point into the bottom level BVHs
+        m_stats.node_count = 0;
+        for (auto const& bvh : m_bvhs)
+        {
+            m_stats.node_count += bvh->GetNodeCount();
+        }
 
-            e->Wait();
-            m_device->DeleteEvent(e);
+        for (int i = 0; i < nummeshes; ++i)
+        {
+            bottomheight = std::max(bottomheight, m_bvhs[i]->GetHeight());
+        }
 
-            m_device->Finish(0);
+        m_stats.height = m_bvhs[nummeshes]->GetHeight() + bottomheight;
+        m_stats.sah_cost = m_bvhs[nummeshes]->GetSahCost();
+        m_stats.memory_bytes = GetBufferSize(m_gpudata->bvh) + GetBufferSize(m_gpudata->vertices) +
+            GetBufferSize(m_gpudata->faces) + GetBufferSize(m_gpudata->shapes) +
+            GetBufferSize(m_gpudata->endnodes) + GetBufferSize(m_gpudata->motiondata);
+    }
+
+    void Bvh2lStrategy::SetMotionArgs(Calc::Function* func, int& arg) const
+    {
+        // Motion blur is implemented in OpenCL kernels only
+        if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+        {
+            func->SetArg(arg++, m_gpudata->endnodes ? m_gpudata->endnodes : m_gpudata->bvh);
+            func->SetArg(arg++, m_gpudata->motiondata ? m_gpudata->motiondata : m_gpudata->shapes);
+            func->SetArg(arg++, sizeof(int), &m_gpudata->motion);
         }
     }
 
     void Bvh2lStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
     {
-        auto& func = m_gpudata->isect_func;
+        FunctionPool::Lease func(*m_gpudata->isect_func);
 
         // Set args
         int arg = 0;
@@ -677,16 +981,18 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
+        SetMotionArgs(func, arg);
+        SetCounterArgs(func, arg, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void Bvh2lStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
     {
-        auto& func = m_gpudata->occlude_func;
+        FunctionPool::Lease func(*m_gpudata->occlude_func);
 
         // Set args
         int arg = 0;
@@ -701,16 +1007,18 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
+        SetMotionArgs(func, arg);
+        SetCounterArgs(func, arg, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void Bvh2lStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->isect_indirect_func;
+        FunctionPool::Lease func(*m_gpudata->isect_indirect_func);
 
         // Set args
         int arg = 0;
@@ -725,16 +1033,18 @@ namespace RadeonRays
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, hits);
+        SetMotionArgs(func, arg);
+        SetCounterArgs(func, arg, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void Bvh2lStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->occlude_indirect_func;
+        FunctionPool::Lease func(*m_gpudata->occlude_indirect_func);
 
         // Set args
         int arg = 0;
@@ -749,10 +1059,12 @@ namespace RadeonRays
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, hits);
+        SetMotionArgs(func, arg);
+        SetCounterArgs(func, arg, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 }
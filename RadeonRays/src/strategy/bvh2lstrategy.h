@@ -24,7 +24,10 @@ THE SOFTWARE.
 #include "calc.h"
 #include "device.h"
 #include "strategy.h"
+#include <cstdint>
 #include <memory>
+#include <unordered_map>
+#include <vector>
 
 
 namespace RadeonRays
@@ -69,16 +72,49 @@ namespace RadeonRays
                             Calc::Event** event) const override;
 
     private:
+        // Collect the shapes to build for, meshes first
+        void CollectShapes(World const& world);
+        // Get the index of the BVH used by the shape
+        int GetBvhIndex(int shapeidx) const;
+        // Recalculate world space bounds of the shape at shutter open and close
+        void UpdateShapeBounds(int shapeidx);
+        // Build top level BVH over the shape bounds
+        void BuildTopLevel(World const& world);
+        // Update top level node bounds bottom-up, optionally marking the nodes which have changed
+        void RefitTopLevel(std::vector<char>* dirty);
+        // Fill the shape data for all the top level leaves
+        void UpdateShapeData();
+        // Fill the shape data for a single top level leaf
+        void FillShapeData(int slot);
+        // Upload top level bounds at shutter close and shape velocities, all of them if dirty is nullptr
+        void UploadMotion(std::vector<char> const* dirtynodes, std::vector<char> const* dirtyslots);
+        // Set motion blur kernel arguments
+        void SetMotionArgs(Calc::Function* func, int& arg) const;
+        // Fill the structure fields of the statistics from the current BVHs and buffers
+        void UpdateStructureStatistics();
 
         // Gpu data
         struct GpuData;
         struct CpuData;
         struct ShapeData;
+        struct ShapeMotion;
         struct Face;
 
+        // Bottom level BVH built for a mesh
+        struct CachedBvh
+        {
+            std::uint64_t stamp;
+            std::shared_ptr<Bvh> bvh;
+        };
+
         std::unique_ptr<GpuData> m_gpudata;
         std::unique_ptr<CpuData> m_cpudata;
-        std::vector<std::unique_ptr<Bvh> > m_bvhs;
+        std::vector<std::shared_ptr<Bvh> > m_bvhs;
+        // Bottom level BVHs of the meshes in the last build
+        std::unordered_map<Shape const*, CachedBvh> m_bvh_cache;
+        // Builder settings the cached BVHs have been built with
+        bool m_cache_use_sah;
+        float m_cache_traversal_cost;
     };
 }
 
@@ -26,15 +26,23 @@ THE SOFTWARE.
 #include "../primitive/mesh.h"
 #include "../primitive/instance.h"
 #include "../world/world.h"
+#include "../async/task_scheduler.h"
 
 #include "../translator/plain_bvh_translator.h"
 
 #include "device.h"
 #include "executable.h"
+#include "function_pool.h"
 #include <algorithm>
+#include <mutex>
+#include <unordered_map>
 
 // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
+// Number of persistent work groups launched per compute unit
+static int const kPersistentGroupsPerUnit = 16;
+// Face::cnt value of the faces standing for referenced instances
+static int const kInstanceFace = -1;
 
 namespace RadeonRays
 {
@@ -68,14 +76,23 @@ namespace RadeonRays
         Calc::Buffer* faces;
         // Shape IDs
         Calc::Buffer* shapes;
-        // Counter
-        Calc::Buffer* raycnt;
+        // Host copy of the shape data and shape indices in it, ids and masks are patched in place
+        std::vector<ShapeData> shapedata;
+        std::unordered_map<Shape const*, int> shape_slots;
+        // Ray counters for persistent kernels, one per queue
+        std::vector<Calc::Buffer*> raycnt;
+        // Serializes counter reset and kernel launch
+        std::mutex raycnt_mutex;
+        // Number of work groups to keep the device busy, 0 if unknown
+        std::size_t num_persistent_groups;
 
         Calc::Executable* executable;
-        Calc::Function* isect_func;
-        Calc::Function* occlude_func;
-        Calc::Function* isect_indirect_func;
-        Calc::Function* occlude_indirect_func;
+        std::unique_ptr<FunctionPool> isect_func;
+        std::unique_ptr<FunctionPool> occlude_func;
+        std::unique_ptr<FunctionPool> isect_indirect_func;
+        std::unique_ptr<FunctionPool> occlude_indirect_func;
+        std::unique_ptr<FunctionPool> isect_persistent_func;
+        std::unique_ptr<FunctionPool> occlude_persistent_func;
 
         GpuData(Calc::Device* d)
             : device(d)
@@ -83,7 +100,7 @@ namespace RadeonRays
             , vertices(nullptr)
             , faces(nullptr)
             , shapes(nullptr)
-            , raycnt(nullptr)
+            , num_persistent_groups(0)
             , executable(nullptr)
         {
         }
@@ -94,13 +111,18 @@ namespace RadeonRays
             device->DeleteBuffer(vertices);
             device->DeleteBuffer(faces);
             device->DeleteBuffer(shapes);
-            device->DeleteBuffer(raycnt);
+            for (auto& cnt : raycnt)
+            {
+                device->DeleteBuffer(cnt);
+            }
             if (executable)
             {
-                executable->DeleteFunction(isect_func);
-                executable->DeleteFunction(occlude_func);
-                executable->DeleteFunction(isect_indirect_func);
-                executable->DeleteFunction(occlude_indirect_func);
+                isect_func.reset();
+                occlude_func.reset();
+                isect_indirect_func.reset();
+                occlude_indirect_func.reset();
+                isect_persistent_func.reset();
+                occlude_persistent_func.reset();
                 device->DeleteExecutable(executable);
             }
         }
@@ -118,6 +140,10 @@ namespace RadeonRays
             "";
 #endif
 
+#ifdef RR_TRAVERSAL_COUNTERS
+        buildopts += " -D RR_TRAVERSAL_COUNTERS";
+#endif
+
 #ifndef RR_EMBED_KERNELS
         if ( device->GetPlatform() == Calc::Platform::kOpenCL )
         {
@@ -150,24 +176,46 @@ namespace RadeonRays
 
         assert(m_gpudata->executable);
 
-        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest");
-        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
-        m_gpudata->isect_indirect_func= m_gpudata->executable->CreateFunction("IntersectClosestRC");
-        m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+        m_gpudata->isect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosest"));
+        m_gpudata->occlude_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAny"));
+        m_gpudata->isect_indirect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosestRC"));
+        m_gpudata->occlude_indirect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAnyRC"));
+
+        // Persistent kernels only exist in the OpenCL version and need
+        // the number of compute units to size the launch
+        Calc::DeviceSpec spec;
+        m_device->GetSpec(spec);
+
+        if (device->GetPlatform() == Calc::Platform::kOpenCL && spec.max_compute_units > 0)
+        {
+            m_gpudata->isect_persistent_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosestRCAMD"));
+            m_gpudata->occlude_persistent_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAnyRCAMD"));
+
+            m_gpudata->num_persistent_groups = spec.max_compute_units * kPersistentGroupsPerUnit;
+
+            for (std::uint32_t i = 0; i < spec.max_num_queues; ++i)
+            {
+                m_gpudata->raycnt.push_back(m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite));
+            }
+        }
     }
 
     void BvhStrategy::Preprocess(World const& world)
     {
-        // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        int statechange = world.GetStateChange();
+
+        // Ids and masks are patched in place, anything else needs a rebuild
+        if (!m_bvh || world.has_changed() || (statechange & ~(ShapeImpl::kStateChangeId | ShapeImpl::kStateChangeMask)))
         {
+            m_stats = Statistics();
+            PhaseTimer timer;
+
             if (m_bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
                 m_device->DeleteBuffer(m_gpudata->vertices);
                 m_device->DeleteBuffer(m_gpudata->faces);
                 m_device->DeleteBuffer(m_gpudata->shapes);
-                m_device->DeleteBuffer(m_gpudata->raycnt);
             }
 
             int numshapes = (int)world.shapes_.size();
@@ -179,12 +227,12 @@ namespace RadeonRays
             std::vector<int> mesh_faces_start_idx(numshapes);
 
             // Check options
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
+            auto builder = GetOption(world.options_, "bvh.builder");
+            auto splits = GetOption(world.options_, "bvh.sah.use_splits");
+            auto maxdepth = GetOption(world.options_, "bvh.sah.max_split_depth");
+            auto overlap = GetOption(world.options_, "bvh.sah.min_overlap");
+            auto tcost = GetOption(world.options_, "bvh.sah.traversal_cost");
+            auto node_budget = GetOption(world.options_, "bvh.sah.extra_node_budget");
 
             bool use_sah = false;
             bool use_splits = false;
@@ -222,6 +270,60 @@ namespace RadeonRays
             // Count the number of instances
             int numinstances = (int)std::distance(firstinst, shapes.end());
 
+            // Instances of meshes with more faces than the threshold are referenced
+            // through their transforms instead of being flattened (OpenCL kernels only)
+            auto optflatten = GetOption(world.options_, "bvh.instance_flatten_faces");
+            int maxflatfaces = -1;
+
+            if (optflatten && m_device->GetPlatform() == Calc::Platform::kOpenCL)
+            {
+                maxflatfaces = (int)optflatten->AsFloat();
+            }
+
+            // Flattened instances go first, then referenced ones
+            auto firstref = std::partition(firstinst, shapes.end(),
+                [&](Shape const* shape)
+            {
+                auto mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape());
+                return maxflatfaces < 0 || mesh->num_faces() <= maxflatfaces;
+            });
+
+            // Index of the first referenced instance
+            int firstrefidx = (int)std::distance(shapes.begin(), firstref);
+
+            // Each referenced mesh gets its own object space BVH
+            std::vector<Mesh const*> refmeshes;
+            std::unordered_map<Mesh const*, int> refmesh_index;
+
+            for (int i = firstrefidx; i < nummeshes + numinstances; ++i)
+            {
+                auto mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[i])->GetBaseShape());
+
+                if (refmesh_index.emplace(mesh, (int)refmeshes.size()).second)
+                {
+                    refmeshes.push_back(mesh);
+                }
+            }
+
+            std::vector<std::unique_ptr<Bvh>> refbvhs(refmeshes.size());
+
+            ParallelFor(0, (int)refmeshes.size(), [&](int k)
+            {
+                Mesh const* mesh = refmeshes[k];
+
+                std::vector<bbox> meshbounds(mesh->num_faces());
+
+                for (int j = 0; j < mesh->num_faces(); ++j)
+                {
+                    mesh->GetFaceBounds(j, true, meshbounds[j]);
+                }
+
+                refbvhs[k].reset(new Bvh(traversal_cost, use_sah));
+                refbvhs[k]->Build(&meshbounds[0], mesh->num_faces());
+            });
+
+            timer.Lap(m_stats.build_ms);
+
             for (int i = 0; i < nummeshes; ++i)
             {
                 Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
@@ -233,7 +335,7 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            for (int i = nummeshes; i < firstrefidx; ++i)
             {
                 Instance const* instance = static_cast<Instance const*>(shapes[i]);
                 Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
@@ -245,13 +347,21 @@ namespace RadeonRays
                 numvertices += mesh->num_vertices();
             }
 
+            // Referenced instance is a single primitive
+            for (int i = firstrefidx; i < nummeshes + numinstances; ++i)
+            {
+                mesh_faces_start_idx[i] = numfaces;
+                mesh_vertices_start_idx[i] = numvertices;
+
+                ++numfaces;
+            }
+
             // We can't avoild allocating it here, since bounds aren't stored anywhere
             std::vector<bbox> bounds(numfaces);
             std::vector<ShapeData> shapedata(numshapes);
 
             // We handle meshes first collecting their world space bounds
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
+            ParallelFor(0, nummeshes, [&](int i)
             {
                 Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
@@ -263,11 +373,10 @@ namespace RadeonRays
 
                 shapedata[i].id = mesh->GetId();
                 shapedata[i].mask = mesh->GetMask();
-            }
+            });
 
             // Then we handle instances. Need to flatten them into actual geometry.
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            ParallelFor(nummeshes, firstrefidx, [&](int i)
             {
                 Instance const* instance = static_cast<Instance const*>(shapes[i]);
                 Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
@@ -286,10 +395,29 @@ namespace RadeonRays
 
                 shapedata[i].id = instance->GetId();
                 shapedata[i].mask = instance->GetMask();
-            }
+            });
+
+            // Referenced instances are bounded by their transformed mesh BVHs
+            ParallelFor(firstrefidx, nummeshes + numinstances, [&](int i)
+            {
+                Instance const* instance = static_cast<Instance const*>(shapes[i]);
+                Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
+
+                matrix m;
+                instance->GetTransform(m, shapedata[i].minv);
+
+                bounds[mesh_faces_start_idx[i]] = transform_bbox(refbvhs[refmesh_index.at(mesh)]->Bounds(), m);
+
+                shapedata[i].id = instance->GetId();
+                shapedata[i].mask = instance->GetMask();
+            });
+
+            timer.Lap(m_stats.bounds_ms);
 
             m_bvh->Build(&bounds[0], numfaces);
 
+            timer.Lap(m_stats.build_ms);
+
 #ifdef RR_PROFILE
             m_bvh->PrintStatistics(std::cout);
 #endif
@@ -297,6 +425,50 @@ namespace RadeonRays
             PlainBvhTranslator translator;
             translator.Process(*m_bvh);
 
+            // This number is different from the number of faces for some BVHs 
+            int numindices = (int)m_bvh->GetNumIndices();
+
+            // Append referenced mesh BVHs after the main one, their faces
+            // and object space vertices go after the main ones as well
+            std::vector<int> refroots(refmeshes.size());
+            std::vector<int> reffaces_start_idx(refmeshes.size());
+            std::vector<int> refvertices_start_idx(refmeshes.size());
+            int numreffaces = 0;
+            int numrefvertices = 0;
+
+            for (int k = 0; k < (int)refmeshes.size(); ++k)
+            {
+                reffaces_start_idx[k] = numindices + numreffaces;
+                refvertices_start_idx[k] = numvertices + numrefvertices;
+
+                numreffaces += refmeshes[k]->num_faces();
+                numrefvertices += refmeshes[k]->num_vertices();
+
+                PlainBvhTranslator reftranslator;
+                reftranslator.Process(*refbvhs[k]);
+
+                int root = (int)translator.nodes_.size();
+                refroots[k] = root;
+
+                // Rebase skip links and leaf face indices
+                for (auto node : reftranslator.nodes_)
+                {
+                    if (node.bounds.pmax.w != -1.f)
+                    {
+                        node.bounds.pmax.w += root;
+                    }
+
+                    if (node.bounds.pmin.w != -1.f)
+                    {
+                        node.bounds.pmin.w += reffaces_start_idx[k];
+                    }
+
+                    translator.nodes_.push_back(node);
+                }
+            }
+
+            timer.Lap(m_stats.translate_ms);
+
             // Update GPU data
             // Copy translated nodes first
             m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(PlainBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
@@ -304,54 +476,57 @@ namespace RadeonRays
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_gpudata->vertices = m_device->CreateBuffer((numvertices + numrefvertices) * sizeof(PackedVertex), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
+                PackedVertex* vertexdata = nullptr;
                 Calc::Event* e = nullptr;
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+                m_device->MapBuffer(m_gpudata->vertices, 0, 0, (numvertices + numrefvertices) * sizeof(PackedVertex), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                ParallelFor(0, nummeshes, [&](int i)
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
+                    matrix m, minv;
                     mesh->GetTransform(m, minv);
 
                     //#pragma omp parallel for
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
-                }
+                });
 
-#pragma omp parallel for
-                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+                ParallelFor(nummeshes, firstrefidx, [&](int i)
                 {
                     Instance const* instance = static_cast<Instance const*>(shapes[i]);
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
+                    matrix m, minv;
                     instance->GetTransform(m, minv);
 
                     //#pragma omp parallel for
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
+                    }
+                });
+
+                // Referenced meshes stay in object space
+                for (int k = 0; k < (int)refmeshes.size(); ++k)
+                {
+                    for (int j = 0; j < refmeshes[k]->num_vertices(); ++j)
+                    {
+                        vertexdata[refvertices_start_idx[k] + j] = refmeshes[k]->GetVertex(j);
                     }
                 }
 
@@ -371,22 +546,22 @@ namespace RadeonRays
                     int shapeidx;
                     // Primitive ID within the mesh
                     int id;
-                    // Idx count
+                    // Idx count, 4 for quads
                     int cnt;
 
-                    int padding[2];
+                    // Fourth vertex index of quads
+                    int idx3;
+                    int padding;
                 };
 
-                // This number is different from the number of faces for some BVHs 
-                auto numindices = m_bvh->GetNumIndices();
                 // Create face buffer
-                m_gpudata->faces = m_device->CreateBuffer(numindices * sizeof(Face), Calc::BufferType::kRead);
+                m_gpudata->faces = m_device->CreateBuffer((numindices + numreffaces) * sizeof(Face), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
                 Face* facedata = nullptr;
                 Calc::Event* e = nullptr;
 
-                m_device->MapBuffer(m_gpudata->faces, 0, 0, numindices * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
+                m_device->MapBuffer(m_gpudata->faces, 0, 0, (numindices + numreffaces) * sizeof(Face), Calc::BufferType::kWrite, (void**)&facedata, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
@@ -406,6 +581,19 @@ namespace RadeonRays
                     // Find the index of the shape
                     int shapeidx = static_cast<int>(std::distance(mesh_faces_start_idx.cbegin(), iter) - 1);
 
+                    if (shapeidx >= firstrefidx)
+                    {
+                        // Referenced instance, point to the root of the mesh BVH
+                        auto mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
+
+                        facedata[i].idx[0] = refroots[refmesh_index.at(mesh)];
+                        facedata[i].idx[1] = facedata[i].idx[2] = 0;
+                        facedata[i].shapeidx = shapeidx;
+                        facedata[i].cnt = kInstanceFace;
+                        facedata[i].id = -1;
+                        continue;
+                    }
+
                     // Get the mesh directly or out of instance
                     Mesh const* mesh = nullptr;
                     if (shapeidx < nummeshes)
@@ -417,23 +605,44 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    Mesh::Face const myface = mesh->GetFace(faceidx);
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx[0] = myface.idx[0] + mystartidx;
+                    facedata[i].idx[1] = myface.idx[1] + mystartidx;
+                    facedata[i].idx[2] = myface.idx[2] + mystartidx;
 
                     facedata[i].shapeidx = shapeidx;
-                    facedata[i].cnt = 0;
+                    facedata[i].cnt = (myface.type_ == Mesh::FaceType::QUAD ? 4 : 3);
+                    facedata[i].idx3 = myface.idx[3] + mystartidx;
                     facedata[i].id = faceidx;
                 }
 
+                // Faces of referenced meshes in their BVH order
+                for (int k = 0; k < (int)refmeshes.size(); ++k)
+                {
+                    int const* refreordering = refbvhs[k]->GetIndices();
+
+                    for (int j = 0; j < refmeshes[k]->num_faces(); ++j)
+                    {
+                        int faceidx = refreordering[j];
+                        Mesh::Face const myface = refmeshes[k]->GetFace(faceidx);
+                        Face& face = facedata[reffaces_start_idx[k] + j];
+
+                        face.idx[0] = myface.idx[0] + refvertices_start_idx[k];
+                        face.idx[1] = myface.idx[1] + refvertices_start_idx[k];
+                        face.idx[2] = myface.idx[2] + refvertices_start_idx[k];
+                        face.shapeidx = 0;
+                        face.cnt = (myface.type_ == Mesh::FaceType::QUAD ? 4 : 3);
+                        face.idx3 = myface.idx[3] + refvertices_start_idx[k];
+                        face.id = faceidx;
+                    }
+                }
+
                 m_device->UnmapBuffer(m_gpudata->faces, 0, facedata, &e);
 
                 e->Wait();
@@ -442,17 +651,59 @@ namespace RadeonRays
 
             // Create shapes buffer
             m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
-            // Create helper raycounter buffer
-            m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
+
+            // Keep the shape data to patch ids and masks later on
+            m_gpudata->shape_slots.clear();
+            for (int i = 0; i < numshapes; ++i)
+            {
+                m_gpudata->shape_slots[shapes[i]] = i;
+            }
+            m_gpudata->shapedata = std::move(shapedata);
 
             // Make sure everything is commited
             m_device->Finish(0);
+
+            timer.Lap(m_stats.upload_ms);
+
+            // Referenced mesh BVHs hang below the leaves of the main one
+            int refheight = 0;
+            m_stats.node_count = m_bvh->GetNodeCount();
+            for (auto const& refbvh : refbvhs)
+            {
+                m_stats.node_count += refbvh->GetNodeCount();
+                refheight = std::max(refheight, refbvh->GetHeight());
+            }
+
+            m_stats.height = m_bvh->GetHeight() + refheight;
+            m_stats.sah_cost = m_bvh->GetSahCost();
+            m_stats.memory_bytes = GetBufferSize(m_gpudata->bvh) + GetBufferSize(m_gpudata->vertices) +
+                GetBufferSize(m_gpudata->faces) + GetBufferSize(m_gpudata->shapes);
+        }
+        else if (statechange != ShapeImpl::kStateChangeNone)
+        {
+            ResetPhaseStatistics();
+            PhaseTimer timer;
+
+            // Only ids and masks have changed, patch shape data in place
+            for (auto const& change : world.GetChanges())
+            {
+                auto shapeimpl = static_cast<ShapeImpl const*>(change.shape);
+                int slot = m_gpudata->shape_slots.at(change.shape);
+
+                m_gpudata->shapedata[slot].id = shapeimpl->GetId();
+                m_gpudata->shapedata[slot].mask = shapeimpl->GetMask();
+                m_device->WriteBuffer(m_gpudata->shapes, 0, slot * sizeof(ShapeData), sizeof(ShapeData), &m_gpudata->shapedata[slot], nullptr);
+            }
+
+            m_device->Finish(0);
+
+            timer.Lap(m_stats.upload_ms);
         }
     }
 
     void BvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
     {
-        auto& func = m_gpudata->isect_func;
+        FunctionPool::Lease func(*m_gpudata->isect_func);
 
         // Set args
         int arg = 0;
@@ -467,15 +718,17 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
 
+        SetCounterArgs(func, arg, hits);
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void BvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
     {
-        auto& func = m_gpudata->occlude_func;
+        FunctionPool::Lease func(*m_gpudata->occlude_func);
 
         // Set args
         int arg = 0;
@@ -490,15 +743,27 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
 
+        SetCounterArgs(func, arg, hits);
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void BvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->isect_indirect_func;
+        // Launch only as many threads as the device can keep in flight
+        // and let them pull rays until the device-side count is reached
+        std::size_t maxgroups = (maxrays + kWorkGroupSize - 1) / kWorkGroupSize;
+
+        if (m_gpudata->isect_persistent_func && maxgroups > m_gpudata->num_persistent_groups)
+        {
+            QueryPersistent(*m_gpudata->isect_persistent_func, queueidx, rays, numrays, maxrays, hits, waitevent, event);
+            return;
+        }
+
+        FunctionPool::Lease func(*m_gpudata->isect_indirect_func);
 
         // Set args
         int arg = 0;
@@ -513,15 +778,27 @@ namespace RadeonRays
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
 
+        SetCounterArgs(func, arg, hits);
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void BvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
-        auto& func = m_gpudata->occlude_indirect_func;
+        // Launch only as many threads as the device can keep in flight
+        // and let them pull rays until the device-side count is reached
+        std::size_t maxgroups = (maxrays + kWorkGroupSize - 1) / kWorkGroupSize;
+
+        if (m_gpudata->occlude_persistent_func && maxgroups > m_gpudata->num_persistent_groups)
+        {
+            QueryPersistent(*m_gpudata->occlude_persistent_func, queueidx, rays, numrays, maxrays, hits, waitevent, event);
+            return;
+        }
+
+        FunctionPool::Lease func(*m_gpudata->occlude_indirect_func);
 
         // Set args
         int arg = 0;
@@ -536,10 +813,46 @@ namespace RadeonRays
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
 
+        SetCounterArgs(func, arg, hits);
+
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
+    void BvhStrategy::QueryPersistent(FunctionPool& pool, std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
+    {
+        FunctionPool::Lease func(pool);
+
+        auto raycnt = m_gpudata->raycnt[queueidx];
+
+        // Set args
+        int arg = 0;
+        int offset = 0;
+
+        func->SetArg(arg++, m_gpudata->bvh);
+        func->SetArg(arg++, m_gpudata->vertices);
+        func->SetArg(arg++, m_gpudata->faces);
+        func->SetArg(arg++, m_gpudata->shapes);
+        func->SetArg(arg++, rays);
+        func->SetArg(arg++, sizeof(offset), &offset);
+        func->SetArg(arg++, numrays);
+        func->SetArg(arg++, sizeof(maxrays), &maxrays);
+        func->SetArg(arg++, hits);
+        func->SetArg(arg++, raycnt);
+
+        SetCounterArgs(func, arg, hits);
+
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = m_gpudata->num_persistent_groups * kWorkGroupSize;
+
+        // The counter is shared by all the launches on this queue, so
+        // nothing else may be enqueued between the reset and the kernel
+        static int zero = 0;
+        std::lock_guard<std::mutex> lock(m_gpudata->raycnt_mutex);
+
+        m_device->WriteBuffer(raycnt, queueidx, 0, sizeof(int), &zero, nullptr);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
+    }
 }
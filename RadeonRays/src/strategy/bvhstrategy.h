@@ -31,6 +31,7 @@ THE SOFTWARE.
 namespace RadeonRays
 {
     class Bvh;
+    class FunctionPool;
     
     class BvhStrategy : public Strategy
     {
@@ -70,6 +71,16 @@ namespace RadeonRays
                             Calc::Event** event) const override;
 
     private:
+        // Indirect query using persistent threads
+        void QueryPersistent(FunctionPool& pool,
+                             std::uint32_t queueidx,
+                             Calc::Buffer const* rays,
+                             Calc::Buffer const* numrays,
+                             std::uint32_t maxrays,
+                             Calc::Buffer* hits,
+                             Calc::Event const* waitevent,
+                             Calc::Event** event) const;
+
         struct GpuData;
         struct ShapeData;
 
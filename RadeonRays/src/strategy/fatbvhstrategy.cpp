@@ -23,6 +23,8 @@
 
 #include "calc.h"
 #include "executable.h"
+#include "function_pool.h"
+#include "stack_pool.h"
 #include "../accelerator/bvh.h"
 #include "../accelerator/split_bvh.h"
 #include "../primitive/mesh.h"
@@ -31,8 +33,11 @@
 
 #include "../translator/fatnode_bvh_translator.h"
 #include "../except/except.h"
+#include "../async/task_scheduler.h"
 
 #include <algorithm>
+#include <unordered_map>
+#include <vector>
 
  // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
@@ -69,25 +74,28 @@ namespace RadeonRays
         Calc::Buffer* faces;
         // Shape IDs
         Calc::Buffer* shapes;
+        // Host copy of the shape data and shape indices in it, ids and masks are patched in place
+        std::vector<ShapeData> shapedata;
+        std::unordered_map<Shape const*, int> shape_slots;
         // Counter
         Calc::Buffer* raycnt;
-        // Traversal stack
-        Calc::Buffer* stack;
+        // Traversal stacks (one per queue)
+        StackPool stacks;
 
         Calc::Executable* executable;
-        Calc::Function* isect_func;
-        Calc::Function* occlude_func;
-        Calc::Function* isect_indirect_func;
-        Calc::Function* occlude_indirect_func;
+        std::unique_ptr<FunctionPool> isect_func;
+        std::unique_ptr<FunctionPool> occlude_func;
+        std::unique_ptr<FunctionPool> isect_indirect_func;
+        std::unique_ptr<FunctionPool> occlude_indirect_func;
 
         GpuData(Calc::Device* d)
         : device(d)
+                          , stacks(d)
                           , bvh(nullptr)
                           , vertices(nullptr)
                           , faces(nullptr)
                           , shapes(nullptr)
                           , raycnt(nullptr)
-                          , stack(nullptr)
                           , executable(nullptr)
                           , isect_func(nullptr)
                           , occlude_func(nullptr)
@@ -103,11 +111,10 @@ namespace RadeonRays
             device->DeleteBuffer(faces);
             device->DeleteBuffer(shapes);
             device->DeleteBuffer(raycnt);
-            device->DeleteBuffer(stack);
-            executable->DeleteFunction(isect_func);
-            executable->DeleteFunction(occlude_func);
-            executable->DeleteFunction(isect_indirect_func);
-            executable->DeleteFunction(occlude_indirect_func);
+            isect_func.reset();
+            occlude_func.reset();
+            isect_indirect_func.reset();
+            occlude_indirect_func.reset();
             device->DeleteExecutable(executable);
         }
     };
@@ -124,6 +131,10 @@ namespace RadeonRays
             "";
 #endif
 
+#ifdef RR_TRAVERSAL_COUNTERS
+        buildopts += " -D RR_TRAVERSAL_COUNTERS";
+#endif
+
 #ifndef RR_EMBED_KERNELS
         if (device->GetPlatform() == Calc::Platform::kOpenCL)
         {
@@ -155,18 +166,23 @@ namespace RadeonRays
 
 #endif
 
-        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest");
-        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
-        m_gpudata->isect_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestRC");
-        m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+        m_gpudata->isect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosest"));
+        m_gpudata->occlude_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAny"));
+        m_gpudata->isect_indirect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosestRC"));
+        m_gpudata->occlude_indirect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAnyRC"));
     }
 
     void FatBvhStrategy::Preprocess(World const& world)
     {
 
-        // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed() || world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        int statechange = world.GetStateChange();
+
+        // Ids and masks are patched in place, anything else needs a rebuild
+        if (!m_bvh || world.has_changed() || (statechange & ~(ShapeImpl::kStateChangeId | ShapeImpl::kStateChangeMask)))
         {
+            m_stats = Statistics();
+            PhaseTimer timer;
+
             if (m_bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->bvh);
@@ -192,12 +208,12 @@ namespace RadeonRays
             std::vector<int> mesh_vertices_start_idx(numshapes);
             std::vector<int> mesh_faces_start_idx(numshapes);
 
-            auto builder = world.options_.GetOption("bvh.builder");
-            auto splits = world.options_.GetOption("bvh.sah.use_splits");
-            auto maxdepth = world.options_.GetOption("bvh.sah.max_split_depth");
-            auto overlap = world.options_.GetOption("bvh.sah.min_overlap");
-            auto tcost = world.options_.GetOption("bvh.sah.traversal_cost");
-            auto node_budget = world.options_.GetOption("bvh.sah.extra_node_budget");
+            auto builder = GetOption(world.options_, "bvh.builder");
+            auto splits = GetOption(world.options_, "bvh.sah.use_splits");
+            auto maxdepth = GetOption(world.options_, "bvh.sah.max_split_depth");
+            auto overlap = GetOption(world.options_, "bvh.sah.min_overlap");
+            auto tcost = GetOption(world.options_, "bvh.sah.traversal_cost");
+            auto node_budget = GetOption(world.options_, "bvh.sah.extra_node_budget");
 
             bool use_sah = false;
             bool use_splits = false;
@@ -264,8 +280,7 @@ namespace RadeonRays
             std::vector<ShapeData>  shapedata(numshapes);
 
             // We handle meshes first collecting their world space bounds
-#pragma omp parallel for
-            for (int i = 0; i < nummeshes; ++i)
+            ParallelFor(0, nummeshes, [&](int i)
             {
                 Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
 
@@ -277,11 +292,10 @@ namespace RadeonRays
 
                 shapedata[i].id = mesh->GetId();
                 shapedata[i].mask = mesh->GetMask();
-            }
+            });
 
             // Then we handle instances. Need to flatten them into actual geometry.
-#pragma omp parallel for
-            for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+            ParallelFor(nummeshes, nummeshes + numinstances, [&](int i)
             {
                 Instance const* instance = static_cast<Instance const*>(shapes[i]);
                 Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
@@ -300,10 +314,14 @@ namespace RadeonRays
 
                 shapedata[i].id = instance->GetId();
                 shapedata[i].mask = instance->GetMask();
-            }
+            });
+
+            timer.Lap(m_stats.bounds_ms);
 
             m_bvh->Build(&bounds[0], numfaces);
 
+            timer.Lap(m_stats.build_ms);
+
 #ifdef RR_PROFILE
             m_bvh->PrintStatistics(std::cout);
 #endif
@@ -318,6 +336,8 @@ namespace RadeonRays
             FatNodeBvhTranslator translator;
             translator.Process(*m_bvh);
 
+            timer.Lap(m_stats.translate_ms);
+
             // Update GPU data
             // Copy translated nodes first
             m_gpudata->bvh = m_device->CreateBuffer(translator.nodes_.size() * sizeof(FatNodeBvhTranslator::Node), Calc::BufferType::kRead, &translator.nodes_[0]);
@@ -325,57 +345,51 @@ namespace RadeonRays
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(PackedVertex), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
+                PackedVertex* vertexdata = nullptr;
                 Calc::Event* e = nullptr;
 
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(PackedVertex), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
-#pragma omp parallel for
-                for (int i = 0; i < nummeshes; ++i)
+                ParallelFor(0, nummeshes, [&](int i)
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(shapes[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
+                    matrix m, minv;
                     mesh->GetTransform(m, minv);
 
                     //#pragma omp parallel for
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
-                }
+                });
 
-#pragma omp parallel for
-                for (int i = nummeshes; i < nummeshes + numinstances; ++i)
+                ParallelFor(nummeshes, nummeshes + numinstances, [&](int i)
                 {
                     Instance const* instance = static_cast<Instance const*>(shapes[i]);
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(instance->GetBaseShape());
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
+                    matrix m, minv;
                     instance->GetTransform(m, minv);
 
                     //#pragma omp parallel for
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
-                }
+                });
 
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
                 e->Wait();
@@ -392,10 +406,12 @@ namespace RadeonRays
                     int shapeidx;
                     // Primitive ID within the mesh
                     int id;
-                    // Idx count
+                    // Idx count, 4 for quads
                     int cnt;
 
-                    int padding[2];
+                    // Fourth vertex index of quads
+                    int idx3;
+                    int padding;
                 };
 
                 // This number is different from the number of faces for some BVHs 
@@ -438,20 +454,20 @@ namespace RadeonRays
                         mesh = static_cast<Mesh const*>(static_cast<Instance const*>(shapes[shapeidx])->GetBaseShape());
                     }
 
-                    // Get vertex buffer of the current mesh
-                    Mesh::Face const* myfacedata = mesh->GetFaceData();
                     // Find face idx
                     int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                    Mesh::Face const myface = mesh->GetFace(faceidx);
                     // Find mesh start idx
                     int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                     // Copy face data to GPU buffer
-                    facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                    facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                    facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                    facedata[i].idx[0] = myface.idx[0] + mystartidx;
+                    facedata[i].idx[1] = myface.idx[1] + mystartidx;
+                    facedata[i].idx[2] = myface.idx[2] + mystartidx;
 
                     facedata[i].shapeidx = shapeidx;
-                    facedata[i].cnt = 0;
+                    facedata[i].cnt = (myface.type_ == Mesh::FaceType::QUAD ? 4 : 3);
+                    facedata[i].idx3 = myface.idx[3] + mystartidx;
                     facedata[i].id = faceidx;
                 }
 
@@ -464,14 +480,51 @@ namespace RadeonRays
             // Create shapes buffer
             m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapedata[0]);
 
+            // Keep the shape data to patch ids and masks later on
+            m_gpudata->shape_slots.clear();
+            for (int i = 0; i < numshapes; ++i)
+            {
+                m_gpudata->shape_slots[shapes[i]] = i;
+            }
+            m_gpudata->shapedata = std::move(shapedata);
+
             // Create helper raycounter buffer
             m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
 
             // Stack
-            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
+            m_gpudata->stacks.Release();
+            m_gpudata->stacks.Reserve(0, kMaxBatchSize*kMaxStackSize);
 
             // Make sure everything is commited
             m_device->Finish(0);
+
+            timer.Lap(m_stats.upload_ms);
+
+            m_stats.node_count = m_bvh->GetNodeCount();
+            m_stats.height = m_bvh->GetHeight();
+            m_stats.sah_cost = m_bvh->GetSahCost();
+            m_stats.memory_bytes = GetBufferSize(m_gpudata->bvh) + GetBufferSize(m_gpudata->vertices) +
+                GetBufferSize(m_gpudata->faces) + GetBufferSize(m_gpudata->shapes);
+        }
+        else if (statechange != ShapeImpl::kStateChangeNone)
+        {
+            ResetPhaseStatistics();
+            PhaseTimer timer;
+
+            // Only ids and masks have changed, patch shape data in place
+            for (auto const& change : world.GetChanges())
+            {
+                auto shapeimpl = static_cast<ShapeImpl const*>(change.shape);
+                int slot = m_gpudata->shape_slots.at(change.shape);
+
+                m_gpudata->shapedata[slot].id = shapeimpl->GetId();
+                m_gpudata->shapedata[slot].mask = shapeimpl->GetMask();
+                m_device->WriteBuffer(m_gpudata->shapes, 0, slot * sizeof(ShapeData), sizeof(ShapeData), &m_gpudata->shapedata[slot], nullptr);
+            }
+
+            m_device->Finish(0);
+
+            timer.Lap(m_stats.upload_ms);
         }
     }
 
@@ -479,14 +532,9 @@ namespace RadeonRays
     {
         size_t stack_size = 4 * numrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
         // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
-        {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
+        StackPool::Lease stack(m_gpudata->stacks, queueidx, stack_size);
 
-        auto& func = m_gpudata->isect_func;
+        FunctionPool::Lease func(*m_gpudata->isect_func);
 
         // Set args
         int arg = 0;
@@ -500,26 +548,23 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
+
+        SetCounterArgs(func, arg, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void FatBvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
     {
         size_t stack_size = 4 * numrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
         // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
-        {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
+        StackPool::Lease stack(m_gpudata->stacks, queueidx, stack_size);
 
-        auto& func = m_gpudata->occlude_func;
+        FunctionPool::Lease func(*m_gpudata->occlude_func);
 
         // Set args
         int arg = 0;
@@ -533,26 +578,23 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
+
+        SetCounterArgs(func, arg, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void FatBvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
         size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
         // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
-        {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
+        StackPool::Lease stack(m_gpudata->stacks, queueidx, stack_size);
 
-        auto& func = m_gpudata->isect_indirect_func;
+        FunctionPool::Lease func(*m_gpudata->isect_indirect_func);
 
         // Set args
         int arg = 0;
@@ -566,26 +608,23 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
+
+        SetCounterArgs(func, arg, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void FatBvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
     {
         size_t stack_size = 4 * maxrays * kMaxStackSize; //required stack size, kMaxStackSize * sizeof(int) bytes per ray
         // Check if we need to relocate memory
-        if (stack_size > m_gpudata->stack->GetSize())
-        {
-            m_device->DeleteBuffer(m_gpudata->stack);
-            m_gpudata->stack = nullptr;
-            m_gpudata->stack = m_device->CreateBuffer(stack_size, Calc::BufferType::kWrite);
-        }
+        StackPool::Lease stack(m_gpudata->stacks, queueidx, stack_size);
 
-        auto& func = m_gpudata->occlude_indirect_func;
+        FunctionPool::Lease func(*m_gpudata->occlude_indirect_func);
 
         // Set args
         int arg = 0;
@@ -599,11 +638,13 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
+
+        SetCounterArgs(func, arg, hits);
 
         size_t localsize = kWorkGroupSize;
         size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 }
@@ -0,0 +1,122 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "calc.h"
+#include "executable.h"
+
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< Pool of Calc functions created for the same kernel.
+    ///< Kernel arguments are state of a function object, so queries issued
+    ///< from several host threads must not share it. A query leases a function,
+    ///< sets the arguments and executes it: the arguments are captured at submission,
+    ///< so the function is returned to the pool right after that.
+    ///<
+    class FunctionPool
+    {
+    public:
+        // Scoped function lease
+        class Lease
+        {
+        public:
+            Lease(FunctionPool& pool)
+                : m_pool(pool)
+                , m_func(pool.Acquire())
+            {
+            }
+
+            ~Lease()
+            {
+                m_pool.Release(m_func);
+            }
+
+            Calc::Function* operator->() const { return m_func; }
+            operator Calc::Function*() const { return m_func; }
+
+            Lease(Lease const&) = delete;
+            Lease& operator = (Lease const&) = delete;
+
+        private:
+            FunctionPool& m_pool;
+            Calc::Function* m_func;
+        };
+
+        FunctionPool(Calc::Executable* executable, char const* name)
+            : m_executable(executable)
+            , m_name(name)
+        {
+            // Most of the time there is a single submitting thread
+            m_free.push_back(m_executable->CreateFunction(m_name.c_str()));
+            m_all = m_free;
+        }
+
+        ~FunctionPool()
+        {
+            for (auto func : m_all)
+            {
+                m_executable->DeleteFunction(func);
+            }
+        }
+
+        Calc::Function* Acquire()
+        {
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+
+                if (!m_free.empty())
+                {
+                    auto func = m_free.back();
+                    m_free.pop_back();
+                    return func;
+                }
+            }
+
+            // Function creation might be expensive, do not hold the lock
+            auto func = m_executable->CreateFunction(m_name.c_str());
+
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_all.push_back(func);
+            return func;
+        }
+
+        void Release(Calc::Function* func)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_free.push_back(func);
+        }
+
+        FunctionPool(FunctionPool const&) = delete;
+        FunctionPool& operator = (FunctionPool const&) = delete;
+
+    private:
+        Calc::Executable* m_executable;
+        std::string m_name;
+        std::vector<Calc::Function*> m_all;
+        std::vector<Calc::Function*> m_free;
+        std::mutex m_mutex;
+    };
+}
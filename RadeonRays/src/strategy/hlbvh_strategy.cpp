@@ -30,12 +30,18 @@ THE SOFTWARE.
 
 #include "device.h"
 #include "executable.h"
+#include "function_pool.h"
+#include "stack_pool.h"
 #include "../except/except.h"
+#include "../async/task_scheduler.h"
 #include <algorithm>
+#include <unordered_map>
+#include <vector>
 
 // Preferred work group size for Radeon devices
 static int const kWorkGroupSize = 64;
-static int const kMaxStackSize = 48;
+// Global traversal stack entries per work item, see hlbvh.cl
+static int const kGlobalStackSize = 32;
 static int const kMaxBatchSize = 2048 * 2048;
 
 namespace RadeonRays
@@ -67,19 +73,23 @@ namespace RadeonRays
         Calc::Buffer* faces;
         // Shape IDs
         Calc::Buffer* shapes;
+        // Host copy of the shape data and shape indices in it, ids and masks are patched in place
+        std::vector<ShapeData> shapedata;
+        std::unordered_map<Shape const*, int> shape_slots;
         // Counter
         Calc::Buffer* raycnt;
-        // Traversal stack
-        Calc::Buffer* stack;
+        // Traversal stacks (one per queue)
+        StackPool stacks;
 
         Calc::Executable* executable;
-        Calc::Function* isect_func;
-        Calc::Function* occlude_func;
-        Calc::Function* isect_indirect_func;
-        Calc::Function* occlude_indirect_func;
+        std::unique_ptr<FunctionPool> isect_func;
+        std::unique_ptr<FunctionPool> occlude_func;
+        std::unique_ptr<FunctionPool> isect_indirect_func;
+        std::unique_ptr<FunctionPool> occlude_indirect_func;
 
         GpuData(Calc::Device* d)
             : device(d)
+            , stacks(d)
             , vertices(nullptr)
             , faces(nullptr)
             , shapes(nullptr)
@@ -93,11 +103,10 @@ namespace RadeonRays
             device->DeleteBuffer(faces);
             device->DeleteBuffer(shapes);
             device->DeleteBuffer(raycnt);
-            device->DeleteBuffer(stack);
-            executable->DeleteFunction(isect_func);
-            executable->DeleteFunction(occlude_func);
-            executable->DeleteFunction(isect_indirect_func);
-            executable->DeleteFunction(occlude_indirect_func);
+            isect_func.reset();
+            occlude_func.reset();
+            isect_indirect_func.reset();
+            occlude_indirect_func.reset();
             device->DeleteExecutable(executable);
         }
     };
@@ -114,6 +123,10 @@ namespace RadeonRays
             "";
 #endif
 
+#ifdef RR_TRAVERSAL_COUNTERS
+        buildopts += " -D RR_TRAVERSAL_COUNTERS";
+#endif
+
 #ifndef RR_EMBED_KERNELS
         if ( device->GetPlatform() == Calc::Platform::kOpenCL )
         {
@@ -145,24 +158,35 @@ namespace RadeonRays
 
 #endif
 
-        m_gpudata->isect_func = m_gpudata->executable->CreateFunction("IntersectClosest");
-        m_gpudata->occlude_func = m_gpudata->executable->CreateFunction("IntersectAny");
-        m_gpudata->isect_indirect_func = m_gpudata->executable->CreateFunction("IntersectClosestRC");
-        m_gpudata->occlude_indirect_func = m_gpudata->executable->CreateFunction("IntersectAnyRC");
+        m_gpudata->isect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosest"));
+        m_gpudata->occlude_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAny"));
+        m_gpudata->isect_indirect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectClosestRC"));
+        m_gpudata->occlude_indirect_func.reset(new FunctionPool(m_gpudata->executable, "IntersectAnyRC"));
     }
 
     void HlbvhStrategy::Preprocess(World const& world)
     {
+        int statechange = world.GetStateChange();
+        bool rebuild = !m_bvh || world.has_changed();
+
+        // Incremental updates below add up their phase times
+        if (!rebuild && statechange != ShapeImpl::kStateChangeNone)
+        {
+            ResetPhaseStatistics();
+        }
+
         // If something has been changed we need to rebuild BVH
-        if (!m_bvh || world.has_changed())
+        if (rebuild)
         {
+            m_stats = Statistics();
+            PhaseTimer timer;
+
             if (m_bvh)
             {
                 m_device->DeleteBuffer(m_gpudata->vertices);
                 m_device->DeleteBuffer(m_gpudata->faces);
                 m_device->DeleteBuffer(m_gpudata->shapes);
                 m_device->DeleteBuffer(m_gpudata->raycnt);
-                m_device->DeleteBuffer(m_gpudata->stack);
             }
             
             int numshapes = (int)world.shapes_.size();
@@ -192,8 +216,7 @@ namespace RadeonRays
             std::vector<bbox> bounds(numfaces);
             std::vector<ShapeData> shapes(numshapes);
 
-#pragma omp parallel for
-            for (int i = 0; i < numshapes; ++i)
+            ParallelFor(0, numshapes, [&](int i)
             {
                 Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
 
@@ -204,45 +227,47 @@ namespace RadeonRays
 
                 shapes[i].id = mesh->GetId();
                 shapes[i].mask = mesh->GetMask();
-            }
+            });
 
+            timer.Lap(m_stats.bounds_ms);
+
+            // Construction runs on the device, wait for it to measure the build
             m_bvh->Build(&bounds[0], numfaces);
+            m_device->Finish(0);
+
+            timer.Lap(m_stats.build_ms);
 
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(PackedVertex), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
+                PackedVertex* vertexdata = nullptr;
                 Calc::Event* e = nullptr;
 
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(PackedVertex), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
-#pragma omp parallel for
-                for (int i = 0; i < numshapes; ++i)
+                ParallelFor(0, numshapes, [&](int i)
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
+                    matrix m, minv;
                     mesh->GetTransform(m, minv);
 
                     //#pragma omp parallel for
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
-                }
+                });
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e); 
 
                 e->Wait();
@@ -260,8 +285,12 @@ namespace RadeonRays
                     int shapeidx;
                     // Primitive ID within the mesh
                     int id;
-                    // Idx count
+                    // Idx count, 4 for quads
                     int cnt;
+                    // Fourth vertex index of quads
+                    int idx3;
+
+                    int padding;
                 };
 
                 // Create face buffer
@@ -274,8 +303,12 @@ namespace RadeonRays
                         int shapeidx;
                         // Primitive ID within the mesh
                         int id;
-                        // Idx count
+                        // Idx count, 4 for quads
                         int cnt;
+                        // Fourth vertex index of quads
+                        int idx3;
+
+                        int padding;
                     };
 
                     // Create face buffer
@@ -306,20 +339,20 @@ namespace RadeonRays
 
                         // Get the mesh
                         Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[shapeidx]);
-                        // Get vertex buffer of the current mesh
-                        Mesh::Face const* myfacedata = mesh->GetFaceData();
                         // Find face idx
                         int faceidx = indextolook4 - mesh_faces_start_idx[shapeidx];
+                        Mesh::Face const myface = mesh->GetFace(faceidx);
                         // Find mesh start idx
                         int mystartidx = mesh_vertices_start_idx[shapeidx];
 
                         // Copy face data to GPU buffer
-                        facedata[i].idx[0] = myfacedata[faceidx].idx[0] + mystartidx;
-                        facedata[i].idx[1] = myfacedata[faceidx].idx[1] + mystartidx;
-                        facedata[i].idx[2] = myfacedata[faceidx].idx[2] + mystartidx;
+                        facedata[i].idx[0] = myface.idx[0] + mystartidx;
+                        facedata[i].idx[1] = myface.idx[1] + mystartidx;
+                        facedata[i].idx[2] = myface.idx[2] + mystartidx;
 
                         facedata[i].shapeidx = shapeidx;
-                        facedata[i].cnt = (myfacedata[faceidx].type_ == Mesh::FaceType::QUAD ? 4 : 3);
+                        facedata[i].cnt = (myface.type_ == Mesh::FaceType::QUAD ? 4 : 3);
+                        facedata[i].idx3 = myface.idx[3] + mystartidx;
                         facedata[i].id = faceidx;
                     }
 
@@ -332,15 +365,31 @@ namespace RadeonRays
 
             // Create shapes buffer
             m_gpudata->shapes = m_device->CreateBuffer(numshapes * sizeof(ShapeData), Calc::BufferType::kRead, &shapes[0]);
+
+            // Keep the shape data to patch ids and masks later on
+            m_gpudata->shape_slots.clear();
+            for (int i = 0; i < numshapes; ++i)
+            {
+                m_gpudata->shape_slots[world.shapes_[i]] = i;
+            }
+            m_gpudata->shapedata = std::move(shapes);
             // Create helper raycounter buffer
             m_gpudata->raycnt = m_device->CreateBuffer(sizeof(int), Calc::BufferType::kWrite);
-            // Stack
-            m_gpudata->stack = m_device->CreateBuffer(kMaxBatchSize*kMaxStackSize, Calc::BufferType::kWrite);
             // Make sure everything is commited
             m_device->Finish(0);
+
+            timer.Lap(m_stats.upload_ms);
+
+            // Tree shape is only known to the device, LBVH always has 2n - 1 nodes
+            m_stats.node_count = numfaces > 0 ? 2 * numfaces - 1 : 0;
+            m_stats.memory_bytes = GetBufferSize(m_bvh->GetGpuData().nodes) + GetBufferSize(m_bvh->GetGpuData().sorted_bounds) +
+                GetBufferSize(m_gpudata->vertices) + GetBufferSize(m_gpudata->faces) + GetBufferSize(m_gpudata->shapes);
         }
-        else if (world.GetStateChange() != ShapeImpl::kStateChangeNone)
+        // Transforms need the BVH to be rebuilt on the device, ids and masks only touch shape data
+        else if (statechange & ~(ShapeImpl::kStateChangeId | ShapeImpl::kStateChangeMask))
         {
+            PhaseTimer timer;
+
             int numshapes = (int)world.shapes_.size();
             int numvertices = 0;
             int numfaces = 0;
@@ -367,8 +416,7 @@ namespace RadeonRays
             // We can't avoid allocating it here, since bounds aren't stored anywhere
             std::vector<bbox> bounds(numfaces);
 
-#pragma omp parallel for
-            for (int i = 0; i < numshapes; ++i)
+            ParallelFor(0, numshapes, [&](int i)
             {
                 Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
 
@@ -376,50 +424,75 @@ namespace RadeonRays
                 {
                     mesh->GetFaceBounds(j, false, bounds[mesh_faces_start_idx[i] + j]);
                 }
-            }
+            });
 
+            timer.Lap(m_stats.bounds_ms);
+
+            // Construction runs on the device, wait for it to measure the build
             m_bvh->Build(&bounds[0], numfaces);
+            m_device->Finish(0);
+
+            timer.Lap(m_stats.build_ms);
 
             // Create vertex buffer
             {
                 // Vertices
-                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(float3), Calc::BufferType::kRead);
+                m_device->DeleteBuffer(m_gpudata->vertices);
+                m_gpudata->vertices = m_device->CreateBuffer(numvertices * sizeof(PackedVertex), Calc::BufferType::kRead);
 
                 // Get the pointer to mapped data
-                float3* vertexdata = nullptr;
+                PackedVertex* vertexdata = nullptr;
                 Calc::Event* e = nullptr;
 
-                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(float3), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
+                m_device->MapBuffer(m_gpudata->vertices, 0, 0, numvertices * sizeof(PackedVertex), Calc::MapType::kMapWrite, (void**)&vertexdata, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
 
                 // Here we need to put data in world space rather than object space
                 // So we need to get the transform from the mesh and multiply each vertex
-                matrix m, minv;
-
-#pragma omp parallel for
-                for (int i = 0; i < numshapes; ++i)
+                ParallelFor(0, numshapes, [&](int i)
                 {
                     // Get the mesh
                     Mesh const* mesh = static_cast<Mesh const*>(world.shapes_[i]);
-                    // Get vertex buffer of the current mesh
-                    float3 const* myvertexdata = mesh->GetVertexData();
                     // Get mesh transform
+                    matrix m, minv;
                     mesh->GetTransform(m, minv);
 
                     //#pragma omp parallel for
                     // Iterate thru vertices multiply and append them to GPU buffer
                     for (int j = 0; j < mesh->num_vertices(); ++j)
                     {
-                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(myvertexdata[j], m);
+                        vertexdata[mesh_vertices_start_idx[i] + j] = transform_point(mesh->GetVertex(j), m);
                     }
-                }
+                });
                 m_device->UnmapBuffer(m_gpudata->vertices, 0, vertexdata, &e);
 
                 e->Wait();
                 m_device->DeleteEvent(e);
             }
+
+            timer.Lap(m_stats.upload_ms);
+        }
+
+        // Ids and masks are patched in place
+        if (!rebuild && (statechange & (ShapeImpl::kStateChangeId | ShapeImpl::kStateChangeMask)))
+        {
+            PhaseTimer timer;
+
+            for (auto const& change : world.GetChanges())
+            {
+                auto shapeimpl = static_cast<ShapeImpl const*>(change.shape);
+                int slot = m_gpudata->shape_slots.at(change.shape);
+
+                m_gpudata->shapedata[slot].id = shapeimpl->GetId();
+                m_gpudata->shapedata[slot].mask = shapeimpl->GetMask();
+                m_device->WriteBuffer(m_gpudata->shapes, 0, slot * sizeof(ShapeData), sizeof(ShapeData), &m_gpudata->shapedata[slot], nullptr);
+            }
+
+            m_device->Finish(0);
+
+            timer.Lap(m_stats.upload_ms);
         }
     }
 
@@ -431,7 +504,12 @@ namespace RadeonRays
             throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
         }
 
-        auto& func = m_gpudata->isect_func;
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        StackPool::Lease stack(m_gpudata->stacks, queueidx, globalsize * kGlobalStackSize * sizeof(int));
+
+        FunctionPool::Lease func(*m_gpudata->isect_func);
 
         // Set args
         int arg = 0;
@@ -446,12 +524,11 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        SetCounterArgs(func, arg, hits);
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void HlbvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, std::uint32_t numrays, Calc::Buffer *hits, Calc::Event const* waitevent, Calc::Event **event) const
@@ -462,7 +539,12 @@ namespace RadeonRays
             throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
         }
 
-        auto& func = m_gpudata->occlude_func;
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        StackPool::Lease stack(m_gpudata->stacks, queueidx, globalsize * kGlobalStackSize * sizeof(int));
+
+        FunctionPool::Lease func(*m_gpudata->occlude_func);
 
         // Set args
         int arg = 0;
@@ -477,12 +559,11 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, sizeof(numrays), &numrays);
         func->SetArg(arg++, hits);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((numrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        SetCounterArgs(func, arg, hits);
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void HlbvhStrategy::QueryIntersection(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
@@ -493,7 +574,12 @@ namespace RadeonRays
             throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
         }
 
-        auto& func = m_gpudata->isect_indirect_func;
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        StackPool::Lease stack(m_gpudata->stacks, queueidx, globalsize * kGlobalStackSize * sizeof(int));
+
+        FunctionPool::Lease func(*m_gpudata->isect_indirect_func);
 
         // Set args
         int arg = 0;
@@ -508,12 +594,11 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        SetCounterArgs(func, arg, hits);
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
     void HlbvhStrategy::QueryOcclusion(std::uint32_t queueidx, Calc::Buffer const* rays, Calc::Buffer const* numrays, std::uint32_t maxrays, Calc::Buffer* hits, Calc::Event const* waitevent, Calc::Event** event) const
@@ -524,7 +609,12 @@ namespace RadeonRays
             throw ExceptionImpl("hlbvh accelerator max batch size exceeded");
         }
 
-        auto& func = m_gpudata->occlude_indirect_func;
+        size_t localsize = kWorkGroupSize;
+        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+
+        StackPool::Lease stack(m_gpudata->stacks, queueidx, globalsize * kGlobalStackSize * sizeof(int));
+
+        FunctionPool::Lease func(*m_gpudata->occlude_indirect_func);
 
         // Set args
         int arg = 0;
@@ -539,12 +629,11 @@ namespace RadeonRays
         func->SetArg(arg++, sizeof(offset), &offset);
         func->SetArg(arg++, numrays);
         func->SetArg(arg++, hits);
-        func->SetArg(arg++, m_gpudata->stack);
+        func->SetArg(arg++, stack);
 
-        size_t localsize = kWorkGroupSize;
-        size_t globalsize = ((maxrays + kWorkGroupSize - 1) / kWorkGroupSize) * kWorkGroupSize;
+        SetCounterArgs(func, arg, hits);
 
-        m_device->Execute(func, queueidx, globalsize, localsize, event);
+        m_device->Execute(func, queueidx, globalsize, localsize, &waitevent, waitevent ? 1 : 0, event);
     }
 
 }
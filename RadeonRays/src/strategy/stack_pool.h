@@ -0,0 +1,126 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#include "calc.h"
+#include "device.h"
+
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+namespace RadeonRays
+{
+    ///< Traversal stack buffers, one per queue.
+    ///< Batches in flight on different queues must not share a stack, while
+    ///< batches on the same queue run in order and reuse it. A query leases the
+    ///< stack of its queue, which keeps the pool locked until the query is submitted
+    ///< so the buffer can't be reallocated under it.
+    ///<
+    class StackPool
+    {
+    public:
+        // Scoped stack lease
+        class Lease
+        {
+        public:
+            Lease(StackPool& pool, std::uint32_t queue, std::size_t size)
+                : m_lock(pool.m_mutex)
+                , m_stack(pool.Get(queue, size))
+            {
+            }
+
+            operator Calc::Buffer*() const { return m_stack; }
+
+            Lease(Lease const&) = delete;
+            Lease& operator = (Lease const&) = delete;
+
+        private:
+            std::lock_guard<std::mutex> m_lock;
+            Calc::Buffer* m_stack;
+        };
+
+        StackPool(Calc::Device* device)
+            : m_device(device)
+        {
+        }
+
+        ~StackPool()
+        {
+            Release();
+        }
+
+        // Make sure the stack of the queue can hold size bytes
+        void Reserve(std::uint32_t queue, std::size_t size)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            Get(queue, size);
+        }
+
+        // Delete all the stacks
+        void Release()
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+
+            for (auto stack : m_stacks)
+            {
+                if (stack)
+                {
+                    m_device->DeleteBuffer(stack);
+                }
+            }
+
+            m_stacks.clear();
+        }
+
+        StackPool(StackPool const&) = delete;
+        StackPool& operator = (StackPool const&) = delete;
+
+    private:
+        // Get the stack of the queue making sure it can hold size bytes, the pool has to be locked
+        Calc::Buffer* Get(std::uint32_t queue, std::size_t size)
+        {
+            if (queue >= m_stacks.size())
+            {
+                m_stacks.resize(queue + 1, nullptr);
+            }
+
+            auto& stack = m_stacks[queue];
+
+            if (!stack || size > stack->GetSize())
+            {
+                if (stack)
+                {
+                    m_device->DeleteBuffer(stack);
+                }
+
+                stack = m_device->CreateBuffer(size, Calc::BufferType::kWrite);
+            }
+
+            return stack;
+        }
+
+        Calc::Device* m_device;
+        std::vector<Calc::Buffer*> m_stacks;
+        std::mutex m_mutex;
+    };
+}
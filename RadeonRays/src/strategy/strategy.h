@@ -26,18 +26,40 @@ THE SOFTWARE.
 #include "calc.h"
 #include "buffer.h"
 #include "event.h"
+#include "executable.h"
+#include "../util/options.h"
+
+#include <chrono>
 
 namespace RadeonRays
 {
     class World;
 
+    ///< Splits a Preprocess call into phases for Statistics,
+    ///< every Lap adds the time since the previous one.
+    class PhaseTimer
+    {
+    public:
+        PhaseTimer() : m_last(std::chrono::high_resolution_clock::now()) {}
+
+        void Lap(float& ms)
+        {
+            auto now = std::chrono::high_resolution_clock::now();
+            ms += std::chrono::duration<float, std::milli>(now - m_last).count();
+            m_last = now;
+        }
+
+    private:
+        std::chrono::high_resolution_clock::time_point m_last;
+    };
+
     ///< Interface for a specific intersection algorithm based on Calc.
     ///< CalcIntersectionDevice uses this interface to select different algorithms.
     class Strategy
     {
     public:
         // Pass Calc::Device in
-        Strategy(Calc::Device* device) : m_device(device) {}
+        Strategy(Calc::Device* device) : m_device(device), m_stats(), m_counters(nullptr) {}
         virtual ~Strategy() = default;
 
         // Perform scene preprocessing
@@ -77,11 +99,62 @@ namespace RadeonRays
                                     Calc::Event const* waitevent,
                                     Calc::Event** event) const = 0;
 
+        // Build measurements of the last Preprocess call, query fields are not used
+        Statistics const& GetStatistics() const { return m_stats; }
+
+        // Side buffer the kernels built with RR_TRAVERSAL_COUNTERS write TraversalCounters
+        // of every ray to, indexed like the rays. nullptr disables counting.
+        void SetTraversalCounters(Calc::Buffer* counters) { m_counters = counters; }
+
+        // Options taking precedence over the world ones on the next Preprocess calls,
+        // the autotuner pins its choice with them without copying the world
+        void SetOptionOverrides(Options const& overrides) { m_overrides = overrides; }
+
         Strategy(Strategy const&) = delete;
         Strategy& operator = (Strategy const&) = delete;
 
     protected:
+        // Start the measurements of an incremental update, structure fields are kept
+        void ResetPhaseStatistics()
+        {
+            m_stats.bounds_ms = m_stats.build_ms = m_stats.translate_ms = m_stats.upload_ms = 0.f;
+        }
+
+        // Look up an option of the world options, overrides first
+        Options::Option const* GetOption(Options const& options, std::string const& name) const
+        {
+            auto option = m_overrides.GetOption(name);
+            return option ? option : options.GetOption(name);
+        }
+
+        static std::uint64_t GetBufferSize(Calc::Buffer const* buffer)
+        {
+            return buffer ? buffer->GetSize() : 0;
+        }
+
+        // Set the trailing counter arguments of instrumented OpenCL kernels,
+        // fallback is bound if counting is disabled and never written then
+#ifdef RR_TRAVERSAL_COUNTERS
+        void SetCounterArgs(Calc::Function* func, int& arg, Calc::Buffer const* fallback) const
+        {
+            if (m_device->GetPlatform() == Calc::Platform::kOpenCL)
+            {
+                int enabled = m_counters ? 1 : 0;
+                func->SetArg(arg++, m_counters ? m_counters : fallback);
+                func->SetArg(arg++, sizeof(enabled), &enabled);
+            }
+        }
+#else
+        void SetCounterArgs(Calc::Function*, int&, Calc::Buffer const*) const {}
+#endif
+
         Calc::Device* m_device;
+        // Filled by Preprocess
+        Statistics m_stats;
+        // Traversal counter side buffer, not owned
+        Calc::Buffer* m_counters;
+        // See SetOptionOverrides
+        Options m_overrides;
     };
 }
 
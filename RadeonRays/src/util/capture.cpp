@@ -0,0 +1,193 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "capture.h"
+
+#include "../world/world.h"
+#include "../primitive/mesh.h"
+#include "../primitive/instance.h"
+#include "../except/except.h"
+
+#include <algorithm>
+#include <fstream>
+#include <map>
+#include <vector>
+
+namespace RadeonRays
+{
+    // The option enabling the capture is not part of the captured scene
+    static char const* kCaptureDirOption = "debug.capture_dir";
+
+    template <typename T>
+    static void Write(std::ofstream& out, T const& value)
+    {
+        out.write(reinterpret_cast<char const*>(&value), sizeof(T));
+    }
+
+    static void WriteString(std::ofstream& out, std::string const& value)
+    {
+        Write(out, static_cast<std::uint32_t>(value.size()));
+        out.write(value.data(), value.size());
+    }
+
+    static void WriteOptions(std::ofstream& out, Options const& options)
+    {
+        std::vector<std::string> names = options.GetNames();
+        names.erase(std::remove(names.begin(), names.end(), kCaptureDirOption), names.end());
+
+        Write(out, static_cast<std::uint32_t>(names.size()));
+
+        for (auto& name : names)
+        {
+            auto option = options.GetOption(name);
+
+            if (option->type == Options::Option::kFloat)
+            {
+                Write(out, static_cast<std::uint32_t>(kCaptureOptionFloat));
+                WriteString(out, name);
+                Write(out, option->AsFloat());
+            }
+            else
+            {
+                Write(out, static_cast<std::uint32_t>(kCaptureOptionString));
+                WriteString(out, name);
+                WriteString(out, option->AsString());
+            }
+        }
+    }
+
+    static void WriteMesh(std::ofstream& out, Mesh const* mesh)
+    {
+        Write(out, static_cast<std::int32_t>(mesh->num_vertices()));
+        Write(out, static_cast<std::int32_t>(mesh->num_faces()));
+
+        for (int i = 0; i < mesh->num_vertices(); ++i)
+        {
+            Write(out, PackedVertex(mesh->GetVertex(i)));
+        }
+
+        std::vector<std::int32_t> numfacevertices(mesh->num_faces());
+        std::vector<std::int32_t> indices;
+        indices.reserve(mesh->num_faces() * 3);
+
+        for (int i = 0; i < mesh->num_faces(); ++i)
+        {
+            Mesh::Face face = mesh->GetFace(i);
+
+            numfacevertices[i] = face.type_ == Mesh::QUAD ? 4 : 3;
+            indices.insert(indices.end(), face.idx, face.idx + numfacevertices[i]);
+        }
+
+        out.write(reinterpret_cast<char const*>(numfacevertices.data()), numfacevertices.size() * sizeof(std::int32_t));
+        out.write(reinterpret_cast<char const*>(indices.data()), indices.size() * sizeof(std::int32_t));
+    }
+
+    CaptureWriter::CaptureWriter(std::string const& dir)
+        : m_dir(dir)
+        , m_numcommits(0)
+        , m_numqueries(0)
+    {
+    }
+
+    void CaptureWriter::WriteScene(World const& world)
+    {
+        std::string path = GetCaptureScenePath(m_dir, m_numcommits);
+        std::ofstream out(path, std::ios::binary);
+        ThrowIf(!out, "Cannot open capture file " + path);
+
+        CaptureHeader header = { kCaptureSceneMagic, kCaptureVersion, m_numcommits, 0 };
+        Write(out, header);
+
+        WriteOptions(out, world.options_);
+
+        // Meshes go first so that instances can refer to meshes which are not attached
+        std::vector<Mesh const*> meshes;
+        std::map<Mesh const*, std::int32_t> meshindices;
+        std::vector<CaptureShape> shapes(world.shapes_.size());
+
+        for (std::size_t i = 0; i < world.shapes_.size(); ++i)
+        {
+            auto shape = static_cast<ShapeImpl const*>(world.shapes_[i]);
+            bool isinstance = shape->is_instance();
+
+            auto mesh = isinstance ?
+                static_cast<Mesh const*>(static_cast<Instance const*>(shape)->GetBaseShape()) :
+                static_cast<Mesh const*>(shape);
+
+            auto iter = meshindices.find(mesh);
+
+            if (iter == meshindices.end())
+            {
+                iter = meshindices.emplace(mesh, static_cast<std::int32_t>(meshes.size())).first;
+                meshes.push_back(mesh);
+            }
+
+            matrix const& m = shape->GetWorldMatrix();
+            float3 v = shape->GetLinearVelocity();
+            quaternion q = shape->GetAngularVelocity();
+
+            CaptureShape& captured = shapes[i];
+            captured.mesh = iter->second;
+            captured.instance = isinstance ? 1 : 0;
+            captured.id = shape->GetId();
+            captured.mask = shape->GetMask();
+            std::copy(&m.m[0][0], &m.m[0][0] + 16, captured.transform);
+            captured.linearvelocity[0] = v.x;
+            captured.linearvelocity[1] = v.y;
+            captured.linearvelocity[2] = v.z;
+            captured.angularvelocity[0] = q.x;
+            captured.angularvelocity[1] = q.y;
+            captured.angularvelocity[2] = q.z;
+            captured.angularvelocity[3] = q.w;
+            captured.reserved = 0;
+        }
+
+        Write(out, static_cast<std::uint32_t>(meshes.size()));
+
+        for (auto mesh : meshes)
+        {
+            WriteMesh(out, mesh);
+        }
+
+        Write(out, static_cast<std::uint32_t>(shapes.size()));
+        out.write(reinterpret_cast<char const*>(shapes.data()), shapes.size() * sizeof(CaptureShape));
+
+        ThrowIf(!out, "Cannot write capture file " + path);
+
+        ++m_numcommits;
+    }
+
+    void CaptureWriter::WriteQuery(CaptureQueryType type, ray const* rays, int numrays, int maxrays) const
+    {
+        std::string path = GetCaptureQueryPath(m_dir, m_numqueries++);
+        std::ofstream out(path, std::ios::binary);
+        ThrowIf(!out, "Cannot open capture file " + path);
+
+        CaptureHeader header = { kCaptureQueryMagic, kCaptureVersion, m_numcommits - 1, 0 };
+        CaptureQuery query = { static_cast<std::uint32_t>(type), numrays, maxrays, static_cast<std::uint32_t>(sizeof(ray)) };
+
+        Write(out, header);
+        Write(out, query);
+        out.write(reinterpret_cast<char const*>(rays), static_cast<std::size_t>(numrays) * sizeof(ray));
+
+        ThrowIf(!out, "Cannot write capture file " + path);
+    }
+}
@@ -0,0 +1,66 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+#include "radeon_rays.h"
+#include "capture_format.h"
+
+namespace RadeonRays
+{
+    class World;
+
+    ///< Writes committed scenes and query rays to a capture directory,
+    ///< see capture_format.h for the file layout.
+    ///<
+    class CaptureWriter
+    {
+    public:
+        // The directory has to exist
+        explicit CaptureWriter(std::string const& dir);
+
+        std::string const& GetDirectory() const { return m_dir; }
+
+        // True once a scene has been written, queries before it are not captured
+        bool HasScene() const { return m_numcommits > 0; }
+
+        // Write the attached shapes and the options of a committed world
+        void WriteScene(World const& world);
+
+        // Write the rays of a query against the last written scene
+        void WriteQuery(CaptureQueryType type, ray const* rays, int numrays, int maxrays) const;
+
+    private:
+        // Capture directory
+        std::string m_dir;
+        // Scenes written so far
+        std::uint32_t m_numcommits;
+        // Queries written so far, queries might be issued from several threads
+        mutable std::atomic<std::uint32_t> m_numqueries;
+    };
+}
+
+#endif // CAPTURE_H
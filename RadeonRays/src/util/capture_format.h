@@ -0,0 +1,116 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#ifndef CAPTURE_FORMAT_H
+#define CAPTURE_FORMAT_H
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+
+namespace RadeonRays
+{
+    ///< Layout of the files written with the "debug.capture_dir" option.
+    ///< Values are stored in host byte order.
+    ///<
+    ///< commit_NNNN.rrs - scene of the N-th captured Commit:
+    ///<     CaptureHeader
+    ///<     uint32 numoptions, per option: uint32 type (CaptureOptionType), uint32 namelength, name,
+    ///<         float value or uint32 length and string value
+    ///<     uint32 nummeshes, per mesh: int32 numvertices, int32 numfaces, float[3] per vertex,
+    ///<         int32 numfacevertices per face, int32 indices for the vertices of all the faces
+    ///<     uint32 numshapes, CaptureShape per attached shape
+    ///<
+    ///< query_NNNNNN.rrq - rays of the N-th captured query:
+    ///<     CaptureHeader, CaptureQuery, ray per query ray
+    ///<
+
+    static std::uint32_t const kCaptureSceneMagic = 0x53435252; // "RRCS"
+    static std::uint32_t const kCaptureQueryMagic = 0x51435252; // "RRCQ"
+    static std::uint32_t const kCaptureVersion = 1;
+
+    enum CaptureOptionType
+    {
+        kCaptureOptionString,
+        kCaptureOptionFloat
+    };
+
+    enum CaptureQueryType
+    {
+        kCaptureIntersection,
+        kCaptureOcclusion
+    };
+
+    struct CaptureHeader
+    {
+        std::uint32_t magic;
+        std::uint32_t version;
+        // Index of the scene the file belongs to
+        std::uint32_t commit;
+        std::uint32_t reserved;
+    };
+
+    struct CaptureShape
+    {
+        // Index of the mesh in the scene file, base mesh for instances
+        std::int32_t mesh;
+        std::int32_t instance;
+        std::int32_t id;
+        std::int32_t mask;
+        // Row major world matrix
+        float transform[16];
+        float linearvelocity[3];
+        float angularvelocity[4];
+        std::int32_t reserved;
+    };
+
+    struct CaptureQuery
+    {
+        // CaptureQueryType
+        std::uint32_t type;
+        // Number of rays captured
+        std::int32_t numrays;
+        // Ray capacity of the query if the number of rays has been passed in a buffer, 0 otherwise
+        std::int32_t maxrays;
+        // Size of a ray in bytes
+        std::uint32_t raysize;
+    };
+
+    static_assert(sizeof(CaptureHeader) == 16, "CaptureHeader must be tightly packed");
+    static_assert(sizeof(CaptureShape) == 112, "CaptureShape must be tightly packed");
+    static_assert(sizeof(CaptureQuery) == 16, "CaptureQuery must be tightly packed");
+
+    inline std::string GetCaptureScenePath(std::string const& dir, std::uint32_t commit)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "commit_%04u.rrs", commit);
+        return dir + "/" + name;
+    }
+
+    inline std::string GetCaptureQueryPath(std::string const& dir, std::uint32_t query)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "query_%06u.rrq", query);
+        return dir + "/" + name;
+    }
+}
+
+#endif // CAPTURE_FORMAT_H
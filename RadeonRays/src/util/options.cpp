@@ -47,4 +47,16 @@ namespace RadeonRays
             return nullptr;
         }
     }
-}
\ No newline at end of file
+
+    std::vector<std::string> Options::GetNames() const
+    {
+        std::vector<std::string> names;
+
+        for (auto& value : values_)
+        {
+            names.push_back(value.first);
+        }
+
+        return names;
+    }
+}
@@ -24,6 +24,7 @@ THE SOFTWARE.
 
 #include <map>
 #include <string>
+#include <vector>
 
 namespace RadeonRays
 {
@@ -37,20 +38,31 @@ namespace RadeonRays
         /// Single option
         struct Option
         {
+            enum Type
+            {
+                kString,
+                kFloat
+            };
+
             struct
             {
                 std::string strval;
                 float floatval;
             } value;
 
+            // Type the value has been set with
+            Type type;
+
             // Construct from string
             Option(std::string const& val="")
+                : type(kString)
             {
                 value.strval = val;
             }
 
             // Construct from float
             Option(float val)
+                : type(kFloat)
             {
                 value.floatval = val;
             }
@@ -79,6 +91,9 @@ namespace RadeonRays
         // Get option
         Option const* GetOption(std::string const& name) const;
 
+        // Get names of all the options set
+        std::vector<std::string> GetNames() const;
+
     private:
         // Options 
         std::map<std::string, Option> values_;
@@ -0,0 +1,96 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "radeon_rays.h"
+#include "../except/except.h"
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <vector>
+
+namespace RadeonRays
+{
+    static std::uint32_t GetMetric(TraversalCounters const& counters, TraversalMetric metric)
+    {
+        return metric == kTraversalNodes ? counters.nodes : counters.primitives;
+    }
+
+    // Channel of the jet color map at t in [0, 1], dark blue through cyan and yellow to dark red
+    static unsigned char Ramp(float t, float center)
+    {
+        float value = std::min(std::max(1.5f - std::fabs(4.f * t - center), 0.f), 1.f);
+        return static_cast<unsigned char>(value * 255.f + 0.5f);
+    }
+
+    void BuildTraversalHistogram(TraversalCounters const* counters, int numrays, TraversalMetric metric,
+                                 std::uint32_t binwidth, int numbins, std::uint32_t* bins)
+    {
+        ThrowIf(numrays < 0 || (numrays > 0 && !counters), "Invalid traversal counters.");
+        ThrowIf(binwidth == 0 || numbins <= 0 || !bins, "Invalid histogram bins.");
+
+        std::fill(bins, bins + numbins, 0u);
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            std::uint32_t bin = GetMetric(counters[i], metric) / binwidth;
+            ++bins[std::min(bin, static_cast<std::uint32_t>(numbins - 1))];
+        }
+    }
+
+    void WriteTraversalHeatmap(char const* filename, TraversalCounters const* counters, int width, int height,
+                               TraversalMetric metric, std::uint32_t maxvalue)
+    {
+        ThrowIf(!filename, "Invalid heatmap file name.");
+        ThrowIf(width <= 0 || height <= 0 || !counters, "Invalid traversal counters.");
+
+        int numrays = width * height;
+
+        if (maxvalue == 0)
+        {
+            for (int i = 0; i < numrays; ++i)
+            {
+                maxvalue = std::max(maxvalue, GetMetric(counters[i], metric));
+            }
+
+            maxvalue = std::max(maxvalue, 1u);
+        }
+
+        std::vector<unsigned char> pixels(numrays * 3);
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            float t = std::min(static_cast<float>(GetMetric(counters[i], metric)) / maxvalue, 1.f);
+
+            pixels[3 * i] = Ramp(t, 3.f);
+            pixels[3 * i + 1] = Ramp(t, 2.f);
+            pixels[3 * i + 2] = Ramp(t, 1.f);
+        }
+
+        std::ofstream out(filename, std::ios::binary);
+        ThrowIf(!out, "Can't open heatmap file for writing.");
+
+        out << "P6\n" << width << " " << height << "\n255\n";
+        out.write(reinterpret_cast<char const*>(pixels.data()), pixels.size());
+
+        ThrowIf(!out, "Can't write heatmap file.");
+    }
+}
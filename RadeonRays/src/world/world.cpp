@@ -22,39 +22,143 @@ THE SOFTWARE.
 #include "world.h"
 
 #include "../primitive/shapeimpl.h"
+#include "../except/except.h"
 
 namespace RadeonRays
 {
+    // Move the last entry of a change list into the slot of the shape, position
+    // gives access to the list index the shapes record
+    template <typename Position>
+    static void Unlist(std::vector<Shape const*>& list, ShapeImpl const* shape, Position position)
+    {
+        std::size_t index = position(shape);
+
+        // The index is stale if the shape is not listed
+        if (index >= list.size() || list[index] != shape)
+        {
+            return;
+        }
+
+        auto last = static_cast<ShapeImpl const*>(list.back());
+        list[index] = last;
+        position(last) = index;
+        list.pop_back();
+    }
+
     void World::AttachShape(Shape const* shape)
     {
-        if (std::find(shapes_.cbegin(), shapes_.cend(), shape) == shapes_.cend())
+        auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+        if (shapeimpl->world_ == this)
+        {
+            return;
+        }
+
+        ThrowIf(shapeimpl->world_ != nullptr, "Shape is attached to another scene.");
+
+        shapeimpl->world_ = this;
+        shapeimpl->worldindex_ = shapes_.size();
+        shapeimpl->worldepoch_ = epoch_;
+        shapes_.push_back(shape);
+        shapeimpl->addedindex_ = shapes_added_.size();
+        shapes_added_.push_back(shape);
+
+        // Changes made while detached are still to be committed
+        if (shapeimpl->GetStateChange() != ShapeImpl::kStateChangeNone)
+        {
+            shapeimpl->dirtyindex_ = shapes_dirty_.size();
+            shapes_dirty_.push_back(shape);
+        }
+
+        has_changed_ = true;
+    }
+
+    void World::AttachShapes(Shape const* const* shapes, int numshapes)
+    {
+        shapes_.reserve(shapes_.size() + numshapes);
+        shapes_added_.reserve(shapes_added_.size() + numshapes);
+
+        for (int i = 0; i < numshapes; ++i)
+        {
+            AttachShape(shapes[i]);
+        }
+    }
+
+    void World::RemoveShape(ShapeImpl const* shape)
+    {
+        if (shape->world_ != this)
+        {
+            return;
+        }
+
+        // Move the last shape into the vacated slot
+        std::size_t index = shape->worldindex_;
+        shapes_[index] = shapes_.back();
+        static_cast<ShapeImpl const*>(shapes_[index])->worldindex_ = index;
+        shapes_.pop_back();
+
+        shape->world_ = nullptr;
+        has_changed_ = true;
+
+        Unlist(shapes_added_, shape, [](ShapeImpl const* s) -> std::size_t& { return s->addedindex_; });
+        Unlist(shapes_dirty_, shape, [](ShapeImpl const* s) -> std::size_t& { return s->dirtyindex_; });
+
+        // Shapes attached during this commit are not known to the devices
+        if (shape->worldepoch_ != epoch_)
         {
-            shapes_.push_back(shape);
-            has_changed_ = true;
+            shapes_removed_.push_back(shape);
         }
     }
 
     void World::DetachShape(Shape const* shape)
     {
-        auto iter = std::find(shapes_.begin(), shapes_.end(), shape);
-        if (iter != shapes_.end())
+        RemoveShape(static_cast<ShapeImpl const*>(shape));
+    }
+
+    void World::DetachShapes(Shape const* const* shapes, int numshapes)
+    {
+        for (int i = 0; i < numshapes; ++i)
         {
-            shapes_.erase(iter);
-            has_changed_ = true;
+            RemoveShape(static_cast<ShapeImpl const*>(shapes[i]));
         }
     }
     
     void World::DetachAll()
     {
+        for (auto shape : shapes_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            // Copies do not own the attachments
+            if (shapeimpl->world_ == this)
+            {
+                shapeimpl->world_ = nullptr;
+
+                if (shapeimpl->worldepoch_ != epoch_)
+                {
+                    shapes_removed_.push_back(shape);
+                }
+            }
+        }
+
         shapes_.clear();
+        shapes_dirty_.clear();
+        shapes_added_.clear();
         has_changed_ = true;
     }
 
+    void World::OnShapeChanged(ShapeImpl const* shape)
+    {
+        std::lock_guard<std::mutex> lock(dirty_mutex_);
+        shape->dirtyindex_ = shapes_dirty_.size();
+        shapes_dirty_.push_back(shape);
+    }
+
     int World::GetStateChange() const
     {
         int statechange_ = ShapeImpl::kStateChangeNone;
 
-        for (auto iter = shapes_.cbegin(); iter != shapes_.cend(); ++iter)
+        for (auto iter = shapes_dirty_.cbegin(); iter != shapes_dirty_.cend(); ++iter)
         {
             ShapeImpl const* shapeimpl = static_cast<ShapeImpl const*>(*iter);
 
@@ -64,15 +168,49 @@ namespace RadeonRays
         return statechange_;
     }
 
+    std::vector<ShapeChange> World::GetChanges() const
+    {
+        std::vector<ShapeChange> changes;
+        changes.reserve(shapes_removed_.size() + shapes_added_.size() + shapes_dirty_.size());
+
+        for (auto shape : shapes_removed_)
+        {
+            changes.push_back({ shape, ShapeImpl::kStateChangeRemoved });
+        }
+
+        for (auto shape : shapes_added_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+            changes.push_back({ shape, ShapeImpl::kStateChangeAdded | shapeimpl->GetStateChange() });
+        }
+
+        for (auto shape : shapes_dirty_)
+        {
+            auto shapeimpl = static_cast<ShapeImpl const*>(shape);
+
+            // Already reported as added
+            if (shapeimpl->worldepoch_ != epoch_)
+            {
+                changes.push_back({ shape, shapeimpl->GetStateChange() });
+            }
+        }
+
+        return changes;
+    }
+
     void World::OnCommit()
     {
-        for (auto iter = shapes_.cbegin(); iter != shapes_.cend(); ++iter)
+        for (auto iter = shapes_dirty_.cbegin(); iter != shapes_dirty_.cend(); ++iter)
         {
             auto shapeimpl = static_cast<ShapeImpl const*>(*iter);
 
             shapeimpl->OnCommit();
         }
 
+        shapes_dirty_.clear();
+        shapes_added_.clear();
+        shapes_removed_.clear();
         has_changed_ = false;
+        ++epoch_;
     }
 }
\ No newline at end of file
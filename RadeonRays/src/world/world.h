@@ -22,7 +22,9 @@ THE SOFTWARE.
 #ifndef WORLD_H
 #define WORLD_H
 
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <vector>
 
 #include "radeon_rays.h"
@@ -30,6 +32,17 @@ THE SOFTWARE.
 
 namespace RadeonRays
 {
+    class ShapeImpl;
+
+    ///< Change of a single shape since the last commit
+    struct ShapeChange
+    {
+        // Removed shapes might have been deleted already, use them as keys only
+        Shape const* shape;
+        // ShapeImpl::StateChangeFlags
+        int flags;
+    };
+
     ///< World class is a container for all entities for the scene. 
     ///< It hosts entities and is in charge of destroying them.
     ///< For convenience reasons it impelements Primitive interface
@@ -44,39 +57,64 @@ namespace RadeonRays
         virtual ~World();
         // Attach the shape updating all the flags
         void AttachShape(Shape const* shape);
+        // Attach numshapes shapes at once
+        void AttachShapes(Shape const* const* shapes, int numshapes);
         // Detach the shape 
         void DetachShape(Shape const* shape);
+        // Detach numshapes shapes at once
+        void DetachShapes(Shape const* const* shapes, int numshapes);
         // Detach all
         void DetachAll();
+        // Called by attached shapes on their first state change since commit
+        void OnShapeChanged(ShapeImpl const* shape);
         // Call this as scene has been commited
         void OnCommit();
         // 
         bool has_changed() const;
         //
         int GetStateChange() const;
-
+        // Per shape changes since the last commit. Removals go first, so a shape
+        // allocated at the address of a removed one shows up as removed and then added.
+        std::vector<ShapeChange> GetChanges() const;
 
     public:
-        // Shapes in the scene
+        // Shapes in the scene, shapes know their index so attach and detach are O(1)
+        // and the order changes on detach
         std::vector<Shape const*> shapes_;
-        // Flags to indicate shapes have been changed
-        std::vector<int> shapes_dirty_;
+        // Attached shapes changed since the last commit
+        std::vector<Shape const*> shapes_dirty_;
+        // Shapes attached since the last commit and still attached
+        std::vector<Shape const*> shapes_added_;
+        // Shapes which were attached at the last commit and are detached now
+        std::vector<Shape const*> shapes_removed_;
 
-        // TODO: Do more preciese dirty flags tracking
+        // Shapes have been attached or detached since the last commit
         bool has_changed_;
         // Global flags
         int hint_;
         // Options
         Options options_;
+
+    private:
+        // Remove the shape from shapes_ and the change lists recording the change
+        void RemoveShape(ShapeImpl const* shape);
+
+        // Commit counter, shapes remember the one they have been attached during
+        std::uint64_t epoch_;
+
+        // Shapes might be changed from several threads at once (see IntersectionApi::SetTransforms)
+        std::mutex dirty_mutex_;
     };
 
     inline World::World()
         : has_changed_(true)
+        , epoch_(0)
     {
     }
 
     inline World::~World()
     {
+        DetachAll();
     }
 
     inline bool World::has_changed() const
@@ -0,0 +1,24 @@
+project "Replay"
+    kind "ConsoleApp"
+    location "../Replay"
+    links {"RadeonRays"}
+    files { "../Replay/**.h", "../Replay/**.cpp" }
+
+    includedirs{ "../RadeonRays/include", "../RadeonRays/src", "." }
+
+    if os.is("macosx") then
+        buildoptions "-std=c++11 -stdlib=libc++"
+    elseif os.is("linux") then
+        buildoptions "-std=c++11"
+        os.execute("rm -rf obj");
+    end
+
+    configuration {"x32", "Debug"}
+        targetdir "../Bin/Debug/x86"
+    configuration {"x64", "Debug"}
+        targetdir "../Bin/Debug/x64"
+    configuration {"x32", "Release"}
+        targetdir "../Bin/Release/x86"
+    configuration {"x64", "Release"}
+        targetdir "../Bin/Release/x64"
+    configuration {}
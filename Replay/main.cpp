@@ -0,0 +1,439 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#include "radeon_rays.h"
+#include "util/capture_format.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace RadeonRays;
+
+// Help message
+char const* kHelpMessage =
+"Replay -c capture_dir [-p cl|vk|embree][-d device_index][-n iterations][-w warmup_iterations]";
+
+char const* g_capture_dir = nullptr;
+DeviceInfo::Platform g_platform = DeviceInfo::kOpenCL;
+int g_device_index = 0;
+int g_num_iterations = 10;
+int g_num_warmup = 1;
+
+// Scene loaded from a capture
+struct ReplayScene
+{
+    bool loaded;
+    std::uint32_t commit;
+    std::vector<Shape*> meshes;
+    std::vector<Shape*> instances;
+};
+
+char* GetCmdOption(char ** begin, char ** end, const std::string & option)
+{
+    char ** itr = std::find(begin, end, option);
+    if (itr != end && ++itr != end)
+    {
+        return *itr;
+    }
+    return 0;
+}
+
+void ShowHelpAndDie()
+{
+    std::cout << kHelpMessage << "\n";
+    std::exit(-1);
+}
+
+template <typename T>
+void Read(std::ifstream& in, T* values, std::size_t count = 1)
+{
+    in.read(reinterpret_cast<char*>(values), count * sizeof(T));
+
+    if (!in)
+    {
+        throw std::runtime_error("Unexpected end of capture file");
+    }
+}
+
+std::string ReadString(std::ifstream& in)
+{
+    std::uint32_t length = 0;
+    Read(in, &length);
+
+    std::string value(length, '\0');
+
+    if (length > 0)
+    {
+        Read(in, &value[0], length);
+    }
+
+    return value;
+}
+
+void ReadHeader(std::ifstream& in, std::string const& path, std::uint32_t magic, CaptureHeader& header)
+{
+    Read(in, &header);
+
+    if (header.magic != magic || header.version != kCaptureVersion)
+    {
+        throw std::runtime_error("Unsupported capture file " + path);
+    }
+}
+
+void UnloadScene(IntersectionApi* api, ReplayScene& scene)
+{
+    api->DetachAll();
+
+    for (auto shape : scene.instances)
+    {
+        api->DeleteShape(shape);
+    }
+
+    for (auto shape : scene.meshes)
+    {
+        api->DeleteShape(shape);
+    }
+
+    scene.instances.clear();
+    scene.meshes.clear();
+    scene.loaded = false;
+}
+
+void LoadScene(IntersectionApi* api, std::uint32_t commit, ReplayScene& scene)
+{
+    UnloadScene(api, scene);
+
+    std::string path = GetCaptureScenePath(g_capture_dir, commit);
+    std::ifstream in(path, std::ios::binary);
+
+    if (!in)
+    {
+        throw std::runtime_error("Cannot open capture file " + path);
+    }
+
+    CaptureHeader header;
+    ReadHeader(in, path, kCaptureSceneMagic, header);
+
+    std::uint32_t numoptions = 0;
+    Read(in, &numoptions);
+
+    for (std::uint32_t i = 0; i < numoptions; ++i)
+    {
+        std::uint32_t type = 0;
+        Read(in, &type);
+
+        std::string name = ReadString(in);
+
+        if (type == kCaptureOptionFloat)
+        {
+            float value = 0.f;
+            Read(in, &value);
+            api->SetOption(name.c_str(), value);
+        }
+        else
+        {
+            api->SetOption(name.c_str(), ReadString(in).c_str());
+        }
+    }
+
+    std::uint32_t nummeshes = 0;
+    Read(in, &nummeshes);
+
+    for (std::uint32_t i = 0; i < nummeshes; ++i)
+    {
+        std::int32_t counts[2];
+        Read(in, counts, 2);
+
+        std::vector<float> vertices(counts[0] * 3);
+        std::vector<int> numfacevertices(counts[1]);
+        Read(in, vertices.data(), vertices.size());
+        Read(in, numfacevertices.data(), numfacevertices.size());
+
+        std::size_t numindices = 0;
+
+        for (auto n : numfacevertices)
+        {
+            numindices += n;
+        }
+
+        std::vector<int> indices(numindices);
+        Read(in, indices.data(), indices.size());
+
+        scene.meshes.push_back(api->CreateMesh(vertices.data(), counts[0], 3 * sizeof(float),
+            indices.data(), 0, numfacevertices.data(), counts[1]));
+    }
+
+    std::uint32_t numshapes = 0;
+    Read(in, &numshapes);
+
+    std::vector<CaptureShape> shapes(numshapes);
+    Read(in, shapes.data(), shapes.size());
+
+    for (auto& captured : shapes)
+    {
+        if (captured.mesh < 0 || captured.mesh >= static_cast<std::int32_t>(scene.meshes.size()))
+        {
+            throw std::runtime_error("Invalid mesh index in capture file " + path);
+        }
+
+        Shape* shape = scene.meshes[captured.mesh];
+
+        if (captured.instance)
+        {
+            shape = api->CreateInstance(shape);
+            scene.instances.push_back(shape);
+        }
+
+        matrix m;
+        std::memcpy(&m.m[0][0], captured.transform, sizeof(captured.transform));
+
+        shape->SetTransform(m, inverse(m));
+        shape->SetLinearVelocity(float3(captured.linearvelocity[0], captured.linearvelocity[1], captured.linearvelocity[2]));
+        shape->SetAngularVelocity(quaternion(captured.angularvelocity[0], captured.angularvelocity[1],
+                                             captured.angularvelocity[2], captured.angularvelocity[3]));
+        shape->SetId(captured.id);
+        shape->SetMask(captured.mask);
+
+        api->AttachShape(shape);
+    }
+
+    api->Commit();
+
+    scene.loaded = true;
+    scene.commit = commit;
+
+    Statistics stats = api->GetStatistics();
+    std::cout << "commit " << commit << ": " << nummeshes << " meshes, " << numshapes << " shapes, "
+        << stats.commit_ms << " ms\n";
+}
+
+// Replay the index-th captured query loading its scene if needed, false once there are no more queries
+bool ReplayQuery(IntersectionApi* api, std::uint32_t index, ReplayScene& scene, double& rayspersecond, int& numrays)
+{
+    std::string path = GetCaptureQueryPath(g_capture_dir, index);
+    std::ifstream in(path, std::ios::binary);
+
+    if (!in)
+    {
+        return false;
+    }
+
+    CaptureHeader header;
+    ReadHeader(in, path, kCaptureQueryMagic, header);
+
+    CaptureQuery query;
+    Read(in, &query);
+
+    if (query.raysize != sizeof(ray))
+    {
+        throw std::runtime_error("Ray layout mismatch in capture file " + path);
+    }
+
+    std::vector<ray> rays(std::max(query.numrays, query.maxrays));
+    Read(in, rays.data(), query.numrays);
+
+    if (!scene.loaded || scene.commit != header.commit)
+    {
+        LoadScene(api, header.commit, scene);
+    }
+
+    numrays = query.numrays;
+
+    if (rays.empty())
+    {
+        rayspersecond = 0.0;
+        return true;
+    }
+
+    bool occlusion = query.type == kCaptureOcclusion;
+    std::size_t hitsize = occlusion ? sizeof(int) : sizeof(Intersection);
+
+    Buffer* ray_buffer = api->CreateBuffer(rays.size() * sizeof(ray), rays.data());
+    Buffer* hit_buffer = api->CreateBuffer(rays.size() * hitsize, nullptr);
+    Buffer* count_buffer = query.maxrays > 0 ? api->CreateBuffer(sizeof(int), &query.numrays) : nullptr;
+
+    auto run = [&]()
+    {
+        Event* e = nullptr;
+
+        if (count_buffer)
+        {
+            if (occlusion)
+                api->QueryOcclusion(ray_buffer, count_buffer, query.maxrays, hit_buffer, nullptr, &e);
+            else
+                api->QueryIntersection(ray_buffer, count_buffer, query.maxrays, hit_buffer, nullptr, &e);
+        }
+        else
+        {
+            if (occlusion)
+                api->QueryOcclusion(ray_buffer, query.numrays, hit_buffer, nullptr, &e);
+            else
+                api->QueryIntersection(ray_buffer, query.numrays, hit_buffer, nullptr, &e);
+        }
+
+        e->Wait();
+        api->DeleteEvent(e);
+    };
+
+    for (int i = 0; i < g_num_warmup; ++i)
+    {
+        run();
+    }
+
+    auto start = std::chrono::high_resolution_clock::now();
+
+    for (int i = 0; i < g_num_iterations; ++i)
+    {
+        run();
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+    rayspersecond = seconds > 0.0 ? static_cast<double>(query.numrays) * g_num_iterations / seconds : 0.0;
+
+    api->DeleteBuffer(ray_buffer);
+    api->DeleteBuffer(hit_buffer);
+
+    if (count_buffer)
+    {
+        api->DeleteBuffer(count_buffer);
+    }
+
+    std::cout << "query " << index << " (commit " << header.commit << ", "
+        << (occlusion ? "occlusion" : "intersection") << ", " << query.numrays << " rays): "
+        << rayspersecond * 1e-6 << " Mrays/s\n";
+
+    return true;
+}
+
+int main(int argc, char * argv[])
+{
+    // Command line parsing
+    g_capture_dir = GetCmdOption(argv, argv + argc, "-c");
+
+    if (!g_capture_dir)
+    {
+        ShowHelpAndDie();
+    }
+
+    char* platform = GetCmdOption(argv, argv + argc, "-p");
+
+    if (platform)
+    {
+        if (std::strcmp(platform, "cl") == 0)
+            g_platform = DeviceInfo::kOpenCL;
+        else if (std::strcmp(platform, "vk") == 0)
+            g_platform = DeviceInfo::kVulkan;
+        else if (std::strcmp(platform, "embree") == 0)
+            g_platform = DeviceInfo::kEmbree;
+        else
+            ShowHelpAndDie();
+    }
+
+    char* device = GetCmdOption(argv, argv + argc, "-d");
+    g_device_index = device ? std::atoi(device) : g_device_index;
+
+    char* iterations = GetCmdOption(argv, argv + argc, "-n");
+    g_num_iterations = iterations ? std::max(std::atoi(iterations), 1) : g_num_iterations;
+
+    char* warmup = GetCmdOption(argv, argv + argc, "-w");
+    g_num_warmup = warmup ? std::max(std::atoi(warmup), 0) : g_num_warmup;
+
+    IntersectionApi* api = nullptr;
+
+    try
+    {
+        IntersectionApi::SetPlatform(g_platform);
+
+        if (g_device_index < 0 || g_device_index >= static_cast<int>(IntersectionApi::GetDeviceCount()))
+        {
+            throw std::runtime_error("No such device on the selected platform");
+        }
+
+        DeviceInfo info;
+        IntersectionApi::GetDeviceInfo(g_device_index, info);
+        std::cout << "Replaying " << g_capture_dir << " on " << info.name << "\n";
+
+        api = IntersectionApi::Create(g_device_index);
+
+        ReplayScene scene;
+        scene.loaded = false;
+        scene.commit = 0;
+
+        double totalrays = 0.0;
+        double totalseconds = 0.0;
+        std::uint32_t numqueries = 0;
+        double rayspersecond = 0.0;
+        int numrays = 0;
+
+        while (ReplayQuery(api, numqueries, scene, rayspersecond, numrays))
+        {
+            if (rayspersecond > 0.0)
+            {
+                totalrays += numrays;
+                totalseconds += numrays / rayspersecond;
+            }
+
+            ++numqueries;
+        }
+
+        if (numqueries == 0)
+        {
+            throw std::runtime_error("No queries found in " + std::string(g_capture_dir));
+        }
+
+        std::cout << numqueries << " queries, " << (totalseconds > 0.0 ? totalrays / totalseconds * 1e-6 : 0.0)
+            << " Mrays/s overall\n";
+
+        UnloadScene(api, scene);
+        IntersectionApi::Delete(api);
+    }
+    catch (Exception& e)
+    {
+        std::cout << e.what() << "\n";
+
+        if (api)
+        {
+            IntersectionApi::Delete(api);
+        }
+
+        return -1;
+    }
+    catch (std::exception& e)
+    {
+        std::cout << e.what() << "\n";
+
+        if (api)
+        {
+            IntersectionApi::Delete(api);
+        }
+
+        return -1;
+    }
+
+    return 0;
+}
@@ -78,6 +78,11 @@ project "UnitTest"
 	defines {"RR_RAY_MASK"}
     end
 
+    if _OPTIONS["enable_traversal_counters"] then
+        configuration {}
+        defines {"RR_TRAVERSAL_COUNTERS"}
+    end
+
     configuration {"x32", "Debug"}
         targetdir "../Bin/Debug/x86"
     configuration {"x64", "Debug"}
@@ -31,6 +31,22 @@ THE SOFTWARE.
 #include "tiny_obj_loader.h"
 #include "utils.h"
 
+#include <thread>
+#include <atomic>
+#include <functional>
+#include <fstream>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#ifdef _WIN32
+#include <direct.h>
+#include <process.h>
+#else
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 using namespace RadeonRays;
 
 
@@ -1099,4 +1115,1475 @@ TEST_F(ApiBackendOpenCL, Intersection_1Ray_InstanceNoShape)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+// The test splits a large batch across several devices and checks every ray got its own result
+TEST_F(ApiBackendOpenCL, Intersection_MultiDevice)
+{
+    // Use every available device, duplicate if there is only one
+    std::vector<std::uint32_t> devices;
+    for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+    {
+        devices.push_back(idx);
+    }
+
+    if (devices.size() == 1)
+    {
+        devices.push_back(devices[0]);
+    }
+
+    IntersectionApi* api = nullptr;
+    ASSERT_NO_THROW(api = IntersectionApi::Create(devices.data(), (std::uint32_t)devices.size()));
+    ASSERT_TRUE(api != nullptr);
+
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api->AttachShape(mesh));
+
+    // Large enough batch to be split across devices. Odd rays miss and every ray has its own
+    // hit distance, so misplaced, swapped or duplicated portions show up
+    int const numrays = 64 * 1024;
+    std::vector<ray> rays(numrays);
+    for (int i = 0; i < numrays; ++i)
+    {
+        float x = (i % 2) ? 5.f : 0.f;
+        rays[i] = ray(float3(x, 0.f, -1.f - static_cast<float>(i % 1000)), float3(0.f, 0.f, 1.f), 2000.f);
+    }
+
+    auto ray_buffer = api->CreateBuffer(numrays * sizeof(ray), rays.data());
+    auto isect_buffer = api->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api->Commit());
+
+    // Run several times for the throughput estimations to kick in
+    for (int pass = 0; pass < 3; ++pass)
+    {
+        Event* e = nullptr;
+        ASSERT_NO_THROW(api->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&tmp, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+
+        for (int i = 0; i < numrays; ++i)
+        {
+            if (i % 2)
+            {
+                ASSERT_EQ(tmp[i].shapeid, kNullId) << "ray " << i;
+            }
+            else
+            {
+                ASSERT_EQ(tmp[i].shapeid, mesh->GetId()) << "ray " << i;
+                ASSERT_LE(std::fabs(tmp[i].uvwt.w - (1.f + static_cast<float>(i % 1000))), 0.01f) << "ray " << i;
+            }
+        }
+
+        ASSERT_NO_THROW(api->UnmapBuffer(isect_buffer, tmp, &e));
+        e->Wait();
+        api->DeleteEvent(e);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api->DetachShape(mesh));
+    ASSERT_NO_THROW(api->DeleteShape(mesh));
+    ASSERT_NO_THROW(api->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api->DeleteBuffer(isect_buffer));
+    IntersectionApi::Delete(api);
+}
+
+// The test uploads a batch while another one is being traversed on a different queue
+TEST_F(ApiBackendOpenCL, Intersection_MultiQueue)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("device.num_queues", 4.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    int const numrays = 1024;
+    int const numbatches = 4;
+    std::vector<ray> rays(numrays, ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f));
+
+    Buffer* ray_buffers[numbatches];
+    Buffer* isect_buffers[numbatches];
+    Event* query_events[numbatches];
+
+    for (int i = 0; i < numbatches; ++i)
+    {
+        ray_buffers[i] = api_->CreateBuffer(numrays * sizeof(ray), nullptr);
+        isect_buffers[i] = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+    }
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    for (int i = 0; i < numbatches; ++i)
+    {
+        // Upload the batch while previous ones are traversed
+        ray* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(ray_buffers[i], kMapWrite, 0, numrays * sizeof(ray), (void**)&tmp, &e_));
+        Wait();
+        std::copy(rays.begin(), rays.end(), tmp);
+        Event* unmap_event = nullptr;
+        ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffers[i], tmp, &unmap_event));
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffers[i], numrays, isect_buffers[i], unmap_event, &query_events[i]));
+        api_->DeleteEvent(unmap_event);
+    }
+
+    for (int i = 0; i < numbatches; ++i)
+    {
+        query_events[i]->Wait();
+        api_->DeleteEvent(query_events[i]);
+
+        Intersection* tmp = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffers[i], kMapRead, 0, numrays * sizeof(Intersection), (void**)&tmp, &e_));
+        Wait();
+
+        for (int j = 0; j < numrays; ++j)
+        {
+            ASSERT_EQ(tmp[j].shapeid, mesh->GetId());
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffers[i], tmp, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+
+    for (int i = 0; i < numbatches; ++i)
+    {
+        ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffers[i]));
+        ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffers[i]));
+    }
+}
+
+// The test chains upload, intersection and occlusion queries through events without waiting on the host
+TEST_F(ApiBackendOpenCL, Intersection_ChainedEvents)
+{
+    Shape* mesh = nullptr;
+
+    // Make sure the chain crosses queues
+    ASSERT_NO_THROW(api_->SetOption("device.num_queues", 4.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    int const numrays = 4096;
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), nullptr);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(numrays * sizeof(int), nullptr);
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray* rays = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(ray_buffer, kMapWrite, 0, numrays * sizeof(ray), (void**)&rays, &e_));
+    Wait();
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        rays[i] = ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f);
+    }
+
+    Event* unmap_event = nullptr;
+    Event* isect_event = nullptr;
+    Event* occlu_event = nullptr;
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(ray_buffer, rays, &unmap_event));
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, unmap_event, &isect_event));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, occlu_buffer, isect_event, &occlu_event));
+
+    occlu_event->Wait();
+
+    // The whole chain has to be resolved by now
+    ASSERT_TRUE(unmap_event->Complete());
+    ASSERT_TRUE(isect_event->Complete());
+
+    api_->DeleteEvent(unmap_event);
+    api_->DeleteEvent(isect_event);
+    api_->DeleteEvent(occlu_event);
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    int* occlu = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, numrays * sizeof(int), (void**)&occlu, &e_));
+    Wait();
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        ASSERT_EQ(occlu[i], 1);
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, occlu, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+}
+
+// The test issues queries from several host threads sharing the same api
+TEST_F(ApiBackendOpenCL, Intersection_ConcurrentQueries)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("device.num_queues", 4.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const numthreads = 4;
+    int const numqueries = 16;
+    int const numrays = 1024;
+
+    std::vector<int> failures(numthreads, 0);
+    std::vector<std::thread> threads;
+
+    for (int t = 0; t < numthreads; ++t)
+    {
+        threads.emplace_back([this, t, mesh, numqueries, numrays, &failures]()
+        {
+            // Every other thread misses the triangle
+            float x = (t % 2) ? 10.f : 0.f;
+            int expected = (t % 2) ? kNullId : mesh->GetId();
+            std::vector<ray> rays(numrays, ray(float3(x, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f));
+
+            auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays.data());
+            auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+            for (int q = 0; q < numqueries; ++q)
+            {
+                Event* e = nullptr;
+                api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &e);
+                e->Wait();
+                api_->DeleteEvent(e);
+
+                Intersection* tmp = nullptr;
+                api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&tmp, &e);
+                e->Wait();
+                api_->DeleteEvent(e);
+
+                for (int i = 0; i < numrays; ++i)
+                {
+                    failures[t] += tmp[i].shapeid != expected ? 1 : 0;
+                }
+
+                api_->UnmapBuffer(isect_buffer, tmp, &e);
+                e->Wait();
+                api_->DeleteEvent(e);
+            }
+
+            api_->DeleteBuffer(ray_buffer);
+            api_->DeleteBuffer(isect_buffer);
+        });
+    }
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    for (int t = 0; t < numthreads; ++t)
+    {
+        ASSERT_EQ(failures[t], 0);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// The test runs indirect queries on a large ray buffer with only a part of it
+// populated, which takes the persistent threads path in the bvh strategy
+TEST_F(ApiBackendOpenCL, Intersection_IndirectPersistent)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "bvh"));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const maxrays = 1 << 20;
+    int numrays = 100000;
+
+    std::vector<ray> rays(maxrays, ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f));
+
+    auto ray_buffer = api_->CreateBuffer(maxrays * sizeof(ray), rays.data());
+    auto count_buffer = api_->CreateBuffer(sizeof(int), &numrays);
+    auto isect_buffer = api_->CreateBuffer(maxrays * sizeof(Intersection), nullptr);
+    auto occlu_buffer = api_->CreateBuffer(maxrays * sizeof(int), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, count_buffer, maxrays, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, count_buffer, maxrays, occlu_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    int* occlu = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(occlu_buffer, kMapRead, 0, numrays * sizeof(int), (void**)&occlu, &e_));
+    Wait();
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        ASSERT_EQ(occlu[i], 1);
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(occlu_buffer, occlu, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(count_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occlu_buffer));
+}
+
+// The test lets the library pick the acceleration structure
+TEST_F(ApiBackendOpenCL, Intersection_AutoAcceleration)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("acc.type", "auto"));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // The decision has to be reported
+    std::string report = api_->GetAccelerationReport();
+    ASSERT_NE(report.find("selected"), std::string::npos);
+    ASSERT_NE(report.find("traversal_cost="), std::string::npos);
+    ASSERT_NE(report.find("splits"), std::string::npos);
+
+    int const numrays = 1024;
+    std::vector<ray> rays(numrays, ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f));
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Later commits reuse the decision
+    ASSERT_NO_THROW(mesh->SetTransform(translation(float3(0.f, 0.f, 1.f)), inverse(translation(float3(0.f, 0.f, 1.f)))));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_EQ(report, std::string(api_->GetAccelerationReport()));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks that moving shapes are sampled at ray time
+TEST_F(ApiBackendOpenCL, Intersection_MotionBlur)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // The triangle moves up by 10 units within the shutter interval
+    ASSERT_NO_THROW(mesh->SetLinearVelocity(float3(0.f, 10.f, 0.f)));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Rays aimed at the start and the end positions at both shutter times
+    int const numrays = 4;
+    ray rays[numrays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f, 0.f),
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f, 1.f),
+        ray(float3(0.f, 10.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f, 0.f),
+        ray(float3(0.f, 10.f, -10.f), float3(0.f, 0.f, 1.f), 1000.f, 1.f)
+    };
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+    ASSERT_EQ(isect[2].shapeid, kNullId);
+    ASSERT_EQ(isect[3].shapeid, mesh->GetId());
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_TopLevelRefit)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+    ASSERT_NO_THROW(api_->SetOption("bvh.refit_top_level", 1.f));
+
+    // Create mesh and its instance
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    matrix m = translation(float3(0, 10, 0));
+    matrix minv = inverse(m);
+    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Rays aimed at the mesh and at the instance
+    int const numrays = 2;
+    ray rays[numrays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 10.f, -10.f), float3(0.f, 0.f, 1.f))
+    };
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, instance->GetId());
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Move the instance away, only the top level bounds are refitted
+    m = translation(float3(0, -10, 0));
+    minv = inverse(m);
+    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_CreateInstances)
+{
+    Shape* mesh = nullptr;
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    // Create a row of instances of a mesh which is not attached itself
+    int const numinstances = 3;
+    matrix transforms[numinstances] =
+    {
+        translation(float3(-10.f, 0.f, 0.f)),
+        translation(float3(0.f, 0.f, 0.f)),
+        translation(float3(10.f, 0.f, 0.f))
+    };
+
+    Shape* instances[numinstances] = { nullptr };
+    ASSERT_NO_THROW(api_->CreateInstances(mesh, numinstances, transforms, instances));
+
+    for (int i = 0; i < numinstances; ++i)
+    {
+        ASSERT_NE(instances[i], nullptr);
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    // Commit geometry update
+    ASSERT_NO_THROW(api_->Commit());
+
+    ray rays[numinstances] =
+    {
+        ray(float3(-10.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(10.f, 0.f, -10.f), float3(0.f, 0.f, 1.f))
+    };
+
+    auto ray_buffer = api_->CreateBuffer(numinstances * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numinstances * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numinstances, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numinstances * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    for (int i = 0; i < numinstances; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, instances[i]->GetId());
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Move all the instances up at once
+    for (int i = 0; i < numinstances; ++i)
+    {
+        transforms[i] = translation(float3(-10.f + 10.f * i, 10.f, 0.f));
+    }
+
+    ASSERT_NO_THROW(api_->SetTransforms(instances, numinstances, transforms));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numinstances, isect_buffer, nullptr, nullptr));
+
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numinstances * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    for (int i = 0; i < numinstances; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, kNullId);
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Bail out
+    for (int i = 0; i < numinstances; ++i)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instances[i]));
+        ASSERT_NO_THROW(api_->DeleteShape(instances[i]));
+    }
+
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_AttachAfterCommit2L)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(api_->SetOption("bvh.force2level", 1.f));
+
+    // Create mesh
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Add an instance, the mesh BVH is reused
+    Shape* instance = nullptr;
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+
+    matrix m = translation(float3(0, 10, 0));
+    matrix minv = inverse(m);
+    ASSERT_NO_THROW(instance->SetTransform(m, minv));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const numrays = 2;
+    ray rays[numrays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 10.f, -10.f), float3(0.f, 0.f, 1.f))
+    };
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, instance->GetId());
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_ReferencedInstances)
+{
+    Shape* mesh = nullptr;
+
+    // Reference all instances from the single level BVH
+    ASSERT_NO_THROW(api_->SetOption("bvh.instance_flatten_faces", 0.f));
+
+    // Create mesh and two instances of it
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    Shape* instances[2] = { nullptr, nullptr };
+
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+
+        matrix m = translation(float3(0.f, 10.f * (i + 1), 0.f));
+        matrix minv = inverse(m);
+        ASSERT_NO_THROW(instances[i]->SetTransform(m, minv));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    int const numrays = 4;
+    ray rays[numrays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 10.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 20.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 30.f, -10.f), float3(0.f, 0.f, 1.f))
+    };
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    // Structures other than "bvh" fall back to the 2-level BVH and have to give the same results
+    char const* acctypes[] = { "bvh", "fatbvh", "hlbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+        ASSERT_EQ(isect[1].shapeid, instances[0]->GetId());
+        ASSERT_EQ(isect[2].shapeid, instances[1]->GetId());
+        ASSERT_EQ(isect[3].shapeid, kNullId);
+        ASSERT_LE(std::fabs(isect[1].uvwt.w - 10.f), 0.01f);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+    }
+
+    // Bail out
+    for (int i = 0; i < 2; ++i)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instances[i]));
+        ASSERT_NO_THROW(api_->DeleteShape(instances[i]));
+    }
+
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_HostPointerBuffer)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const numrays = 2;
+    alignas(64) ray rays[numrays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 10.f, -10.f), float3(0.f, 0.f, 1.f))
+    };
+    alignas(64) Intersection isects[numrays];
+
+    Buffer* ray_buffer = nullptr;
+    Buffer* isect_buffer = nullptr;
+    ASSERT_NO_THROW(ray_buffer = api_->CreateBufferFromHostPointer(rays, sizeof(rays)));
+    ASSERT_NO_THROW(isect_buffer = api_->CreateBufferFromHostPointer(isects, sizeof(isects)));
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+
+    // Mapping keeps host memory coherent with the device
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(isects), (void**)&isect, &e_));
+    Wait();
+
+    ASSERT_EQ(isect[0].shapeid, mesh->GetId());
+    ASSERT_EQ(isect[1].shapeid, kNullId);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    ASSERT_THROW(api_->CreateBufferFromHostPointer(nullptr, sizeof(isects)), Exception);
+
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+}
+
+// Runs every task right away on the submitting thread
+class InlineTaskArena : public TaskArena
+{
+public:
+    InlineTaskArena() : numtasks(0) {}
+
+    void Execute(void (*func)(void*), void* arg) override
+    {
+        ++numtasks;
+        func(arg);
+    }
+
+    std::atomic<int> numtasks;
+};
+
+TEST_F(ApiBackendOpenCL, Intersection_TaskArena)
+{
+    InlineTaskArena arena;
+    ASSERT_NO_THROW(IntersectionApi::SetTaskArena(&arena));
+
+    Shape* mesh = nullptr;
+
+    // Large enough for the parallel mesh loading to kick in
+    int const numfaces = 10000;
+    std::vector<float> vertices(numfaces * 9);
+    std::vector<int> indices(numfaces * 3);
+    for (int i = 0; i < numfaces; ++i)
+    {
+        float z = static_cast<float>(i);
+        float tri[9] = { -1.f, -1.f, z, 1.f, -1.f, z, 0.f, 1.f, z };
+        std::copy(tri, tri + 9, &vertices[i * 9]);
+        indices[i * 3] = i * 3;
+        indices[i * 3 + 1] = i * 3 + 1;
+        indices[i * 3 + 2] = i * 3 + 2;
+    }
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices.data(), numfaces * 3, 3 * sizeof(float), indices.data(), 0, nullptr, numfaces));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    ASSERT_GT(arena.numtasks.load(), 0);
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    ASSERT_EQ(isect->shapeid, mesh->GetId());
+    ASSERT_EQ(isect->primid, 0);
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+
+    ASSERT_NO_THROW(IntersectionApi::SetTaskArena(nullptr));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_BatchedAttach)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+
+    int const numinstances = 64;
+    std::vector<matrix> transforms(numinstances);
+    std::vector<ray> rays(numinstances);
+    for (int i = 0; i < numinstances; ++i)
+    {
+        transforms[i] = translation(float3(10.f * i, 0.f, 0.f));
+        rays[i] = ray(float3(10.f * i, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    }
+
+    std::vector<Shape*> instances(numinstances);
+    ASSERT_NO_THROW(api_->CreateInstances(mesh, numinstances, transforms.data(), instances.data()));
+    ASSERT_NO_THROW(api_->AttachShapes(instances.data(), numinstances));
+    // Attaching twice is a no-op
+    ASSERT_NO_THROW(api_->AttachShapes(instances.data(), numinstances));
+    ASSERT_NO_THROW(api_->Commit());
+
+    auto ray_buffer = api_->CreateBuffer(numinstances * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numinstances * sizeof(Intersection), nullptr);
+
+    auto query = [&](std::function<Id(int)> expected)
+    {
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numinstances, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numinstances * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        for (int i = 0; i < numinstances; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, expected(i));
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+    };
+
+    query([&](int i) { return instances[i]->GetId(); });
+
+    // Detach every other instance in one go
+    std::vector<Shape const*> odd;
+    for (int i = 1; i < numinstances; i += 2)
+    {
+        odd.push_back(instances[i]);
+    }
+
+    ASSERT_NO_THROW(api_->DetachShapes(odd.data(), static_cast<int>(odd.size())));
+    ASSERT_NO_THROW(api_->Commit());
+    query([&](int i) { return (i % 2) ? kNullId : instances[i]->GetId(); });
+
+    // Deleting an attached shape detaches it
+    ASSERT_NO_THROW(api_->DeleteShape(instances[0]));
+    instances[0] = nullptr;
+    ASSERT_NO_THROW(api_->Commit());
+    query([&](int i) { return (i % 2 || i == 0) ? kNullId : instances[i]->GetId(); });
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_ChangeRecords)
+{
+    Shape* mesh0 = nullptr;
+    Shape* mesh1 = nullptr;
+
+    ASSERT_NO_THROW(mesh0 = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh1 = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(mesh1->SetTransform(translation(float3(0.f, 10.f, 0.f)), inverse(translation(float3(0.f, 10.f, 0.f)))));
+    ASSERT_NO_THROW(api_->AttachShape(mesh0));
+    ASSERT_NO_THROW(api_->AttachShape(mesh1));
+
+    int const numrays = 3;
+    ray rays[numrays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 10.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 20.f, -10.f), float3(0.f, 0.f, 1.f))
+    };
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    auto query = [&](Id expected0, Id expected1, Id expected2)
+    {
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+        ASSERT_EQ(isect[0].shapeid, expected0);
+        ASSERT_EQ(isect[1].shapeid, expected1);
+        ASSERT_EQ(isect[2].shapeid, expected2);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+    };
+
+    struct Config
+    {
+        char const* acctype;
+        float force2level;
+    };
+
+    Config const configs[] = { { "bvh", 0.f }, { "fatbvh", 0.f }, { "hlbvh", 0.f }, { "bvh", 1.f } };
+
+    for (auto const& config : configs)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", config.acctype));
+        ASSERT_NO_THROW(api_->SetOption("bvh.force2level", config.force2level));
+
+        ASSERT_NO_THROW(mesh0->SetId(1));
+        ASSERT_NO_THROW(mesh1->SetId(2));
+        ASSERT_NO_THROW(mesh1->SetMask(0xFFFFFFFF));
+        ASSERT_NO_THROW(mesh1->SetTransform(translation(float3(0.f, 10.f, 0.f)), inverse(translation(float3(0.f, 10.f, 0.f)))));
+        query(1, 2, kNullId);
+
+        // Id and mask changes are patched in place
+        ASSERT_NO_THROW(mesh0->SetId(100));
+        query(100, 2, kNullId);
+
+        ASSERT_NO_THROW(mesh1->SetMask(0));
+        query(100, kNullId, kNullId);
+
+        // Transforms go through refits or rebuilds
+        ASSERT_NO_THROW(mesh1->SetMask(0xFFFFFFFF));
+        ASSERT_NO_THROW(mesh1->SetTransform(translation(float3(0.f, 20.f, 0.f)), inverse(translation(float3(0.f, 20.f, 0.f)))));
+        query(100, kNullId, 2);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(mesh0));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh1));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_CreateMeshes)
+{
+    int const nummeshes = 32;
+
+    // Caller owned positions with a padded stride, every mesh shifted along x
+    struct Vertex
+    {
+        float position[3];
+        float padding;
+    };
+
+    std::vector<Vertex> vertexdata(nummeshes * 3);
+    std::vector<ray> rays(nummeshes);
+    for (int i = 0; i < nummeshes; ++i)
+    {
+        for (int j = 0; j < 3; ++j)
+        {
+            vertexdata[i * 3 + j].position[0] = vertices()[j * 3] + 10.f * i;
+            vertexdata[i * 3 + j].position[1] = vertices()[j * 3 + 1];
+            vertexdata[i * 3 + j].position[2] = vertices()[j * 3 + 2];
+            vertexdata[i * 3 + j].padding = 0.f;
+        }
+
+        rays[i] = ray(float3(10.f * i, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+    }
+
+    // Referenced triangle meshes and copied mixed ones
+    std::vector<MeshDesc> descs(nummeshes);
+    for (int i = 0; i < nummeshes; ++i)
+    {
+        bool reference = (i % 2) == 0;
+
+        descs[i].vertices = vertexdata[i * 3].position;
+        descs[i].vnum = 3;
+        descs[i].vstride = sizeof(Vertex);
+        descs[i].indices = indices();
+        descs[i].istride = 0;
+        descs[i].numfacevertices = reference ? nullptr : numfaceverts();
+        descs[i].numfaces = 1;
+        descs[i].flags = reference ? kMeshReferenceData : kMeshCopyData;
+    }
+
+    // First half blocking, second half asynchronous
+    std::vector<Shape*> meshes(nummeshes, nullptr);
+    ASSERT_NO_THROW(api_->CreateMeshes(descs.data(), nummeshes / 2, meshes.data(), nullptr));
+    ASSERT_NO_THROW(api_->CreateMeshes(descs.data() + nummeshes / 2, nummeshes / 2, meshes.data() + nummeshes / 2, &e_));
+    Wait();
+
+    for (int i = 0; i < nummeshes; ++i)
+    {
+        ASSERT_NE(meshes[i], nullptr);
+        // IDs are handed out in order
+        if (i > 0)
+        {
+            ASSERT_EQ(meshes[i]->GetId(), meshes[i - 1]->GetId() + 1);
+        }
+    }
+
+    ASSERT_NO_THROW(api_->AttachShapes(meshes.data(), nummeshes));
+    ASSERT_NO_THROW(api_->Commit());
+
+    auto ray_buffer = api_->CreateBuffer(nummeshes * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(nummeshes * sizeof(Intersection), nullptr);
+
+    Intersection* isect = nullptr;
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, nummeshes, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, nummeshes * sizeof(Intersection), (void**)&isect, &e_));
+    Wait();
+
+    for (int i = 0; i < nummeshes; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, meshes[i]->GetId());
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+    Wait();
+
+    // A bad face invalidates the whole batch
+    int const badfaceverts[] = { 5 };
+    descs[1].numfacevertices = badfaceverts;
+    std::vector<Shape*> failed(2, nullptr);
+    ASSERT_NO_THROW(api_->CreateMeshes(descs.data(), 2, failed.data(), &e_));
+    ASSERT_ANY_THROW(e_->Wait());
+    ASSERT_NO_THROW(api_->DeleteEvent(e_));
+    ASSERT_EQ(failed[0], nullptr);
+    ASSERT_EQ(failed[1], nullptr);
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    for (auto mesh : meshes)
+    {
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    }
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_PackedVertices)
+{
+    // A row of separate triangles, so every face reads distinct vertices
+    int const numfaces = 64;
+    std::vector<float> positions;
+    std::vector<int> faceindices;
+    std::vector<ray> rays(2 * numfaces);
+    for (int i = 0; i < numfaces; ++i)
+    {
+        for (int j = 0; j < 9; ++j)
+        {
+            positions.push_back(vertices()[j] + ((j % 3) == 0 ? 10.f * i : 0.f));
+        }
+
+        faceindices.push_back(3 * i);
+        faceindices.push_back(3 * i + 1);
+        faceindices.push_back(3 * i + 2);
+
+        rays[i] = ray(float3(10.f * i, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+        rays[numfaces + i] = ray(float3(10.f * i, 10.f, -10.f), float3(0.f, 0.f, 1.f));
+    }
+
+    // The second mesh starts past the vertices of the first one in the device buffers
+    Shape* mesh0 = nullptr;
+    Shape* mesh1 = nullptr;
+    ASSERT_NO_THROW(mesh0 = api_->CreateMesh(positions.data(), 3 * numfaces, 3 * sizeof(float), faceindices.data(), 0, nullptr, numfaces));
+    ASSERT_NO_THROW(mesh1 = api_->CreateMesh(positions.data(), 3 * numfaces, 3 * sizeof(float), faceindices.data(), 0, nullptr, numfaces));
+    ASSERT_NO_THROW(mesh1->SetTransform(translation(float3(0.f, 10.f, 0.f)), inverse(translation(float3(0.f, 10.f, 0.f)))));
+    ASSERT_NO_THROW(api_->AttachShape(mesh0));
+    ASSERT_NO_THROW(api_->AttachShape(mesh1));
+
+    auto ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+
+    char const* acctypes[] = { "bvh", "fatbvh", "hlbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->Commit());
+
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, rays.size() * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        for (int i = 0; i < numfaces; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, mesh0->GetId());
+            ASSERT_EQ(isect[i].primid, i);
+            ASSERT_EQ(isect[numfaces + i].shapeid, mesh1->GetId());
+            ASSERT_EQ(isect[numfaces + i].primid, i);
+            ASSERT_NEAR(isect[i].uvwt.w, 10.f, 0.01f);
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(mesh0));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh1));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_Quads)
+{
+    // Unit quad in the xy plane followed by a triangle next to it
+    float const positions[] = {
+        0.f, 0.f, 0.f,
+        1.f, 0.f, 0.f,
+        1.f, 1.f, 0.f,
+        0.f, 1.f, 0.f,
+        2.f, 0.f, 0.f,
+        3.f, 0.f, 0.f,
+        2.f, 1.f, 0.f
+    };
+
+    int const faceindices[] = { 0, 1, 2, 3, 4, 5, 6 };
+    int const facevertices[] = { 4, 3 };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(positions, 7, 3 * sizeof(float), faceindices, 0, facevertices, 2));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Both halves of the quad and the triangle
+    ray rays[] = {
+        ray(float3(0.75f, 0.25f, -1.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.25f, 0.75f, -1.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(2.25f, 0.25f, -1.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(1.5f, 0.5f, -1.f), float3(0.f, 0.f, 1.f))
+    };
+    int const numrays = sizeof(rays) / sizeof(rays[0]);
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    char const* acctypes[] = { "bvh", "fatbvh", "hlbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->Commit());
+
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, &e_));
+        Wait();
+
+        // Quad hits report the quad parametrization
+        ASSERT_EQ(isect[0].primid, 0);
+        ASSERT_NEAR(isect[0].uvwt.x, 0.75f, 0.001f);
+        ASSERT_NEAR(isect[0].uvwt.y, 0.25f, 0.001f);
+        ASSERT_EQ(isect[1].primid, 0);
+        ASSERT_NEAR(isect[1].uvwt.x, 0.25f, 0.001f);
+        ASSERT_NEAR(isect[1].uvwt.y, 0.75f, 0.001f);
+        ASSERT_EQ(isect[2].primid, 1);
+        ASSERT_EQ(isect[3].shapeid, kNullId);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, &e_));
+        Wait();
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendOpenCL, Intersection_Statistics)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    std::vector<ray> rays(16, ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)));
+    auto ray_buffer = api_->CreateBuffer(rays.size() * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(rays.size() * sizeof(Intersection), nullptr);
+
+    char const* acctypes[] = { "bvh", "fatbvh", "hlbvh" };
+
+    for (auto acctype : acctypes)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", acctype));
+        ASSERT_NO_THROW(api_->Commit());
+
+        Statistics stats = api_->GetStatistics();
+        ASSERT_GT(stats.node_count, 0u);
+        ASSERT_GT(stats.memory_bytes, 0u);
+        ASSERT_GE(stats.commit_ms, 0.f);
+        ASSERT_EQ(stats.num_queries, 0u);
+
+        // One blocking and one asynchronous query
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, (int)rays.size(), isect_buffer, nullptr, &e_));
+        Wait();
+
+        stats = api_->GetStatistics();
+        ASSERT_EQ(stats.num_queries, 2u);
+        ASSERT_EQ(stats.num_rays, 2 * rays.size());
+        // OpenCL queries are profiled on the device
+        ASSERT_GT(stats.query_ms, 0.f);
+        ASSERT_GT(stats.rays_per_second, 0.f);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test checks per ray traversal counters of a hitting and a missing ray
+#ifdef RR_TRAVERSAL_COUNTERS
+TEST_F(ApiBackendOpenCL, Intersection_TraversalCounters)
+#else
+TEST_F(ApiBackendOpenCL, DISABLED_Intersection_TraversalCounters)
+#endif
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray rays[2] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, -1.f))
+    };
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(rays), rays);
+    auto isect_buffer = api_->CreateBuffer(2 * sizeof(Intersection), nullptr);
+    auto counters_buffer = api_->CreateBuffer(2 * sizeof(TraversalCounters), nullptr);
+
+    ASSERT_NO_THROW(api_->SetTraversalCounters(counters_buffer));
+
+    // The last pass forces the 2-level BVH
+    struct
+    {
+        char const* acctype;
+        float force2level;
+    } const configs[] = { { "bvh", 0.f }, { "fatbvh", 0.f }, { "hlbvh", 0.f }, { "bvh", 1.f } };
+
+    for (auto const& config : configs)
+    {
+        ASSERT_NO_THROW(api_->SetOption("acc.type", config.acctype));
+        ASSERT_NO_THROW(api_->SetOption("bvh.force2level", config.force2level));
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 2, isect_buffer, nullptr, nullptr));
+
+        TraversalCounters* counters = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(counters_buffer, kMapRead, 0, 2 * sizeof(TraversalCounters), (void**)&counters, &e_));
+        Wait();
+
+        // The ray pointing at the triangle has to test it
+        ASSERT_GT(counters[0].nodes, 0u);
+        ASSERT_GE(counters[0].primitives, 1u);
+        ASSERT_LE(counters[1].primitives, counters[0].primitives);
+
+        // Values past the last bin are clamped into it
+        std::uint32_t bins[2];
+        ASSERT_NO_THROW(BuildTraversalHistogram(counters, 2, kTraversalPrimitives, 1, 2, bins));
+        ASSERT_EQ(bins[0] + bins[1], 2u);
+        ASSERT_GE(bins[1], 1u);
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(counters_buffer, counters, &e_));
+        Wait();
+    }
+
+    // Counting stops with nullptr, too small buffers are rejected
+    ASSERT_NO_THROW(api_->SetTraversalCounters(nullptr));
+    ASSERT_NO_THROW(api_->SetTraversalCounters(counters_buffer));
+    ASSERT_ANY_THROW(api_->QueryIntersection(ray_buffer, 3, isect_buffer, nullptr, nullptr));
+    ASSERT_NO_THROW(api_->SetTraversalCounters(nullptr));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(counters_buffer));
+}
+
+#ifndef RR_TRAVERSAL_COUNTERS
+// The test checks that counters are rejected without instrumented kernels and queries keep working
+TEST_F(ApiBackendOpenCL, Intersection_TraversalCountersUnavailable)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray r(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f));
+
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+    auto counters_buffer = api_->CreateBuffer(sizeof(TraversalCounters), nullptr);
+
+    ASSERT_ANY_THROW(api_->SetTraversalCounters(counters_buffer));
+    ASSERT_NO_THROW(api_->SetTraversalCounters(nullptr));
+
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    Intersection* tmp = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, sizeof(Intersection), (void**)&tmp, &e_));
+    Wait();
+    auto isect = *tmp;
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, tmp, &e_));
+    Wait();
+
+    ASSERT_EQ(isect.shapeid, mesh->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(counters_buffer));
+}
+#endif
+
+// Unique directory under the system temp one, removed along with the files
+// a single capture writes when going out of scope
+struct CaptureDir
+{
+    CaptureDir()
+    {
+#ifdef _WIN32
+        char const* base = std::getenv("TEMP");
+        path = std::string(base ? base : ".") + "/rr_capture_" + std::to_string(_getpid());
+        valid = _mkdir(path.c_str()) == 0;
+#else
+        char const* base = std::getenv("TMPDIR");
+        std::string templ = std::string(base ? base : "/tmp") + "/rr_capture_XXXXXX";
+        valid = mkdtemp(&templ[0]) != nullptr;
+        path = templ;
+#endif
+    }
+
+    ~CaptureDir()
+    {
+        std::remove(File("commit_0000.rrs").c_str());
+        std::remove(File("query_000000.rrq").c_str());
+#ifdef _WIN32
+        _rmdir(path.c_str());
+#else
+        rmdir(path.c_str());
+#endif
+    }
+
+    std::string File(char const* name) const { return path + "/" + name; }
+
+    std::string path;
+    bool valid;
+};
+
+// The test checks the scene and the rays written with debug.capture_dir
+TEST_F(ApiBackendOpenCL, Intersection_Capture)
+{
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    ray r(float3(0.5f, 0.25f, -10.f), float3(0.f, 0.f, 1.f));
+    auto ray_buffer = api_->CreateBuffer(sizeof(ray), &r);
+    auto isect_buffer = api_->CreateBuffer(sizeof(Intersection), nullptr);
+
+    CaptureDir dir;
+    ASSERT_TRUE(dir.valid);
+
+    ASSERT_NO_THROW(api_->SetOption("debug.capture_dir", dir.path.c_str()));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    // Capture stops on the next commit
+    ASSERT_NO_THROW(api_->SetOption("debug.capture_dir", ""));
+    ASSERT_NO_THROW(api_->Commit());
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, 1, isect_buffer, nullptr, nullptr));
+
+    std::uint32_t magic = 0;
+    std::ifstream scene(dir.File("commit_0000.rrs"), std::ios::binary);
+    ASSERT_TRUE(scene.read(reinterpret_cast<char*>(&magic), sizeof(magic)).good());
+    ASSERT_EQ(magic, 0x53435252u);
+
+    // Header: magic, version, commit, reserved, then type, numrays, maxrays, raysize
+    std::uint32_t header[8];
+    ray captured;
+    std::ifstream query(dir.File("query_000000.rrq"), std::ios::binary);
+    ASSERT_TRUE(query.read(reinterpret_cast<char*>(header), sizeof(header)).good());
+    ASSERT_TRUE(query.read(reinterpret_cast<char*>(&captured), sizeof(captured)).good());
+    ASSERT_EQ(header[0], 0x51435252u);
+    ASSERT_EQ(header[2], 0u);
+    ASSERT_EQ(header[5], 1u);
+    ASSERT_EQ(header[7], sizeof(ray));
+    ASSERT_EQ(captured.o.x, r.o.x);
+    ASSERT_EQ(captured.d.z, r.d.z);
+
+    ASSERT_FALSE(std::ifstream(dir.File("query_000001.rrq")).good());
+
+    scene.close();
+    query.close();
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachAll());
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
 #endif // USE_OPENCL
\ No newline at end of file
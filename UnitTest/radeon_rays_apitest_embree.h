@@ -1110,4 +1110,309 @@ TEST_F(ApiBackendEmbree, Intersection_1Ray_InstanceNoShape)
     ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
 }
 
+TEST_F(ApiBackendEmbree, Intersection_ChainedEvents)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    // Enough rays to be split into several tasks
+    int const numrays = 1000;
+    std::vector<ray> rays(numrays, ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)));
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(numrays * sizeof(int), nullptr);
+
+    // Second query depends on the first one, which is deleted right away
+    Event* e = nullptr;
+    ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, &e));
+    ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, occl_buffer, e, &e_));
+    ASSERT_NO_THROW(api_->DeleteEvent(e));
+    Wait();
+
+    // Synchronous calls don't return events
+    Intersection* isect = nullptr;
+    int* occl = nullptr;
+    ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, nullptr));
+    ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, numrays * sizeof(int), (void**)&occl, nullptr));
+
+    for (int i = 0; i < numrays; ++i)
+    {
+        ASSERT_EQ(isect[i].shapeid, mesh->GetId());
+        ASSERT_EQ(occl[i], mesh->GetId());
+    }
+
+    ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, nullptr));
+    ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, nullptr));
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+TEST_F(ApiBackendEmbree, Intersection_IncrementalCommit)
+{
+    Shape* mesh = nullptr;
+    Shape* instance = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(instance = api_->CreateInstance(mesh));
+    ASSERT_NO_THROW(instance->SetTransform(translation(float3(0.f, 10.f, 0.f)), inverse(translation(float3(0.f, 10.f, 0.f)))));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->AttachShape(instance));
+    ASSERT_NO_THROW(api_->SetOption("embree.build_quality", 1.f));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const numrays = 2;
+    ray rays[numrays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 20.f, -10.f), float3(0.f, 0.f, 1.f))
+    };
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    auto query = [&](Id expected0, Id expected1)
+    {
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, nullptr));
+        ASSERT_EQ(isect[0].shapeid, expected0);
+        ASSERT_EQ(isect[1].shapeid, expected1);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, nullptr));
+    };
+
+    query(mesh->GetId(), kNullId);
+
+    // Move the instance only
+    ASSERT_NO_THROW(instance->SetTransform(translation(float3(0.f, 20.f, 0.f)), inverse(translation(float3(0.f, 20.f, 0.f)))));
+    ASSERT_NO_THROW(api_->Commit());
+    query(mesh->GetId(), instance->GetId());
+
+    // Detach the mesh, its instance keeps it alive
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+    query(kNullId, instance->GetId());
+
+    // And back
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+    query(mesh->GetId(), instance->GetId());
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(instance));
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(instance));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+// The test replaces a mesh in a single commit, the new mesh is likely allocated at the address of the deleted one
+TEST_F(ApiBackendEmbree, Intersection_ReplaceMesh)
+{
+    float const shifted[] =
+    {
+        -1.f, 9.f, 0.f,
+        1.f, 9.f, 0.f,
+        0.f, 11.f, 0.f
+    };
+
+    Shape* mesh = nullptr;
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+    ASSERT_NO_THROW(api_->Commit());
+
+    int const numrays = 2;
+    ray rays[numrays] =
+    {
+        ray(float3(0.f, 0.f, -10.f), float3(0.f, 0.f, 1.f)),
+        ray(float3(0.f, 10.f, -10.f), float3(0.f, 0.f, 1.f))
+    };
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays);
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+
+    auto query = [&](Id expected0, Id expected1)
+    {
+        Intersection* isect = nullptr;
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, nullptr));
+        ASSERT_EQ(isect[0].shapeid, expected0);
+        ASSERT_EQ(isect[1].shapeid, expected1);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, nullptr));
+    };
+
+    query(mesh->GetId(), kNullId);
+
+    // Alternate the geometry, each new mesh has to be picked up instead of the deleted one
+    for (int i = 0; i < 4; ++i)
+    {
+        bool const up = (i % 2) == 0;
+
+        ASSERT_NO_THROW(api_->DeleteShape(mesh));
+        ASSERT_NO_THROW(mesh = api_->CreateMesh(up ? shifted : vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+        ASSERT_NO_THROW(api_->AttachShape(mesh));
+        ASSERT_NO_THROW(api_->Commit());
+
+        query(up ? kNullId : mesh->GetId(), up ? mesh->GetId() : kNullId);
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+}
+
+TEST_F(ApiBackendEmbree, Intersection_PacketWidths)
+{
+    Shape* mesh = nullptr;
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    ASSERT_NO_THROW(api_->AttachShape(mesh));
+
+    // Not a multiple of any packet width, every other ray is inactive
+    int const numrays = 37;
+    std::vector<ray> rays(numrays);
+    for (int i = 0; i < numrays; ++i)
+    {
+        rays[i] = ray(float3(0.f, (i % 3) ? 0.f : 10.f, -10.f), float3(0.f, 0.f, 1.f));
+        rays[i].SetActive(i % 2 == 0);
+    }
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(numrays * sizeof(int), nullptr);
+
+    int const widths[] = { 0, 1, 4, 8, 16 };
+    for (auto width : widths)
+    {
+        ASSERT_NO_THROW(api_->SetOption("embree.packet_width", static_cast<float>(width)));
+        ASSERT_NO_THROW(api_->SetOption("embree.chunk_size", 16.f));
+
+        // Wide packets are rejected on hosts which lack them
+        try
+        {
+            api_->Commit();
+        }
+        catch (Exception&)
+        {
+            ASSERT_GT(width, 4);
+            continue;
+        }
+
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, occl_buffer, nullptr, nullptr));
+
+        Intersection* isect = nullptr;
+        int* occl = nullptr;
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, numrays * sizeof(int), (void**)&occl, nullptr));
+
+        for (int i = 0; i < numrays; i += 2)
+        {
+            Id expected = (i % 3) ? mesh->GetId() : kNullId;
+            ASSERT_EQ(isect[i].shapeid, expected);
+            ASSERT_EQ(occl[i], expected);
+
+            if (expected != kNullId)
+            {
+                ASSERT_LE(std::fabs(isect[i].uvwt.w - 10.f), 0.01f);
+            }
+        }
+
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, nullptr));
+        ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, nullptr));
+    }
+
+    // Bail out
+    ASSERT_NO_THROW(api_->DetachShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
+TEST_F(ApiBackendEmbree, Intersection_ShapeIdTable)
+{
+    Shape* mesh = nullptr;
+    int const numinstances = 8;
+    std::vector<Shape*> instances(numinstances);
+
+    ASSERT_NO_THROW(mesh = api_->CreateMesh(vertices(), 3, 3 * sizeof(float), indices(), 0, numfaceverts(), 1));
+    for (int i = 0; i < numinstances; ++i)
+    {
+        matrix m = translation(float3(0.f, 10.f * (i + 1), 0.f));
+        ASSERT_NO_THROW(instances[i] = api_->CreateInstance(mesh));
+        ASSERT_NO_THROW(instances[i]->SetTransform(m, inverse(m)));
+        ASSERT_NO_THROW(api_->AttachShape(instances[i]));
+    }
+
+    // One ray per instance and a trailing miss, so both full and partial lane groups are converted
+    int const numrays = numinstances + 1;
+    std::vector<ray> rays(numrays);
+    for (int i = 0; i < numrays; ++i)
+    {
+        rays[i] = ray(float3(0.f, 10.f * (i + 1), -10.f), float3(0.f, 0.f, 1.f));
+    }
+
+    auto ray_buffer = api_->CreateBuffer(numrays * sizeof(ray), rays.data());
+    auto isect_buffer = api_->CreateBuffer(numrays * sizeof(Intersection), nullptr);
+    auto occl_buffer = api_->CreateBuffer(numrays * sizeof(int), nullptr);
+
+    auto query = [&]()
+    {
+        Intersection* isect = nullptr;
+        int* occl = nullptr;
+        ASSERT_NO_THROW(api_->Commit());
+        ASSERT_NO_THROW(api_->QueryIntersection(ray_buffer, numrays, isect_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->QueryOcclusion(ray_buffer, numrays, occl_buffer, nullptr, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(isect_buffer, kMapRead, 0, numrays * sizeof(Intersection), (void**)&isect, nullptr));
+        ASSERT_NO_THROW(api_->MapBuffer(occl_buffer, kMapRead, 0, numrays * sizeof(int), (void**)&occl, nullptr));
+
+        for (int i = 0; i < numinstances; ++i)
+        {
+            ASSERT_EQ(isect[i].shapeid, instances[i]->GetId());
+            ASSERT_EQ(isect[i].primid, 0);
+            ASSERT_LE(std::fabs(isect[i].uvwt.w - 10.f), 0.01f);
+        }
+
+        ASSERT_EQ(isect[numinstances].shapeid, kNullId);
+        ASSERT_EQ(occl[numinstances], kNullId);
+        ASSERT_NO_THROW(api_->UnmapBuffer(isect_buffer, isect, nullptr));
+        ASSERT_NO_THROW(api_->UnmapBuffer(occl_buffer, occl, nullptr));
+    };
+
+    ASSERT_NO_THROW(api_->SetOption("embree.packet_width", 4.f));
+    query();
+
+    // Renamed shapes are picked up on the next commit
+    ASSERT_NO_THROW(instances[1]->SetId(100));
+    ASSERT_NO_THROW(instances[6]->SetId(101));
+    query();
+
+    // Same lookups on the stream path
+    ASSERT_NO_THROW(api_->SetOption("embree.packet_width", 1.f));
+    query();
+
+    // Bail out
+    for (auto instance : instances)
+    {
+        ASSERT_NO_THROW(api_->DetachShape(instance));
+        ASSERT_NO_THROW(api_->DeleteShape(instance));
+    }
+    ASSERT_NO_THROW(api_->DeleteShape(mesh));
+    ASSERT_NO_THROW(api_->DeleteBuffer(ray_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(isect_buffer));
+    ASSERT_NO_THROW(api_->DeleteBuffer(occl_buffer));
+}
+
 #endif // USE_VULKAN
@@ -0,0 +1,167 @@
+/**********************************************************************
+Copyright (c) 2016 Advanced Micro Devices, Inc. All rights reserved.
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in
+all copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT.  IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+THE SOFTWARE.
+********************************************************************/
+#pragma once
+
+#if USE_EMBREE
+/// This test suite is measuring Embree backend throughput
+///
+#include "gtest/gtest.h"
+#include "radeon_rays.h"
+
+using namespace RadeonRays;
+
+#include "tiny_obj_loader.h"
+
+using namespace tinyobj;
+
+#include <vector>
+#include <cstdio>
+#include <chrono>
+#include <random>
+
+// Api creation fixture, loads the scene and prepares random rays
+class ApiPerformanceEmbree : public ::testing::Test
+{
+public:
+    virtual void SetUp()
+    {
+        IntersectionApi::SetPlatform(DeviceInfo::kEmbree);
+
+        int nativeidx = -1;
+        for (auto idx = 0U; idx < IntersectionApi::GetDeviceCount(); ++idx)
+        {
+            DeviceInfo devinfo;
+            IntersectionApi::GetDeviceInfo(idx, devinfo);
+
+            if (devinfo.type == DeviceInfo::kCpu && nativeidx == -1)
+            {
+                nativeidx = idx;
+            }
+        }
+
+        ASSERT_NE(nativeidx, -1);
+
+        api_ = IntersectionApi::Create(nativeidx);
+
+        // Load obj file 
+        std::string res = LoadObj(shapes_, materials_, "../Resources/CornellBox/orig.objm");
+
+        // Create meshes within IntersectionApi
+        for (int i = 0; i < (int)shapes_.size(); ++i)
+        {
+            Shape* shape = nullptr;
+
+            ASSERT_NO_THROW(shape = api_->CreateMesh(&shapes_[i].mesh.positions[0], (int)shapes_[i].mesh.positions.size() / 3, 3 * sizeof(float),
+                &shapes_[i].mesh.indices[0], 0, nullptr, (int)shapes_[i].mesh.indices.size() / 3));
+
+            ASSERT_NO_THROW(api_->AttachShape(shape));
+
+            apishapes_.push_back(shape);
+        }
+
+        // Incoherent rays from the middle of the box
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<float> dist(-1.f, 1.f);
+
+        rays_.resize(kNumRays);
+        for (auto& r : rays_)
+        {
+            r = ray(float3(0.f, 1.f, 0.f), normalize(float3(dist(rng), dist(rng), dist(rng))));
+        }
+    }
+
+    virtual void TearDown()
+    {
+        for (int i = 0; i < (int)apishapes_.size(); ++i)
+        {
+            ASSERT_NO_THROW(api_->DetachShape(apishapes_[i]));
+            ASSERT_NO_THROW(api_->DeleteShape(apishapes_[i]));
+        }
+
+        IntersectionApi::Delete(api_);
+    }
+
+    // Returns million rays per second of the best of a few runs
+    double Measure(bool occlusion)
+    {
+        auto ray_buffer = api_->CreateBuffer(kNumRays * sizeof(ray), rays_.data());
+        auto hit_buffer = api_->CreateBuffer(kNumRays * sizeof(Intersection), nullptr);
+
+        double best = 0.0;
+        for (int i = 0; i < kNumRuns; ++i)
+        {
+            auto start = std::chrono::high_resolution_clock::now();
+
+            if (occlusion)
+                api_->QueryOcclusion(ray_buffer, kNumRays, hit_buffer, nullptr, nullptr);
+            else
+                api_->QueryIntersection(ray_buffer, kNumRays, hit_buffer, nullptr, nullptr);
+
+            std::chrono::duration<double> delta = std::chrono::high_resolution_clock::now() - start;
+            best = std::max(best, kNumRays / delta.count() * 1e-6);
+        }
+
+        api_->DeleteBuffer(ray_buffer);
+        api_->DeleteBuffer(hit_buffer);
+
+        return best;
+    }
+
+    static int const kNumRays = 1 << 20;
+    static int const kNumRuns = 5;
+
+    IntersectionApi* api_;
+    std::vector<Shape*> apishapes_;
+    std::vector<ray> rays_;
+
+    // Tinyobj data
+    std::vector<shape_t> shapes_;
+    std::vector<material_t> materials_;
+};
+
+// Compare packet widths and streams, widths the host does not support are skipped
+TEST_F(ApiPerformanceEmbree, PacketWidth)
+{
+    // 0 is the width picked for the host
+    int const widths[] = { 0, 1, 4, 8, 16 };
+
+    for (auto width : widths)
+    {
+        api_->SetOption("embree.packet_width", static_cast<float>(width));
+
+        try
+        {
+            api_->Commit();
+
+            double isect = Measure(false);
+            double occl = Measure(true);
+
+            std::printf("embree.packet_width %2d: intersection %7.2f Mrays/s, occlusion %7.2f Mrays/s\n", width, isect, occl);
+        }
+        catch (Exception& e)
+        {
+            std::printf("embree.packet_width %2d: not supported (%s)\n", width, e.what());
+        }
+    }
+}
+
+#endif // USE_EMBREE
@@ -65,6 +65,11 @@ newoption {
     description = "Enable ray masking in intersection kernels"
 }
 
+newoption {
+    trigger     = "enable_traversal_counters",
+    description = "Build intersection kernels which count traversal steps per ray"
+}
+
 
 if not _OPTIONS["use_opencl"] and not _OPTIONS["use_vulkan"] and not _OPTIONS["use_embree"] then
     _OPTIONS["use_opencl"] = 1
@@ -246,6 +251,12 @@ else
         end
     end
 
+    if not _OPTIONS["library_only"] then
+        if fileExists("./Replay/Replay.lua") then
+            dofile("./Replay/Replay.lua")
+        end
+    end
+
     if not _OPTIONS["no_tests"] then
         if fileExists("./Gtest/gtest.lua") then
             dofile("./Gtest/gtest.lua")